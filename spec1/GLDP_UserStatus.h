@@ -17,6 +17,7 @@
 
 #include <NPSTypes.h>
 #include <NPS_Serialize.h>
+#include <NPS_SerializeSchema.h>
 #include <NPS_SessionKey.h>
 #include "GLD_UserAction.h"
 #include <GLDP_BaseMessage.h>
@@ -27,7 +28,8 @@
 //! Class that encapusulates a request for the user status.
 
 
-class GLDP_UserStatusRequest: public GLDP_CustomerId {
+class GLDP_UserStatusRequest
+  : public NPS_SchemaSerialize<GLDP_UserStatusRequest, GLDP_CustomerId> {
 public:
 
   //! default constructor
@@ -61,17 +63,15 @@ public:
   //! set cache_is_dirty flag
   void                  setOperation( OP );
 
-  //! reimplemented from NPS_Serialized.
-  virtual uint16        serializeSizeOf() const;
-  //! reimplemented from NPS_Serialized.
-  virtual void          _doSerialize();
-  //! reimplemented from NPS_Serialized.
-  virtual void          _doDeserialize();
-
 private:
 
   OP                    operation_;
 
+public:
+
+  //! wire layout, following GLDP_CustomerId's fields.
+  typedef NPS_Schema< NPS_FIELD_AS( GLDP_UserStatusRequest, operation_, uint32 ) > Schema;
+
 };
 
 
@@ -172,6 +172,13 @@ private:
   bool                          isCacheHit_;
   NPS_SessionKey                sessionKey_;
 
+  // GLD_UserAction has no schema, so the ban and gag records are still
+  // written by hand between these two generated runs.
+  typedef NPS_Schema< NPS_FIELD_AS( GLDP_UserStatus, customerId_, uint32 ),
+                      NPS_FIELD_AS( GLDP_UserStatus, personaId_, uint32 ),
+                      NPS_FIELD( GLDP_UserStatus, isCacheHit_ ) > HeadFields;
+  typedef NPS_Schema< NPS_NESTED_FIELD( GLDP_UserStatus, sessionKey_ ) > TailFields;
+
 };
 
 
@@ -186,13 +193,13 @@ private:
 inline
 GLDP_UserStatusRequest::GLDP_UserStatusRequest( NPS_CUSTOMERID              c_id,
 						GLDP_UserStatusRequest::OP  op )
-  : GLDP_CustomerId( c_id ),
+  : NPS_SchemaSerialize<GLDP_UserStatusRequest, GLDP_CustomerId>( c_id ),
     operation_(op)
 {}
 
 inline
 GLDP_UserStatusRequest::GLDP_UserStatusRequest( const GLDP_UserStatusRequest &usr )
-  : GLDP_CustomerId( reinterpret_cast< const GLDP_CustomerId &>(usr) ),
+  : NPS_SchemaSerialize<GLDP_UserStatusRequest, GLDP_CustomerId>( usr ),
     operation_( usr.operation_ )
 {}
 
@@ -225,27 +232,6 @@ GLDP_UserStatusRequest::setOperation( GLDP_UserStatusRequest::OP op ) {
 }
 
 
-inline uint16
-GLDP_UserStatusRequest::serializeSizeOf() const {
-  return GLDP_CustomerId::serializeSizeOf() +
-    _serializeSizeOf( (uint32)operation_ );
-}
-
-
-inline void
-GLDP_UserStatusRequest::_doSerialize() {
-  GLDP_CustomerId::_doSerialize();
-  _serialize( (uint32)operation_ );
-}
-
-//! reimplemented from NPS_Serialized.
-inline void
-GLDP_UserStatusRequest::_doDeserialize() {
-  GLDP_CustomerId::_doDeserialize();
-  _deserialize( (uint32 &)operation_ );
-}
-
-
 //***************** class GLDP_UserStatus **********************
 
 inline
@@ -379,34 +365,28 @@ GLDP_UserStatus::setAsCacheHit( bool b ) {
 inline uint16
 GLDP_UserStatus::serializeSizeOf() const {
   return NPS_Serialize::serializeSizeOf() +
-    _serializeSizeOf( (uint32)customerId_ ) +
-    _serializeSizeOf( (uint32)personaId_ ) +
-    _serializeSizeOf( isCacheHit_ ) +
+    HeadFields::sizeOf( *this ) +
     _serializeSizeOf( &ban_ ) +
     _serializeSizeOf( &gag_ ) +
-    _serializeSizeOf( &sessionKey_ );
+    TailFields::sizeOf( *this );
 }
 
 // serialize this class
 inline void
 GLDP_UserStatus::_doSerialize() {
-  _serialize( (uint32)customerId_ );
-  _serialize( (uint32)personaId_ );
-  _serialize( isCacheHit_ );
-  _serialize( &ban_ );
-  _serialize( &gag_ );
-  _serialize( &sessionKey_ );
+  HeadFields::encode( _gather(), _serializeCursor(), *this );
+  _serializeRef( &ban_ );
+  _serializeRef( &gag_ );
+  TailFields::encode( _gather(), _serializeCursor(), *this );
 }
 
 
 inline void
 GLDP_UserStatus::_doDeserialize() {
-  _deserialize( (uint32 &)customerId_ );
-  _deserialize( (uint32 &)personaId_ );
-  _deserialize( isCacheHit_ );
+  HeadFields::decode( _serializeCursor(), *this );
   _deserialize( &ban_ );
   _deserialize( &gag_ );
-  _deserialize( &sessionKey_ );
+  TailFields::decode( _serializeCursor(), *this );
 }
 
 
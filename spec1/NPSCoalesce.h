@@ -0,0 +1,359 @@
+/*************************************************************************
+ File Name:     NPSCoalesce.h
+
+ Purpose:       Server side SendRate coalescing for comm channels
+ Notes:
+
+   NPSSetCommChannelRate (..., NPS_SET_SERVER_RATE | NPS_SEND_ON_xxx)
+   asks the server to gather a channel's game messages and send them at
+   most once every SendRate milliseconds.  NPSCoalescer does that
+   gathering with the fields NPS_CommData already has for it: messages
+   wait on MessagesToSend, MetaMsgLen and NumMetaMsg count them,
+   MessageOnList says something is waiting, and LastTimeSent is when
+   the channel last went out.
+
+   Once a tick the waiting messages go to the channel as one
+   meta-message: the messages back to back, each with its own header,
+   handed to the NPSCoalesceSend callback in one buffer.  Receivers need
+   nothing new, since they already take a stream apart message by
+   message (NPS_FrameBuffer); what is saved is the sends, and the packet
+   headers that came with them.
+
+   The policies are those of the channel flags:
+
+     NPS_SEND_ON_TIME   everything in a tick goes out together at its
+                        end.
+     NPS_SEND_ON_DUP    as ON_TIME, except that a second message from a
+                        user already waiting sends the group at once,
+                        so no user's messages are ever merged with
+                        each other.
+
+   A channel with a message waiting holds one timer on the NPSReactor,
+   due SendRate after LastTimeSent; idle channels hold none.  A group
+   that would exceed MAX_MSG_LEN goes out early.
+
+   MessagesMerged(), SendsSaved() and BytesSaved() count the effect.
+   BytesSaved() is an estimate: NPS_COALESCE_PACKET_OVERHEAD header
+   bytes for each send to each channel member that was avoided.
+
+   Not thread safe; run it on the reactor's thread.
+ *************************************************************************/
+
+#ifndef _NPS_COALESCE_H
+#define _NPS_COALESCE_H
+
+#include <NPSReactor.h>
+#include <MessageTypes.h>
+#include "NPS_MessageView.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#ifdef __cplusplus
+
+#define NPS_COALESCE_PACKET_OVERHEAD (40)   // IPv4 + TCP headers, no options
+
+#define NPS_COALESCE_POLICY_FLAGS (NPS_SEND_ON_DUP | NPS_SEND_ON_TIME)
+
+// Delivers a channel's meta-message (NumMsg messages, MetaMsgLen bytes)
+// to its members.
+typedef NPSSTATUS (*NPSCoalesceSend) (NPS_CommData * Channel,
+                                      const char *MetaMsg, long MetaMsgLen,
+                                      int NumMsg, void *Context);
+
+class NPSCoalescer
+{
+public:
+  NPSCoalescer (NPSReactor * Reactor, NPSCoalesceSend Send, void *Context)
+  {
+    m_Reactor = Reactor;
+    m_Send = Send;
+    m_Context = Context;
+    m_MessagesQueued = 0;
+    m_MetaMessagesSent = 0;
+    m_MessagesMerged = 0;
+    m_SendsSaved = 0;
+    m_BytesSaved = 0;
+  }
+
+  ~NPSCoalescer (void)
+  {
+    while (!m_Channels.empty ())
+      RemoveChannel (m_Channels.begin ()->first);
+  }
+
+  //------------------------- Channels ---------------------------------
+  // The server half of NPSSetCommChannelRate ().  Rate is in ms; 0 turns
+  // coalescing off, sending anything waiting.  Flags must have
+  // NPS_SET_SERVER_RATE, and may have NPS_SEND_ON_DUP or
+  // NPS_SEND_ON_TIME (the default).
+  NPSSTATUS SetChannelRate (NPS_CommData * Channel, long Rate,
+                            unsigned long Flags)
+  {
+    if (!Channel || Rate < 0 || !(Flags & NPS_SET_SERVER_RATE)
+        || (Flags & NPS_COALESCE_POLICY_FLAGS) == NPS_COALESCE_POLICY_FLAGS)
+      return NPS_BAD_PARAM;
+
+    NPSSTATUS Status = Flush (Channel);
+
+    Channel->SendRate = Rate;
+    Channel->Flags &= ~(NPS_COALESCE_POLICY_FLAGS | NPS_SET_SERVER_RATE);
+    if (Rate)
+    {
+      if (!(Flags & NPS_COALESCE_POLICY_FLAGS))
+        Flags |= NPS_SEND_ON_TIME;
+      Channel->Flags |= Flags & (NPS_COALESCE_POLICY_FLAGS
+                                 | NPS_SET_SERVER_RATE);
+    }
+    return Status;
+  }
+
+  NPS_INLINE NPS_LOGICAL IsCoalescing (const NPS_CommData * Channel)
+  {
+    return (Channel->SendRate > 0 && (Channel->Flags & NPS_SET_SERVER_RATE))
+      ? TRUE : FALSE;
+  }
+
+  // Forgets Channel, discarding anything waiting.  Call before the
+  // channel is freed.
+  void RemoveChannel (NPS_CommData * Channel)
+  {
+    ChannelMap::iterator it = m_Channels.find (Channel);
+
+    if (it == m_Channels.end ())
+      return;
+    if (it->second.Timer)
+    {
+      m_Reactor->CancelTimer (it->second.Timer);
+      m_Timers.erase (it->second.Timer);
+    }
+    m_Channels.erase (it);
+    _FreeList (Channel);
+  }
+
+  //------------------------- Sending ----------------------------------
+  // Sends a serialized game message From a user to Channel, now or with
+  // the channel's next meta-message.  The message is copied.
+  NPSSTATUS Queue (NPS_CommData * Channel, NPS_USERID From,
+                   const char *Message)
+  {
+    NPS_HeaderView Header ((const unsigned char *) Message, MAX_MSG_LEN);
+
+    if (!Channel || !Message || !Header.valid ())
+      return NPS_BAD_PARAM;
+
+    long MsgLen = Header.length ();
+
+    m_MessagesQueued++;
+    if (!IsCoalescing (Channel))
+    {
+      m_MetaMessagesSent++;
+      return m_Send (Channel, Message, MsgLen, 1, m_Context);
+    }
+
+    ChannelState & State = m_Channels[Channel];
+    NPSSTATUS Status = NPS_OK;
+
+    if (Channel->NumMetaMsg
+        && ((long) Channel->MetaMsgLen + MsgLen > MAX_MSG_LEN
+            || ((Channel->Flags & NPS_SEND_ON_DUP)
+                && std::find (State.Senders.begin (), State.Senders.end (),
+                              From) != State.Senders.end ())))
+      Status = Flush (Channel);
+
+    NPS_MsgList *Node = (NPS_MsgList *) malloc (sizeof (NPS_MsgList));
+    char *Copy = (char *) malloc (MsgLen);
+
+    if (!Node || !Copy)
+    {
+      free (Node);
+      free (Copy);
+      return NPS_OUT_OF_MEMORY;
+    }
+    memcpy (Copy, Message, MsgLen);
+    Node->Message = Copy;
+    Node->Next = NULL;
+    Node->Prev = State.Tail;
+    if (State.Tail)
+      State.Tail->Next = Node;
+    else
+      Channel->MessagesToSend = Node;
+    State.Tail = Node;
+
+    Channel->MetaMsgLen = (NPS_MSGLEN) (Channel->MetaMsgLen + MsgLen);
+    Channel->NumMetaMsg++;
+    Channel->MessageOnList = TRUE;
+    if (std::find (State.Senders.begin (), State.Senders.end (), From)
+        == State.Senders.end ())
+      State.Senders.push_back (From);
+
+    if (!State.Timer)
+    {
+      NPSReactorTime Now = NPSReactor::Clock ();
+      NPSReactorTime Due = _LastSent (Channel) + Channel->SendRate;
+
+      State.Timer = m_Reactor->AddTimer ((Due > Now) ? (long) (Due - Now) : 0,
+                                         0, _OnTick, this);
+      m_Timers[State.Timer] = Channel;
+    }
+    return Status;
+  }
+
+  // Sends Channel's meta-message now.
+  NPSSTATUS Flush (NPS_CommData * Channel)
+  {
+    ChannelMap::iterator it = m_Channels.find (Channel);
+
+    if (it == m_Channels.end () || !Channel->NumMetaMsg)
+      return NPS_OK;
+
+    ChannelState & State = it->second;
+    int NumMsg = Channel->NumMetaMsg;
+    long MetaMsgLen = Channel->MetaMsgLen;
+
+    if (State.Timer)
+    {
+      m_Reactor->CancelTimer (State.Timer);
+      m_Timers.erase (State.Timer);
+      State.Timer = 0;
+    }
+
+    m_Meta.resize (MetaMsgLen);
+    char *Out = &m_Meta[0];
+    for (NPS_MsgList * Node = Channel->MessagesToSend; Node; Node = Node->Next)
+    {
+      NPS_HeaderView Header ((const unsigned char *) Node->Message,
+                             MAX_MSG_LEN);
+
+      memcpy (Out, Node->Message, Header.length ());
+      Out += Header.length ();
+    }
+    _FreeList (Channel);
+    State.Tail = NULL;
+    State.Senders.clear ();
+
+    NPSReactorTime Now = NPSReactor::Clock ();
+    Channel->LastTimeSent.seconds = (unsigned long) (Now / 1000);
+    Channel->LastTimeSent.msecs = (unsigned long) (Now % 1000);
+
+    long Members = (Channel->ConnectedUsers > 0) ? Channel->ConnectedUsers : 1;
+    m_MetaMessagesSent++;
+    if (NumMsg > 1)
+    {
+      m_MessagesMerged += NumMsg;
+      m_SendsSaved += (NumMsg - 1) * Members;
+      m_BytesSaved += (NumMsg - 1) * Members * NPS_COALESCE_PACKET_OVERHEAD;
+    }
+    return m_Send (Channel, &m_Meta[0], MetaMsgLen, NumMsg, m_Context);
+  }
+
+  // Sends every channel's meta-message now, e.g. at shutdown.
+  void FlushAll (void)
+  {
+    for (ChannelMap::iterator it = m_Channels.begin ();
+         it != m_Channels.end (); ++it)
+      Flush (it->first);
+  }
+
+  //------------------------- Metrics ----------------------------------
+  NPS_INLINE long MessagesQueued (void)
+  {
+    return m_MessagesQueued;
+  }
+
+  // Meta-messages sent, counting messages that went alone.
+  NPS_INLINE long MetaMessagesSent (void)
+  {
+    return m_MetaMessagesSent;
+  }
+
+  // Messages that went out in a meta-message with at least one other.
+  NPS_INLINE long MessagesMerged (void)
+  {
+    return m_MessagesMerged;
+  }
+
+  // Sends to channel members avoided by merging.
+  NPS_INLINE long SendsSaved (void)
+  {
+    return m_SendsSaved;
+  }
+
+  NPS_INLINE long BytesSaved (void)
+  {
+    return m_BytesSaved;
+  }
+
+private:
+  struct ChannelState
+  {
+    ChannelState () : Tail (NULL), Timer (0) {}
+
+    NPS_MsgList *Tail;              // last node of MessagesToSend
+    NPSReactorTimerId Timer;        // due at the end of this tick, or 0
+    std::vector<NPS_USERID> Senders; // users with a message waiting
+  };
+  typedef std::map<NPS_CommData *, ChannelState> ChannelMap;
+
+  NPSReactor *m_Reactor;
+  NPSCoalesceSend m_Send;
+  void *m_Context;
+  ChannelMap m_Channels;
+  std::map<NPSReactorTimerId, NPS_CommData *> m_Timers;
+  std::vector<char> m_Meta;
+  long m_MessagesQueued;
+  long m_MetaMessagesSent;
+  long m_MessagesMerged;
+  long m_SendsSaved;
+  long m_BytesSaved;
+
+  NPSCoalescer (const NPSCoalescer &);
+  NPSCoalescer & operator = (const NPSCoalescer &);
+
+  static NPSReactorTime _LastSent (const NPS_CommData * Channel)
+  {
+    return (NPSReactorTime) Channel->LastTimeSent.seconds * 1000
+      + Channel->LastTimeSent.msecs;
+  }
+
+  static void _FreeList (NPS_CommData * Channel)
+  {
+    NPS_MsgList *Node = Channel->MessagesToSend;
+
+    while (Node)
+    {
+      NPS_MsgList *Next = Node->Next;
+
+      free (Node->Message);
+      free (Node);
+      Node = Next;
+    }
+    Channel->MessagesToSend = NULL;
+    Channel->MetaMsgLen = 0;
+    Channel->NumMetaMsg = 0;
+    Channel->MessageOnList = FALSE;
+  }
+
+  static void _OnTick (NPSReactorTimerId TimerId, void *Context)
+  {
+    NPSCoalescer *pThis = (NPSCoalescer *) Context;
+    std::map<NPSReactorTimerId, NPS_CommData *>::iterator it =
+      pThis->m_Timers.find (TimerId);
+
+    if (it == pThis->m_Timers.end ())
+      return;
+
+    NPS_CommData *Channel = it->second;
+
+    pThis->m_Timers.erase (it);
+    pThis->m_Channels[Channel].Timer = 0;
+    pThis->Flush (Channel);
+  }
+};
+
+#endif // __cplusplus
+
+#endif // _NPS_COALESCE_H
@@ -67,7 +67,7 @@
 #if !defined NPSCOMM_LATENCY_AND_BANDWIDTH && defined _DEBUG
 # define NPSCOMM_LATENCY_AND_BANDWIDTH (0)
 #endif
-#undef NPSCOMM_LATENCY_AND_BANDWIDTH
+#undef NPSCOMM_LATENCY_AND_BANDWIDTH  // NPSShaper.h shapes without blocking
 
 //#ifdef __cplusplus                 // Added by DRS to make this C Compatible.
 //# include <vector>
@@ -91,7 +91,20 @@
 # include <sys/time.h>
 # include <syslog.h>
 # include <sys/stat.h>
+# include <sys/uio.h>
 # include <stdio.h>
+# include <string.h>
+# if !defined (MSG_NOSIGNAL)
+#  define MSG_NOSIGNAL 0
+# endif
+#endif
+
+#if defined (linux)
+# include <netinet/udp.h>
+# if !defined (UDP_SEGMENT)
+#  define UDP_SEGMENT 103
+#  define UDP_GRO     104
+# endif
 #endif
 
 
@@ -112,6 +125,9 @@
 #define OPT_LEN            5
 #define COMM_BUFFER_LEN    256
 #define MAX_MSG_LEN        0xFFFF
+#define MAX_GATHER_FRAGS   16     // most fragments SendToSocketV will take
+#define MAX_UDP_BATCH      256    // most datagrams per system call (a full room)
+#define MAX_UDP_SEGMENTS   64     // most datagrams one GSO send may carry
 
 #ifdef NPSCOMM_LATENCY_AND_BANDWIDTH
 typedef enum _NPSCommGroup
@@ -136,6 +152,17 @@ NPSCommSendParams;
 # define NPSCOMM_INFINITE_BANDWIDTH  0xFFFFFFFFUL
 #endif // NPSCOMM_LATENCY_AND_BANDWIDTH
 
+#if defined (WIN32)
+// Winsock has no iovec; this mirrors the POSIX layout (see NPS_GatherList.h).
+# if !defined ( NPS_GATHER_LIST_H_ )
+struct iovec
+{
+  void *iov_base;
+  size_t iov_len;
+};
+# endif
+#endif
+
 #if !defined (WIN32)
 // SEP
 // const int INVALID_SOCKET =    -1;
@@ -178,6 +205,18 @@ typedef struct _SockBuffer
 }
 SockBuffer;
 
+// One datagram for the batched UDP calls.
+typedef struct _NPSDatagram
+{
+  struct sockaddr_in Addr;      // send: destination; receive: source
+  char *Data;
+  long Size;                    // send: bytes; receive: room in, bytes out,
+                                // or NPS_SHORT_READ if it was cut short
+  int SegmentSize;              // receive with GRO: size of each datagram
+                                // coalesced into Data, else 0
+}
+NPSDatagram;
+
 #ifdef __cplusplus                 // Added by DRS to make this C Compatible.
 
 #ifdef NPSCOMM_LATENCY_AND_BANDWIDTH
@@ -310,6 +349,8 @@ public:
   NPSSTATUS WaitForSocket (SOCKET LocalSocket, struct timeval *MyTimeOut,
                            NPS_LOGICAL SelectForWrite = FALSE);
 
+  // Limited to MaxSocketsInFdSet() sockets; NPSReactor.h has an event
+  // loop, and a WaitForSockets(), without that limit.
   fd_set *CreateSocketFdSet (SOCKET * Sockets, int nSockets);
 
   NPS_LOGICAL IsSocketSet (SOCKET Socket, fd_set * FdSet);
@@ -323,6 +364,64 @@ public:
   NPSSTATUS SendToSocket (SOCKET * LocalSocket, char *MyMessage,
                           long MsgSize = 0, NPS_LOGICAL stringdata = FALSE);
 
+  // Gathering send: writes the fragments in order with sendmsg(), so a
+  // message serialized to an NPS_GatherList goes out without first being
+  // copied into one contiguous buffer.  Blocks until every byte is sent.
+  // A closed peer is an error, not a SIGPIPE.  At most MAX_GATHER_FRAGS
+  // fragments.
+  NPSSTATUS SendToSocketV (SOCKET * LocalSocket,
+                           const struct iovec *Fragments, int nFragments)
+  {
+    if (!LocalSocket || *LocalSocket == INVALID_SOCKET)
+      return NPS_INVALID_SOCKET;
+    if (nFragments < 0 || nFragments > MAX_GATHER_FRAGS)
+      return NPS_BAD_PARAM;
+
+#if defined (WIN32)
+    for (int i = 0; i < nFragments; i++)
+    {
+      NPSSTATUS status = SendToSocket (LocalSocket,
+                                       (char *) Fragments[i].iov_base,
+                                       (long) Fragments[i].iov_len);
+      if (status != NPS_OK)
+        return status;
+    }
+#else
+    // sendmsg() may stop part way; walk a private copy forward.
+    struct iovec iov[MAX_GATHER_FRAGS];
+    struct msghdr msg;
+    int first = 0;
+
+    memcpy (iov, Fragments, nFragments * sizeof (struct iovec));
+    memset (&msg, 0, sizeof (msg));
+    while (first < nFragments)
+    {
+      msg.msg_iov = iov + first;
+      msg.msg_iovlen = nFragments - first;
+
+      ssize_t sent = sendmsg (*LocalSocket, &msg, MSG_NOSIGNAL);
+      if (sent < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        NPSComm_SetLastError ();
+        return NPS_ERR;
+      }
+      while (first < nFragments && (size_t) sent >= iov[first].iov_len)
+      {
+        sent -= iov[first].iov_len;
+        first++;
+      }
+      if (first < nFragments)
+      {
+        iov[first].iov_base = (char *) iov[first].iov_base + sent;
+        iov[first].iov_len -= sent;
+      }
+    }
+#endif
+    return NPS_OK;
+  }
+
   NPSSTATUS PeekOnSocket (SOCKET * LocalSocket, char *PeekMessage,
                           int MsgSize = PEEKMSGSIZE);
 
@@ -393,6 +492,279 @@ public:
                              socklen_t *pSockAddrLen,
                              char *PeekMessage, int MsgSize);
 
+  //------------------------------------------------------------
+  //
+  // batched UDP: one system call per MAX_UDP_BATCH datagrams
+  // (sendmmsg/recvmmsg) where the platform has it, one per
+  // datagram elsewhere.
+  //
+  //------------------------------------------------------------
+
+  // Sends each datagram to its Addr.  *nSent (if given) says how many
+  // went before any error.
+  NPSSTATUS SendToSocketUDPMulti (SOCKET * LocalSocket,
+                                  NPSDatagram * Datagrams, int nDatagrams,
+                                  int *nSent = NULL)
+  {
+    int Sent = 0;
+
+    if (nSent)
+      *nSent = 0;
+    if (!LocalSocket || *LocalSocket == INVALID_SOCKET)
+      return NPS_INVALID_SOCKET;
+    if (!Datagrams || nDatagrams < 0)
+      return NPS_BAD_PARAM;
+
+    while (Sent < nDatagrams)
+    {
+#if defined (linux)
+      struct mmsghdr Msgs[MAX_UDP_BATCH];
+      struct iovec Iov[MAX_UDP_BATCH];
+      int n = nDatagrams - Sent;
+
+      if (n > MAX_UDP_BATCH)
+        n = MAX_UDP_BATCH;
+      memset (Msgs, 0, n * sizeof (struct mmsghdr));
+      for (int i = 0; i < n; i++)
+      {
+        Iov[i].iov_base = Datagrams[Sent + i].Data;
+        Iov[i].iov_len = Datagrams[Sent + i].Size;
+        Msgs[i].msg_hdr.msg_name = &Datagrams[Sent + i].Addr;
+        Msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+        Msgs[i].msg_hdr.msg_iov = &Iov[i];
+        Msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+      // May stop short; carry on from where it did.
+      int Result = sendmmsg (*LocalSocket, Msgs, n, 0);
+      if (Result < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        NPSComm_SetLastError ();
+        break;
+      }
+      Sent += Result;
+#else
+      NPSDatagram *Dg = &Datagrams[Sent];
+
+      if (SendToSocketUDP (LocalSocket, (struct sockaddr *) &Dg->Addr,
+                           sizeof (Dg->Addr), Dg->Data, Dg->Size) < 0)
+        break;
+      Sent++;
+#endif
+    }
+
+    if (nSent)
+      *nSent = Sent;
+    return (Sent == nDatagrams) ? NPS_OK : NPS_ERR;
+  }
+
+  // Sends the same message to every peer: a room broadcast is one
+  // system call rather than one per player.
+  NPSSTATUS BroadcastToSocketUDP (SOCKET * LocalSocket,
+                                  const struct sockaddr_in *Peers, int nPeers,
+                                  char *MyMessage, long MsgSize)
+  {
+    NPSDatagram Datagrams[MAX_UDP_BATCH];
+
+    if (!Peers || nPeers < 0 || !MyMessage)
+      return NPS_BAD_PARAM;
+    for (int First = 0; First < nPeers; First += MAX_UDP_BATCH)
+    {
+      int n = (nPeers - First < MAX_UDP_BATCH) ? nPeers - First
+        : MAX_UDP_BATCH;
+      NPSSTATUS Status;
+
+      for (int i = 0; i < n; i++)
+      {
+        Datagrams[i].Addr = Peers[First + i];
+        Datagrams[i].Data = MyMessage;
+        Datagrams[i].Size = MsgSize;
+      }
+      Status = SendToSocketUDPMulti (LocalSocket, Datagrams, n);
+      if (Status != NPS_OK)
+        return Status;
+    }
+    return NPS_OK;
+  }
+
+  // Receives up to nDatagrams datagrams into the callers' buffers: waits
+  // (unless the socket is async) for the first, then takes whatever else
+  // is already queued.  Replaces PeekOnSocketUDP + ReceiveFromSocketUDP.
+  // Returns the number received, NPS_NO_DATA_AVAIL, or NPS_ERR.
+  int ReceiveFromSocketUDPMulti (SOCKET * LocalSocket,
+                                 NPSDatagram * Datagrams, int nDatagrams)
+  {
+    if (!LocalSocket || *LocalSocket == INVALID_SOCKET)
+      return NPS_INVALID_SOCKET;
+    if (!Datagrams || nDatagrams <= 0)
+      return NPS_BAD_PARAM;
+    if (nDatagrams > MAX_UDP_BATCH)
+      nDatagrams = MAX_UDP_BATCH;
+
+#if defined (linux)
+    struct mmsghdr Msgs[MAX_UDP_BATCH];
+    struct iovec Iov[MAX_UDP_BATCH];
+    // Room for the GRO segment size that comes with a coalesced datagram.
+    union
+    {
+      char Buf[CMSG_SPACE (sizeof (int))];
+      struct cmsghdr Align;
+    } Control[MAX_UDP_BATCH];
+    int Result;
+
+    memset (Msgs, 0, nDatagrams * sizeof (struct mmsghdr));
+    for (int i = 0; i < nDatagrams; i++)
+    {
+      Iov[i].iov_base = Datagrams[i].Data;
+      Iov[i].iov_len = Datagrams[i].Size;
+      Msgs[i].msg_hdr.msg_name = &Datagrams[i].Addr;
+      Msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+      Msgs[i].msg_hdr.msg_iov = &Iov[i];
+      Msgs[i].msg_hdr.msg_iovlen = 1;
+      Msgs[i].msg_hdr.msg_control = Control[i].Buf;
+      Msgs[i].msg_hdr.msg_controllen = sizeof (Control[i].Buf);
+    }
+
+    do
+      Result = recvmmsg (*LocalSocket, Msgs, nDatagrams, MSG_WAITFORONE,
+                         NULL);
+    while (Result < 0 && errno == EINTR);
+    if (Result < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return NPS_NO_DATA_AVAIL;
+      NPSComm_SetLastError ();
+      return NPS_ERR;
+    }
+
+    for (int i = 0; i < Result; i++)
+    {
+      struct msghdr *Hdr = &Msgs[i].msg_hdr;
+      struct cmsghdr *Cmsg;
+
+      Datagrams[i].Size = (Hdr->msg_flags & MSG_TRUNC) ? (long) NPS_SHORT_READ
+        : (long) Msgs[i].msg_len;
+      Datagrams[i].SegmentSize = 0;
+      for (Cmsg = CMSG_FIRSTHDR (Hdr); Cmsg; Cmsg = CMSG_NXTHDR (Hdr, Cmsg))
+      {
+        if (Cmsg->cmsg_level == IPPROTO_UDP && Cmsg->cmsg_type == UDP_GRO)
+          memcpy (&Datagrams[i].SegmentSize, CMSG_DATA (Cmsg), sizeof (int));
+      }
+    }
+    return Result;
+#else
+    socklen_t AddrLen = sizeof (Datagrams[0].Addr);
+    NPSSTATUS Status = ReceiveFromSocketUDP (LocalSocket,
+                                             (struct sockaddr *) &Datagrams[0].Addr,
+                                             &AddrLen, Datagrams[0].Data,
+                                             (int) Datagrams[0].Size);
+
+    if (Status < 0)
+      return Status;
+    Datagrams[0].Size = Status;
+    Datagrams[0].SegmentSize = 0;
+    return 1;
+#endif
+  }
+
+  // Sends MsgSize bytes to one peer as datagrams of SegmentSize bytes
+  // (the last may be shorter), e.g. a backlog of equal sized updates.
+  // The kernel (or NIC) does the splitting where it offers UDP GSO;
+  // elsewhere the segments go out as a batch.  A kernel without GSO is
+  // asked once per process; a send it refuses for its own reasons (say
+  // SegmentSize is over the path MTU) goes out as a batch that time only.
+  NPSSTATUS SendToSocketUDPSegmented (SOCKET * LocalSocket,
+                                      struct sockaddr_in *Peer,
+                                      char *MyMessage, long MsgSize,
+                                      int SegmentSize)
+  {
+    NPSDatagram Datagrams[MAX_UDP_SEGMENTS];
+    int nSegments;
+#if defined (linux)
+    static int UDPGso = TRUE;   // cleared if the kernel has no GSO; atomic
+#endif
+
+    if (!LocalSocket || *LocalSocket == INVALID_SOCKET)
+      return NPS_INVALID_SOCKET;
+    if (!Peer || !MyMessage || MsgSize <= 0 || SegmentSize <= 0)
+      return NPS_BAD_PARAM;
+    nSegments = (int) ((MsgSize + SegmentSize - 1) / SegmentSize);
+    if (nSegments > MAX_UDP_SEGMENTS || MsgSize > MAX_MSG_LEN)
+      return NPS_BAD_PARAM;
+
+#if defined (linux)
+    if (nSegments > 1 && __atomic_load_n (&UDPGso, __ATOMIC_RELAXED))
+    {
+      struct msghdr Hdr;
+      struct iovec Iov;
+      union
+      {
+        char Buf[CMSG_SPACE (sizeof (unsigned short))];
+        struct cmsghdr Align;
+      } Control;
+      struct cmsghdr *Cmsg;
+      unsigned short GsoSize = (unsigned short) SegmentSize;
+      ssize_t Result;
+
+      memset (&Hdr, 0, sizeof (Hdr));
+      memset (&Control, 0, sizeof (Control));
+      Iov.iov_base = MyMessage;
+      Iov.iov_len = MsgSize;
+      Hdr.msg_name = Peer;
+      Hdr.msg_namelen = sizeof (*Peer);
+      Hdr.msg_iov = &Iov;
+      Hdr.msg_iovlen = 1;
+      Hdr.msg_control = Control.Buf;
+      Hdr.msg_controllen = sizeof (Control.Buf);
+      Cmsg = CMSG_FIRSTHDR (&Hdr);
+      Cmsg->cmsg_level = IPPROTO_UDP;
+      Cmsg->cmsg_type = UDP_SEGMENT;
+      Cmsg->cmsg_len = CMSG_LEN (sizeof (GsoSize));
+      memcpy (CMSG_DATA (Cmsg), &GsoSize, sizeof (GsoSize));
+
+      do
+        Result = sendmsg (*LocalSocket, &Hdr, 0);
+      while (Result < 0 && errno == EINTR);
+      if (Result == MsgSize)
+        return NPS_OK;
+      // No GSO on this kernel: stop asking.
+      if (Result < 0 && (errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+        __atomic_store_n (&UDPGso, FALSE, __ATOMIC_RELAXED);
+      // Not this send (segment size, route or device): batch it instead.
+      else if (Result < 0 && errno != EINVAL && errno != EIO)
+      {
+        NPSComm_SetLastError ();
+        return NPS_ERR;
+      }
+    }
+#endif
+
+    for (int i = 0; i < nSegments; i++)
+    {
+      Datagrams[i].Addr = *Peer;
+      Datagrams[i].Data = MyMessage + (long) i * SegmentSize;
+      Datagrams[i].Size = (i < nSegments - 1) ? SegmentSize
+        : MsgSize - (long) i * SegmentSize;
+    }
+    return SendToSocketUDPMulti (LocalSocket, Datagrams, nSegments);
+  }
+
+  // Lets the kernel coalesce datagrams from one peer into a single
+  // buffer for ReceiveFromSocketUDPMulti(), which then reports the
+  // SegmentSize to split it by.  NPS_NOT_IMPLEMENTED without UDP GRO.
+  NPSSTATUS EnableUDPGro (SOCKET LocalSocket)
+  {
+#if defined (linux)
+    int On = 1;
+
+    if (setsockopt (LocalSocket, IPPROTO_UDP, UDP_GRO, &On, sizeof (On)) == 0)
+      return NPS_OK;
+#endif
+    (void) LocalSocket;
+    return NPS_NOT_IMPLEMENTED;
+  }
+
   // Set and clear asynchronous mode for a socket
   NPSSTATUS SetSocketSync (SOCKET * LocalSocket);
   NPSSTATUS SetSocketAsync (SOCKET * LocalSocket);
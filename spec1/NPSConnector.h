@@ -0,0 +1,919 @@
+/*************************************************************************
+ File Name:     NPSConnector.h
+
+ Purpose:       Non-blocking outbound connections, with a resolver cache
+                and a pool of warm connections
+ Notes:
+
+   BuildRemoteSocket() resolves the host name synchronously, and
+   ConnectSocket() then blocks in connect(); a client hopping from the
+   lobby to a room server pays for a DNS lookup and a TCP handshake
+   before it can say anything, and a dead address stalls it for the
+   whole connect timeout before the next of MAX_SERVER_RETRY tries.
+
+   NPSConnector does the same work on an NPSReactor without blocking it:
+
+   - Names are looked up on a helper thread and cached for
+     NPS_CONNECT_CACHE_SECS.  Lookups of a name already being looked up
+     wait for that one.  Numeric addresses skip the lookup.
+
+   - The addresses are tried as a race ("happy eyeballs", RFC 8305):
+     address families alternate, a new attempt starts every
+     NPS_CONNECT_STAGGER_MS (or as soon as one fails) while earlier ones
+     are still going, and the first to connect wins.  An unreachable
+     address costs a stagger, not a timeout.
+
+   - Release() keeps a finished connection open for the next Acquire()
+     of the same server, up to SetPoolLimits() connections per server
+     for at most as long; Warm() opens some ahead of time.  A pooled
+     connection the server has since closed is dropped, not handed out.
+
+   The callback is always called from the reactor, never from within
+   Connect() or Acquire(), with a connected non-blocking socket or
+   INVALID_SOCKET and the reason (NPS_TIMEOUT, or NPS_ERR; see
+   GetConnectError()).
+
+   Not thread safe; use it on the reactor's thread.  Linux only for now;
+   elsewhere Open() returns NPS_NOT_IMPLEMENTED.
+ *************************************************************************/
+
+#ifndef _NPS_CONNECTOR_H
+#define _NPS_CONNECTOR_H
+
+#include <NPSReactor.h>
+
+#include <stdio.h>
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+
+#if defined (linux)
+# include <pthread.h>
+# include <unistd.h>
+# include <netdb.h>
+# include <arpa/inet.h>
+# include <sys/eventfd.h>
+#endif
+
+#ifdef __cplusplus
+
+#define NPS_CONNECT_TIMEOUT_DEFAULT  (10000)  // ms for a whole Connect()
+#define NPS_CONNECT_STAGGER_MS       (250)    // between racing attempts
+#define NPS_CONNECT_CACHE_SECS       (300)    // resolver cache lifetime
+#define NPS_CONNECT_POOL_MAX         (4)      // idle connections per server
+#define NPS_CONNECT_POOL_IDLE_MS     (60000)  // how long they are kept
+
+// Socket is connected and non-blocking, or INVALID_SOCKET and Status
+// says why.
+typedef void (*NPSConnectCallback) (unsigned long Request, SOCKET Socket,
+                                    NPSSTATUS Status, void *Context);
+
+class NPSConnector
+{
+public:
+  NPSConnector (void)
+  {
+    m_Reactor = NULL;
+    m_WakeFd = -1;
+    m_ResolverRunning = FALSE;
+    m_ResolverStop = FALSE;
+    m_NextRequest = 1;
+    m_PruneTimer = 0;
+    m_StaggerMs = NPS_CONNECT_STAGGER_MS;
+    m_PoolMax = NPS_CONNECT_POOL_MAX;
+    m_PoolIdleMs = NPS_CONNECT_POOL_IDLE_MS;
+    m_LastErrno = 0;
+    m_Connects = 0;
+    m_PoolHits = 0;
+    m_CacheHits = 0;
+  }
+
+  ~NPSConnector (void)
+  {
+    Close ();
+  }
+
+  // Runs connections on Reactor, which must outlive the connector.
+  NPSSTATUS Open (NPSReactor * Reactor)
+  {
+#if defined (linux)
+    if (m_Reactor)
+      return NPS_ERR;
+    if (!Reactor)
+      return NPS_BAD_PARAM;
+
+    m_WakeFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_WakeFd < 0)
+    {
+      m_LastErrno = errno;
+      return NPS_ERR;
+    }
+    if (Reactor->AddSocket (m_WakeFd, NPS_REACTOR_READ, _OnResolved, this)
+        != NPS_OK)
+    {
+      m_LastErrno = Reactor->GetReactorError ();
+      close (m_WakeFd);
+      m_WakeFd = -1;
+      return NPS_ERR;
+    }
+    pthread_mutex_init (&m_ResolverLock, NULL);
+    pthread_cond_init (&m_ResolverWork, NULL);
+    m_ResolverStop = FALSE;
+    if (pthread_create (&m_ResolverThread, NULL, _Resolver, this))
+    {
+      m_LastErrno = errno;
+      Reactor->RemoveSocket (m_WakeFd);
+      close (m_WakeFd);
+      m_WakeFd = -1;
+      return NPS_ERR;
+    }
+    m_ResolverRunning = TRUE;
+    m_Reactor = Reactor;
+    return NPS_OK;
+#else
+    (void) Reactor;
+    return NPS_NOT_IMPLEMENTED;
+#endif
+  }
+
+  // Abandons every request without calling back, and closes every pooled
+  // connection.  Waits for a lookup in progress to finish.
+  NPSSTATUS Close (void)
+  {
+#if defined (linux)
+    if (!m_Reactor)
+      return NPS_OK;
+
+    while (!m_Requests.empty ())
+      _Finish (m_Requests.begin ()->first, INVALID_SOCKET, NPS_ERR, FALSE);
+    for (PoolMap::iterator it = m_Idle.begin (); it != m_Idle.end (); ++it)
+    {
+      for (size_t i = 0; i < it->second.size (); i++)
+        close (it->second[i].Socket);
+    }
+    m_Idle.clear ();
+    if (m_PruneTimer)
+      m_Reactor->CancelTimer (m_PruneTimer);
+    m_PruneTimer = 0;
+
+    pthread_mutex_lock (&m_ResolverLock);
+    m_ResolverStop = TRUE;
+    pthread_cond_signal (&m_ResolverWork);
+    pthread_mutex_unlock (&m_ResolverLock);
+    if (m_ResolverRunning)
+      pthread_join (m_ResolverThread, NULL);
+    m_ResolverRunning = FALSE;
+    pthread_mutex_destroy (&m_ResolverLock);
+    pthread_cond_destroy (&m_ResolverWork);
+    m_Lookups.clear ();
+    m_Resolved.clear ();
+    m_Waiting.clear ();
+
+    m_Reactor->RemoveSocket (m_WakeFd);
+    close (m_WakeFd);
+    m_WakeFd = -1;
+    m_Reactor = NULL;
+#endif
+    return NPS_OK;
+  }
+
+  //------------------------- Settings ---------------------------------
+  NPS_INLINE void SetStagger (long StaggerMs)
+  {
+    m_StaggerMs = (StaggerMs > 0) ? StaggerMs : 1;
+  }
+
+  // Keep at most MaxIdle released connections per server, for at most
+  // IdleMs each.  MaxIdle 0 turns pooling off.
+  NPS_INLINE void SetPoolLimits (int MaxIdle, long IdleMs)
+  {
+    m_PoolMax = (MaxIdle > 0) ? MaxIdle : 0;
+    m_PoolIdleMs = (IdleMs > 0) ? IdleMs : 1;
+  }
+
+  // Forgets cached addresses, e.g. after a server moves.
+  NPS_INLINE void FlushResolverCache (void)
+  {
+    m_Cache.clear ();
+  }
+
+  //------------------------- Connecting -------------------------------
+  // Opens a new connection to Host:Port.  Returns the request's id (for
+  // Cancel()), or 0 if it could not be started.
+  unsigned long Connect (const char *Host, int Port,
+                         NPSConnectCallback Callback, void *Context = NULL,
+                         long TimeOutMs = NPS_CONNECT_TIMEOUT_DEFAULT)
+  {
+    if (!Callback)
+      return 0;
+    return _NewRequest (Host, Port, Callback, Context, TimeOutMs, FALSE);
+  }
+
+  // As Connect(), but hands out a pooled connection if there is one.
+  unsigned long Acquire (const char *Host, int Port,
+                         NPSConnectCallback Callback, void *Context = NULL,
+                         long TimeOutMs = NPS_CONNECT_TIMEOUT_DEFAULT)
+  {
+    if (!Callback)
+      return 0;
+    return _NewRequest (Host, Port, Callback, Context, TimeOutMs, TRUE);
+  }
+
+  // Gives back a healthy connection from Acquire() or Connect() for
+  // reuse; it is closed if the pool for Host:Port is full.
+  NPSSTATUS Release (const char *Host, int Port, SOCKET Socket)
+  {
+    if (!Host || Socket == INVALID_SOCKET)
+      return NPS_BAD_PARAM;
+    if (!m_Reactor)
+      return NPS_ERR;
+    _PoolPut (_Key (Host, Port), Socket);
+    return NPS_OK;
+  }
+
+  // Opens connections to Host:Port until Count are pooled or on the way.
+  NPSSTATUS Warm (const char *Host, int Port, int Count)
+  {
+    std::string Key;
+    int Have;
+
+    if (!Host || Count < 0)
+      return NPS_BAD_PARAM;
+    if (!m_Reactor)
+      return NPS_ERR;
+
+    Key = _Key (Host, Port);
+    Have = IdleCount (Host, Port);
+    for (RequestMap::iterator it = m_Requests.begin ();
+         it != m_Requests.end (); ++it)
+    {
+      if (it->second.Warming && it->second.Key == Key)
+        Have++;
+    }
+    if (Count > m_PoolMax)
+      Count = m_PoolMax;
+    for (; Have < Count; Have++)
+    {
+      if (!_NewRequest (Host, Port, NULL, NULL,
+                        NPS_CONNECT_TIMEOUT_DEFAULT, FALSE))
+        return NPS_ERR;
+    }
+    return NPS_OK;
+  }
+
+  // Abandons a request; its callback will not be called.
+  NPSSTATUS Cancel (unsigned long Request)
+  {
+    if (m_Requests.find (Request) == m_Requests.end ())
+      return NPS_BAD_PARAM;
+    _Finish (Request, INVALID_SOCKET, NPS_ERR, FALSE);
+    return NPS_OK;
+  }
+
+  //------------------------- Statistics -------------------------------
+  int IdleCount (const char *Host, int Port)
+  {
+    PoolMap::iterator it = m_Idle.find (_Key (Host, Port));
+
+    return (it == m_Idle.end ()) ? 0 : (int) it->second.size ();
+  }
+
+  // New connections made, pooled connections handed out, and lookups
+  // answered from the cache.
+  NPS_INLINE long Connects (void)
+  {
+    return m_Connects;
+  }
+
+  NPS_INLINE long PoolHits (void)
+  {
+    return m_PoolHits;
+  }
+
+  NPS_INLINE long CacheHits (void)
+  {
+    return m_CacheHits;
+  }
+
+  // errno of the last failure, or an EAI_ code for a failed lookup.
+  NPS_INLINE int GetConnectError (void)
+  {
+    return m_LastErrno;
+  }
+
+private:
+  struct Address
+  {
+    struct sockaddr_storage Addr;
+    socklen_t Len;
+  };
+  typedef std::vector < Address > AddressList;
+
+  struct Request
+  {
+    std::string Host;
+    std::string Key;                // pool key, "host:port"
+    int Port;
+    NPSConnectCallback Callback;
+    void *Context;
+    NPS_LOGICAL Warming;            // Warm(): pool the result
+    AddressList Addresses;
+    size_t Next;                    // next address to try
+    std::vector < SOCKET > Attempts; // connects in flight
+    SOCKET Pooled;                  // handed out on DeliverTimer
+    int LastErrno;
+    NPSReactorTimerId StaggerTimer;
+    NPSReactorTimerId DeadlineTimer;
+    NPSReactorTimerId DeliverTimer;
+  };
+  typedef std::map < unsigned long, Request > RequestMap;
+
+  struct CacheEntry
+  {
+    AddressList Addresses;
+    NPSReactorTime Expires;
+  };
+
+  struct Lookup
+  {
+    std::string Host;
+    int Error;
+    AddressList Addresses;
+  };
+
+  struct IdleSocket
+  {
+    SOCKET Socket;
+    NPSReactorTime Since;
+  };
+  typedef std::map < std::string, std::vector < IdleSocket > > PoolMap;
+
+  NPSReactor *m_Reactor;
+  int m_WakeFd;
+#if defined (linux)
+  pthread_t m_ResolverThread;
+  pthread_mutex_t m_ResolverLock;
+  pthread_cond_t m_ResolverWork;
+#endif
+  NPS_LOGICAL m_ResolverRunning;
+  NPS_LOGICAL m_ResolverStop;       // under m_ResolverLock
+  std::deque < std::string > m_Lookups;   // for the resolver; under lock
+  std::vector < Lookup > m_Resolved;      // from the resolver; under lock
+  std::map < std::string, std::vector < unsigned long > > m_Waiting;
+  std::map < std::string, CacheEntry > m_Cache;
+  RequestMap m_Requests;
+  std::map < SOCKET, unsigned long > m_AttemptOwner;
+  std::map < NPSReactorTimerId, unsigned long > m_TimerOwner;
+  PoolMap m_Idle;
+  unsigned long m_NextRequest;
+  NPSReactorTimerId m_PruneTimer;
+  long m_StaggerMs;
+  int m_PoolMax;
+  long m_PoolIdleMs;
+  int m_LastErrno;
+  long m_Connects;
+  long m_PoolHits;
+  long m_CacheHits;
+
+  NPSConnector (const NPSConnector &);
+  NPSConnector & operator = (const NPSConnector &);
+
+  static std::string _Key (const char *Host, int Port)
+  {
+    char PortText[16];
+
+    sprintf (PortText, ":%d", Port);
+    return std::string (Host) + PortText;
+  }
+
+  unsigned long _NewRequest (const char *Host, int Port,
+                             NPSConnectCallback Callback, void *Context,
+                             long TimeOutMs, NPS_LOGICAL UsePool)
+  {
+    if (!m_Reactor || !Host || Port <= 0 || Port > 0xFFFF || TimeOutMs <= 0)
+      return 0;
+
+    unsigned long Id = m_NextRequest++;
+    Request & Req = m_Requests[Id];
+
+    if (!m_NextRequest)
+      m_NextRequest = 1;
+    Req.Host = Host;
+    Req.Key = _Key (Host, Port);
+    Req.Port = Port;
+    Req.Callback = Callback;
+    Req.Context = Context;
+    Req.Warming = Callback ? FALSE : TRUE;
+    Req.Next = 0;
+    Req.Pooled = INVALID_SOCKET;
+    Req.LastErrno = 0;
+    Req.StaggerTimer = 0;
+    Req.DeliverTimer = 0;
+    Req.DeadlineTimer = _AddTimer (Id, TimeOutMs);
+
+    if (UsePool && (Req.Pooled = _PoolTake (Req.Key)) != INVALID_SOCKET)
+    {
+      m_PoolHits++;
+      Req.DeliverTimer = _AddTimer (Id, 0);
+      return Id;
+    }
+
+    m_Connects++;
+    _Resolve (Id);
+    return Id;
+  }
+
+  NPSReactorTimerId _AddTimer (unsigned long Id, long DelayMs)
+  {
+    NPSReactorTimerId Timer = m_Reactor->AddTimer (DelayMs, 0, _OnTimer, this);
+
+    m_TimerOwner[Timer] = Id;
+    return Timer;
+  }
+
+  void _CancelTimer (NPSReactorTimerId &Timer)
+  {
+    if (Timer)
+    {
+      m_Reactor->CancelTimer (Timer);
+      m_TimerOwner.erase (Timer);
+    }
+    Timer = 0;
+  }
+
+  //------------------------- Resolving --------------------------------
+  void _Resolve (unsigned long Id)
+  {
+    Request & Req = m_Requests[Id];
+    AddressList Numeric;
+
+    if (_ParseNumeric (Req.Host.c_str (), Numeric))
+    {
+      _Race (Id, Numeric);
+      return;
+    }
+
+    std::map < std::string, CacheEntry >::iterator Cached =
+      m_Cache.find (Req.Host);
+
+    if (Cached != m_Cache.end ())
+    {
+      if (Cached->second.Expires > NPSReactor::Clock ())
+      {
+        m_CacheHits++;
+        _Race (Id, Cached->second.Addresses);
+        return;
+      }
+      m_Cache.erase (Cached);
+    }
+
+    std::vector < unsigned long > & Waiters = m_Waiting[Req.Host];
+
+    Waiters.push_back (Id);
+    if (Waiters.size () > 1)
+      return;                       // already being looked up
+#if defined (linux)
+    pthread_mutex_lock (&m_ResolverLock);
+    m_Lookups.push_back (Req.Host);
+    pthread_cond_signal (&m_ResolverWork);
+    pthread_mutex_unlock (&m_ResolverLock);
+#endif
+  }
+
+  static NPS_LOGICAL _ParseNumeric (const char *Host, AddressList & Out)
+  {
+#if defined (linux)
+    Address A;
+
+    memset (&A, 0, sizeof (A));
+    if (inet_pton (AF_INET, Host,
+                   &((struct sockaddr_in *) &A.Addr)->sin_addr) == 1)
+    {
+      A.Addr.ss_family = AF_INET;
+      A.Len = sizeof (struct sockaddr_in);
+    }
+    else if (inet_pton (AF_INET6, Host,
+                        &((struct sockaddr_in6 *) &A.Addr)->sin6_addr) == 1)
+    {
+      A.Addr.ss_family = AF_INET6;
+      A.Len = sizeof (struct sockaddr_in6);
+    }
+    else
+      return FALSE;
+    Out.push_back (A);
+    return TRUE;
+#else
+    (void) Host;
+    (void) Out;
+    return FALSE;
+#endif
+  }
+
+#if defined (linux)
+  static void *_Resolver (void *Context)
+  {
+    NPSConnector *pThis = (NPSConnector *) Context;
+
+    pthread_mutex_lock (&pThis->m_ResolverLock);
+    for (;;)
+    {
+      while (!pThis->m_ResolverStop && pThis->m_Lookups.empty ())
+        pthread_cond_wait (&pThis->m_ResolverWork, &pThis->m_ResolverLock);
+      if (pThis->m_ResolverStop)
+        break;
+
+      Lookup Done;
+      struct addrinfo Hints;
+      struct addrinfo *Found = NULL;
+
+      Done.Host = pThis->m_Lookups.front ();
+      pThis->m_Lookups.pop_front ();
+      pthread_mutex_unlock (&pThis->m_ResolverLock);
+
+      memset (&Hints, 0, sizeof (Hints));
+      Hints.ai_family = AF_UNSPEC;
+      Hints.ai_socktype = SOCK_STREAM;
+      Hints.ai_flags = AI_ADDRCONFIG;
+      Done.Error = getaddrinfo (Done.Host.c_str (), NULL, &Hints, &Found);
+      for (struct addrinfo * Ai = Found; Ai; Ai = Ai->ai_next)
+      {
+        Address A;
+
+        if (Ai->ai_addrlen > sizeof (A.Addr))
+          continue;
+        memset (&A, 0, sizeof (A));
+        memcpy (&A.Addr, Ai->ai_addr, Ai->ai_addrlen);
+        A.Len = Ai->ai_addrlen;
+        Done.Addresses.push_back (A);
+      }
+      if (Found)
+        freeaddrinfo (Found);
+
+      unsigned long long One = 1;
+
+      pthread_mutex_lock (&pThis->m_ResolverLock);
+      pThis->m_Resolved.push_back (Done);
+      if (write (pThis->m_WakeFd, &One, sizeof (One)) < 0)
+        continue;                   // counter full: already signalled
+    }
+    pthread_mutex_unlock (&pThis->m_ResolverLock);
+    return NULL;
+  }
+#endif
+
+  static void _OnResolved (SOCKET WakeFd, int, void *Context)
+  {
+    NPSConnector *pThis = (NPSConnector *) Context;
+    std::vector < Lookup > Resolved;
+    unsigned long long Count;
+
+#if defined (linux)
+    while (read (WakeFd, &Count, sizeof (Count)) > 0)
+      ;
+    pthread_mutex_lock (&pThis->m_ResolverLock);
+    Resolved.swap (pThis->m_Resolved);
+    pthread_mutex_unlock (&pThis->m_ResolverLock);
+#else
+    (void) WakeFd;
+    (void) Count;
+#endif
+
+    for (size_t i = 0; i < Resolved.size (); i++)
+    {
+      Lookup & Done = Resolved[i];
+      std::vector < unsigned long > Waiters;
+
+      Waiters.swap (pThis->m_Waiting[Done.Host]);
+      pThis->m_Waiting.erase (Done.Host);
+      if (!Done.Error && !Done.Addresses.empty ())
+      {
+        CacheEntry & Entry = pThis->m_Cache[Done.Host];
+
+        Entry.Addresses = Done.Addresses;
+        Entry.Expires = NPSReactor::Clock ()
+          + (NPSReactorTime) NPS_CONNECT_CACHE_SECS * 1000;
+      }
+      for (size_t w = 0; w < Waiters.size (); w++)
+      {
+        if (pThis->m_Requests.find (Waiters[w]) == pThis->m_Requests.end ())
+          continue;                 // cancelled meanwhile
+        if (Done.Error || Done.Addresses.empty ())
+        {
+          pThis->m_LastErrno = Done.Error;
+          pThis->_Finish (Waiters[w], INVALID_SOCKET, NPS_ERR, TRUE);
+        }
+        else
+          pThis->_Race (Waiters[w], Done.Addresses);
+      }
+    }
+  }
+
+  //------------------------- Racing -----------------------------------
+  // Orders Found as RFC 8305 section 4 does, alternating address
+  // families starting with the resolver's first choice, and starts.
+  void _Race (unsigned long Id, const AddressList & Found)
+  {
+    Request & Req = m_Requests[Id];
+    AddressList First;
+    AddressList Other;
+    size_t i;
+
+    for (i = 0; i < Found.size (); i++)
+    {
+      Address A = Found[i];
+
+      if (A.Addr.ss_family == AF_INET)
+        ((struct sockaddr_in *) &A.Addr)->sin_port = htons ((unsigned short) Req.Port);
+      else
+        ((struct sockaddr_in6 *) &A.Addr)->sin6_port = htons ((unsigned short) Req.Port);
+      (A.Addr.ss_family == Found[0].Addr.ss_family ? First : Other).push_back (A);
+    }
+    Req.Addresses.clear ();
+    for (i = 0; i < First.size () || i < Other.size (); i++)
+    {
+      if (i < First.size ())
+        Req.Addresses.push_back (First[i]);
+      if (i < Other.size ())
+        Req.Addresses.push_back (Other[i]);
+    }
+    Req.Next = 0;
+    _NextAttempt (Id);
+  }
+
+  // Starts a connect to the next address that will take one.
+  void _NextAttempt (unsigned long Id)
+  {
+#if defined (linux)
+    Request & Req = m_Requests[Id];
+
+    _CancelTimer (Req.StaggerTimer);
+    while (Req.Next < Req.Addresses.size ())
+    {
+      const Address & A = Req.Addresses[Req.Next++];
+      SOCKET Socket = socket (A.Addr.ss_family,
+                              SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+      if (Socket == INVALID_SOCKET)
+      {
+        Req.LastErrno = errno;
+        continue;
+      }
+      // Even an immediate success is reported through the reactor, which
+      // sees the new socket writable.
+      if ((connect (Socket, (struct sockaddr *) &A.Addr, A.Len)
+           && errno != EINPROGRESS)
+          || m_Reactor->AddSocket (Socket, NPS_REACTOR_WRITE, _OnAttempt,
+                                   this) != NPS_OK)
+      {
+        Req.LastErrno = errno;
+        close (Socket);
+        continue;
+      }
+      Req.Attempts.push_back (Socket);
+      m_AttemptOwner[Socket] = Id;
+      if (Req.Next < Req.Addresses.size ())
+        Req.StaggerTimer = _AddTimer (Id, m_StaggerMs);
+      return;
+    }
+    if (Req.Attempts.empty ())
+    {
+      m_LastErrno = Req.LastErrno;
+      _Finish (Id, INVALID_SOCKET, NPS_ERR, TRUE);
+    }
+#else
+    (void) Id;
+#endif
+  }
+
+  static void _OnAttempt (SOCKET Socket, int, void *Context)
+  {
+    NPSConnector *pThis = (NPSConnector *) Context;
+    std::map < SOCKET, unsigned long >::iterator Owner =
+      pThis->m_AttemptOwner.find (Socket);
+    int Error = 0;
+    socklen_t Len = sizeof (Error);
+
+    if (Owner == pThis->m_AttemptOwner.end ())
+      return;
+
+    unsigned long Id = Owner->second;
+
+    if (getsockopt (Socket, SOL_SOCKET, SO_ERROR, (char *) &Error, &Len))
+      Error = errno;
+    if (!Error)
+    {
+      pThis->_Finish (Id, Socket, NPS_OK, TRUE);
+      return;
+    }
+
+    // Lost: drop it and move straight on to the next address.
+    Request & Req = pThis->m_Requests[Id];
+
+    pThis->_DropAttempt (Req, Socket);
+    Req.LastErrno = Error;
+    if (Req.Next < Req.Addresses.size ())
+      pThis->_NextAttempt (Id);
+    else if (Req.Attempts.empty ())
+    {
+      pThis->m_LastErrno = Error;
+      pThis->_Finish (Id, INVALID_SOCKET, NPS_ERR, TRUE);
+    }
+  }
+
+  void _DropAttempt (Request & Req, SOCKET Socket)
+  {
+    m_Reactor->RemoveSocket (Socket);
+    m_AttemptOwner.erase (Socket);
+    Req.Attempts.erase (std::find (Req.Attempts.begin (),
+                                   Req.Attempts.end (), Socket));
+#if defined (linux)
+    if (Socket != INVALID_SOCKET)
+      close (Socket);
+#endif
+  }
+
+  static void _OnTimer (NPSReactorTimerId Timer, void *Context)
+  {
+    NPSConnector *pThis = (NPSConnector *) Context;
+    std::map < NPSReactorTimerId, unsigned long >::iterator Owner =
+      pThis->m_TimerOwner.find (Timer);
+
+    if (Owner == pThis->m_TimerOwner.end ())
+      return;
+
+    unsigned long Id = Owner->second;
+    Request & Req = pThis->m_Requests[Id];
+
+    pThis->m_TimerOwner.erase (Owner);
+    if (Timer == Req.StaggerTimer)
+    {
+      Req.StaggerTimer = 0;
+      pThis->_NextAttempt (Id);
+    }
+    else if (Timer == Req.DeliverTimer)
+    {
+      SOCKET Socket = Req.Pooled;
+
+      Req.DeliverTimer = 0;
+      Req.Pooled = INVALID_SOCKET;
+      pThis->_Finish (Id, Socket, NPS_OK, TRUE);
+    }
+    else if (Timer == Req.DeadlineTimer)
+    {
+      Req.DeadlineTimer = 0;
+      pThis->m_LastErrno = ETIMEDOUT;
+      pThis->_Finish (Id, INVALID_SOCKET, NPS_TIMEOUT, TRUE);
+    }
+  }
+
+  // Ends request Id with Winner (one of its attempts, a pooled socket,
+  // or INVALID_SOCKET), closing everything else it holds.
+  void _Finish (unsigned long Id, SOCKET Winner, NPSSTATUS Status,
+                NPS_LOGICAL CallBack)
+  {
+    RequestMap::iterator it = m_Requests.find (Id);
+
+    if (it == m_Requests.end ())
+      return;
+
+    Request & Req = it->second;
+    NPSConnectCallback Callback = Req.Callback;
+    void *Context = Req.Context;
+    std::string Key = Req.Key;
+    NPS_LOGICAL Warming = Req.Warming;
+
+    if (Winner != INVALID_SOCKET
+        && m_AttemptOwner.find (Winner) != m_AttemptOwner.end ())
+    {
+      m_Reactor->RemoveSocket (Winner);
+      m_AttemptOwner.erase (Winner);
+      Req.Attempts.erase (std::find (Req.Attempts.begin (),
+                                     Req.Attempts.end (), Winner));
+    }
+    while (!Req.Attempts.empty ())
+      _DropAttempt (Req, Req.Attempts.back ());
+#if defined (linux)
+    if (Req.Pooled != INVALID_SOCKET)
+      close (Req.Pooled);
+#endif
+    _CancelTimer (Req.StaggerTimer);
+    _CancelTimer (Req.DeadlineTimer);
+    _CancelTimer (Req.DeliverTimer);
+    m_Requests.erase (it);
+
+    if (Warming)
+    {
+      if (Winner != INVALID_SOCKET)
+        _PoolPut (Key, Winner);
+      return;
+    }
+    if (CallBack)
+      Callback (Id, Winner, Status, Context);
+#if defined (linux)
+    else if (Winner != INVALID_SOCKET)
+      close (Winner);
+#endif
+  }
+
+  //------------------------- Pool -------------------------------------
+  void _PoolPut (const std::string & Key, SOCKET Socket)
+  {
+    std::vector < IdleSocket > & Idle = m_Idle[Key];
+
+    if ((int) Idle.size () >= m_PoolMax)
+    {
+#if defined (linux)
+      close (Socket);
+#endif
+      if (Idle.empty ())
+        m_Idle.erase (Key);
+      return;
+    }
+
+    IdleSocket Entry = { Socket, NPSReactor::Clock () };
+
+    Idle.push_back (Entry);
+    if (!m_PruneTimer)
+      m_PruneTimer = m_Reactor->AddTimer (m_PoolIdleMs / 2 + 1,
+                                          m_PoolIdleMs / 2 + 1,
+                                          _OnPrune, this);
+  }
+
+  // The newest idle connection to Key that is still open.
+  SOCKET _PoolTake (const std::string & Key)
+  {
+    PoolMap::iterator it = m_Idle.find (Key);
+    SOCKET Socket = INVALID_SOCKET;
+
+    while (it != m_Idle.end () && !it->second.empty ()
+           && Socket == INVALID_SOCKET)
+    {
+      Socket = it->second.back ().Socket;
+      it->second.pop_back ();
+      if (!_IsAlive (Socket))
+      {
+#if defined (linux)
+        close (Socket);
+#endif
+        Socket = INVALID_SOCKET;
+      }
+    }
+    if (it != m_Idle.end () && it->second.empty ())
+      m_Idle.erase (it);
+    return Socket;
+  }
+
+  // Idle means nothing to read: data or end of stream both disqualify.
+  static NPS_LOGICAL _IsAlive (SOCKET Socket)
+  {
+#if defined (linux)
+    char Byte;
+    long Got = recv (Socket, &Byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return (Got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      ? TRUE : FALSE;
+#else
+    (void) Socket;
+    return FALSE;
+#endif
+  }
+
+  static void _OnPrune (NPSReactorTimerId, void *Context)
+  {
+    NPSConnector *pThis = (NPSConnector *) Context;
+    NPSReactorTime Now = NPSReactor::Clock ();
+    PoolMap::iterator it = pThis->m_Idle.begin ();
+
+    while (it != pThis->m_Idle.end ())
+    {
+      std::vector < IdleSocket > & Idle = it->second;
+      size_t Kept = 0;
+
+      for (size_t i = 0; i < Idle.size (); i++)
+      {
+        if (Now - Idle[i].Since < (NPSReactorTime) pThis->m_PoolIdleMs
+            && _IsAlive (Idle[i].Socket))
+          Idle[Kept++] = Idle[i];
+#if defined (linux)
+        else
+          close (Idle[i].Socket);
+#endif
+      }
+      Idle.resize (Kept);
+      if (Idle.empty ())
+        pThis->m_Idle.erase (it++);
+      else
+        ++it;
+    }
+    if (pThis->m_Idle.empty ())
+    {
+      pThis->m_Reactor->CancelTimer (pThis->m_PruneTimer);
+      pThis->m_PruneTimer = 0;
+    }
+  }
+};
+
+#endif // __cplusplus
+
+#endif // _NPS_CONNECTOR_H
@@ -0,0 +1,349 @@
+/*************************************************************************
+ File Name:     NPSListenerGroup.h
+
+ Purpose:       SO_REUSEPORT listening sockets, one per worker thread
+ Notes:
+
+   BuildLocalSocket() and WaitForSocketAccept() give a server one
+   listening socket and one thread accepting on it.  After a restart the
+   whole player base logs in at once, and every connection queues behind
+   that thread.
+
+   An NPSListenerGroup opens the port once per worker with SO_REUSEPORT.
+   Each worker thread has its own listening socket and its own
+   NPSReactor, and the kernel spreads new connections across the
+   listeners by hashing their addresses, so workers never contend for an
+   accept queue or a lock.  Connections are handed to the accept
+   callback on the thread that accepted them.  Register them with that
+   worker's reactor (GetReactor()) to keep each connection on one
+   thread for life.
+
+   Accepted sockets are already non-blocking, ready for an edge-triggered
+   reactor.  PinToCpus puts worker i on CPU i modulo the CPU count.  Do
+   that only when workers have the machine to themselves.
+
+   Linux 3.9 and later; elsewhere Open() returns NPS_NOT_IMPLEMENTED.
+ *************************************************************************/
+
+#ifndef _NPS_LISTENER_GROUP_H
+#define _NPS_LISTENER_GROUP_H
+
+#include <NPSReactor.h>
+
+#if defined (linux)
+# include <pthread.h>
+# include <sched.h>
+# include <unistd.h>
+# include <sys/eventfd.h>
+#endif
+
+#ifdef __cplusplus
+
+#define NPS_LISTENER_BACKLOG       (1024) // connections waiting per worker
+
+#if defined (linux) && !defined (SO_REUSEPORT)
+# define SO_REUSEPORT 15
+#endif
+
+// Called on worker Worker's thread with each connection it accepts.  The
+// callback owns Client from then on.
+typedef void (*NPSAcceptCallback) (int Worker, SOCKET Client,
+                                   struct sockaddr_in * RemoteAddr,
+                                   void *Context);
+
+class NPSListenerGroup
+{
+public:
+  NPSListenerGroup (void)
+  {
+    m_Workers = NULL;
+    m_nWorkers = 0;
+    m_Port = 0;
+    m_StopFd = -1;
+    m_Accept = NULL;
+    m_Context = NULL;
+    m_PinToCpus = FALSE;
+    m_LastErrno = 0;
+  }
+
+  ~NPSListenerGroup (void)
+  {
+    Close ();
+  }
+
+  // Listens on Port (0 for any) with nWorkers threads (0 for one per
+  // CPU), calling Accept with each connection.
+  NPSSTATUS Open (int Port, int nWorkers, NPSAcceptCallback Accept,
+                  void *Context = NULL, NPS_LOGICAL PinToCpus = FALSE)
+  {
+#if defined (linux)
+    int i;
+
+    if (m_Workers)
+      return NPS_ERR;
+    if (Port < 0 || Port > 0xFFFF || nWorkers < 0 || !Accept)
+      return NPS_BAD_PARAM;
+    if (!nWorkers)
+      nWorkers = _CpuCount ();
+
+    m_Accept = Accept;
+    m_Context = Context;
+    m_PinToCpus = PinToCpus;
+    m_Port = Port;
+    m_StopFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_StopFd < 0)
+    {
+      m_LastErrno = errno;
+      return NPS_ERR;
+    }
+
+    // Every listener is bound before any thread starts, so that a failure
+    // leaves nothing running.
+    m_Workers = new Worker[nWorkers];
+    m_nWorkers = nWorkers;
+    for (i = 0; i < nWorkers; i++)
+    {
+      Worker & W = m_Workers[i];
+
+      W.Group = this;
+      W.Index = i;
+      if (_Listen (W) != NPS_OK
+          || W.Reactor.AddSocket (W.Listener, NPS_REACTOR_READ, _OnAccept,
+                                  &W) != NPS_OK
+          || W.Reactor.AddSocket (m_StopFd, NPS_REACTOR_READ, _OnStop,
+                                  &W) != NPS_OK)
+      {
+        if (!m_LastErrno)
+          m_LastErrno = W.Reactor.GetReactorError ();
+        Close ();
+        return NPS_ERR;
+      }
+    }
+
+    for (i = 0; i < nWorkers; i++)
+    {
+      if (pthread_create (&m_Workers[i].Thread, NULL, _Run, &m_Workers[i]))
+      {
+        m_LastErrno = errno;
+        Close ();
+        return NPS_ERR;
+      }
+      m_Workers[i].Started = TRUE;
+    }
+    return NPS_OK;
+#else
+    (void) Port;
+    (void) nWorkers;
+    (void) Accept;
+    (void) Context;
+    (void) PinToCpus;
+    return NPS_NOT_IMPLEMENTED;
+#endif
+  }
+
+  // Stops the workers and closes the listening sockets.  Connections
+  // already handed out are the callback's to close.
+  NPSSTATUS Close (void)
+  {
+#if defined (linux)
+    int i;
+
+    if (m_StopFd >= 0)
+    {
+      unsigned long long One = 1;
+
+      // Every reactor watches it, so one write stops them all.
+      if (write (m_StopFd, &One, sizeof (One)) < 0)
+        m_LastErrno = errno;
+    }
+    for (i = 0; i < m_nWorkers; i++)
+    {
+      if (m_Workers[i].Started)
+        pthread_join (m_Workers[i].Thread, NULL);
+    }
+    for (i = 0; i < m_nWorkers; i++)
+    {
+      if (m_Workers[i].Listener != INVALID_SOCKET)
+        close (m_Workers[i].Listener);
+    }
+    if (m_StopFd >= 0)
+      close (m_StopFd);
+    m_StopFd = -1;
+#endif
+    delete[] m_Workers;
+    m_Workers = NULL;
+    m_nWorkers = 0;
+    return NPS_OK;
+  }
+
+  NPS_INLINE int WorkerCount (void)
+  {
+    return m_nWorkers;
+  }
+
+  // The port listened on; useful after Open (0, ...).
+  NPS_INLINE int GetPort (void)
+  {
+    return m_Port;
+  }
+
+  // Worker's event loop.  Only touch it from that worker's thread, i.e.
+  // from the accept callback or callbacks registered on it.
+  NPS_INLINE NPSReactor *GetReactor (int Worker)
+  {
+    return (Worker >= 0 && Worker < m_nWorkers)
+      ? &m_Workers[Worker].Reactor : NULL;
+  }
+
+  // Connections Worker has accepted, to see how evenly they spread.
+  NPS_INLINE long AcceptedBy (int Worker)
+  {
+    return (Worker >= 0 && Worker < m_nWorkers)
+      ? m_Workers[Worker].Accepted : 0;
+  }
+
+  NPS_INLINE int GetListenError (void)
+  {
+    return m_LastErrno;
+  }
+
+  // The last accept () error seen by Worker, other than EAGAIN.
+  NPS_INLINE int GetWorkerError (int Worker)
+  {
+    return (Worker >= 0 && Worker < m_nWorkers)
+      ? m_Workers[Worker].LastErrno : 0;
+  }
+
+private:
+  struct Worker
+  {
+    Worker () : Group (NULL), Index (0), Listener (INVALID_SOCKET),
+      Started (FALSE), Accepted (0), LastErrno (0) {}
+
+    NPSListenerGroup *Group;
+    int Index;
+    SOCKET Listener;
+    NPSReactor Reactor;
+#if defined (linux)
+    pthread_t Thread;
+#endif
+    NPS_LOGICAL Started;
+    volatile long Accepted;
+    int LastErrno;
+  };
+
+  Worker *m_Workers;
+  int m_nWorkers;
+  int m_Port;
+  int m_StopFd;
+  NPSAcceptCallback m_Accept;
+  void *m_Context;
+  NPS_LOGICAL m_PinToCpus;
+  int m_LastErrno;
+
+  NPSListenerGroup (const NPSListenerGroup &);
+  NPSListenerGroup & operator = (const NPSListenerGroup &);
+
+#if defined (linux)
+  static int _CpuCount (void)
+  {
+    long nCpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+    return (nCpus > 0) ? (int) nCpus : 1;
+  }
+
+  NPSSTATUS _Listen (Worker & W)
+  {
+    struct sockaddr_in Addr;
+    socklen_t AddrLen = sizeof (Addr);
+    int On = 1;
+
+    W.Listener = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0);
+    if (W.Listener == INVALID_SOCKET)
+    {
+      m_LastErrno = errno;
+      return NPS_INVALID_SOCKET;
+    }
+
+    memset (&Addr, 0, sizeof (Addr));
+    Addr.sin_family = AF_INET;
+    Addr.sin_addr.s_addr = htonl (INADDR_ANY);
+    Addr.sin_port = htons ((unsigned short) m_Port);
+    if (setsockopt (W.Listener, SOL_SOCKET, SO_REUSEADDR, &On, sizeof (On))
+        || setsockopt (W.Listener, SOL_SOCKET, SO_REUSEPORT, &On, sizeof (On))
+        || bind (W.Listener, (struct sockaddr *) &Addr, sizeof (Addr))
+        || listen (W.Listener, NPS_LISTENER_BACKLOG))
+    {
+      m_LastErrno = errno;
+      return NPS_ERR;
+    }
+
+    // The first listener's port, if the kernel picked it, is everyone's.
+    if (!m_Port)
+    {
+      if (getsockname (W.Listener, (struct sockaddr *) &Addr, &AddrLen))
+      {
+        m_LastErrno = errno;
+        return NPS_ERR;
+      }
+      m_Port = ntohs (Addr.sin_port);
+    }
+    return NPS_OK;
+  }
+
+  static void *_Run (void *Context)
+  {
+    Worker *W = (Worker *) Context;
+
+    if (W->Group->m_PinToCpus)
+    {
+      cpu_set_t Cpus;
+
+      CPU_ZERO (&Cpus);
+      CPU_SET (W->Index % _CpuCount (), &Cpus);
+      pthread_setaffinity_np (pthread_self (), sizeof (Cpus), &Cpus);
+    }
+    if (W->Reactor.Run () != NPS_OK)
+      W->LastErrno = W->Reactor.GetReactorError ();
+    return NULL;
+  }
+
+  // Edge-triggered, so accept until the queue is empty.
+  static void _OnAccept (SOCKET Listener, int, void *Context)
+  {
+    Worker *W = (Worker *) Context;
+    NPSListenerGroup *Group = W->Group;
+
+    for (;;)
+    {
+      struct sockaddr_in Addr;
+      socklen_t AddrLen = sizeof (Addr);
+      SOCKET Client = accept4 (Listener, (struct sockaddr *) &Addr, &AddrLen,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+      if (Client == INVALID_SOCKET)
+      {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        // EMFILE and the like leave the rest queued until the next
+        // connection arrives.
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          W->LastErrno = errno;
+        return;
+      }
+      W->Accepted++;
+      Group->m_Accept (W->Index, Client, &Addr, Group->m_Context);
+    }
+  }
+
+  static void _OnStop (SOCKET, int, void *Context)
+  {
+    ((Worker *) Context)->Reactor.Stop ();
+  }
+#endif
+};
+
+#endif // __cplusplus
+
+#endif // _NPS_LISTENER_GROUP_H
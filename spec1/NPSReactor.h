@@ -0,0 +1,1045 @@
+/*************************************************************************
+ File Name:     NPSReactor.h
+
+ Purpose:       Readiness-driven socket event loop for NPSComm sockets
+ Notes:
+
+   NPSComm::WaitForMultipleSockets() and friends are built on fd_set and
+   select(): they cannot see a socket numbered FD_SETSIZE or higher (see
+   MaxSocketsInFdSet()), and every wakeup costs a pass over every socket
+   in the set.  A lobby with thousands of mostly idle clients pays for all
+   of them every time one of them speaks.
+
+   NPSReactor keeps the interest set in the kernel (epoll on linux) and is
+   told only about the sockets that are ready, so a wakeup costs O(ready)
+   and there is no descriptor ceiling.  Each socket registers a callback
+   which is called with NPS_REACTOR_* bits as it becomes readable or
+   writable.
+
+   Sockets are registered edge-triggered: a callback hears about new data
+   once, and must read (or write) until the call would block before it
+   returns.  Use NPSComm::SetSocketAsync() on sockets given to AddSocket().
+
+   Timers run on the same loop.  SetHeartbeat() arms a per-socket idle
+   timer (NPS_HEARTBEAT_TIMEOUT_DEFAULT seconds unless told otherwise);
+   when a socket has been silent that long its callback is called with
+   NPS_REACTOR_TIMEOUT.  Reads push the deadline back for free; the timer
+   is only re-queued when it comes due, so busy sockets cost nothing.
+
+   Timers live in a hierarchical timing wheel: NPS_REACTOR_WHEEL_LEVELS
+   wheels of 2^NPS_REACTOR_WHEEL_BITS slots, each slot of one a full turn
+   of the one below, from 1 ms up to some 49 days.  Adding or cancelling
+   a timer is O(1) however many there are, a timer costs nothing until
+   its slot comes round, and the far-off ones (heartbeats) move down a
+   level only a few times in their life.  Heartbeat deadlines are rounded
+   up to NPS_REACTOR_HEARTBEAT_GRAIN ms so that a server's worth of them
+   expire in a handful of wakeups; SetTimerSlack() does the same for
+   other timers.
+
+   WaitForSocket() and WaitForSockets() are blocking waits in the style
+   of their NPSComm namesakes.  They run the loop while they wait, so
+   registered sockets and timers keep being serviced underneath them.
+
+   Neither class is thread safe; run one reactor per thread.  The reactor
+   never closes a socket.  Call RemoveSocket() before CloseSocket().
+
+   Platforms without epoll get the same interface over select(), with its
+   FD_SETSIZE limit and level-triggered readiness.
+ *************************************************************************/
+
+#ifndef _NPS_REACTOR_H
+#define _NPS_REACTOR_H
+
+#include <NPSComm.h>
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <string.h>
+#include <time.h>
+
+#if defined (linux)
+# define NPS_REACTOR_EPOLL
+# include <sys/epoll.h>
+#endif
+
+#ifdef __cplusplus
+
+// Readiness bits passed to an NPSReactorCallback
+#define NPS_REACTOR_READ           0x01  // data (or end of stream) to read
+#define NPS_REACTOR_WRITE          0x02  // room to write
+#define NPS_REACTOR_HANGUP         0x04  // peer closed or socket error
+#define NPS_REACTOR_TIMEOUT        0x08  // heartbeat expired
+
+#define NPS_REACTOR_MAX_EVENTS     256   // events taken per wakeup
+
+#define NPS_REACTOR_WHEEL_BITS     8     // 256 slots per wheel
+#define NPS_REACTOR_WHEEL_LEVELS   4     // 1 ms slots up to 2^32 ms
+#define NPS_REACTOR_HEARTBEAT_GRAIN 1000 // ms heartbeat deadlines round to
+
+#if defined (WIN32)
+typedef unsigned __int64 NPSReactorTime;
+typedef unsigned __int64 NPSReactorTimerId;
+#else
+typedef unsigned long long NPSReactorTime;
+typedef unsigned long long NPSReactorTimerId;
+#endif
+
+typedef void (*NPSReactorCallback) (SOCKET Socket, int Events, void *Context);
+typedef void (*NPSReactorTimerCallback) (NPSReactorTimerId TimerId,
+                                         void *Context);
+
+class NPSReactor
+{
+public:
+  NPSReactor (void)
+  {
+    m_PollFd = -1;
+    m_Open = FALSE;
+    m_Running = FALSE;
+    m_LastErrno = 0;
+    m_nSockets = 0;
+    m_Serial = 0;
+    m_Now = _Clock ();
+    m_Tick = m_Now;
+    m_Slack = 1;
+    m_FreeTimer = NO_TIMER;
+    m_nTimers = 0;
+    for (int i = 0; i <= WHEEL_BUCKETS; i++)
+      m_Buckets[i] = NO_TIMER;
+    memset (m_Occupied, 0, sizeof (m_Occupied));
+  }
+
+  ~NPSReactor (void)
+  {
+    Close ();
+  }
+
+  // Creates the kernel interest set.  Called on first use if not before.
+  NPSSTATUS Open (void)
+  {
+    if (m_Open)
+      return NPS_OK;
+#if defined (NPS_REACTOR_EPOLL)
+    m_PollFd = epoll_create1 (EPOLL_CLOEXEC);
+    if (m_PollFd < 0)
+    {
+      _SetLastError ();
+      return NPS_ERR;
+    }
+#endif
+    m_Open = TRUE;
+    return NPS_OK;
+  }
+
+  // Forgets every socket and timer.  The sockets are left open.
+  NPSSTATUS Close (void)
+  {
+#if defined (NPS_REACTOR_EPOLL)
+    if (m_PollFd >= 0)
+      close (m_PollFd);
+    m_PollFd = -1;
+#endif
+    m_Sockets.clear ();
+    for (size_t i = 0; i < m_TimerSlab.size (); i++)
+    {
+      if (m_TimerSlab[i].Bucket != NO_TIMER)
+      {
+        _Unlink ((int) i);
+        _FreeTimer ((int) i);
+      }
+    }
+    m_nSockets = 0;
+    m_Open = FALSE;
+    return NPS_OK;
+  }
+
+  //------------------------- Sockets ----------------------------------
+  // Watches Socket for Events (NPS_REACTOR_READ and/or NPS_REACTOR_WRITE);
+  // Callback is called with Context whenever any of them become true.
+  // NPS_REACTOR_HANGUP is always reported.
+  NPSSTATUS AddSocket (SOCKET Socket, int Events,
+                       NPSReactorCallback Callback, void *Context = NULL)
+  {
+    if (Socket == INVALID_SOCKET)
+      return NPS_INVALID_SOCKET;
+    if (!Callback)
+      return NPS_BAD_PARAM;
+    if (Open () != NPS_OK)
+      return NPS_ERR;
+    if (_Find (Socket))
+      return NPS_BAD_PARAM;
+
+    SocketEntry *Entry = _Insert (Socket);
+    Entry->Callback = Callback;
+    Entry->Context = Context;
+    Entry->Events = Events;
+    if (_Control (Socket, Entry, TRUE) != NPS_OK)
+    {
+      _Erase (Socket);
+      return NPS_ERR;
+    }
+    return NPS_OK;
+  }
+
+  // Changes the events watched on Socket.  Readiness that already holds
+  // is reported again, so this also re-arms an edge-triggered socket.
+  NPSSTATUS ModifySocket (SOCKET Socket, int Events)
+  {
+    SocketEntry *Entry = _Find (Socket);
+
+    if (!Entry || Entry->Waiting)
+      return NPS_BAD_PARAM;
+    Entry->Events = Events;
+    return _Control (Socket, Entry, FALSE);
+  }
+
+  // Stops watching Socket and cancels its heartbeat.
+  NPSSTATUS RemoveSocket (SOCKET Socket)
+  {
+    SocketEntry *Entry = _Find (Socket);
+
+    if (!Entry || Entry->Waiting)
+      return NPS_BAD_PARAM;
+    _Remove (Socket);
+    return NPS_OK;
+  }
+
+  // Calls Socket's callback with NPS_REACTOR_TIMEOUT once it has gone
+  // TimeOutSecs without being readable (or Touch()ed), and again each
+  // TimeOutSecs it stays silent.  A TimeOutSecs of 0 turns it off.
+  NPSSTATUS SetHeartbeat (SOCKET Socket,
+                          long TimeOutSecs = NPS_HEARTBEAT_TIMEOUT_DEFAULT)
+  {
+    SocketEntry *Entry = _Find (Socket);
+
+    if (!Entry || Entry->Waiting || TimeOutSecs < 0)
+      return NPS_BAD_PARAM;
+    if (Entry->HeartbeatTimer)
+      CancelTimer (Entry->HeartbeatTimer);
+    Entry->HeartbeatTimer = 0;
+    Entry->HeartbeatMs = (NPSReactorTime) TimeOutSecs * 1000;
+    // From now, as in AddTimer().
+    m_Now = _Clock ();
+    Entry->LastActivity = m_Now;
+    if (TimeOutSecs)
+    {
+      Entry->HeartbeatTimer = _AddTimer (_Coarse (m_Now + Entry->HeartbeatMs)
+                                         - m_Now, 0, NULL, NULL,
+                                         Socket, Entry->Serial);
+    }
+    return NPS_OK;
+  }
+
+  // Counts as activity on Socket for SetHeartbeat(), e.g. after sending a
+  // keepalive or completing a message.
+  NPS_INLINE void Touch (SOCKET Socket)
+  {
+    SocketEntry *Entry = _Find (Socket);
+
+    if (Entry)
+      Entry->LastActivity = m_Now = _Clock ();
+  }
+
+  NPS_INLINE int SocketCount (void)
+  {
+    return m_nSockets;
+  }
+
+  //------------------------- Timers -----------------------------------
+  // Calls Callback DelayMs from now, then every IntervalMs if that is not
+  // 0.  Returns the timer's id, or 0 if there are too many.  An id is
+  // never reused, so cancelling one that has fired is harmless.
+  NPSReactorTimerId AddTimer (unsigned long DelayMs, unsigned long IntervalMs,
+                              NPSReactorTimerCallback Callback,
+                              void *Context = NULL)
+  {
+    if (!Callback)
+      return 0;
+    // From now, not from the last wakeup: the loop may have been idle.
+    m_Now = _Clock ();
+    return _AddTimer (DelayMs, IntervalMs, Callback, Context,
+                      INVALID_SOCKET, 0);
+  }
+
+  NPSSTATUS CancelTimer (NPSReactorTimerId TimerId)
+  {
+    int Index = _TimerIndex (TimerId);
+
+    if (Index == NO_TIMER)
+      return NPS_BAD_PARAM;
+    _Unlink (Index);
+    _FreeTimer (Index);
+    return NPS_OK;
+  }
+
+  // Lets timers run up to SlackMs late, so that those due close together
+  // share a wakeup.  1, the default, runs each on its millisecond.
+  NPS_INLINE void SetTimerSlack (unsigned long SlackMs)
+  {
+    m_Slack = SlackMs ? SlackMs : 1;
+  }
+
+  // Timers pending, heartbeats included.
+  NPS_INLINE int TimerCount (void)
+  {
+    return m_nTimers;
+  }
+
+  //------------------------- Dispatch ---------------------------------
+  // Waits up to TimeOut (forever if NULL) for a socket to become ready or
+  // a timer to come due, then dispatches everything that is.  Returns the
+  // number of callbacks made, or NPS_ERR.
+  int RunOnce (struct timeval *TimeOut)
+  {
+    int Dispatched = 0;
+    int WaitMs;
+
+    if (Open () != NPS_OK)
+      return NPS_ERR;
+
+    m_Now = _Clock ();
+    WaitMs = _WaitMs (TimeOut);
+
+#if defined (NPS_REACTOR_EPOLL)
+    struct epoll_event Events[NPS_REACTOR_MAX_EVENTS];
+    int nEvents = epoll_wait (m_PollFd, Events, NPS_REACTOR_MAX_EVENTS, WaitMs);
+
+    if (nEvents < 0)
+    {
+      if (errno != EINTR)
+      {
+        _SetLastError ();
+        return NPS_ERR;
+      }
+      nEvents = 0;
+    }
+    m_Now = _Clock ();
+
+    for (int i = 0; i < nEvents; i++)
+    {
+      unsigned int Flags = Events[i].events;
+      int Ready = 0;
+
+      if (Flags & EPOLLIN)
+        Ready |= NPS_REACTOR_READ;
+      if (Flags & EPOLLOUT)
+        Ready |= NPS_REACTOR_WRITE;
+      if (Flags & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+        Ready |= NPS_REACTOR_HANGUP;
+
+      // An earlier callback may have removed this socket, or removed it
+      // and registered a new one on the same descriptor.
+      Dispatched += _Dispatch ((SOCKET) (Events[i].data.u64 & 0xFFFFFFFF),
+                               (unsigned long) (Events[i].data.u64 >> 32),
+                               Ready);
+    }
+#else
+    std::vector < std::pair < SOCKET, unsigned long > > Watched;
+    fd_set ReadSet;
+    fd_set WriteSet;
+    fd_set ErrorSet;
+    struct timeval Tv;
+    SOCKET MaxFd = 0;
+    SocketMap::iterator it;
+    int nReady;
+
+    FD_ZERO (&ReadSet);
+    FD_ZERO (&WriteSet);
+    FD_ZERO (&ErrorSet);
+    for (it = m_Sockets.begin (); it != m_Sockets.end (); it++)
+    {
+      if (it->second.Events & NPS_REACTOR_READ)
+        FD_SET (it->first, &ReadSet);
+      if (it->second.Events & NPS_REACTOR_WRITE)
+        FD_SET (it->first, &WriteSet);
+      FD_SET (it->first, &ErrorSet);
+      if (it->first > MaxFd)
+        MaxFd = it->first;
+      Watched.push_back (std::make_pair (it->first, it->second.Serial));
+    }
+    if (WaitMs >= 0)
+    {
+      Tv.tv_sec = WaitMs / 1000;
+      Tv.tv_usec = (WaitMs % 1000) * 1000;
+    }
+
+    nReady = select ((int) MaxFd + 1, &ReadSet, &WriteSet, &ErrorSet,
+                     (WaitMs >= 0) ? &Tv : NULL);
+    if (nReady < 0)
+    {
+      if (errno != EINTR)
+      {
+        _SetLastError ();
+        return NPS_ERR;
+      }
+      nReady = 0;
+    }
+    m_Now = _Clock ();
+
+    for (size_t i = 0; nReady > 0 && i < Watched.size (); i++)
+    {
+      SOCKET Socket = Watched[i].first;
+      int Ready = 0;
+
+      if (FD_ISSET (Socket, &ReadSet))
+        Ready |= NPS_REACTOR_READ;
+      if (FD_ISSET (Socket, &WriteSet))
+        Ready |= NPS_REACTOR_WRITE;
+      if (FD_ISSET (Socket, &ErrorSet))
+        Ready |= NPS_REACTOR_HANGUP;
+      if (Ready)
+        Dispatched += _Dispatch (Socket, Watched[i].second, Ready);
+    }
+#endif
+
+    return Dispatched + _RunTimers ();
+  }
+
+  // Dispatches until Stop() is called from a callback or timer.
+  NPSSTATUS Run (void)
+  {
+    m_Running = TRUE;
+    while (m_Running)
+    {
+      if (RunOnce (NULL) < 0)
+        return NPS_ERR;
+    }
+    return NPS_OK;
+  }
+
+  NPS_INLINE void Stop (void)
+  {
+    m_Running = FALSE;
+  }
+
+  //------------------------- Blocking waits ---------------------------
+  // As NPSComm::WaitForSocket(), for a socket not added with AddSocket().
+  // Returns NPS_OK when it is ready, or NPS_TIMEOUT.
+  NPSSTATUS WaitForSocket (SOCKET Socket, struct timeval *TimeOut,
+                           NPS_LOGICAL SelectForWrite = FALSE)
+  {
+    return WaitForSockets (&Socket, 1, TimeOut, NULL, NULL, SelectForWrite);
+  }
+
+  // As NPSComm::WaitForMultipleSockets() without the FD_SETSIZE limit.
+  // Returns NPS_OK when at least one socket is ready, and copies the ready
+  // ones to Ready (room for nSockets) if it is not NULL.
+  NPSSTATUS WaitForSockets (SOCKET * Sockets, int nSockets,
+                            struct timeval *TimeOut,
+                            SOCKET * Ready, int *nReady,
+                            NPS_LOGICAL SelectForWrite = FALSE)
+  {
+    NPSSTATUS Status = NPS_OK;
+    int Events = SelectForWrite ? NPS_REACTOR_WRITE : NPS_REACTOR_READ;
+    int Added;
+    int Found = 0;
+
+    if (nReady)
+      *nReady = 0;
+    if (!Sockets || nSockets <= 0)
+      return NPS_BAD_PARAM;
+    if (Open () != NPS_OK)
+      return NPS_ERR;
+
+    for (Added = 0; Added < nSockets; Added++)
+    {
+      Status = _AddWaiter (Sockets[Added], Events);
+      if (Status != NPS_OK)
+        break;
+    }
+    if (Status == NPS_OK)
+      Status = _Wait (Sockets, nSockets, TimeOut);
+
+    for (int i = 0; i < Added; i++)
+    {
+      if (Status == NPS_OK && _Find (Sockets[i])->Ready)
+      {
+        if (Ready)
+          Ready[Found] = Sockets[i];
+        Found++;
+      }
+      _Remove (Sockets[i]);
+    }
+    if (nReady)
+      *nReady = Found;
+    return Status;
+  }
+
+  NPS_INLINE int GetReactorError (void)
+  {
+    return m_LastErrno;
+  }
+
+  // Milliseconds on the clock timers run by.
+  static NPSReactorTime Clock (void)
+  {
+    return _Clock ();
+  }
+
+private:
+  struct SocketEntry
+  {
+    NPSReactorCallback Callback;
+    void *Context;
+    int Events;
+    unsigned long Serial;           // tells a reused descriptor apart
+    NPS_LOGICAL Registered;
+    NPS_LOGICAL Waiting;            // belongs to WaitForSockets()
+    int Ready;                      // what WaitForSockets() saw
+    NPSReactorTime HeartbeatMs;
+    NPSReactorTime LastActivity;
+    NPSReactorTimerId HeartbeatTimer;
+  };
+
+  struct Timer
+  {
+    NPSReactorTime Deadline;
+    NPSReactorTime Interval;
+    NPSReactorTimerCallback Callback;
+    void *Context;
+    SOCKET Socket;                  // a heartbeat if not INVALID_SOCKET
+    unsigned long Serial;
+    NPSReactorTimerId Generation;   // tells a reused slot's ids apart
+    int Bucket;                     // NO_TIMER while free
+    int Next;                       // within the bucket, or the free list
+    int Prev;
+  };
+
+  enum
+  {
+    WHEEL_SLOTS = 1 << NPS_REACTOR_WHEEL_BITS,
+    WHEEL_MASK = WHEEL_SLOTS - 1,
+    WHEEL_BUCKETS = WHEEL_SLOTS * NPS_REACTOR_WHEEL_LEVELS,
+    FIRING = WHEEL_BUCKETS,         // the bucket _RunTimers() is running
+    NO_TIMER = -1,
+    TIMER_INDEX_BITS = 22           // the other 42 bits are the generation
+  };
+
+#if defined (NPS_REACTOR_EPOLL)
+  // Indexed by descriptor.
+  typedef std::vector < SocketEntry > SocketMap;
+#else
+  typedef std::map < SOCKET, SocketEntry > SocketMap;
+#endif
+
+  int m_PollFd;
+  NPS_LOGICAL m_Open;
+  NPS_LOGICAL m_Running;
+  int m_LastErrno;
+  int m_nSockets;
+  unsigned long m_Serial;
+  NPSReactorTime m_Now;
+  NPSReactorTime m_Tick;            // the wheels have run up to here
+  NPSReactorTime m_Slack;
+  SocketMap m_Sockets;
+  std::vector < Timer > m_TimerSlab;
+  int m_FreeTimer;
+  int m_nTimers;
+  int m_Buckets[WHEEL_BUCKETS + 1]; // first timer in each, or NO_TIMER
+  unsigned long long m_Occupied[NPS_REACTOR_WHEEL_LEVELS][WHEEL_SLOTS / 64];
+
+  static NPSReactorTime _Clock (void)
+  {
+#if defined (WIN32)
+    return GetTickCount64 ();
+#else
+    struct timespec Ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &Ts);
+    return (NPSReactorTime) Ts.tv_sec * 1000 + Ts.tv_nsec / 1000000;
+#endif
+  }
+
+  NPS_INLINE void _SetLastError (void)
+  {
+#if defined (WIN32)
+    m_LastErrno = WSAGetLastError ();
+#else
+    m_LastErrno = errno;
+#endif
+  }
+
+  SocketEntry *_Find (SOCKET Socket)
+  {
+#if defined (NPS_REACTOR_EPOLL)
+    if (Socket < 0 || (size_t) Socket >= m_Sockets.size ()
+        || !m_Sockets[Socket].Registered)
+      return NULL;
+    return &m_Sockets[Socket];
+#else
+    SocketMap::iterator it = m_Sockets.find (Socket);
+
+    return (it == m_Sockets.end ()) ? NULL : &it->second;
+#endif
+  }
+
+  SocketEntry *_Insert (SOCKET Socket)
+  {
+    SocketEntry Entry;
+
+    memset (&Entry, 0, sizeof (Entry));
+    Entry.Registered = TRUE;
+    Entry.Serial = ++m_Serial & 0xFFFFFFFF;
+    Entry.LastActivity = m_Now;
+    m_nSockets++;
+#if defined (NPS_REACTOR_EPOLL)
+    if ((size_t) Socket >= m_Sockets.size ())
+    {
+      SocketEntry Empty;
+
+      memset (&Empty, 0, sizeof (Empty));
+      m_Sockets.resize (std::max ((size_t) Socket + 1,
+                                  m_Sockets.size () * 2), Empty);
+    }
+    m_Sockets[Socket] = Entry;
+    return &m_Sockets[Socket];
+#else
+    return &(m_Sockets[Socket] = Entry);
+#endif
+  }
+
+  void _Erase (SOCKET Socket)
+  {
+    m_nSockets--;
+#if defined (NPS_REACTOR_EPOLL)
+    m_Sockets[Socket].Registered = FALSE;
+    m_Sockets[Socket].Callback = NULL;
+#else
+    m_Sockets.erase (Socket);
+#endif
+  }
+
+  // Registers (Add) or updates Socket with the kernel.
+  NPSSTATUS _Control (SOCKET Socket, SocketEntry * Entry, NPS_LOGICAL Add)
+  {
+#if defined (NPS_REACTOR_EPOLL)
+    struct epoll_event Event;
+
+    // Waiters are level-triggered so readiness from before the wait counts.
+    Event.events = EPOLLRDHUP | (Entry->Waiting ? 0 : (unsigned int) EPOLLET);
+    if (Entry->Events & NPS_REACTOR_READ)
+      Event.events |= EPOLLIN;
+    if (Entry->Events & NPS_REACTOR_WRITE)
+      Event.events |= EPOLLOUT;
+    Event.data.u64 = ((unsigned long long) Entry->Serial << 32)
+      | (unsigned int) Socket;
+    if (epoll_ctl (m_PollFd, Add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                   Socket, &Event) < 0)
+    {
+      _SetLastError ();
+      return NPS_ERR;
+    }
+#elif defined (WIN32)
+    if (m_nSockets > FD_SETSIZE)
+      return NPS_BAD_PARAM;
+#else
+    if (Socket >= FD_SETSIZE)
+      return NPS_BAD_PARAM;
+#endif
+    return NPS_OK;
+  }
+
+  void _Remove (SOCKET Socket)
+  {
+    SocketEntry *Entry = _Find (Socket);
+
+    if (Entry->HeartbeatTimer)
+      CancelTimer (Entry->HeartbeatTimer);
+#if defined (NPS_REACTOR_EPOLL)
+    // Fails harmlessly if the socket has already been closed.
+    epoll_ctl (m_PollFd, EPOLL_CTL_DEL, Socket, NULL);
+#endif
+    _Erase (Socket);
+  }
+
+  int _Dispatch (SOCKET Socket, unsigned long Serial, int Ready)
+  {
+    SocketEntry *Entry = _Find (Socket);
+
+    if (!Entry || Entry->Serial != Serial)
+      return 0;
+    if (Ready & NPS_REACTOR_READ)
+      Entry->LastActivity = m_Now;
+    if (Entry->Waiting)
+    {
+      Entry->Ready |= Ready;
+      return 0;
+    }
+    Entry->Callback (Socket, Ready, Entry->Context);
+    return 1;
+  }
+
+  NPSReactorTimerId _AddTimer (NPSReactorTime DelayMs,
+                               NPSReactorTime IntervalMs,
+                               NPSReactorTimerCallback Callback,
+                               void *Context, SOCKET Socket,
+                               unsigned long Serial)
+  {
+    int Index = m_FreeTimer;
+
+    if (Index != NO_TIMER)
+      m_FreeTimer = m_TimerSlab[Index].Next;
+    else
+    {
+      if (m_TimerSlab.size () >= ((size_t) 1 << TIMER_INDEX_BITS) - 1)
+        return 0;
+      Index = (int) m_TimerSlab.size ();
+      m_TimerSlab.push_back (Timer ());
+      m_TimerSlab[Index].Generation = 0;
+    }
+
+    Timer &T = m_TimerSlab[Index];
+
+    T.Deadline = m_Now + DelayMs;
+    T.Interval = IntervalMs;
+    T.Callback = Callback;
+    T.Context = Context;
+    T.Socket = Socket;
+    T.Serial = Serial;
+    m_nTimers++;
+    _Schedule (Index);
+    return _TimerId (Index);
+  }
+
+  NPS_INLINE NPSReactorTimerId _TimerId (int Index)
+  {
+    return (m_TimerSlab[Index].Generation << TIMER_INDEX_BITS)
+      | (NPSReactorTimerId) (Index + 1);
+  }
+
+  // The live timer TimerId names, or NO_TIMER.
+  int _TimerIndex (NPSReactorTimerId TimerId)
+  {
+    int Index = (int) (TimerId & (((NPSReactorTimerId) 1 << TIMER_INDEX_BITS)
+                                  - 1)) - 1;
+
+    if (Index < 0 || Index >= (int) m_TimerSlab.size ()
+        || m_TimerSlab[Index].Bucket == NO_TIMER
+        || _TimerId (Index) != TimerId)
+      return NO_TIMER;
+    return Index;
+  }
+
+  void _FreeTimer (int Index)
+  {
+    Timer &T = m_TimerSlab[Index];
+
+    T.Generation++;
+    T.Bucket = NO_TIMER;
+    T.Next = m_FreeTimer;
+    m_FreeTimer = Index;
+    m_nTimers--;
+  }
+
+  // Heartbeats need not be punctual; rounding them up lets those due in
+  // the same second expire together.
+  static NPSReactorTime _Coarse (NPSReactorTime Time)
+  {
+    return (Time + NPS_REACTOR_HEARTBEAT_GRAIN - 1)
+      / NPS_REACTOR_HEARTBEAT_GRAIN * NPS_REACTOR_HEARTBEAT_GRAIN;
+  }
+
+  //------------------------- Timing wheel -----------------------------
+  // A timer due Delta ms after m_Tick goes on the lowest wheel whose turn
+  // covers Delta, in the slot its deadline falls in.  So a slot on wheel
+  // L > 0 holds the timers of one 2^(BITS * L) ms stretch, and is moved
+  // down (cascaded) when m_Tick reaches the start of that stretch.
+  void _Schedule (int Index)
+  {
+    Timer &T = m_TimerSlab[Index];
+    NPSReactorTime Delta = (T.Deadline > m_Tick) ? T.Deadline - m_Tick : 0;
+    int Level = 0;
+
+    while (Level < NPS_REACTOR_WHEEL_LEVELS - 1
+           && Delta >> (NPS_REACTOR_WHEEL_BITS * (Level + 1)))
+      Level++;
+    // Beyond the top wheel: park it in its last slot until then.
+    if (Delta >> (NPS_REACTOR_WHEEL_BITS * (Level + 1)))
+      Delta = ((NPSReactorTime) 1 << (NPS_REACTOR_WHEEL_BITS * (Level + 1))) - 1;
+
+    int Slot = (int) (((m_Tick + Delta) >> (NPS_REACTOR_WHEEL_BITS * Level))
+                      & WHEEL_MASK);
+
+    _Link (Index, Level * WHEEL_SLOTS + Slot);
+  }
+
+  void _Link (int Index, int Bucket)
+  {
+    Timer &T = m_TimerSlab[Index];
+
+    T.Bucket = Bucket;
+    T.Prev = NO_TIMER;
+    T.Next = m_Buckets[Bucket];
+    if (T.Next != NO_TIMER)
+      m_TimerSlab[T.Next].Prev = Index;
+    m_Buckets[Bucket] = Index;
+    if (Bucket < WHEEL_BUCKETS)
+      m_Occupied[Bucket / WHEEL_SLOTS][(Bucket % WHEEL_SLOTS) / 64] |=
+        1ULL << (Bucket % 64);
+  }
+
+  void _Unlink (int Index)
+  {
+    Timer &T = m_TimerSlab[Index];
+
+    if (T.Prev != NO_TIMER)
+      m_TimerSlab[T.Prev].Next = T.Next;
+    else
+      m_Buckets[T.Bucket] = T.Next;
+    if (T.Next != NO_TIMER)
+      m_TimerSlab[T.Next].Prev = T.Prev;
+    if (m_Buckets[T.Bucket] == NO_TIMER && T.Bucket < WHEEL_BUCKETS)
+      m_Occupied[T.Bucket / WHEEL_SLOTS][(T.Bucket % WHEEL_SLOTS) / 64] &=
+        ~(1ULL << (T.Bucket % 64));
+  }
+
+  static int _LowestBit (unsigned long long Word)
+  {
+#if defined (WIN32)
+    int Bit = 0;
+
+    while (!(Word & 1))
+    {
+      Word >>= 1;
+      Bit++;
+    }
+    return Bit;
+#else
+    return __builtin_ctzll (Word);
+#endif
+  }
+
+  // The first occupied slot on wheel Level, counting From to To slots on
+  // from m_Tick's; -1 if none.
+  int _NextSlot (int Level, int From, int To)
+  {
+    int Base = (int) (m_Tick >> (NPS_REACTOR_WHEEL_BITS * Level));
+
+    for (int k = From; k <= To;)
+    {
+      int Slot = (Base + k) & WHEEL_MASK;
+      unsigned long long Word = m_Occupied[Level][Slot / 64] >> (Slot % 64);
+
+      if (Word)
+      {
+        k += _LowestBit (Word);
+        return (k <= To) ? k : -1;
+      }
+      k += 64 - Slot % 64;
+    }
+    return -1;
+  }
+
+  // When the wheels next have work: a bottom slot to run or an upper one
+  // to cascade.  All ones if there are no timers.
+  NPSReactorTime _NextEvent (void)
+  {
+    NPSReactorTime Next = ~(NPSReactorTime) 0;
+    int k;
+
+    if (!m_nTimers)
+      return Next;
+    if ((k = _NextSlot (0, 0, WHEEL_SLOTS - 1)) >= 0)
+      Next = m_Tick + k;
+    for (int Level = 1; Level < NPS_REACTOR_WHEEL_LEVELS; Level++)
+    {
+      int Shift = NPS_REACTOR_WHEEL_BITS * Level;
+
+      // Anything in the current slot is a full turn away.
+      if ((k = _NextSlot (Level, 1, WHEEL_SLOTS)) >= 0)
+      {
+        NPSReactorTime At = ((m_Tick >> Shift) + k) << Shift;
+
+        if (At < Next)
+          Next = At;
+      }
+    }
+    return Next;
+  }
+
+  // Milliseconds to wait: the caller's timeout or the next timer,
+  // whichever is sooner; -1 for forever.
+  int _WaitMs (struct timeval *TimeOut)
+  {
+    long long WaitMs = -1;
+    NPSReactorTime Next = _NextEvent ();
+
+    if (TimeOut)
+      WaitMs = (long long) TimeOut->tv_sec * 1000
+        + (TimeOut->tv_usec + 999) / 1000;
+    if (Next != ~(NPSReactorTime) 0)
+    {
+      Next = (Next + m_Slack - 1) / m_Slack * m_Slack;
+
+      long long Due = (Next > m_Now) ? (long long) (Next - m_Now) : 0;
+
+      if (WaitMs < 0 || Due < WaitMs)
+        WaitMs = Due;
+    }
+    return (WaitMs > 0x7FFFFFFF) ? 0x7FFFFFFF : (int) WaitMs;
+  }
+
+  // Turns the wheels up to m_Now, running whatever comes due.
+  int _RunTimers (void)
+  {
+    int Fired = 0;
+
+    for (;;)
+    {
+      NPSReactorTime Next = _NextEvent ();
+
+      if (Next > m_Now)
+        break;
+      m_Tick = Next;
+
+      // Top down, so that a cascade into a slot due now is itself
+      // cascaded.
+      for (int Level = NPS_REACTOR_WHEEL_LEVELS - 1; Level > 0; Level--)
+      {
+        int Shift = NPS_REACTOR_WHEEL_BITS * Level;
+        int Bucket;
+
+        if (m_Tick & (((NPSReactorTime) 1 << Shift) - 1))
+          continue;
+        Bucket = Level * WHEEL_SLOTS + (int) ((m_Tick >> Shift) & WHEEL_MASK);
+        while (m_Buckets[Bucket] != NO_TIMER)
+        {
+          int Index = m_Buckets[Bucket];
+
+          _Unlink (Index);
+          _Schedule (Index);
+        }
+      }
+
+      // Run the bottom slot from a bucket of its own, so that callbacks
+      // may cancel or add timers, this slot's included.
+      int Bucket = (int) (m_Tick & WHEEL_MASK);
+
+      while (m_Buckets[Bucket] != NO_TIMER)
+      {
+        int Index = m_Buckets[Bucket];
+
+        _Unlink (Index);
+        _Link (Index, FIRING);
+      }
+      while (m_Buckets[FIRING] != NO_TIMER)
+      {
+        int Index = m_Buckets[FIRING];
+        Timer &T = m_TimerSlab[Index];
+
+        _Unlink (Index);
+        if (T.Deadline > m_Tick)
+        {
+          _Schedule (Index);        // parked beyond the top wheel
+          continue;
+        }
+        if (T.Socket != INVALID_SOCKET)
+        {
+          Fired += _Heartbeat (Index);
+          continue;
+        }
+
+        NPSReactorTimerId Id = _TimerId (Index);
+        NPSReactorTimerCallback Callback = T.Callback;
+        void *Context = T.Context;
+
+        if (T.Interval)
+        {
+          T.Deadline = m_Now + T.Interval;
+          _Schedule (Index);
+        }
+        else
+          _FreeTimer (Index);
+
+        Callback (Id, Context);
+        Fired++;
+      }
+    }
+    m_Tick = m_Now;
+    return Fired;
+  }
+
+  int _Heartbeat (int Index)
+  {
+    Timer &T = m_TimerSlab[Index];
+    SOCKET Socket = T.Socket;
+    SocketEntry *Entry = _Find (Socket);
+    NPSReactorTime Due;
+
+    if (!Entry || Entry->Serial != T.Serial)
+    {
+      _FreeTimer (Index);
+      return 0;
+    }
+
+    // Heard from since it was queued: push it back and stay quiet.
+    Due = Entry->LastActivity + Entry->HeartbeatMs;
+    if (Due > m_Now)
+    {
+      T.Deadline = _Coarse (Due);
+      _Schedule (Index);
+      return 0;
+    }
+
+    T.Deadline = _Coarse (m_Now + Entry->HeartbeatMs);
+    _Schedule (Index);
+    Entry->Callback (Socket, NPS_REACTOR_TIMEOUT, Entry->Context);
+    return 1;
+  }
+
+  NPSSTATUS _AddWaiter (SOCKET Socket, int Events)
+  {
+    SocketEntry *Entry;
+
+    if (Socket == INVALID_SOCKET)
+      return NPS_INVALID_SOCKET;
+    if (_Find (Socket))
+      return NPS_BAD_PARAM;
+
+    Entry = _Insert (Socket);
+    Entry->Waiting = TRUE;
+    Entry->Events = Events;
+    if (_Control (Socket, Entry, TRUE) != NPS_OK)
+    {
+      _Erase (Socket);
+      return NPS_ERR;
+    }
+    return NPS_OK;
+  }
+
+  NPSSTATUS _Wait (SOCKET * Sockets, int nSockets, struct timeval *TimeOut)
+  {
+    NPSReactorTime Deadline = 0;
+
+    m_Now = _Clock ();
+    if (TimeOut)
+      Deadline = m_Now + (NPSReactorTime) TimeOut->tv_sec * 1000
+        + (TimeOut->tv_usec + 999) / 1000;
+
+    for (;;)
+    {
+      struct timeval Remaining;
+      int i;
+
+      for (i = 0; i < nSockets; i++)
+      {
+        if (_Find (Sockets[i])->Ready)
+          return NPS_OK;
+      }
+      if (TimeOut && m_Now >= Deadline)
+        return NPS_TIMEOUT;
+      if (TimeOut)
+      {
+        Remaining.tv_sec = (long) ((Deadline - m_Now) / 1000);
+        Remaining.tv_usec = (long) ((Deadline - m_Now) % 1000) * 1000;
+      }
+      if (RunOnce (TimeOut ? &Remaining : NULL) < 0)
+        return NPS_ERR;
+    }
+  }
+};
+
+#endif // __cplusplus
+
+#endif // _NPS_REACTOR_H
@@ -0,0 +1,355 @@
+/*************************************************************************
+ File Name:     NPSSendQueue.h
+
+ Purpose:       Per-connection output queue that coalesces small messages
+ Notes:
+
+   NPSComm::SendToSocket() writes as soon as it is called, so a lobby
+   event that sends one client three small messages (user joined, slot
+   list, channel update) puts three small segments on the wire, each
+   with its own headers and its own system call.
+
+   An NPSSendQueue collects a connection's messages in one buffer and
+   writes them together: when about a segment's worth is waiting
+   (SetFlushSize()), when the oldest has waited the flush window
+   (SetMaxLatency(), NPS_SEND_LATENCY_DEFAULT ms), or on Flush().  With
+   an NPSReactor attached the window is a reactor timer; without one,
+   call Poll() from the service loop.  A window of 0 writes through.
+
+   Because every byte goes through the one buffer, the kernel sees a
+   whole window in one send() and TCP_CORK is not needed.  When a burst
+   overflows the flush size, the full part goes with MSG_MORE so the
+   kernel can hold a partial segment for the rest, which always follows
+   in a later plain send().
+
+   Depth() and BytesPending() are there for backpressure.  Beyond
+   SetMaxPending() bytes Queue() refuses with NPS_OUT_OF_MEMORY, which
+   means the peer is not reading.
+
+   On an async socket a flush that would block keeps the remainder and
+   tries again on the next window or OnWritable().  Not thread safe.
+ *************************************************************************/
+
+#ifndef _NPS_SEND_QUEUE_H
+#define _NPS_SEND_QUEUE_H
+
+#include <NPSReactor.h>
+#include <MessageTypes.h>
+#include "NPS_MessageView.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+
+#define NPS_SEND_LATENCY_DEFAULT     (5)           // ms a message may wait
+#define NPS_SEND_FLUSH_SIZE_DEFAULT  (1400)        // about one segment
+#define NPS_SEND_MAX_PENDING_DEFAULT (256 * 1024)  // backlog before refusing
+
+#if !defined (MSG_MORE)
+# define MSG_MORE 0
+#endif
+#if !defined (MSG_NOSIGNAL)
+# define MSG_NOSIGNAL 0
+#endif
+
+class NPSSendQueue
+{
+public:
+  NPSSendQueue (SOCKET Socket = INVALID_SOCKET,
+                long MaxLatencyMs = NPS_SEND_LATENCY_DEFAULT)
+  {
+    m_Socket = Socket;
+    m_MaxLatency = MaxLatencyMs;
+    m_FlushSize = NPS_SEND_FLUSH_SIZE_DEFAULT;
+    m_MaxPending = NPS_SEND_MAX_PENDING_DEFAULT;
+    m_Reactor = NULL;
+    m_Timer = 0;
+    m_Buffer = NULL;
+    m_Capacity = 0;
+    m_Head = 0;
+    m_Tail = 0;
+    m_Depth = 0;
+    m_FirstQueued = 0;
+    m_LastErrno = 0;
+    m_MessagesQueued = 0;
+    m_Sends = 0;
+    m_BytesSent = 0;
+  }
+
+  ~NPSSendQueue (void)
+  {
+    _CancelTimer ();
+    free (m_Buffer);
+  }
+
+  //------------------------- Setup ------------------------------------
+  NPS_INLINE void SetSocket (SOCKET Socket)
+  {
+    m_Socket = Socket;
+  }
+
+  // How long (ms) a message may wait for company; 0 writes through.
+  NPS_INLINE void SetMaxLatency (long MaxLatencyMs)
+  {
+    m_MaxLatency = (MaxLatencyMs < 0) ? 0 : MaxLatencyMs;
+  }
+
+  // Write as soon as this many bytes are waiting.
+  NPS_INLINE void SetFlushSize (long Bytes)
+  {
+    m_FlushSize = (Bytes < 1) ? 1 : Bytes;
+  }
+
+  // Refuse messages beyond this backlog.
+  NPS_INLINE void SetMaxPending (long Bytes)
+  {
+    m_MaxPending = Bytes;
+  }
+
+  // Runs the flush window as a timer on Reactor.  NULL to detach.
+  void Attach (NPSReactor * Reactor)
+  {
+    _CancelTimer ();
+    m_Reactor = Reactor;
+    if (m_Reactor && BytesPending ())
+      _ArmTimer ();
+  }
+
+  //------------------------- Sending ----------------------------------
+  // Queues MsgSize bytes at Message, which may be reused on return.
+  NPSSTATUS Queue (const char *Message, long MsgSize)
+  {
+    NPSSTATUS Status;
+
+    if (m_Socket == INVALID_SOCKET)
+      return NPS_INVALID_SOCKET;
+    if (!Message || MsgSize <= 0)
+      return NPS_BAD_PARAM;
+    if (BytesPending () + MsgSize > m_MaxPending)
+      return NPS_OUT_OF_MEMORY;
+
+    // Overflowing the flush size: write what is here, telling the
+    // kernel more follows.  This message guarantees it does.
+    if (BytesPending () && BytesPending () + MsgSize > m_FlushSize)
+    {
+      Status = _Send (MSG_MORE);
+      if (Status != NPS_OK)
+        return Status;
+    }
+
+    if (!_Reserve (MsgSize))
+      return NPS_OUT_OF_MEMORY;
+    if (!BytesPending ())
+      m_FirstQueued = NPSReactor::Clock ();
+    memcpy (m_Buffer + m_Tail, Message, MsgSize);
+    m_Tail += MsgSize;
+    m_Depth++;
+    m_MessagesQueued++;
+
+    if (!m_MaxLatency || BytesPending () >= m_FlushSize)
+      return Flush ();
+    if (m_Reactor && !m_Timer)
+      _ArmTimer ();
+    return NPS_OK;
+  }
+
+  // Queues a serialized message, its length taken from its header.
+  NPSSTATUS QueueMessage (const char *Message)
+  {
+    NPS_HeaderView Header ((const unsigned char *) Message, MAX_MSG_LEN);
+
+    if (!Message || !Header.valid ())
+      return NPS_BAD_PARAM;
+    return Queue (Message, Header.length ());
+  }
+
+  // Queues every message on an NPS_CommData's MessagesToSend list, in
+  // order.  The list is left to its owner.  Returns the number queued,
+  // or an NPSSTATUS if one could not be.
+  int QueueMessageList (NPS_MsgList * List)
+  {
+    int Queued = 0;
+
+    for (; List; List = List->Next)
+    {
+      NPSSTATUS Status = QueueMessage (List->Message);
+
+      if (Status != NPS_OK)
+        return Status;
+      Queued++;
+    }
+    return Queued;
+  }
+
+  // Writes everything waiting.
+  NPSSTATUS Flush (void)
+  {
+    NPSSTATUS Status = BytesPending () ? _Send (0) : NPS_OK;
+
+    if (!BytesPending ())
+      _CancelTimer ();
+    else if (Status == NPS_OK)
+    {
+      // Would block.  The window starts again, so a peer that is not
+      // reading gets one retry a window rather than one a millisecond.
+      m_FirstQueued = NPSReactor::Clock ();
+      if (m_Reactor && !m_Timer)
+        _ArmTimer ();
+    }
+    return Status;
+  }
+
+  // For a queue with no reactor: flushes once the window has passed.
+  NPSSTATUS Poll (void)
+  {
+    if (BytesPending ()
+        && NPSReactor::Clock () - m_FirstQueued >= (NPSReactorTime) m_MaxLatency)
+      return Flush ();
+    return NPS_OK;
+  }
+
+  // Call when an async socket that would have blocked is writable again.
+  NPS_INLINE NPSSTATUS OnWritable (void)
+  {
+    return Flush ();
+  }
+
+  //------------------------- Backpressure -----------------------------
+  // Messages queued since the queue was last empty.
+  NPS_INLINE int Depth (void)
+  {
+    return m_Depth;
+  }
+
+  NPS_INLINE long BytesPending (void)
+  {
+    return m_Tail - m_Head;
+  }
+
+  NPS_INLINE long MessagesQueued (void)
+  {
+    return m_MessagesQueued;
+  }
+
+  // send() calls made; MessagesQueued() / Sends() is the coalescing.
+  NPS_INLINE long Sends (void)
+  {
+    return m_Sends;
+  }
+
+  NPS_INLINE long BytesSent (void)
+  {
+    return m_BytesSent;
+  }
+
+  NPS_INLINE int GetSendError (void)
+  {
+    return m_LastErrno;
+  }
+
+private:
+  SOCKET m_Socket;
+  long m_MaxLatency;
+  long m_FlushSize;
+  long m_MaxPending;
+  NPSReactor *m_Reactor;
+  NPSReactorTimerId m_Timer;
+  char *m_Buffer;
+  long m_Capacity;
+  long m_Head;                      // first byte not yet sent
+  long m_Tail;                      // one past the last byte queued
+  int m_Depth;
+  NPSReactorTime m_FirstQueued;
+  int m_LastErrno;
+  long m_MessagesQueued;
+  long m_Sends;
+  long m_BytesSent;
+
+  NPSSendQueue (const NPSSendQueue &);
+  NPSSendQueue & operator = (const NPSSendQueue &);
+
+  // Room for Size more bytes at m_Tail.
+  NPS_LOGICAL _Reserve (long Size)
+  {
+    if (m_Tail + Size <= m_Capacity)
+      return TRUE;
+    if (m_Head)
+    {
+      memmove (m_Buffer, m_Buffer + m_Head, m_Tail - m_Head);
+      m_Tail -= m_Head;
+      m_Head = 0;
+      if (m_Tail + Size <= m_Capacity)
+        return TRUE;
+    }
+
+    long Capacity = m_Capacity ? m_Capacity : m_FlushSize;
+    while (Capacity < m_Tail + Size)
+      Capacity *= 2;
+    char *Buffer = (char *) realloc (m_Buffer, Capacity);
+    if (!Buffer)
+      return FALSE;
+    m_Buffer = Buffer;
+    m_Capacity = Capacity;
+    return TRUE;
+  }
+
+  NPSSTATUS _Send (int Flags)
+  {
+    while (m_Head < m_Tail)
+    {
+      long Sent = send (m_Socket, m_Buffer + m_Head, m_Tail - m_Head,
+                        Flags | MSG_NOSIGNAL);
+
+      m_Sends++;
+      if (Sent < 0)
+      {
+#if defined (WIN32)
+        m_LastErrno = WSAGetLastError ();
+        if (m_LastErrno == WSAEWOULDBLOCK)
+          return NPS_OK;
+#else
+        if (errno == EINTR)
+          continue;
+        m_LastErrno = errno;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return NPS_OK;            // the rest waits for OnWritable()
+#endif
+        return NPS_ERR;
+      }
+      m_Head += Sent;
+      m_BytesSent += Sent;
+    }
+    m_Head = m_Tail = 0;
+    m_Depth = 0;
+    return NPS_OK;
+  }
+
+  void _ArmTimer (void)
+  {
+    NPSReactorTime Waited = NPSReactor::Clock () - m_FirstQueued;
+    long Delay = (Waited >= (NPSReactorTime) m_MaxLatency) ? 1
+      : m_MaxLatency - (long) Waited;
+
+    m_Timer = m_Reactor->AddTimer (Delay, 0, _OnTimer, this);
+  }
+
+  void _CancelTimer (void)
+  {
+    if (m_Timer && m_Reactor)
+      m_Reactor->CancelTimer (m_Timer);
+    m_Timer = 0;
+  }
+
+  static void _OnTimer (NPSReactorTimerId, void *Context)
+  {
+    NPSSendQueue *pThis = (NPSSendQueue *) Context;
+
+    pThis->m_Timer = 0;
+    pThis->Flush ();
+  }
+};
+
+#endif // __cplusplus
+
+#endif // _NPS_SEND_QUEUE_H
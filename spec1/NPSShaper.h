@@ -0,0 +1,723 @@
+/*************************************************************************
+ File Name:     NPSShaper.h
+
+ Purpose:       Token bucket traffic shaping by connection, IP group and
+                channel
+ Notes:
+
+   The NPSCOMM_LATENCY_AND_BANDWIDTH code in NPSComm.h shaped traffic by
+   putting the sending thread to sleep, and found a peer's group by
+   walking every group's address list under a lock.  It has long been
+   compiled out.
+
+   NPSShaper shapes without blocking anyone.  Each message is checked
+   against up to three token buckets:
+
+     connection  SetConnectionRate(), or SetDefaultConnectionRate() for
+                 connections with no rate of their own
+     IP group    CreateGroup() + AddAddrToGroup(); a peer's group is
+                 found by hashing its address
+     channel     SetChannelRate(), when Send() names an NPS_COMMID
+
+   If every bucket has room and nothing is waiting ahead of it, the
+   message goes straight to the send function.  Otherwise it waits, in
+   order, on its connection's queue, and a timer on the NPSReactor sends
+   it when the buckets have refilled.  Waiting connections take turns,
+   one message each, so a heavy user sharing a group or channel bucket
+   with a light one cannot starve it.  They wait in a heap ordered by
+   when their next message may go, so neither Send() nor the timer walks
+   every waiting connection.
+
+   A bucket fills at its rate to at most its burst, in bytes.  A message
+   larger than the burst goes once the bucket is full, and leaves it in
+   debt.  A rate of NPS_SHAPER_UNLIMITED turns a bucket off.
+
+   A group may also add latency, BaseLatencyUs plus or minus up to
+   DeltaLatencyUs, for simulating slow links in tests.  The jitter comes
+   from SetSeed()'s seed, so a run can be repeated exactly.  Latency
+   never reorders a connection's messages.  Times are only kept to the
+   reactor's millisecond.
+
+   Nothing blocks the reactor's thread.  The default send function
+   writes what the socket will take now; the rest of the message keeps
+   its place at the head of the connection's queue, its tokens go back
+   in the buckets, and it is tried again NPS_SHAPER_RETRY_MS later.  On
+   WIN32, which has no MSG_DONTWAIT, that needs the socket itself to be
+   non-blocking.  A send function passed in, e.g. one that queues to an
+   NPSSendQueue, must take the whole message.  Depth() and BytesQueued()
+   report a connection's backlog.  If the send function fails on a
+   message that had been waiting, the rest of that connection's backlog
+   is dropped and SendErrors() counts it.
+
+   Not thread safe; use it on the reactor's thread.
+ *************************************************************************/
+
+#ifndef _NPS_SHAPER_H
+#define _NPS_SHAPER_H
+
+#include <NPSReactor.h>
+
+#if !defined (WIN32)
+# include <errno.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <vector>
+#include <unordered_map>
+
+#ifdef __cplusplus
+
+#define NPS_SHAPER_UNLIMITED       (0)    // a rate that never limits
+#define NPS_SHAPER_RETRY_MS        (5)    // before retrying a full socket
+
+#if !defined (MSG_NOSIGNAL)
+# define MSG_NOSIGNAL 0
+#endif
+#if !defined (MSG_DONTWAIT)
+# define MSG_DONTWAIT 0
+#endif
+
+// Writes, or queues, all Size bytes of Message to Socket.
+typedef NPSSTATUS (*NPSShaperSend) (SOCKET Socket, const char *Message,
+                                    long Size, void *Context);
+
+class NPSShaper
+{
+public:
+  NPSShaper (NPSReactor * Reactor, NPSShaperSend Send = NULL,
+             void *Context = NULL)
+  {
+    m_Reactor = Reactor;
+    m_Send = Send;
+    m_Context = Context;
+    m_Timer = 0;
+    m_TimerDue = 0;
+    m_Seed = 1;
+    m_Tickets = 0;
+    m_BytesSent = 0;
+    m_BytesDeferred = 0;
+    m_MessagesDeferred = 0;
+    m_SendErrors = 0;
+    _InitBucket (m_Default, NPS_SHAPER_UNLIMITED, 0);
+  }
+
+  ~NPSShaper (void)
+  {
+    while (!m_Connections.empty ())
+      RemoveConnection (m_Connections.begin ()->first);
+    if (m_Timer)
+      m_Reactor->CancelTimer (m_Timer);
+  }
+
+  //------------------------- Limits -----------------------------------
+  // The bucket for connections without a rate of their own.
+  NPS_INLINE void SetDefaultConnectionRate (unsigned long BytesPerSec,
+                                            unsigned long Burst)
+  {
+    _InitBucket (m_Default, BytesPerSec, Burst);
+    _Rekey ();
+  }
+
+  NPSSTATUS SetConnectionRate (SOCKET Socket, unsigned long BytesPerSec,
+                               unsigned long Burst)
+  {
+    Connection *Conn = _Connection (Socket);
+
+    if (!Conn)
+      return NPS_INVALID_SOCKET;
+    _InitBucket (Conn->Bucket, BytesPerSec, Burst);
+    Conn->OwnRate = TRUE;
+    _Rekey ();
+    return NPS_OK;
+  }
+
+  // Returns the new group's id.
+  int CreateGroup (unsigned long BytesPerSec, unsigned long Burst,
+                   unsigned long BaseLatencyUs = 0,
+                   unsigned long DeltaLatencyUs = 0)
+  {
+    Group G;
+
+    _InitBucket (G.Bucket, BytesPerSec, Burst);
+    G.BaseLatencyMs = (long) (BaseLatencyUs / 1000);
+    G.DeltaLatencyMs = (long) (DeltaLatencyUs / 1000);
+    if (G.DeltaLatencyMs > G.BaseLatencyMs)
+      G.DeltaLatencyMs = G.BaseLatencyMs;
+    m_Groups.push_back (G);
+    return (int) m_Groups.size () - 1;
+  }
+
+  // Puts peers at IpAddress in Group, moving them from any other.
+  // Connections already added keep the group they had.
+  NPSSTATUS AddAddrToGroup (int Group, const struct in_addr *IpAddress)
+  {
+    if (Group < 0 || Group >= (int) m_Groups.size () || !IpAddress)
+      return NPS_BAD_PARAM;
+    m_GroupOf[IpAddress->s_addr] = Group;
+    return NPS_OK;
+  }
+
+  // The group of peers at IpAddress, or -1.
+  int FindGroup (const struct in_addr *IpAddress)
+  {
+    std::unordered_map < unsigned long, int >::iterator it =
+      m_GroupOf.find (IpAddress->s_addr);
+
+    return (it == m_GroupOf.end ()) ? -1 : it->second;
+  }
+
+  NPSSTATUS SetChannelRate (NPS_COMMID Channel, unsigned long BytesPerSec,
+                            unsigned long Burst)
+  {
+    if (BytesPerSec == NPS_SHAPER_UNLIMITED)
+      m_Channels.erase (Channel);
+    else
+      _InitBucket (m_Channels[Channel], BytesPerSec, Burst);
+    _Rekey ();
+    return NPS_OK;
+  }
+
+  // Makes the jitter of a run repeatable.
+  NPS_INLINE void SetSeed (unsigned long Seed)
+  {
+    m_Seed = Seed;
+  }
+
+  //------------------------- Connections ------------------------------
+  // Starts shaping Socket.  Its group is looked up by PeerAddr, or by
+  // the socket's peer if that is NULL.
+  NPSSTATUS AddConnection (SOCKET Socket,
+                           const struct sockaddr_in *PeerAddr = NULL)
+  {
+    struct sockaddr_in Peer;
+#if defined (WIN32)
+    int PeerLen = sizeof (Peer);
+#else
+    socklen_t PeerLen = sizeof (Peer);
+#endif
+
+    if (Socket == INVALID_SOCKET)
+      return NPS_INVALID_SOCKET;
+    if (!PeerAddr)
+    {
+      memset (&Peer, 0, sizeof (Peer));
+      if (!getpeername (Socket, (struct sockaddr *) &Peer, &PeerLen)
+          && Peer.sin_family == AF_INET)
+        PeerAddr = &Peer;
+    }
+
+    Connection & Conn = m_Connections[Socket];
+
+    Conn.Group = PeerAddr ? FindGroup (&PeerAddr->sin_addr) : -1;
+    return NPS_OK;
+  }
+
+  // Stops shaping Socket, discarding anything still waiting.
+  void RemoveConnection (SOCKET Socket)
+  {
+    ConnectionMap::iterator it = m_Connections.find (Socket);
+
+    if (it == m_Connections.end ())
+      return;
+    _Discard (it->second);
+    m_Connections.erase (it);
+  }
+
+  //------------------------- Sending ----------------------------------
+  // Sends Message to Socket now if the buckets allow, or later if not.
+  // Channel, if not 0, is charged as well.  Message may be reused on
+  // return.
+  NPSSTATUS Send (SOCKET Socket, const char *Message, long Size,
+                  NPS_COMMID Channel = 0)
+  {
+    Connection *Conn = _Connection (Socket);
+
+    if (!Conn)
+      return NPS_INVALID_SOCKET;
+    if (!Message || Size <= 0)
+      return NPS_BAD_PARAM;
+
+    NPSReactorTime Now = NPSReactor::Clock ();
+    NPSReactorTime Release = _ReleaseTime (*Conn, Now);
+
+    // Straight through if nothing is ahead of it and there is room.
+    if (Conn->Waiting.empty () && Release <= Now
+        && _WaitFor (*Conn, Channel, Size, Now) == 0)
+    {
+      long Sent;
+      NPSSTATUS Status;
+
+      _Charge (*Conn, Channel, Size);
+      Status = _Deliver (Socket, Message, Size, Sent);
+      m_BytesSent += Sent;
+      if (Status != NPS_OK || Sent == Size)
+        return Status;
+
+      // The socket is full; the rest waits, and its tokens go back.
+      _Charge (*Conn, Channel, Sent - Size);
+      Message += Sent;
+      Size -= Sent;
+      Release = Now + NPS_SHAPER_RETRY_MS;
+    }
+
+    Pending P;
+
+    P.Data = (char *) malloc (Size);
+    if (!P.Data)
+      return NPS_OUT_OF_MEMORY;
+    memcpy (P.Data, Message, Size);
+    P.Size = Size;
+    P.Channel = Channel;
+    P.Release = Release;
+    Conn->Waiting.push_back (P);
+    Conn->BytesQueued += Size;
+    m_BytesDeferred += Size;
+    m_MessagesDeferred++;
+    if (!Conn->Ticket)
+      _Enqueue (Socket, *Conn, Now);
+    _Reschedule (Now);
+    return NPS_OK;
+  }
+
+  //------------------------- Backpressure -----------------------------
+  NPS_INLINE int Depth (SOCKET Socket)
+  {
+    Connection *Conn = _Connection (Socket);
+
+    return Conn ? (int) Conn->Waiting.size () : 0;
+  }
+
+  NPS_INLINE long BytesQueued (SOCKET Socket)
+  {
+    Connection *Conn = _Connection (Socket);
+
+    return Conn ? Conn->BytesQueued : 0;
+  }
+
+  NPS_INLINE long BytesSent (void)
+  {
+    return m_BytesSent;
+  }
+
+  // Messages, and their bytes, that had to wait.
+  NPS_INLINE long MessagesDeferred (void)
+  {
+    return m_MessagesDeferred;
+  }
+
+  NPS_INLINE long BytesDeferred (void)
+  {
+    return m_BytesDeferred;
+  }
+
+  // Waiting messages the send function failed on.
+  NPS_INLINE long SendErrors (void)
+  {
+    return m_SendErrors;
+  }
+
+private:
+  // Tokens are kept in thousandths of a byte, so that a bucket refilled
+  // every millisecond loses nothing to rounding.
+  struct TokenBucket
+  {
+    unsigned long Rate;             // bytes per second, or UNLIMITED
+    long long Burst;                // most tokens it holds
+    long long Tokens;               // may go negative: debt
+    NPSReactorTime Refilled;
+  };
+
+  struct Group
+  {
+    TokenBucket Bucket;
+    long BaseLatencyMs;
+    long DeltaLatencyMs;
+  };
+
+  struct Pending
+  {
+    char *Data;
+    long Size;
+    NPS_COMMID Channel;
+    NPSReactorTime Release;         // not before, for simulated latency
+  };
+
+  struct Connection
+  {
+    Connection () : OwnRate (FALSE), Group (-1), Ticket (0),
+      BytesQueued (0), LastRelease (0)
+    {
+      Bucket.Rate = NPS_SHAPER_UNLIMITED;
+      Bucket.Burst = Bucket.Tokens = 0;
+      Bucket.Refilled = 0;
+    }
+
+    TokenBucket Bucket;
+    NPS_LOGICAL OwnRate;            // else m_Default applies
+    int Group;
+    unsigned long long Ticket;      // its place in m_Turns, 0 if none
+    std::deque < Pending > Waiting;
+    long BytesQueued;
+    NPSReactorTime LastRelease;
+  };
+  typedef std::unordered_map < SOCKET, Connection > ConnectionMap;
+
+  // A connection with messages waiting: when the first may go, then the
+  // order it got in line.  A min-heap through std::greater.  An entry
+  // whose Ticket is no longer its connection's is stale and is skipped.
+  struct Turn
+  {
+    NPSReactorTime Due;
+    unsigned long long Ticket;
+    SOCKET Socket;
+
+    bool operator > (const Turn & T) const
+    {
+      return (Due != T.Due) ? Due > T.Due : Ticket > T.Ticket;
+    }
+  };
+
+  NPSReactor *m_Reactor;
+  NPSShaperSend m_Send;
+  void *m_Context;
+  TokenBucket m_Default;
+  std::vector < Group > m_Groups;
+  std::unordered_map < unsigned long, int > m_GroupOf;  // by s_addr
+  std::unordered_map < NPS_COMMID, TokenBucket > m_Channels;
+  ConnectionMap m_Connections;
+  std::vector < Turn > m_Turns;
+  NPSReactorTimerId m_Timer;
+  NPSReactorTime m_TimerDue;
+  unsigned long m_Seed;
+  unsigned long long m_Tickets;
+  long m_BytesSent;
+  long m_BytesDeferred;
+  long m_MessagesDeferred;
+  long m_SendErrors;
+
+  NPSShaper (const NPSShaper &);
+  NPSShaper & operator = (const NPSShaper &);
+
+  // Hands Message to the send function, or with none, writes what the
+  // socket will take without waiting.  Sent is how much went; short of
+  // Size only if the socket is full.
+  NPSSTATUS _Deliver (SOCKET Socket, const char *Message, long Size,
+                      long &Sent)
+  {
+    Sent = 0;
+    if (m_Send)
+    {
+      Sent = Size;
+      return m_Send (Socket, Message, Size, m_Context);
+    }
+    while (Sent < Size)
+    {
+      long n = send (Socket, Message + Sent, Size - Sent,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+
+      if (n < 0)
+      {
+#if defined (WIN32)
+        if (WSAGetLastError () == WSAEWOULDBLOCK)
+          return NPS_OK;
+#else
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return NPS_OK;
+#endif
+        return NPS_ERR;
+      }
+      Sent += n;
+    }
+    return NPS_OK;
+  }
+
+  NPS_INLINE Connection *_Connection (SOCKET Socket)
+  {
+    ConnectionMap::iterator it = m_Connections.find (Socket);
+
+    return (it == m_Connections.end ()) ? NULL : &it->second;
+  }
+
+  static void _InitBucket (TokenBucket & B, unsigned long BytesPerSec,
+                           unsigned long Burst)
+  {
+    B.Rate = BytesPerSec;
+    B.Burst = (long long) (Burst ? Burst : 1) * 1000;
+    B.Tokens = B.Burst;
+    B.Refilled = NPSReactor::Clock ();
+  }
+
+  // Bytes per second is thousandths of a byte per millisecond.
+  static void _Refill (TokenBucket & B, NPSReactorTime Now)
+  {
+    if (Now > B.Refilled)
+    {
+      B.Tokens += (long long) B.Rate * (long long) (Now - B.Refilled);
+      if (B.Tokens > B.Burst)
+        B.Tokens = B.Burst;
+      B.Refilled = Now;
+    }
+  }
+
+  // Milliseconds until B can take Size bytes; 0 if it can now.
+  static NPSReactorTime _BucketWait (TokenBucket & B, long Size,
+                                     NPSReactorTime Now)
+  {
+    if (B.Rate == NPS_SHAPER_UNLIMITED)
+      return 0;
+    _Refill (B, Now);
+
+    long long Need = (long long) Size * 1000;
+
+    if (Need > B.Burst)
+      Need = B.Burst;
+    if (B.Tokens >= Need)
+      return 0;
+    return (NPSReactorTime) ((Need - B.Tokens + B.Rate - 1) / B.Rate);
+  }
+
+  NPSReactorTime _WaitFor (Connection & Conn, NPS_COMMID Channel, long Size,
+                           NPSReactorTime Now)
+  {
+    NPSReactorTime Wait = _BucketWait (Conn.OwnRate ? Conn.Bucket : m_Default,
+                                       Size, Now);
+    NPSReactorTime W;
+
+    if (Conn.Group >= 0
+        && (W = _BucketWait (m_Groups[Conn.Group].Bucket, Size, Now)) > Wait)
+      Wait = W;
+    if (Channel)
+    {
+      std::unordered_map < NPS_COMMID, TokenBucket >::iterator it =
+        m_Channels.find (Channel);
+
+      if (it != m_Channels.end ()
+          && (W = _BucketWait (it->second, Size, Now)) > Wait)
+        Wait = W;
+    }
+    return Wait;
+  }
+
+  void _Charge (Connection & Conn, NPS_COMMID Channel, long Size)
+  {
+    long long Cost = (long long) Size * 1000;
+
+    (Conn.OwnRate ? Conn.Bucket : m_Default).Tokens -= Cost;
+    if (Conn.Group >= 0)
+      m_Groups[Conn.Group].Bucket.Tokens -= Cost;
+    if (Channel)
+    {
+      std::unordered_map < NPS_COMMID, TokenBucket >::iterator it =
+        m_Channels.find (Channel);
+
+      if (it != m_Channels.end ())
+        it->second.Tokens -= Cost;
+    }
+  }
+
+  // When a message sent now may go out: its group's latency, but never
+  // ahead of the connection's previous message.
+  NPSReactorTime _ReleaseTime (Connection & Conn, NPSReactorTime Now)
+  {
+    if (Conn.Group < 0 || !m_Groups[Conn.Group].BaseLatencyMs)
+      return Now;
+
+    Group & G = m_Groups[Conn.Group];
+    long Latency = G.BaseLatencyMs;
+
+    if (G.DeltaLatencyMs)
+    {
+      m_Seed = m_Seed * 1103515245UL + 12345UL;
+      Latency += (long) ((m_Seed >> 16) % (2 * G.DeltaLatencyMs + 1))
+        - G.DeltaLatencyMs;
+    }
+
+    NPSReactorTime Release = Now + Latency;
+
+    if (Release < Conn.LastRelease)
+      Release = Conn.LastRelease;
+    Conn.LastRelease = Release;
+    return Release;
+  }
+
+  // Frees everything waiting on Conn and takes it out of line.
+  void _Discard (Connection & Conn)
+  {
+    while (!Conn.Waiting.empty ())
+    {
+      free (Conn.Waiting.front ().Data);
+      Conn.Waiting.pop_front ();
+    }
+    Conn.BytesQueued = 0;
+    Conn.Ticket = 0;
+  }
+
+  // When Conn's first waiting message may go, as the buckets stand now.
+  NPSReactorTime _DueAt (Connection & Conn, NPSReactorTime Now)
+  {
+    Pending & P = Conn.Waiting.front ();
+    NPSReactorTime At = Now + _WaitFor (Conn, P.Channel, P.Size, Now);
+
+    return (P.Release > At) ? P.Release : At;
+  }
+
+  void _PushTurn (SOCKET Socket, unsigned long long Ticket,
+                  NPSReactorTime Due)
+  {
+    Turn T;
+
+    T.Due = Due;
+    T.Ticket = Ticket;
+    T.Socket = Socket;
+    m_Turns.push_back (T);
+    std::push_heap (m_Turns.begin (), m_Turns.end (),
+                    std::greater < Turn > ());
+  }
+
+  NPS_INLINE void _PopTurn (void)
+  {
+    std::pop_heap (m_Turns.begin (), m_Turns.end (),
+                   std::greater < Turn > ());
+    m_Turns.pop_back ();
+  }
+
+  // Puts Conn at the back of the line.
+  void _Enqueue (SOCKET Socket, Connection & Conn, NPSReactorTime Now)
+  {
+    Conn.Ticket = ++m_Tickets;
+    _PushTurn (Socket, Conn.Ticket, _DueAt (Conn, Now));
+  }
+
+  // The connection T is for, or NULL if T is stale.
+  NPS_INLINE Connection *_Live (const Turn & T)
+  {
+    Connection *Conn = _Connection (T.Socket);
+
+    return (Conn && Conn->Ticket == T.Ticket) ? Conn : NULL;
+  }
+
+  // Sends what the buckets now allow.  A connection that sends goes to
+  // the back of the line; one that finds a shared bucket emptied by
+  // those ahead of it keeps its place, so connections sharing a bucket
+  // take turns.  A Due is never later than the message can really go.
+  void _Run (NPSReactorTime Now)
+  {
+    while (!m_Turns.empty () && m_Turns.front ().Due <= Now)
+    {
+      Turn T = m_Turns.front ();
+      Connection *Conn = _Live (T);
+
+      _PopTurn ();
+      if (!Conn)
+        continue;
+
+      NPSReactorTime Due = _DueAt (*Conn, Now);
+
+      if (Due > Now)
+      {
+        _PushTurn (T.Socket, T.Ticket, Due);
+        continue;
+      }
+
+      Pending P = Conn->Waiting.front ();
+      long Sent;
+
+      _Charge (*Conn, P.Channel, P.Size);
+      Conn->Waiting.pop_front ();
+      Conn->BytesQueued -= P.Size;
+      if (Conn->Waiting.empty ())
+        Conn->Ticket = 0;
+      else
+        _Enqueue (T.Socket, *Conn, Now);
+
+      // The send function may add or remove connections; look it up again.
+      NPSSTATUS Status = _Deliver (T.Socket, P.Data, P.Size, Sent);
+
+      m_BytesSent += Sent;
+      if (Status == NPS_OK && Sent < P.Size
+          && (Conn = _Connection (T.Socket)) != NULL)
+      {
+        // The socket is full; the rest goes first, a little later.
+        _Charge (*Conn, P.Channel, Sent - P.Size);
+        memmove (P.Data, P.Data + Sent, P.Size - Sent);
+        P.Size -= Sent;
+        P.Release = Now + NPS_SHAPER_RETRY_MS;
+        Conn->Waiting.push_front (P);
+        Conn->BytesQueued += P.Size;
+        _Enqueue (T.Socket, *Conn, Now);
+        continue;
+      }
+      free (P.Data);
+      if (Status != NPS_OK)
+      {
+        m_SendErrors++;
+        if ((Conn = _Connection (T.Socket)) != NULL)
+          _Discard (*Conn);
+      }
+    }
+  }
+
+  // A rate changed; work out again when everyone in line may go.
+  void _Rekey (void)
+  {
+    NPSReactorTime Now = NPSReactor::Clock ();
+    std::vector < Turn > Turns;
+
+    for (size_t i = 0; i < m_Turns.size (); i++)
+    {
+      Connection *Conn = _Live (m_Turns[i]);
+
+      if (Conn)
+      {
+        Turns.push_back (m_Turns[i]);
+        Turns.back ().Due = _DueAt (*Conn, Now);
+      }
+    }
+    m_Turns.swap (Turns);
+    std::make_heap (m_Turns.begin (), m_Turns.end (),
+                    std::greater < Turn > ());
+    _Reschedule (Now);
+  }
+
+  // Sets the timer for the soonest any waiting message can go.
+  void _Reschedule (NPSReactorTime Now)
+  {
+    NPSReactorTime Due = ~(NPSReactorTime) 0;
+
+    while (!m_Turns.empty () && !_Live (m_Turns.front ()))
+      _PopTurn ();
+    if (!m_Turns.empty ())
+      Due = m_Turns.front ().Due;
+
+    if (m_Timer && m_TimerDue == Due)
+      return;
+    if (m_Timer)
+      m_Reactor->CancelTimer (m_Timer);
+    m_Timer = 0;
+    if (Due != ~(NPSReactorTime) 0)
+    {
+      m_TimerDue = Due;
+      m_Timer = m_Reactor->AddTimer ((Due > Now) ? (unsigned long) (Due - Now)
+                                     : 0, 0, _OnTimer, this);
+    }
+  }
+
+  static void _OnTimer (NPSReactorTimerId, void *Context)
+  {
+    NPSShaper *pThis = (NPSShaper *) Context;
+    NPSReactorTime Now = NPSReactor::Clock ();
+
+    pThis->m_Timer = 0;
+    pThis->_Run (Now);
+    pThis->_Reschedule (Now);
+  }
+};
+
+#endif // __cplusplus
+
+#endif // _NPS_SHAPER_H
@@ -0,0 +1,469 @@
+/*************************************************************************
+ File Name:     NPSThreadPool.h
+
+ Purpose:       A fixed pool of worker threads that steal work from one
+                another
+ Notes:
+
+   NPS_ThreadCreate() per connection or job gives a busy server hundreds
+   of threads fighting over a handful of CPUs.  An NPSThreadPool runs
+   tasks on a fixed set of workers, one per CPU unless told otherwise,
+   so connection handling, database lookups and broadcast fan-out can
+   share the machine instead of oversubscribing it.
+
+   Each worker has its own deques.  A task submitted from a worker goes
+   on that worker's deque, where the worker takes the newest first while
+   its data is still in cache.  A task submitted from any other thread
+   goes to the workers in turn.  A worker with nothing to do steals the
+   oldest task from another.  Only the deque's owner and its thieves
+   share its lock, so submitters and workers rarely meet.
+
+   Tasks are run in priority order (NPS_POOL_PRIORITY_HIGH first), from
+   any worker's deque, before older tasks of lower priority.  Priority
+   only orders the pool's own work.  How the pool's threads compete with
+   the rest of the process is the ThreadPriority given to Open(), which
+   each worker sets on itself as it starts; use a pool per
+   thread priority to keep e.g. broadcasts ahead of database lookups.
+   PinToCpus puts worker i on CPU i modulo the CPU count.
+
+   Close() stops taking tasks from outside the pool, then either runs
+   every task already queued, including any they submit (Drain), or
+   throws them away.  Drain() waits for the queue to empty without
+   closing.
+
+   A task must not wait on a task it submitted: with every worker doing
+   that, nothing would run the submitted ones.
+ *************************************************************************/
+
+#ifndef _NPS_THREAD_POOL_H
+#define _NPS_THREAD_POOL_H
+
+#include <NPSTypes.h>
+#include <NPSThread.h>
+
+#if defined (linux)
+# include <sched.h>
+# include <unistd.h>
+#elif defined (WIN32)
+# include <windows.h>
+#endif
+
+#ifdef __cplusplus
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#define NPS_POOL_PRIORITY_HIGH     (0)
+#define NPS_POOL_PRIORITY_NORMAL   (1)
+#define NPS_POOL_PRIORITY_LOW      (2)
+#define NPS_POOL_PRIORITIES        (3)
+
+// Open()'s ThreadPriority for threads of the default priority.
+#define NPS_POOL_DEFAULT_THREAD_PRIORITY  (-0x7FFF)
+
+typedef void (*NPSPoolTask) (void *Context);
+
+class NPSThreadPool
+{
+public:
+  NPSThreadPool (void)
+  {
+    m_Workers = NULL;
+    m_nWorkers = 0;
+    m_PinToCpus = FALSE;
+    m_ThreadPriority = NPS_POOL_DEFAULT_THREAD_PRIORITY;
+    m_Open = FALSE;
+    m_Stopping = FALSE;
+    m_Queued = 0;
+    m_Sleepers = 0;
+    m_Outstanding = 0;
+    m_Submitting = 0;
+    m_Running = 0;
+    m_NextWorker = 0;
+    for (int i = 0; i < NPS_POOL_PRIORITIES; i++)
+      m_QueuedAt[i] = 0;
+  }
+
+  ~NPSThreadPool (void)
+  {
+    Close (FALSE);
+  }
+
+  // Starts nWorkers threads (0 for one per CPU).
+  NPSSTATUS Open (int nWorkers = 0,
+                  int ThreadPriority = NPS_POOL_DEFAULT_THREAD_PRIORITY,
+                  NPS_LOGICAL PinToCpus = FALSE)
+  {
+    int i;
+
+    if (m_Workers)
+      return NPS_ERR;
+    if (nWorkers < 0)
+      return NPS_BAD_PARAM;
+    if (!nWorkers)
+      nWorkers = _CpuCount ();
+
+    m_Workers = new Worker[nWorkers];
+    m_nWorkers = nWorkers;
+    m_PinToCpus = PinToCpus;
+    m_ThreadPriority = ThreadPriority;
+    m_Stopping = FALSE;
+    m_Open = TRUE;
+    for (i = 0; i < nWorkers; i++)
+    {
+      m_Workers[i].Pool = this;
+      m_Workers[i].Index = i;
+      m_Running++;
+      // Close() waits on m_Running, so nothing needs joining.
+      if (NPS_ThreadCreateDetached (_Run, &m_Workers[i], "NPSThreadPool")
+          == NPS_THREAD_INVALID)
+      {
+        m_Running--;
+        Close (FALSE);
+        return NPS_ERR;
+      }
+    }
+    return NPS_OK;
+  }
+
+  // Stops the workers once the queue is empty (Drain) or at once,
+  // discarding what is queued.  Tasks already running are finished
+  // either way.  Must not be called from a task.
+  NPSSTATUS Close (NPS_LOGICAL Drain = TRUE)
+  {
+    if (!m_Workers)
+      return NPS_OK;
+
+    // Once no Submit () from outside is part way through, none can
+    // queue anything more.
+    m_Open = FALSE;
+    {
+      std::unique_lock < std::mutex > Guard (m_Lock);
+
+      m_Idle.wait (Guard, [this] { return m_Submitting == 0; });
+    }
+    if (Drain)
+      this->Drain ();
+    else
+    {
+      for (int i = 0; i < m_nWorkers; i++)
+      {
+        std::lock_guard < std::mutex > Guard (m_Workers[i].Lock);
+
+        for (int p = 0; p < NPS_POOL_PRIORITIES; p++)
+        {
+          long n = (long) m_Workers[i].Tasks[p].size ();
+
+          m_Workers[i].Tasks[p].clear ();
+          m_QueuedAt[p] -= n;
+          m_Queued -= n;
+          _Finished (n);
+        }
+      }
+    }
+
+    {
+      std::unique_lock < std::mutex > Guard (m_Lock);
+
+      m_Stopping = TRUE;
+      m_Wake.notify_all ();
+      m_Idle.wait (Guard, [this] { return m_Running == 0; });
+    }
+
+    delete[] m_Workers;
+    m_Workers = NULL;
+    m_nWorkers = 0;
+    return NPS_OK;
+  }
+
+  // Queues Task (Context).  NPS_ERR once Close() has begun, except from
+  // the pool's own tasks while it drains.
+  NPSSTATUS Submit (NPSPoolTask Task, void *Context = NULL,
+                    int Priority = NPS_POOL_PRIORITY_NORMAL)
+  {
+    Worker *Self = _Current ();
+    Worker *W;
+
+    if (!Task || Priority < 0 || Priority >= NPS_POOL_PRIORITIES)
+      return NPS_BAD_PARAM;
+    if (Self && Self->Pool != this)
+      Self = NULL;
+
+    // Announce the submit before looking at m_Open; Close () clears
+    // m_Open and then waits for the announced ones, so the workers are
+    // still there for a submit that saw it set.  The pool's own tasks
+    // run on workers, which outlive them.
+    if (!Self)
+      m_Submitting++;
+    if ((!m_Open && !Self) || m_Stopping || !m_Workers)
+    {
+      _Submitted (Self);
+      return NPS_ERR;
+    }
+
+    W = Self ? Self
+      : &m_Workers[(unsigned long) m_NextWorker++ % (unsigned long) m_nWorkers];
+    m_Outstanding++;
+    {
+      std::lock_guard < std::mutex > Guard (W->Lock);
+
+      W->Tasks[Priority].push_back (QueuedTask (Task, Context));
+      m_QueuedAt[Priority]++;
+      m_Queued++;
+    }
+    _Submitted (Self);
+
+    // Pairs with the check in _Wait (): either the sleeper sees the task
+    // or this sees the sleeper.
+    if (m_Sleepers.load ())
+    {
+      std::lock_guard < std::mutex > Guard (m_Lock);
+
+      m_Wake.notify_one ();
+    }
+    return NPS_OK;
+  }
+
+  // Waits until every task submitted so far, and every task they
+  // submit, has run.  Must not be called from a task.
+  void Drain (void)
+  {
+    std::unique_lock < std::mutex > Guard (m_Lock);
+
+    m_Idle.wait (Guard, [this] { return m_Outstanding == 0; });
+  }
+
+  NPS_INLINE int WorkerCount (void)
+  {
+    return m_nWorkers;
+  }
+
+  // Tasks queued and not yet started.
+  NPS_INLINE long Pending (void)
+  {
+    return m_Queued;
+  }
+
+  // Tasks Worker has run, and how many of them it stole.
+  NPS_INLINE long TasksRun (int Worker)
+  {
+    return (Worker >= 0 && Worker < m_nWorkers) ? m_Workers[Worker].Run.load () : 0;
+  }
+
+  NPS_INLINE long TasksStolen (int Worker)
+  {
+    return (Worker >= 0 && Worker < m_nWorkers)
+      ? m_Workers[Worker].Stolen.load () : 0;
+  }
+
+  // The worker running the caller, or -1 if it is not one of this
+  // pool's.
+  NPS_INLINE int CurrentWorker (void)
+  {
+    Worker *Self = _Current ();
+
+    return (Self && Self->Pool == this) ? Self->Index : -1;
+  }
+
+private:
+  struct QueuedTask
+  {
+    QueuedTask (NPSPoolTask T, void *C) : Task (T), Context (C) {}
+
+    NPSPoolTask Task;
+    void *Context;
+  };
+
+  struct Worker
+  {
+    Worker () : Pool (NULL), Index (0), Run (0), Stolen (0) {}
+
+    NPSThreadPool *Pool;
+    int Index;
+    std::mutex Lock;                // Tasks, for the owner and thieves
+    std::deque < QueuedTask > Tasks[NPS_POOL_PRIORITIES];
+    std::atomic < long > Run;
+    std::atomic < long > Stolen;
+  };
+
+  Worker *m_Workers;
+  int m_nWorkers;
+  NPS_LOGICAL m_PinToCpus;
+  int m_ThreadPriority;             // Open()'s, for the workers to set
+  std::atomic < bool > m_Open;
+  std::atomic < bool > m_Stopping;
+  std::atomic < long > m_Queued;    // in some deque
+  std::atomic < long > m_QueuedAt[NPS_POOL_PRIORITIES];
+  std::atomic < int > m_Sleepers;
+  std::atomic < long > m_Outstanding;       // submitted and not yet run
+  std::atomic < int > m_Submitting; // Submit ()s from outside under way
+  int m_Running;                    // threads; under m_Lock
+  std::atomic < unsigned long > m_NextWorker;
+  std::mutex m_Lock;
+  std::condition_variable m_Wake;   // work, or stop
+  std::condition_variable m_Idle;   // m_Outstanding, m_Submitting or
+                                    // m_Running reached 0
+
+  NPSThreadPool (const NPSThreadPool &);
+  NPSThreadPool & operator = (const NPSThreadPool &);
+
+  static Worker *&_Current (void)
+  {
+    static thread_local Worker *Current = NULL;
+
+    return Current;
+  }
+
+  static int _CpuCount (void)
+  {
+#if defined (linux)
+    long nCpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+    return (nCpus > 0) ? (int) nCpus : 1;
+#elif defined (WIN32)
+    SYSTEM_INFO Info;
+
+    GetSystemInfo (&Info);
+    return (int) Info.dwNumberOfProcessors;
+#else
+    return 1;
+#endif
+  }
+
+  void _Pin (int Cpu)
+  {
+#if defined (linux)
+    cpu_set_t Cpus;
+
+    CPU_ZERO (&Cpus);
+    CPU_SET (Cpu, &Cpus);
+    pthread_setaffinity_np (pthread_self (), sizeof (Cpus), &Cpus);
+#elif defined (WIN32)
+    SetThreadAffinityMask (GetCurrentThread (), (DWORD_PTR) 1 << Cpu);
+#else
+    (void) Cpu;
+#endif
+  }
+
+  // Gives the calling worker Open()'s ThreadPriority.
+  static void _SetPriority (int Priority)
+  {
+#if defined (linux)
+    pthread_setschedprio (pthread_self (), Priority);
+#elif defined (WIN32)
+    SetThreadPriority (GetCurrentThread (), Priority);
+#else
+    (void) Priority;
+#endif
+  }
+
+  // Ends a Submit () from outside; Close () may be waiting for it.
+  void _Submitted (Worker * Self)
+  {
+    if (!Self && --m_Submitting == 0 && !m_Open)
+    {
+      std::lock_guard < std::mutex > Guard (m_Lock);
+
+      m_Idle.notify_all ();
+    }
+  }
+
+  void _Finished (long n)
+  {
+    if (n && (m_Outstanding -= n) == 0)
+    {
+      std::lock_guard < std::mutex > Guard (m_Lock);
+
+      m_Idle.notify_all ();
+    }
+  }
+
+  // The highest priority task there is: W's newest, or another
+  // worker's oldest.
+  NPS_LOGICAL _Take (Worker * W, QueuedTask & Task)
+  {
+    for (int p = 0; p < NPS_POOL_PRIORITIES; p++)
+    {
+      if (!m_QueuedAt[p])
+        continue;
+      {
+        std::lock_guard < std::mutex > Guard (W->Lock);
+
+        if (!W->Tasks[p].empty ())
+        {
+          Task = W->Tasks[p].back ();
+          W->Tasks[p].pop_back ();
+          m_QueuedAt[p]--;
+          m_Queued--;
+          return TRUE;
+        }
+      }
+      for (int i = 1; i < m_nWorkers; i++)
+      {
+        Worker *Victim = &m_Workers[(W->Index + i) % m_nWorkers];
+        std::lock_guard < std::mutex > Guard (Victim->Lock);
+
+        if (!Victim->Tasks[p].empty ())
+        {
+          Task = Victim->Tasks[p].front ();
+          Victim->Tasks[p].pop_front ();
+          m_QueuedAt[p]--;
+          m_Queued--;
+          W->Stolen++;
+          return TRUE;
+        }
+      }
+    }
+    return FALSE;
+  }
+
+  // Sleeps until there may be work; FALSE when it is time to stop.
+  NPS_LOGICAL _Wait (void)
+  {
+    std::unique_lock < std::mutex > Guard (m_Lock);
+
+    m_Sleepers++;
+    while (!m_Queued && !m_Stopping)
+      m_Wake.wait (Guard);
+    m_Sleepers--;
+    return m_Queued || !m_Stopping;
+  }
+
+  static void NPSThread_Convention _Run (void *Context)
+  {
+    Worker *W = (Worker *) Context;
+    NPSThreadPool *Pool = W->Pool;
+    QueuedTask Task (NULL, NULL);
+
+    _Current () = W;
+    if (Pool->m_ThreadPriority != NPS_POOL_DEFAULT_THREAD_PRIORITY)
+      _SetPriority (Pool->m_ThreadPriority);
+    if (Pool->m_PinToCpus)
+      Pool->_Pin (W->Index % _CpuCount ());
+
+    for (;;)
+    {
+      if (Pool->_Take (W, Task))
+      {
+        Task.Task (Task.Context);
+        W->Run++;
+        Pool->_Finished (1);
+      }
+      else if (!Pool->_Wait ())
+        break;
+    }
+
+    // Nothing of the pool may be touched once Close() can see this.
+    _Current () = NULL;
+    std::lock_guard < std::mutex > Guard (Pool->m_Lock);
+
+    if (--Pool->m_Running == 0)
+      Pool->m_Idle.notify_all ();
+  }
+};
+
+#endif // __cplusplus
+
+#endif // _NPS_THREAD_POOL_H
@@ -0,0 +1,1051 @@
+/*************************************************************************
+ File Name:     NPSUring.h
+
+ Purpose:       Batched socket sends and receives over io_uring
+ Notes:
+
+   NPSComm::SendToSocket(), ReceiveFromSocket() and their UDP versions
+   make one system call per message.  A rebroadcaster relaying a message
+   to every player in a room makes one per recipient.
+
+   NPSUring queues sends to any number of sockets and hands them to the
+   kernel with one io_uring_enter() in Submit().  Receives are multishot:
+   one RecvMultishot() keeps delivering data from a ring of kernel-picked
+   buffers until the socket closes, with no call per read.  Sends can
+   also come from a pool of buffers registered with the kernel
+   (SetupSendBuffers()); serialize straight into GetSendBuffer() and the
+   kernel reads the message without mapping the pages again.
+
+   io_uring is chosen at run time.  Open() falls back to plain sends and
+   an NPSReactor for receives if the kernel does not offer it (or if it
+   is told not to), and the interface behaves the same either way.  In
+   the fallback, sends go out during Submit() and sockets given to
+   RecvMultishot() must be non-blocking (NPSComm::SetSocketAsync()).
+   Multishot receives need linux 6.0; older kernels get the fallback.
+
+   Completions are delivered from Wait() (and from Submit() for the
+   fallback's sends) to an NPSUringCallback:
+
+     Result > 0    bytes sent, or bytes received at Data
+     Result == 0   the peer closed (receives only)
+     Result < 0    -errno; the operation is over
+
+   Received Data is only valid during the callback.
+
+   Buffers passed to QueueSend() must stay put until their completion.
+   Not thread safe; one NPSUring per thread.  Define NPS_NO_URING to
+   build without io_uring, e.g. against pre-5.19 kernel headers.
+ *************************************************************************/
+
+#ifndef _NPS_URING_H
+#define _NPS_URING_H
+
+#include <NPSReactor.h>
+
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+
+#include <poll.h>
+
+#if defined (linux) && !defined (NPS_NO_URING)
+# define NPS_URING
+# include <linux/io_uring.h>
+# include <sys/syscall.h>
+# include <sys/mman.h>
+#endif
+
+#ifdef __cplusplus
+
+#define NPS_URING_ENTRIES          256   // submission queue size
+#define NPS_URING_BUFFER_GROUP     0     // provided buffer ring id
+
+typedef void (*NPSUringCallback) (SOCKET Socket, int Result,
+                                  const char *Data, void *Context);
+
+class NPSUring
+{
+public:
+  NPSUring (void)
+  {
+    m_Open = FALSE;
+    m_Uring = FALSE;
+    m_LastErrno = 0;
+    m_FreeOps = NULL;
+    m_SendPool = NULL;
+    m_SendSize = 0;
+    m_SendCount = 0;
+    m_RecvData = NULL;
+    m_RecvSize = 0;
+    m_RecvCount = 0;
+#if defined (NPS_URING)
+    m_RingFd = -1;
+    m_RingMem = NULL;
+    m_RingMemSize = 0;
+    m_CqMem = NULL;
+    m_CqMemSize = 0;
+    m_Sqes = NULL;
+    m_SqesSize = 0;
+    m_SqLocalTail = 0;
+    m_ToSubmit = 0;
+    m_BufRing = NULL;
+    m_BufRingSize = 0;
+    m_BufTail = 0;
+#endif
+  }
+
+  ~NPSUring (void)
+  {
+    Close ();
+  }
+
+  // Sets up io_uring if UseUring and the kernel allow it, and the
+  // fallback otherwise.  Entries is the submission queue size.
+  NPSSTATUS Open (unsigned int Entries = NPS_URING_ENTRIES,
+                  NPS_LOGICAL UseUring = TRUE)
+  {
+    if (m_Open)
+      return NPS_OK;
+    if (Entries < 8)
+      Entries = 8;
+
+#if defined (NPS_URING)
+    if (UseUring)
+      m_Uring = (_SetupRing (Entries) == NPS_OK);
+#endif
+    if (!m_Uring && m_Reactor.Open () != NPS_OK)
+    {
+      m_LastErrno = m_Reactor.GetReactorError ();
+      return NPS_ERR;
+    }
+    m_Open = TRUE;
+    return NPS_OK;
+  }
+
+  // Drops everything in flight without calling back.  The sockets are
+  // left open.
+  NPSSTATUS Close (void)
+  {
+#if defined (NPS_URING)
+    if (m_Sqes)
+      munmap (m_Sqes, m_SqesSize);
+    if (m_CqMem)
+      munmap (m_CqMem, m_CqMemSize);
+    if (m_RingMem)
+      munmap (m_RingMem, m_RingMemSize);
+    if (m_BufRing)
+      munmap (m_BufRing, m_BufRingSize);
+    if (m_RingFd >= 0)
+      close (m_RingFd);
+    m_RingFd = -1;
+    m_RingMem = m_CqMem = NULL;
+    m_Sqes = NULL;
+    m_BufRing = NULL;
+    m_ToSubmit = 0;
+#endif
+    m_Reactor.Close ();
+    free (m_SendPool);
+    free (m_RecvData);
+    m_SendPool = NULL;
+    m_RecvData = NULL;
+    m_SendFree.clear ();
+    m_Queued.clear ();
+    for (size_t i = 0; i < m_OpChunks.size (); i++)
+      delete[] m_OpChunks[i];
+    m_OpChunks.clear ();
+    m_FreeOps = NULL;
+    m_Open = FALSE;
+    m_Uring = FALSE;
+    return NPS_OK;
+  }
+
+  // TRUE if io_uring is in use, FALSE for the fallback.
+  NPS_INLINE NPS_LOGICAL UsingUring (void)
+  {
+    return m_Uring;
+  }
+
+  NPS_INLINE int GetUringError (void)
+  {
+    return m_LastErrno;
+  }
+
+  //------------------------- Sends ------------------------------------
+  // Queues MsgSize bytes at Message for Socket.  Stream sockets get all
+  // of them, as with NPSComm::SendToSocket().
+  NPSSTATUS QueueSend (SOCKET Socket, const char *Message, long MsgSize,
+                       NPSUringCallback Callback = NULL,
+                       void *Context = NULL)
+  {
+    return _QueueSend (OP_SEND, Socket, Message, MsgSize, NULL, 0,
+                       Callback, Context);
+  }
+
+  // As NPSComm::SendToSocketUDP(), queued.
+  NPSSTATUS QueueSendUDP (SOCKET Socket, const struct sockaddr *pSockAddr,
+                          socklen_t SockAddrLen, const char *Message,
+                          long MsgSize, NPSUringCallback Callback = NULL,
+                          void *Context = NULL)
+  {
+    if (!pSockAddr || SockAddrLen > (socklen_t) sizeof (struct sockaddr_storage))
+      return NPS_BAD_PARAM;
+    return _QueueSend (OP_SENDTO, Socket, Message, MsgSize, pSockAddr,
+                       SockAddrLen, Callback, Context);
+  }
+
+  // Carves Count send buffers of Size bytes and registers them with the
+  // kernel.  Call once, after Open().
+  NPSSTATUS SetupSendBuffers (int Count, int Size = MAX_MSG_LEN)
+  {
+    if (!m_Open || m_SendPool || Count <= 0 || Size <= 0)
+      return NPS_BAD_PARAM;
+    m_SendPool = (char *) malloc ((size_t) Count * Size);
+    if (!m_SendPool)
+      return NPS_OUT_OF_MEMORY;
+    m_SendSize = Size;
+    m_SendCount = Count;
+    for (int i = Count; i-- > 0;)
+      m_SendFree.push_back (m_SendPool + (size_t) i * Size);
+
+#if defined (NPS_URING)
+    if (m_Uring)
+    {
+      struct iovec Region;
+
+      Region.iov_base = m_SendPool;
+      Region.iov_len = (size_t) Count * Size;
+      if (_Register (IORING_REGISTER_BUFFERS, &Region, 1) < 0)
+      {
+        free (m_SendPool);
+        m_SendPool = NULL;
+        m_SendFree.clear ();
+        return NPS_ERR;
+      }
+    }
+#endif
+    return NPS_OK;
+  }
+
+  // A registered buffer to serialize a message into, or NULL if they are
+  // all in flight.  It comes back when QueueSendBuffer() completes.
+  char *GetSendBuffer (void)
+  {
+    char *Buffer;
+
+    if (m_SendFree.empty ())
+      return NULL;
+    Buffer = m_SendFree.back ();
+    m_SendFree.pop_back ();
+    return Buffer;
+  }
+
+  // For a buffer from GetSendBuffer() that will not be sent after all.
+  NPS_INLINE void ReleaseSendBuffer (char *Buffer)
+  {
+    m_SendFree.push_back (Buffer);
+  }
+
+  NPS_INLINE int SendBufferSize (void)
+  {
+    return m_SendSize;
+  }
+
+  // Queues MsgSize bytes of a buffer from GetSendBuffer().
+  NPSSTATUS QueueSendBuffer (SOCKET Socket, char *Buffer, long MsgSize,
+                             NPSUringCallback Callback = NULL,
+                             void *Context = NULL)
+  {
+    if (!Buffer || Buffer < m_SendPool
+        || Buffer >= m_SendPool + (size_t) m_SendCount * m_SendSize
+        || MsgSize > m_SendSize - (Buffer - m_SendPool) % m_SendSize)
+      return NPS_BAD_PARAM;
+    return _QueueSend (OP_SEND_FIXED, Socket, Buffer, MsgSize, NULL, 0,
+                       Callback, Context);
+  }
+
+  // Hands everything queued to the kernel in one call.  Returns the
+  // number of operations it submitted (a full queue is flushed early),
+  // or NPS_ERR.
+  int Submit (void)
+  {
+    int Submitted;
+
+    if (!m_Uring)
+      return _SubmitFallback ();
+#if defined (NPS_URING)
+    Submitted = m_ToSubmit;
+    if (_Enter (0, NULL) < 0)
+      return NPS_ERR;
+    _Reap ();
+    return Submitted;
+#else
+    return 0;
+#endif
+  }
+
+  //------------------------- Receives ---------------------------------
+  // Sets aside Count (a power of two) receive buffers of Size bytes for
+  // the kernel to fill.  Call once, after Open(), before RecvMultishot().
+  NPSSTATUS SetupRecvBuffers (int Count, int Size = MAX_MSG_LEN)
+  {
+    if (!m_Open || m_RecvData || Count <= 0 || Count > 0x8000
+        || (Count & (Count - 1)) || Size <= 0)
+      return NPS_BAD_PARAM;
+    m_RecvData = (char *) malloc ((size_t) Count * Size);
+    if (!m_RecvData)
+      return NPS_OUT_OF_MEMORY;
+    m_RecvSize = Size;
+    m_RecvCount = Count;
+
+#if defined (NPS_URING)
+    if (m_Uring)
+    {
+      struct io_uring_buf_reg Reg;
+
+      m_BufRingSize = (size_t) Count * sizeof (struct io_uring_buf);
+      m_BufRing = (struct io_uring_buf *)
+        mmap (NULL, m_BufRingSize, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (m_BufRing == MAP_FAILED)
+      {
+        m_BufRing = NULL;
+        _SetLastError ();
+        return NPS_ERR;
+      }
+      memset (&Reg, 0, sizeof (Reg));
+      Reg.ring_addr = (unsigned long) m_BufRing;
+      Reg.ring_entries = Count;
+      Reg.bgid = NPS_URING_BUFFER_GROUP;
+      if (_Register (IORING_REGISTER_PBUF_RING, &Reg, 1) < 0)
+      {
+        munmap (m_BufRing, m_BufRingSize);
+        m_BufRing = NULL;
+        return NPS_ERR;
+      }
+      m_BufTail = 0;
+      for (int i = 0; i < Count; i++)
+        _ProvideBuffer ((unsigned short) i);
+    }
+#endif
+    return NPS_OK;
+  }
+
+  // Delivers everything Socket receives to Callback until it closes, it
+  // fails or CancelRecv() is called.
+  NPSSTATUS RecvMultishot (SOCKET Socket, NPSUringCallback Callback,
+                           void *Context = NULL)
+  {
+    NPSSTATUS Status;
+    Op *pOp;
+
+    if (Socket == INVALID_SOCKET)
+      return NPS_INVALID_SOCKET;
+    if (!m_RecvData || !Callback)
+      return NPS_BAD_PARAM;
+    if (!(pOp = _AllocOp ()))
+      return NPS_ERR;
+    pOp->Type = OP_RECV;
+    pOp->Owner = this;
+    pOp->Socket = Socket;
+    pOp->Callback = Callback;
+    pOp->Context = Context;
+
+#if defined (NPS_URING)
+    Status = m_Uring ? _ArmRecv (pOp) : _RecvFallback (pOp);
+#else
+    Status = _RecvFallback (pOp);
+#endif
+    if (Status != NPS_OK)
+    {
+      _FreeOp (pOp);
+      return NPS_ERR;
+    }
+    return NPS_OK;
+  }
+
+  // Stops the receive on Socket.  No more callbacks are made for it.
+  NPSSTATUS CancelRecv (SOCKET Socket)
+  {
+    for (size_t i = 0; i < m_OpChunks.size () * OP_CHUNK; i++)
+    {
+      Op *pOp = &m_OpChunks[i / OP_CHUNK][i % OP_CHUNK];
+
+      if (pOp->Type != OP_RECV || pOp->Socket != Socket || pOp->Cancelled)
+        continue;
+      if (!m_Uring)
+      {
+        m_Reactor.RemoveSocket (Socket);
+        _FreeOp (pOp);
+        return NPS_OK;
+      }
+#if defined (NPS_URING)
+      // The op is freed when its last completion, -ECANCELED, arrives.
+      // If the cancel cannot be queued the receive carries on as before.
+      struct io_uring_sqe *Sqe = _GetSqe ();
+      if (!Sqe)
+        return NPS_ERR;
+      pOp->Cancelled = TRUE;
+      Sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      Sqe->fd = -1;
+      Sqe->addr = (unsigned long) pOp;
+      Sqe->user_data = 0;
+      return NPS_OK;
+#endif
+    }
+    return NPS_BAD_PARAM;
+  }
+
+  //------------------------- Completions ------------------------------
+  // Submits anything queued, waits up to TimeOut (forever if NULL) for
+  // something to complete and calls back for everything that has.
+  // Returns the number of callbacks made, or NPS_ERR.
+  int Wait (struct timeval *TimeOut)
+  {
+    if (!m_Open)
+      return NPS_ERR;
+    if (!m_Uring)
+    {
+      struct timeval Zero = { 0, 0 };
+      int Sent = _SubmitFallback ();
+      int Received;
+
+      if (Sent < 0)
+        return NPS_ERR;
+      Received = m_Reactor.RunOnce (Sent ? &Zero : TimeOut);
+      return (Received < 0) ? NPS_ERR : Sent + Received;
+    }
+#if defined (NPS_URING)
+    // Don't sleep on completions that are already here.
+    int Dispatched = _Reap ();
+
+    if (_Enter (Dispatched ? 0 : 1, TimeOut) < 0)
+      return NPS_ERR;
+    return Dispatched + _Reap ();
+#else
+    return 0;
+#endif
+  }
+
+private:
+  enum
+  {
+    OP_FREE,
+    OP_SEND,
+    OP_SENDTO,
+    OP_SEND_FIXED,
+    OP_RECV,
+    OP_CHUNK = 256                  // ops allocated at a time
+  };
+
+  struct Op
+  {
+    int Type;
+    SOCKET Socket;
+    const char *Data;
+    long Length;
+    long Done;
+    NPSUringCallback Callback;
+    void *Context;
+    NPS_LOGICAL Cancelled;
+    NPS_LOGICAL Finished;           // fixed send reported, notifs pending
+    int Notifs;                     // SEND_ZC notifications outstanding
+    NPSUring *Owner;
+    struct msghdr Msg;
+    struct iovec Iov;
+    struct sockaddr_storage Addr;
+    Op *NextFree;
+  };
+
+  NPS_LOGICAL m_Open;
+  NPS_LOGICAL m_Uring;
+  int m_LastErrno;
+  std::vector < Op * > m_OpChunks;  // never move: the kernel has pointers
+  Op *m_FreeOps;
+  std::vector < Op * > m_Queued;    // fallback sends awaiting Submit()
+  NPSReactor m_Reactor;             // fallback receives
+  char *m_SendPool;
+  int m_SendSize;
+  int m_SendCount;
+  std::vector < char * > m_SendFree;
+  char *m_RecvData;
+  int m_RecvSize;
+  int m_RecvCount;
+
+#if defined (NPS_URING)
+  int m_RingFd;
+  void *m_RingMem;
+  size_t m_RingMemSize;
+  void *m_CqMem;
+  size_t m_CqMemSize;
+  struct io_uring_sqe *m_Sqes;
+  size_t m_SqesSize;
+  unsigned *m_SqHead;
+  unsigned *m_SqTail;
+  unsigned *m_SqMask;
+  unsigned *m_SqArray;
+  unsigned m_SqEntries;
+  unsigned m_SqLocalTail;
+  unsigned *m_CqHead;
+  unsigned *m_CqTail;
+  unsigned *m_CqMask;
+  struct io_uring_cqe *m_Cqes;
+  int m_ToSubmit;
+  struct io_uring_buf *m_BufRing;
+  size_t m_BufRingSize;
+  unsigned short m_BufTail;
+#endif
+
+  NPS_INLINE void _SetLastError (void)
+  {
+    m_LastErrno = errno;
+  }
+
+  Op *_AllocOp (void)
+  {
+    Op *pOp;
+
+    if (!m_FreeOps)
+    {
+      Op *Chunk = new Op[OP_CHUNK];
+
+      m_OpChunks.push_back (Chunk);
+      for (int i = OP_CHUNK; i-- > 0;)
+      {
+        Chunk[i].Type = OP_FREE;
+        Chunk[i].NextFree = m_FreeOps;
+        m_FreeOps = &Chunk[i];
+      }
+    }
+    pOp = m_FreeOps;
+    m_FreeOps = pOp->NextFree;
+    memset (pOp, 0, sizeof (*pOp));
+    return pOp;
+  }
+
+  void _FreeOp (Op * pOp)
+  {
+    pOp->Type = OP_FREE;
+    pOp->NextFree = m_FreeOps;
+    m_FreeOps = pOp;
+  }
+
+  // Tells the sender its send is over (if Notify), and recycles it.
+  void _SendDone (Op * pOp, int Result, NPS_LOGICAL Notify = TRUE)
+  {
+    NPSUringCallback Callback = pOp->Callback;
+    void *Context = pOp->Context;
+    SOCKET Socket = pOp->Socket;
+
+    if (pOp->Type == OP_SEND_FIXED)
+      m_SendFree.push_back (m_SendPool
+                            + (pOp->Data - m_SendPool) / m_SendSize
+                            * m_SendSize);
+    _FreeOp (pOp);
+    if (Callback && Notify)
+      Callback (Socket, Result, NULL, Context);
+  }
+
+  NPSSTATUS _QueueSend (int Type, SOCKET Socket, const char *Message,
+                        long MsgSize, const struct sockaddr *pSockAddr,
+                        socklen_t SockAddrLen, NPSUringCallback Callback,
+                        void *Context)
+  {
+    Op *pOp;
+
+    if (!m_Open)
+      return NPS_ERR;
+    if (Socket == INVALID_SOCKET)
+      return NPS_INVALID_SOCKET;
+    if (!Message || MsgSize <= 0 || MsgSize > MAX_MSG_LEN)
+      return NPS_BAD_PARAM;
+    if (!(pOp = _AllocOp ()))
+      return NPS_ERR;
+
+    pOp->Type = Type;
+    pOp->Socket = Socket;
+    pOp->Data = Message;
+    pOp->Length = MsgSize;
+    pOp->Callback = Callback;
+    pOp->Context = Context;
+    if (Type == OP_SENDTO)
+    {
+      memcpy (&pOp->Addr, pSockAddr, SockAddrLen);
+      pOp->Msg.msg_name = &pOp->Addr;
+      pOp->Msg.msg_namelen = SockAddrLen;
+      pOp->Msg.msg_iov = &pOp->Iov;
+      pOp->Msg.msg_iovlen = 1;
+    }
+
+    if (!m_Uring)
+    {
+      m_Queued.push_back (pOp);
+      return NPS_OK;
+    }
+#if defined (NPS_URING)
+    if (_PrepSend (pOp) != NPS_OK)
+    {
+      _FreeOp (pOp);
+      return NPS_ERR;
+    }
+#endif
+    return NPS_OK;
+  }
+
+  //------------------------- Fallback ---------------------------------
+  int _SubmitFallback (void)
+  {
+    std::vector < Op * > Queued;
+    int Done = 0;
+
+    Queued.swap (m_Queued);
+    for (size_t i = 0; i < Queued.size (); i++)
+    {
+      Op *pOp = Queued[i];
+      long Result = 0;
+
+      while (pOp->Done < pOp->Length)
+      {
+        const char *Data = pOp->Data + pOp->Done;
+        long Left = pOp->Length - pOp->Done;
+
+        if (pOp->Type == OP_SENDTO)
+          Result = sendto (pOp->Socket, Data, Left, MSG_NOSIGNAL,
+                           (struct sockaddr *) &pOp->Addr,
+                           pOp->Msg.msg_namelen);
+        else
+          Result = send (pOp->Socket, Data, Left, MSG_NOSIGNAL);
+        if (Result < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+          {
+            // Non-blocking socket: block here, as SendToSocket() would.
+            struct pollfd Writable;
+
+            Writable.fd = pOp->Socket;
+            Writable.events = POLLOUT;
+            poll (&Writable, 1, -1);
+            continue;
+          }
+          Result = -errno;
+          break;
+        }
+        pOp->Done += Result;
+        if (pOp->Type == OP_SENDTO)
+          break;
+      }
+      _SendDone (pOp, (Result < 0) ? (int) Result : (int) pOp->Done);
+      Done++;
+    }
+    return Done;
+  }
+
+  NPSSTATUS _RecvFallback (Op * pOp)
+  {
+    if (m_Reactor.AddSocket (pOp->Socket, NPS_REACTOR_READ,
+                             _OnReadable, pOp) != NPS_OK)
+    {
+      m_LastErrno = m_Reactor.GetReactorError ();
+      return NPS_ERR;
+    }
+    return NPS_OK;
+  }
+
+  static void _OnReadable (SOCKET, int, void *Context)
+  {
+    Op *pOp = (Op *) Context;
+
+    pOp->Owner->_ReadFallback (pOp);
+  }
+
+  // Edge-triggered: read until the socket runs dry.
+  void _ReadFallback (Op * pOp)
+  {
+    for (;;)
+    {
+      long Result = recv (pOp->Socket, m_RecvData, m_RecvSize, 0);
+
+      if (Result < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return;
+        Result = -errno;
+      }
+      if (Result <= 0)
+      {
+        NPSUringCallback Callback = pOp->Callback;
+        void *Context = pOp->Context;
+        SOCKET Socket = pOp->Socket;
+
+        m_Reactor.RemoveSocket (Socket);
+        _FreeOp (pOp);
+        Callback (Socket, (int) Result, NULL, Context);
+        return;
+      }
+      pOp->Callback (pOp->Socket, (int) Result, m_RecvData, pOp->Context);
+      if (pOp->Type != OP_RECV || pOp->Cancelled)
+        return;
+    }
+  }
+
+#if defined (NPS_URING)
+  //------------------------- io_uring ---------------------------------
+  NPSSTATUS _SetupRing (unsigned int Entries)
+  {
+    struct io_uring_params Params;
+    unsigned char *Sq;
+    unsigned char *Cq;
+
+    memset (&Params, 0, sizeof (Params));
+    m_RingFd = (int) syscall (__NR_io_uring_setup, Entries, &Params);
+    if (m_RingFd < 0)
+    {
+      _SetLastError ();
+      return NPS_NOT_IMPLEMENTED;
+    }
+    // Timed waits need EXT_ARG (5.11), and multishot receives came in
+    // 6.0 alongside SEND_ZC, which a probe can see.
+    if (!(Params.features & IORING_FEAT_EXT_ARG)
+        || !(Params.features & IORING_FEAT_NODROP)
+        || !_Supports (IORING_OP_SEND_ZC))
+    {
+      close (m_RingFd);
+      m_RingFd = -1;
+      return NPS_NOT_IMPLEMENTED;
+    }
+
+    m_RingMemSize = Params.sq_off.array + Params.sq_entries * sizeof (unsigned);
+    m_CqMemSize = Params.cq_off.cqes
+      + Params.cq_entries * sizeof (struct io_uring_cqe);
+    if (Params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (m_CqMemSize > m_RingMemSize)
+        m_RingMemSize = m_CqMemSize;
+      m_CqMemSize = 0;
+    }
+    m_RingMem = mmap (NULL, m_RingMemSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_RingFd, IORING_OFF_SQ_RING);
+    if (m_RingMem == MAP_FAILED)
+    {
+      m_RingMem = NULL;
+      return _SetupFailed ();
+    }
+    if (m_CqMemSize)
+    {
+      m_CqMem = mmap (NULL, m_CqMemSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_RingFd, IORING_OFF_CQ_RING);
+      if (m_CqMem == MAP_FAILED)
+      {
+        m_CqMem = NULL;
+        return _SetupFailed ();
+      }
+    }
+    m_SqesSize = Params.sq_entries * sizeof (struct io_uring_sqe);
+    m_Sqes = (struct io_uring_sqe *)
+      mmap (NULL, m_SqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, m_RingFd, IORING_OFF_SQES);
+    if (m_Sqes == MAP_FAILED)
+    {
+      m_Sqes = NULL;
+      return _SetupFailed ();
+    }
+
+    Sq = (unsigned char *) m_RingMem;
+    Cq = m_CqMem ? (unsigned char *) m_CqMem : Sq;
+    m_SqHead = (unsigned *) (Sq + Params.sq_off.head);
+    m_SqTail = (unsigned *) (Sq + Params.sq_off.tail);
+    m_SqMask = (unsigned *) (Sq + Params.sq_off.ring_mask);
+    m_SqArray = (unsigned *) (Sq + Params.sq_off.array);
+    m_SqEntries = Params.sq_entries;
+    m_CqHead = (unsigned *) (Cq + Params.cq_off.head);
+    m_CqTail = (unsigned *) (Cq + Params.cq_off.tail);
+    m_CqMask = (unsigned *) (Cq + Params.cq_off.ring_mask);
+    m_Cqes = (struct io_uring_cqe *) (Cq + Params.cq_off.cqes);
+    m_SqLocalTail = *m_SqTail;
+    m_ToSubmit = 0;
+    return NPS_OK;
+  }
+
+  NPS_LOGICAL _Supports (int Opcode)
+  {
+    unsigned long long Buffer[(sizeof (struct io_uring_probe)
+                               + 256 * sizeof (struct io_uring_probe_op))
+                              / sizeof (unsigned long long) + 1];
+    struct io_uring_probe *Probe = (struct io_uring_probe *) Buffer;
+
+    memset (Buffer, 0, sizeof (Buffer));
+    if (_Register (IORING_REGISTER_PROBE, Probe, 256) < 0)
+      return FALSE;
+    return Opcode <= Probe->last_op
+      && (Probe->ops[Opcode].flags & IO_URING_OP_SUPPORTED);
+  }
+
+  NPSSTATUS _SetupFailed (void)
+  {
+    _SetLastError ();
+    Close ();
+    return NPS_ERR;
+  }
+
+  int _Register (unsigned int Opcode, void *Arg, unsigned int nArgs)
+  {
+    int Result = (int) syscall (__NR_io_uring_register, m_RingFd, Opcode,
+                                Arg, nArgs);
+
+    if (Result < 0)
+      _SetLastError ();
+    return Result;
+  }
+
+  // Submits what is queued and, if WaitFor, waits up to TimeOut for a
+  // completion.
+  int _Enter (unsigned int WaitFor, struct timeval *TimeOut)
+  {
+    struct io_uring_getevents_arg Arg;
+    struct __kernel_timespec Ts;
+    unsigned int Flags = 0;
+    int Result;
+
+    if (!m_ToSubmit && !WaitFor)
+      return 0;
+    if (WaitFor)
+    {
+      Flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+      memset (&Arg, 0, sizeof (Arg));
+      if (TimeOut)
+      {
+        Ts.tv_sec = TimeOut->tv_sec;
+        Ts.tv_nsec = (long long) TimeOut->tv_usec * 1000;
+        Arg.ts = (unsigned long) &Ts;
+      }
+    }
+
+    // Publish the queued entries before the kernel looks for them.
+    __atomic_store_n (m_SqTail, m_SqLocalTail, __ATOMIC_RELEASE);
+    for (;;)
+    {
+      Result = (int) syscall (__NR_io_uring_enter, m_RingFd, m_ToSubmit,
+                              WaitFor, Flags, WaitFor ? &Arg : NULL,
+                              WaitFor ? sizeof (Arg) : 0);
+      if (Result >= 0)
+      {
+        m_ToSubmit -= Result;
+        return Result;
+      }
+      if (errno == ETIME || errno == EINTR)
+        return 0;
+      if (errno == EBUSY || errno == EAGAIN)
+      {
+        // Completion queue backed up; make room and try again.
+        _Reap ();
+        continue;
+      }
+      _SetLastError ();
+      return -1;
+    }
+  }
+
+  struct io_uring_sqe *_GetSqe (void)
+  {
+    unsigned Tail = m_SqLocalTail;
+    struct io_uring_sqe *Sqe;
+
+    if (Tail - __atomic_load_n (m_SqHead, __ATOMIC_ACQUIRE) >= m_SqEntries)
+    {
+      if (_Enter (0, NULL) < 0)
+        return NULL;
+      if (Tail - __atomic_load_n (m_SqHead, __ATOMIC_ACQUIRE) >= m_SqEntries)
+        return NULL;
+    }
+    Sqe = &m_Sqes[Tail & *m_SqMask];
+    memset (Sqe, 0, sizeof (*Sqe));
+    m_SqArray[Tail & *m_SqMask] = Tail & *m_SqMask;
+    m_SqLocalTail = Tail + 1;
+    m_ToSubmit++;
+    return Sqe;
+  }
+
+  NPSSTATUS _PrepSend (Op * pOp)
+  {
+    struct io_uring_sqe *Sqe = _GetSqe ();
+
+    if (!Sqe)
+      return NPS_ERR;
+    Sqe->fd = pOp->Socket;
+    Sqe->user_data = (unsigned long) pOp;
+    switch (pOp->Type)
+    {
+    case OP_SENDTO:
+      pOp->Iov.iov_base = (void *) pOp->Data;
+      pOp->Iov.iov_len = pOp->Length;
+      Sqe->opcode = IORING_OP_SENDMSG;
+      Sqe->addr = (unsigned long) &pOp->Msg;
+      Sqe->len = 1;
+      break;
+    case OP_SEND_FIXED:
+      // A zero-copy send from the registered buffer.  A write would do
+      // the same but cannot take MSG_NOSIGNAL, and a reset peer would
+      // raise SIGPIPE.
+      Sqe->opcode = IORING_OP_SEND_ZC;
+      Sqe->addr = (unsigned long) (pOp->Data + pOp->Done);
+      Sqe->len = pOp->Length - pOp->Done;
+      Sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+      Sqe->buf_index = 0;
+      Sqe->msg_flags = MSG_NOSIGNAL;
+      break;
+    default:
+      Sqe->opcode = IORING_OP_SEND;
+      Sqe->addr = (unsigned long) (pOp->Data + pOp->Done);
+      Sqe->len = pOp->Length - pOp->Done;
+      Sqe->msg_flags = MSG_NOSIGNAL;
+      break;
+    }
+    return NPS_OK;
+  }
+
+  NPSSTATUS _ArmRecv (Op * pOp)
+  {
+    struct io_uring_sqe *Sqe = _GetSqe ();
+
+    if (!Sqe)
+      return NPS_ERR;
+    Sqe->opcode = IORING_OP_RECV;
+    Sqe->fd = pOp->Socket;
+    Sqe->ioprio = IORING_RECV_MULTISHOT;
+    Sqe->flags = IOSQE_BUFFER_SELECT;
+    Sqe->buf_group = NPS_URING_BUFFER_GROUP;
+    Sqe->user_data = (unsigned long) pOp;
+    return NPS_OK;
+  }
+
+  void _ProvideBuffer (unsigned short Bid)
+  {
+    // Not io_uring_buf_ring::bufs: as C++ lays out its empty-struct
+    // flexible array, that lands 8 bytes late.  The tail is right.
+    struct io_uring_buf *Buf = &m_BufRing[m_BufTail & (m_RecvCount - 1)];
+
+    Buf->addr = (unsigned long) (m_RecvData + (size_t) Bid * m_RecvSize);
+    Buf->len = m_RecvSize;
+    Buf->bid = Bid;
+    m_BufTail++;
+    __atomic_store_n (&((struct io_uring_buf_ring *) m_BufRing)->tail,
+                      m_BufTail, __ATOMIC_RELEASE);
+  }
+
+  // Calls back for every completion already posted.  No system calls.
+  int _Reap (void)
+  {
+    int Dispatched = 0;
+    unsigned Head = *m_CqHead;
+
+    while (Head != __atomic_load_n (m_CqTail, __ATOMIC_ACQUIRE))
+    {
+      struct io_uring_cqe Cqe = m_Cqes[Head & *m_CqMask];
+
+      // Release the slot first; callbacks may queue more work.
+      __atomic_store_n (m_CqHead, ++Head, __ATOMIC_RELEASE);
+      if (Cqe.user_data)
+        Dispatched += _Complete ((Op *) (unsigned long) Cqe.user_data,
+                                 Cqe.res, Cqe.flags);
+      Head = *m_CqHead;
+    }
+    return Dispatched;
+  }
+
+  // SEND_ZC posts its result and then, flagged MORE, a notification once
+  // the kernel is done with the buffer.  The sender hears of the result
+  // straight away; the buffer goes back on the last notification.
+  int _CompleteFixed (Op * pOp, int Result, unsigned int Flags)
+  {
+    if (Flags & IORING_CQE_F_NOTIF)
+    {
+      if (--pOp->Notifs == 0 && pOp->Finished)
+        _SendDone (pOp, 0, FALSE);
+      return 0;
+    }
+    if (Flags & IORING_CQE_F_MORE)
+      pOp->Notifs++;
+    if (Result > 0)
+    {
+      pOp->Done += Result;
+      if (pOp->Done < pOp->Length && _PrepSend (pOp) == NPS_OK)
+        return 0;
+      Result = (int) pOp->Done;
+    }
+    if (pOp->Callback)
+      pOp->Callback (pOp->Socket, Result, NULL, pOp->Context);
+    pOp->Finished = TRUE;
+    if (!pOp->Notifs)
+      _SendDone (pOp, 0, FALSE);
+    return 1;
+  }
+
+  int _Complete (Op * pOp, int Result, unsigned int Flags)
+  {
+    if (pOp->Type == OP_SEND_FIXED)
+      return _CompleteFixed (pOp, Result, Flags);
+    if (pOp->Type != OP_RECV)
+    {
+      // A short stream send goes back for the rest.
+      if (Result > 0 && pOp->Type != OP_SENDTO)
+      {
+        pOp->Done += Result;
+        if (pOp->Done < pOp->Length && _PrepSend (pOp) == NPS_OK)
+          return 0;
+        Result = (int) pOp->Done;
+      }
+      else if (Result > 0)
+        pOp->Done = Result;
+      _SendDone (pOp, Result);
+      return 1;
+    }
+
+    NPS_LOGICAL More = (Flags & IORING_CQE_F_MORE) != 0;
+    int Dispatched = 0;
+
+    if (Flags & IORING_CQE_F_BUFFER)
+    {
+      unsigned short Bid = (unsigned short) (Flags >> IORING_CQE_BUFFER_SHIFT);
+
+      if (Result > 0 && !pOp->Cancelled)
+      {
+        pOp->Callback (pOp->Socket, Result,
+                       m_RecvData + (size_t) Bid * m_RecvSize, pOp->Context);
+        Dispatched = 1;
+      }
+      _ProvideBuffer (Bid);
+    }
+    if (More)
+      return Dispatched;
+
+    // The receive has stopped, possibly on a completion that still
+    // carried data.  If it only ran out of buffers (they are back by
+    // now), or the kernel just chose to end it, go again.
+    if (!pOp->Cancelled && (Result == -ENOBUFS || Result > 0))
+    {
+      if (_ArmRecv (pOp) == NPS_OK)
+        return Dispatched;
+      if (Result > 0)
+        Result = -EBUSY;            // no room to re-arm; it is over
+    }
+
+    NPSUringCallback Callback = pOp->Callback;
+    void *Context = pOp->Context;
+    SOCKET Socket = pOp->Socket;
+    NPS_LOGICAL Cancelled = pOp->Cancelled;
+
+    _FreeOp (pOp);
+    if (Cancelled)
+      return Dispatched;
+    Callback (Socket, Result, NULL, Context);
+    return Dispatched + 1;
+  }
+#endif
+};
+
+#endif // __cplusplus
+
+#endif // _NPS_URING_H
@@ -0,0 +1,327 @@
+//  Name: NPS_Checksum.h
+//
+//  Purpose: message checksum engines for the NPS_Serialize header.
+//
+//  Notes:
+//  ------------------
+//  The header's checksum slot has always carried generateChecksum(), a
+//  function of the version and length only, so it catches no corruption
+//  of the body at all.  These engines hash the message body:
+//  \li CRC32C (Castagnoli), using the SSE4.2 crc32 instruction when the
+//      target has it (-msse4.2), else a table-driven loop.  Same values
+//      as iSCSI/ext4 CRC32C, so tools on the other end can check them.
+//  \li xxHash32 (seed 0), for targets without hardware CRC.
+//
+//  Both are incremental: a body that lives in several fragments (see
+//  NPS_GatherList.h) is hashed fragment by fragment, without first being
+//  copied into one buffer.
+//
+//  A sequence number set with setSequenceNumber() still takes the slot
+//  in place of any checksum; peers that use sequence numbers cannot also
+//  verify checksums.
+//
+
+#if !defined ( NPS_CHECKSUM_H_ )
+#define NPS_CHECKSUM_H_
+
+#include <string.h>
+#include <stddef.h>
+#include "NPS_Utils.h"
+
+#if !defined ( NPS_NO_SIMD ) && defined ( __SSE4_2__ )
+# include <nmmintrin.h>
+# define NPS_CRC32C_SSE42
+#endif
+
+
+//! the checksum carried in the header's checksum slot.
+enum NPS_ChecksumType {
+  NPS_CHECKSUM_LEGACY = 0,  //!< generateChecksum(); version and length only
+  NPS_CHECKSUM_CRC32C,      //!< CRC32C over the body
+  NPS_CHECKSUM_XXHASH32     //!< xxHash32 over the body
+};
+
+
+//! Incremental checksum over one or more byte ranges.
+/*!
+  \code
+  NPS_Checksum sum( NPS_CHECKSUM_CRC32C );
+  sum.update( first, first_len );
+  sum.update( second, second_len );
+  uint32 value = sum.value();
+  \endcode
+
+  NPS_CHECKSUM_LEGACY has no body hash; value() is always 0 for it.
+*/
+class NPS_Checksum {
+public:
+
+  //! constructor.
+  NPS_Checksum( NPS_ChecksumType type = NPS_CHECKSUM_CRC32C );
+
+  //! start over.
+  void                  reset();
+
+  //! fold \p len more bytes into the checksum.
+  void                  update( const void *data, size_t len );
+
+  //! the checksum of all bytes seen since construction or reset().
+  uint32                value() const;
+
+  //! the engine in use.
+  NPS_ChecksumType      type() const;
+
+  //! one-shot helper.
+  static uint32         compute( NPS_ChecksumType type,
+				 const void *data, size_t len );
+
+private:
+
+  //! software CRC32C, one byte at a time.
+  static unsigned int   crc32cByte( unsigned int crc, const unsigned char *p,
+				    size_t len );
+  static unsigned int   crc32c( unsigned int crc, const unsigned char *p,
+				size_t len );
+
+  static unsigned int   rotl( unsigned int v, int bits );
+  static unsigned int   read32( const unsigned char *p );
+  static unsigned int   xxRound( unsigned int acc, unsigned int input );
+  void                  xxUpdate( const unsigned char *p, size_t len );
+  unsigned int          xxDigest() const;
+
+  enum {
+    xxStripe_ = 16
+  };
+
+  NPS_ChecksumType      type_;
+  unsigned int          crc_;
+
+  // xxHash32 state.
+  unsigned int          acc_[4];
+  unsigned int          total_;
+  unsigned char         pending_[xxStripe_];
+  unsigned int          pendingLength_;
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////
+//
+//    I N L I N E   M E T H O D S
+//
+
+// xxHash32 primes.
+#define NPS_XXH_PRIME1  2654435761U
+#define NPS_XXH_PRIME2  2246822519U
+#define NPS_XXH_PRIME3  3266489917U
+#define NPS_XXH_PRIME4   668265263U
+#define NPS_XXH_PRIME5   374761393U
+
+
+inline
+NPS_Checksum::NPS_Checksum( NPS_ChecksumType type )
+  : type_(type)
+{
+  reset();
+}
+
+
+inline void
+NPS_Checksum::reset() {
+  crc_ = 0xFFFFFFFFU;
+  acc_[0] = NPS_XXH_PRIME1 + NPS_XXH_PRIME2;
+  acc_[1] = NPS_XXH_PRIME2;
+  acc_[2] = 0;
+  acc_[3] = 0U - NPS_XXH_PRIME1;
+  total_ = 0;
+  pendingLength_ = 0;
+}
+
+
+inline NPS_ChecksumType
+NPS_Checksum::type() const {
+  return type_;
+}
+
+
+inline void
+NPS_Checksum::update( const void *data, size_t len ) {
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  switch( type_ ) {
+  case NPS_CHECKSUM_CRC32C:
+    crc_ = crc32c( crc_, p, len );
+    break;
+  case NPS_CHECKSUM_XXHASH32:
+    xxUpdate( p, len );
+    break;
+  default:
+    break;
+  }
+}
+
+
+inline uint32
+NPS_Checksum::value() const {
+  switch( type_ ) {
+  case NPS_CHECKSUM_CRC32C:
+    return crc_ ^ 0xFFFFFFFFU;
+  case NPS_CHECKSUM_XXHASH32:
+    return xxDigest();
+  default:
+    return 0;
+  }
+}
+
+
+inline uint32
+NPS_Checksum::compute( NPS_ChecksumType type, const void *data, size_t len ) {
+  NPS_Checksum sum( type );
+  sum.update( data, len );
+  return sum.value();
+}
+
+
+//**************** CRC32C ******************//
+
+inline unsigned int
+NPS_Checksum::crc32cByte( unsigned int crc, const unsigned char *p, size_t len ) {
+  // reflected Castagnoli polynomial; the table is built on first use.
+  static struct Table {
+    unsigned int entry_[256];
+    Table() {
+      for( unsigned int i = 0; i < 256; ++i ) {
+	unsigned int c = i;
+	for( int k = 0; k < 8; ++k )
+	  c = ( c & 1 )? ( c >> 1 ) ^ 0x82F63B78U : ( c >> 1 );
+	entry_[i] = c;
+      }
+    }
+  } table;
+
+  while( len-- )
+    crc = table.entry_[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+
+inline unsigned int
+NPS_Checksum::crc32c( unsigned int crc, const unsigned char *p, size_t len ) {
+#if defined ( NPS_CRC32C_SSE42 )
+  // byte steps up to 8-byte alignment, then one crc32 instruction per word.
+  while( len && ( (size_t)p & 7 ) ) {
+    crc = _mm_crc32_u8( crc, *p++ );
+    --len;
+  }
+# if defined ( __x86_64__ ) || defined ( _M_X64 )
+  NPS_SWAP64 crc64 = crc;
+  for( ; len >= 8; len -= 8, p += 8 ) {
+    NPS_SWAP64 word;
+    memcpy( &word, p, sizeof(word) );
+    crc64 = _mm_crc32_u64( crc64, word );
+  }
+  crc = (unsigned int)crc64;
+# endif
+  for( ; len >= 4; len -= 4, p += 4 ) {
+    unsigned int word;
+    memcpy( &word, p, sizeof(word) );
+    crc = _mm_crc32_u32( crc, word );
+  }
+  while( len-- )
+    crc = _mm_crc32_u8( crc, *p++ );
+  return crc;
+#else
+  return crc32cByte( crc, p, len );
+#endif
+}
+
+
+//**************** xxHash32 ******************//
+
+inline unsigned int
+NPS_Checksum::rotl( unsigned int v, int bits ) {
+  return ( v << bits ) | ( v >> (32 - bits) );
+}
+
+
+inline unsigned int
+NPS_Checksum::read32( const unsigned char *p ) {
+  // xxHash is defined over little-endian words.
+  unsigned int v;
+  memcpy( &v, p, sizeof(v) );
+#if defined ( NPS_BIG_ENDIAN )
+  v = NPS_BSWAP32( v );
+#endif
+  return v;
+}
+
+
+inline unsigned int
+NPS_Checksum::xxRound( unsigned int acc, unsigned int input ) {
+  acc += input * NPS_XXH_PRIME2;
+  acc = rotl( acc, 13 );
+  return acc * NPS_XXH_PRIME1;
+}
+
+
+inline void
+NPS_Checksum::xxUpdate( const unsigned char *p, size_t len ) {
+  total_ += (unsigned int)len;
+
+  if( pendingLength_ + len < xxStripe_ ) {
+    memcpy( pending_ + pendingLength_, p, len );
+    pendingLength_ += (unsigned int)len;
+    return;
+  }
+
+  if( pendingLength_ ) {
+    size_t fill = xxStripe_ - pendingLength_;
+    memcpy( pending_ + pendingLength_, p, fill );
+    p += fill;
+    len -= fill;
+    for( int i = 0; i < 4; ++i )
+      acc_[i] = xxRound( acc_[i], read32( pending_ + 4 * i ) );
+    pendingLength_ = 0;
+  }
+
+  unsigned int a0 = acc_[0], a1 = acc_[1], a2 = acc_[2], a3 = acc_[3];
+  for( ; len >= xxStripe_; len -= xxStripe_, p += xxStripe_ ) {
+    a0 = xxRound( a0, read32( p ) );
+    a1 = xxRound( a1, read32( p + 4 ) );
+    a2 = xxRound( a2, read32( p + 8 ) );
+    a3 = xxRound( a3, read32( p + 12 ) );
+  }
+  acc_[0] = a0; acc_[1] = a1; acc_[2] = a2; acc_[3] = a3;
+
+  if( len ) {
+    memcpy( pending_, p, len );
+    pendingLength_ = (unsigned int)len;
+  }
+}
+
+
+inline unsigned int
+NPS_Checksum::xxDigest() const {
+  unsigned int h;
+  if( total_ >= xxStripe_ )
+    h = rotl( acc_[0], 1 ) + rotl( acc_[1], 7 ) + rotl( acc_[2], 12 ) + rotl( acc_[3], 18 );
+  else
+    h = acc_[2] + NPS_XXH_PRIME5;  // acc_[2] is still the seed
+  h += total_;
+
+  const unsigned char *p = pending_;
+  unsigned int len = pendingLength_;
+  for( ; len >= 4; len -= 4, p += 4 )
+    h = rotl( h + read32( p ) * NPS_XXH_PRIME3, 17 ) * NPS_XXH_PRIME4;
+  while( len-- )
+    h = rotl( h + (*p++) * NPS_XXH_PRIME5, 11 ) * NPS_XXH_PRIME1;
+
+  h ^= h >> 15;
+  h *= NPS_XXH_PRIME2;
+  h ^= h >> 13;
+  h *= NPS_XXH_PRIME3;
+  h ^= h >> 16;
+  return h;
+}
+
+
+#endif // #if !defined ( NPS_CHECKSUM_H_ )
@@ -0,0 +1,475 @@
+//  Name: NPS_Decoder.h
+//
+//  Purpose: bounds-checked read cursor for deserialization.
+//
+//  Notes:
+//  ------------------
+//  The _deserialize() family trusts the buffer: it reads wherever the
+//  field layout says, so a truncated or hostile packet makes it read past
+//  the end of the receive buffer.  An NPS_Decoder carries the end of the
+//  readable range alongside the cursor.  A read that would cross it
+//  yields zero, parks the cursor at the end and sets a sticky failure
+//  flag; every later read then fails the same way.  The caller checks
+//  failed() once, after the whole message, instead of after every field.
+//
+//  The bounds test is folded into the read as a conditional select
+//  rather than a branch, so a well-formed message pays for a compare
+//  per field and nothing else.
+//
+//  For partial TCP reads, see NPS_Serialize::bytesNeeded() and
+//  NPS_Serialize::deserialize( NPS_Decoder & ): a message is decoded only
+//  once all of its bytes are present, and extend() lets the same decoder
+//  pick up bytes appended to its buffer by a later read.
+//
+
+#if !defined ( NPS_DECODER_H_ )
+#define NPS_DECODER_H_
+
+#include <string.h>
+#include "NPS_Utils.h"
+#include "NPS_Varint.h"
+
+
+//! outcome of a bounds-checked decode.
+enum NPS_DecodeStatus {
+  NPS_DECODE_OK = 0,    //!< the message decoded within its bounds
+  NPS_DECODE_SHORT,     //!< the message is not all here yet; nothing consumed
+  NPS_DECODE_BAD        //!< the message is malformed; drop it (or the peer)
+};
+
+
+//! A read cursor over [cursor(), end()) with a sticky failure flag.
+/*!
+  \code
+  NPS_Decoder dec( buff, buff + len );
+  uint32 id;
+  uint16 count;
+  char   name[32];
+  dec.get( id );
+  dec.get( count );
+  dec.getBlob( name, sizeof(name) );
+  if( dec.failed() )
+    return NPS_BAD_PARAM;     // one test for the whole message
+  \endcode
+
+  The get() overloads read exactly what the matching _deserialize()
+  overloads read: network order, sizeof(T) bytes, with bool, int8 and
+  uint8 as a single byte.
+*/
+class NPS_Decoder {
+public:
+
+  //! constructor.
+  NPS_Decoder( const unsigned char *begin = NULL, const unsigned char *end = NULL );
+
+  //! start over on a new range.
+  void                  reset( const unsigned char *begin, const unsigned char *end );
+
+  //! more bytes were appended to the buffer; \p end is the new end.
+  /*!
+    Does not clear a failure; rewind() to a mark taken before the failed
+    read to retry it.
+  */
+  void                  extend( const unsigned char *end );
+
+  //! the next byte to be read.
+  const unsigned char * cursor() const;
+
+  //! one past the last readable byte.
+  const unsigned char * end() const;
+
+  //! the number of bytes left.
+  uint32                remaining() const;
+
+  //! true if any read so far ran out of bytes.
+  bool                  failed() const;
+
+  //! force the failure flag, e.g. when a length field is inconsistent.
+  void                  fail();
+
+  //! fold in the failure flag of a nested() decoder.
+  void                  merge( const NPS_Decoder &nested );
+
+  /** @name checkpoints
+   *  for decoding a run of records across partial reads.
+   */
+  //@{
+  //! the current position, for a later rewind().
+  const unsigned char * mark() const;
+  //! return to \p mark and clear the failure flag.
+  void                  rewind( const unsigned char *mark );
+  //! move to \p pos, keeping the failure flag; fails if \p pos is past end().
+  void                  seek( const unsigned char *pos );
+  //@}
+
+  /** @name reads
+   */
+  //@{
+  void                  get( bool & );
+  void                  get( int8 & );
+  void                  get( uint8 & );
+  void                  get( int16 & );
+  void                  get( uint16 & );
+  void                  get( int & );
+  void                  get( unsigned int & );
+  void                  get( int32 & );
+  void                  get( uint32 & );
+#if !defined ( WIN32 )
+  void                  get( int64 & );
+  void                  get( uint64 & );
+#endif
+  void                  get( float32 & );
+  void                  get( double64 & );
+
+  //! \p len raw bytes; zero-filled on failure.
+  void                  getBytes( void *dest, uint32 len );
+
+  //! a uint16 length plus bytes, as written by _serialize( const char *, uint16 ).
+  /*!
+    At most \p size bytes are kept (\p size - 1 if \p terminate); the rest
+    are skipped.
+    \return the number of bytes kept.
+  */
+  uint16                getBlob( char *dest, uint16 size, bool terminate = true );
+
+  //! as getBlob(), but returns the bytes in place, or NULL on failure.
+  const char *          getBlobRef( uint16 &len );
+
+  //! \p count scalars with one bulk ntoh_n() pass; the inverse of _serializeArray().
+  template <class T>
+  void                  getArray( T *vals, uint16 count );
+
+  //! a LEB128 varint, as written by varint_encode(); at most NPS_VARINT_MAX_SIZE bytes.
+  void                  getVarint( NPS_VARINT &val );
+
+  //! \p len bytes in place, or NULL on failure.
+  const unsigned char * getRef( uint32 len );
+
+  //! a decoder confined to the next \p len bytes; the outer decoder moves past them.
+  NPS_Decoder           slice( uint32 len );
+
+  //! a uint16 length plus a nested body; returns a decoder confined to the body.
+  /*!
+    The outer decoder moves past the body.  merge() the nested decoder
+    back when done with it.
+  */
+  NPS_Decoder           nested();
+
+  //! step over \p len bytes.
+  void                  skip( uint32 len );
+  //@}
+
+private:
+
+  //! \p len bytes from the cursor, or from a zero pad if they are not all there.
+  const unsigned char * _take( uint32 len );
+
+  template <class T>
+  void                  _getScalar( T &val );
+
+  const unsigned char * cursor_;
+  const unsigned char * end_;
+  bool                  failed_;
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////
+//
+//    I N L I N E   M E T H O D S
+//
+
+inline
+NPS_Decoder::NPS_Decoder( const unsigned char *begin, const unsigned char *end )
+  : cursor_(begin),
+    end_( (begin)? end : begin ),
+    failed_(false)
+{}
+
+
+inline void
+NPS_Decoder::reset( const unsigned char *begin, const unsigned char *end ) {
+  cursor_ = begin;
+  end_ = ( begin )? end : begin;
+  failed_ = false;
+}
+
+
+inline void
+NPS_Decoder::extend( const unsigned char *end ) {
+  if( end > end_ )
+    end_ = end;
+}
+
+
+inline const unsigned char *
+NPS_Decoder::cursor() const {
+  return cursor_;
+}
+
+
+inline const unsigned char *
+NPS_Decoder::end() const {
+  return end_;
+}
+
+
+inline uint32
+NPS_Decoder::remaining() const {
+  return (uint32)(end_ - cursor_);
+}
+
+
+inline bool
+NPS_Decoder::failed() const {
+  return failed_;
+}
+
+
+inline void
+NPS_Decoder::fail() {
+  failed_ = true;
+  cursor_ = end_;
+}
+
+
+inline void
+NPS_Decoder::merge( const NPS_Decoder &nested ) {
+  failed_ |= nested.failed_;
+}
+
+
+inline const unsigned char *
+NPS_Decoder::mark() const {
+  return cursor_;
+}
+
+
+inline void
+NPS_Decoder::rewind( const unsigned char *mark ) {
+  cursor_ = mark;
+  failed_ = false;
+}
+
+
+inline void
+NPS_Decoder::seek( const unsigned char *pos ) {
+  if( pos > end_ )
+    fail();
+  else
+    cursor_ = pos;
+}
+
+
+inline const unsigned char *
+NPS_Decoder::_take( uint32 len ) {
+  // covers the widest scalar; only ever read, never written.
+  static const unsigned char zeros[8] = { 0 };
+
+  bool fits = len <= remaining();
+  const unsigned char *src = ( fits )? cursor_ : zeros;
+  cursor_ = ( fits )? cursor_ + len : end_;
+  failed_ |= !fits;
+  return src;
+}
+
+
+template <class T>
+inline void
+NPS_Decoder::_getScalar( T &val ) {
+  memcpy( &val, _take( sizeof(T) ), sizeof(T) );
+  val = ntoh(val);
+}
+
+
+// single bytes are never swapped; see _deserialize( bool & ).
+inline void
+NPS_Decoder::get( bool &val ) {
+  val = (bool)(*_take( 1 ));
+}
+
+inline void
+NPS_Decoder::get( int8 &val ) {
+  val = (int8)(*_take( 1 ));
+}
+
+inline void
+NPS_Decoder::get( uint8 &val ) {
+  val = *_take( 1 );
+}
+
+inline void
+NPS_Decoder::get( int16 &val ) {
+  _getScalar( val );
+}
+
+inline void
+NPS_Decoder::get( uint16 &val ) {
+  _getScalar( val );
+}
+
+// int travels as an unsigned int of the same width, as in _deserialize( int & ).
+inline void
+NPS_Decoder::get( int &val ) {
+  unsigned int tmp;
+  _getScalar( tmp );
+  val = (int)tmp;
+}
+
+inline void
+NPS_Decoder::get( unsigned int &val ) {
+  _getScalar( val );
+}
+
+inline void
+NPS_Decoder::get( int32 &val ) {
+  _getScalar( val );
+}
+
+inline void
+NPS_Decoder::get( uint32 &val ) {
+  _getScalar( val );
+}
+
+#if !defined ( WIN32 )
+inline void
+NPS_Decoder::get( int64 &val ) {
+  _getScalar( val );
+}
+
+inline void
+NPS_Decoder::get( uint64 &val ) {
+  _getScalar( val );
+}
+#endif
+
+inline void
+NPS_Decoder::get( float32 &val ) {
+  _getScalar( val );
+}
+
+inline void
+NPS_Decoder::get( double64 &val ) {
+  _getScalar( val );
+}
+
+
+inline void
+NPS_Decoder::getBytes( void *dest, uint32 len ) {
+  uint32 take = ( len <= remaining() )? len : 0;
+  memcpy( dest, cursor_, take );
+  if( take != len ) {
+    memset( static_cast<unsigned char *>(dest) + take, 0, len - take );
+    fail();
+  }
+  cursor_ += take;
+}
+
+
+inline uint16
+NPS_Decoder::getBlob( char *dest, uint16 size, bool terminate ) {
+  uint16 len = 0;
+  get( len );
+  const char *src = reinterpret_cast<const char *>(cursor_);
+  uint32 take = ( len <= remaining() )? len : 0;
+  uint32 room = ( terminate && size )? size - 1 : size;
+  uint16 keep = (uint16)(( take < room )? take : room);
+
+  memcpy( dest, src, keep );
+  if( terminate && size )
+    dest[keep] = '\0';
+  if( take != len )
+    fail();
+  cursor_ += take;
+  return keep;
+}
+
+
+inline const char *
+NPS_Decoder::getBlobRef( uint16 &len ) {
+  get( len );
+  if( len > remaining() ) {
+    fail();
+    len = 0;
+    return NULL;
+  }
+  const char *ref = reinterpret_cast<const char *>(cursor_);
+  cursor_ += len;
+  return ref;
+}
+
+
+template <class T>
+inline void
+NPS_Decoder::getArray( T *vals, uint16 count ) {
+  uint32 bytes = count * sizeof(T);
+  if( bytes > remaining() ) {
+    memset( vals, 0, bytes );
+    fail();
+    return;
+  }
+  ntoh_n( vals, reinterpret_cast<const T *>(cursor_), count );
+  cursor_ += bytes;
+}
+
+
+inline void
+NPS_Decoder::getVarint( NPS_VARINT &val ) {
+  // one byte covers most lengths, counts and opcodes-in-family.
+  if( cursor_ < end_ && !( *cursor_ & 0x80 ) ) {
+    val = *cursor_++;
+    return;
+  }
+  val = 0;
+  for( int shift = 0; shift < 64 && cursor_ < end_; shift += 7 ) {
+    unsigned char b = *cursor_++;
+    val |= (NPS_VARINT)(b & 0x7F) << shift;
+    if( !( b & 0x80 ) )
+      return;
+  }
+  // ran off the end, or more than NPS_VARINT_MAX_SIZE bytes.
+  val = 0;
+  fail();
+}
+
+
+inline const unsigned char *
+NPS_Decoder::getRef( uint32 len ) {
+  if( len > remaining() ) {
+    fail();
+    return NULL;
+  }
+  const unsigned char *ref = cursor_;
+  cursor_ += len;
+  return ref;
+}
+
+
+inline NPS_Decoder
+NPS_Decoder::slice( uint32 len ) {
+  const unsigned char *body = getRef( len );
+  NPS_Decoder inner( body, body + len );
+  if( !body )
+    inner.fail();
+  return inner;
+}
+
+
+inline NPS_Decoder
+NPS_Decoder::nested() {
+  uint16 len = 0;
+  const unsigned char *body = reinterpret_cast<const unsigned char *>(getBlobRef( len ));
+  NPS_Decoder inner( body, body + len );
+  if( !body )
+    inner.fail();
+  return inner;
+}
+
+
+inline void
+NPS_Decoder::skip( uint32 len ) {
+  _take( len );
+}
+
+
+#endif // #if !defined ( NPS_DECODER_H_ )
@@ -0,0 +1,233 @@
+//  Name: NPS_FrameBuffer.h
+//
+//  Purpose: per-connection receive buffer that splits a TCP stream into messages.
+//
+//  Notes:
+//  ------------------
+//  A message starts with its opcode and length (NPS_HEADER_LENGTH), so
+//  NPSComm::PeekOnSocket() peeks PEEKMSGSIZE bytes to learn the length,
+//  and ReceiveFromSocket() then reads the message: two system calls per
+//  message, into a SockBuffer malloc'ed per socket.
+//
+//  An NPS_FrameBuffer instead takes whatever the socket has in one large
+//  recv() and hands back every complete message (frame) in it, in place.
+//  A frame split across reads stays put until the rest arrives.  Frames
+//  are never copied, except that a partial frame left near the end of
+//  the buffer is moved back to the front before the next read.  That is
+//  at most one frame per capacity's worth of traffic, and it guarantees
+//  every frame is contiguous, up to the largest a uint16 length allows.
+//
+//  Both header formats are recognised (see NPS_Serialize::bytesNeeded()).
+//
+//  Not thread safe; one per connection.
+//
+
+#if !defined ( NPS_FRAME_BUFFER_H_ )
+#define NPS_FRAME_BUFFER_H_
+
+#include <string.h>
+#include "NPS_MessageView.h"
+
+#if defined ( WIN32 )
+# include <winsock.h>
+#else
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <errno.h>
+#endif
+
+
+//! Reassembles the messages of one connection's byte stream.
+/*!
+  \code
+  NPS_FrameBuffer frames;           // one per connection
+
+  // when the socket is readable:
+  if( frames.fill( sock ) <= 0 )
+    ...                             // closed, or an error (errno)
+
+  NPS_HeaderView frame;
+  NPS_DecodeStatus status;
+  while( ( status = frames.next( frame ) ) == NPS_DECODE_OK )
+    registry.dispatch( frame.buffer(), frame.length(), connection );
+  if( status == NPS_DECODE_BAD )
+    ...                             // garbage on the wire; drop the connection
+  \endcode
+
+  Frames from next() point into the buffer and stay valid until the
+  next writePtr() or fill(), so dispatch them all before reading again.
+  Reading through some other call (NPSComm::ReceiveFromSocket(),
+  NPSUring, ...) is writePtr() / writable(), the read, then commit().
+*/
+class NPS_FrameBuffer {
+public:
+
+#if defined ( WIN32 )
+  typedef SOCKET        Socket;
+#else
+  typedef int           Socket;
+#endif
+
+  enum {
+    maxFrame_        = 0xFFFF,          //!< the longest frame (uint16 length)
+    minCapacity_     = 2 * maxFrame_,   //!< room for a partial frame plus a maximal read
+    defaultCapacity_ = 4 * maxFrame_
+  };
+
+  //! constructor.
+  /*!
+    \param capacity bytes to buffer; raised to minCapacity_ if lower.
+  */
+  NPS_FrameBuffer( uint32 capacity = defaultCapacity_ );
+
+  //! destructor.
+  ~NPS_FrameBuffer();
+
+  //! one recv() of as much as there is room for.
+  /*!
+    Returns the bytes read, 0 if the peer closed, or -1 with errno set
+    (EWOULDBLOCK if an async socket had nothing).
+  */
+  long                  fill( Socket sock );
+
+  //! where the next read should go; may move a partial frame, invalidating earlier frames.
+  unsigned char *       writePtr();
+
+  //! the bytes that may be read to writePtr().
+  uint32                writable() const;
+
+  //! record \p len bytes read to writePtr().
+  void                  commit( uint32 len );
+
+  //! the next complete frame.
+  /*!
+    NPS_DECODE_SHORT if it has not all arrived (\p frame is untouched),
+    NPS_DECODE_BAD if the stream cannot be framed; the connection must
+    then be dropped, since no later byte can be trusted either.
+  */
+  NPS_DecodeStatus      next( NPS_HeaderView &frame );
+
+  //! bytes received but not yet returned as frames.
+  uint32                buffered() const;
+
+  //! bytes still to arrive to complete the next frame; 0 if one is complete.
+  uint32                bytesNeeded() const;
+
+  //! discard everything buffered.
+  void                  reset();
+
+private:
+
+  NPS_FrameBuffer( const NPS_FrameBuffer & );
+  NPS_FrameBuffer &     operator = ( const NPS_FrameBuffer & );
+
+  unsigned char *       buffer_;
+  uint32                capacity_;
+  uint32                read_;      //!< the first byte not yet returned
+  uint32                write_;     //!< one past the last byte received
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////
+//
+//    I N L I N E   M E T H O D S
+//
+
+inline
+NPS_FrameBuffer::NPS_FrameBuffer( uint32 capacity )
+  : buffer_(NULL),
+    capacity_( ( capacity < (uint32)minCapacity_ )? (uint32)minCapacity_ : capacity ),
+    read_(0),
+    write_(0)
+{
+  buffer_ = new unsigned char[capacity_];
+}
+
+
+inline
+NPS_FrameBuffer::~NPS_FrameBuffer() {
+  delete[] buffer_;
+}
+
+
+inline long
+NPS_FrameBuffer::fill( Socket sock ) {
+  unsigned char *p = writePtr();
+  long n;
+  do
+    n = recv( sock, (char *)p, writable(), 0 );
+#if defined ( WIN32 )
+  while( 0 );
+#else
+  while( n < 0 && errno == EINTR );
+#endif
+  if( n > 0 )
+    commit( (uint32)n );
+  return n;
+}
+
+
+inline unsigned char *
+NPS_FrameBuffer::writePtr() {
+  if( read_ == write_ )
+    read_ = write_ = 0;
+  else if( capacity_ - write_ < (uint32)maxFrame_ ) {
+    // the partial frame is < maxFrame_, so this leaves room for a whole one.
+    memmove( buffer_, buffer_ + read_, write_ - read_ );
+    write_ -= read_;
+    read_ = 0;
+  }
+  return buffer_ + write_;
+}
+
+
+inline uint32
+NPS_FrameBuffer::writable() const {
+  return capacity_ - write_;
+}
+
+
+inline void
+NPS_FrameBuffer::commit( uint32 len ) {
+  write_ += ( len < capacity_ - write_ )? len : capacity_ - write_;
+}
+
+
+inline NPS_DecodeStatus
+NPS_FrameBuffer::next( NPS_HeaderView &frame ) {
+  const unsigned char *p = buffer_ + read_;
+  uint32 available = write_ - read_;
+
+  if( !available || NPS_Serialize::bytesNeeded( p, available ) )
+    return NPS_DECODE_SHORT;
+
+  NPS_HeaderView view( p, available );
+  if( !view.valid() )
+    return NPS_DECODE_BAD;
+
+  read_ += view.length();
+  frame = NPS_HeaderView( p, view.length() );
+  return NPS_DECODE_OK;
+}
+
+
+inline uint32
+NPS_FrameBuffer::buffered() const {
+  return write_ - read_;
+}
+
+
+inline uint32
+NPS_FrameBuffer::bytesNeeded() const {
+  return NPS_Serialize::bytesNeeded( buffer_ + read_, write_ - read_ );
+}
+
+
+inline void
+NPS_FrameBuffer::reset() {
+  read_ = write_ = 0;
+}
+
+
+#endif // #if !defined ( NPS_FRAME_BUFFER_H_ )
@@ -0,0 +1,230 @@
+//  Name: NPS_GatherList.h
+//
+//  Purpose: scatter/gather (iovec) output for NPS_Serialize.
+//
+//  Notes:
+//  ------------------
+//  serialize( unsigned char *, uint16 & ) produces one contiguous buffer,
+//  so every blob a message carries (chat text, channel data, mail bodies,
+//  NPS_RawMessage payloads) is memcpy'd into it before being written to
+//  the socket.  serialize( NPS_GatherList &, uint16 & ) instead produces a
+//  short list of iovec fragments: the header and scalar fields are packed
+//  into a caller-supplied scratch buffer, and blobs of at least
+//  referenceThreshold_ bytes are referenced in place.  The list can be
+//  handed straight to NPSComm::SendToSocketV() (sendmsg).
+//
+//  Blobs are referenced if they are written with _serializeRef() or as
+//  NPS_BLOB_FIELDs, at any depth of NPS_NESTED_FIELDs or members written
+//  with _serializeRef( const NPS_Serialize * ).  Members written with
+//  plain _serialize( const NPS_Serialize * ) are copied whole.
+//
+//  The referenced blobs must stay alive and unmodified until the send
+//  completes.
+//
+
+#if !defined ( NPS_GATHER_LIST_H_ )
+#define NPS_GATHER_LIST_H_
+
+#include <string.h>
+#include "NPS_Utils.h"
+
+#if defined ( WIN32 )
+// Winsock has no iovec; this mirrors the POSIX layout (see NPSComm.h).
+# if !defined ( _NPS_COMM_H )
+struct iovec {
+  void *                iov_base;
+  size_t                iov_len;
+};
+# endif
+#else
+#include <sys/uio.h>
+#endif
+
+
+//! The fragment list produced by a gathering serialization.
+/*!
+  Example usage:
+  \code
+  // the scratch must hold serializeSizeOf() bytes so that blobs can still
+  // be copied when the fragment slots run out; one MAX_MSG_LEN buffer per
+  // connection always suffices and is reused for every message.
+  NPS_GatherList gather( connScratch, sizeof(connScratch) );
+
+  uint16 len = 0;
+  if( message.serialize( gather, len ) )
+    comm.SendToSocketV( &sock, gather.fragments(), gather.count() );
+  \endcode
+*/
+class NPS_GatherList {
+public:
+
+  enum {
+    maxFragments_       = 16,  //!< iovec slots; further blobs are copied
+    referenceThreshold_ = 64   //!< smaller blobs are cheaper to copy
+  };
+
+  //! constructor.
+  /*!
+    \param scratch buffer for the header and copied fields. It must hold at
+    least serializeSizeOf() bytes of the message being serialized.
+    \param capacity the size of \p scratch.
+  */
+  NPS_GatherList( unsigned char *scratch = NULL, uint32 capacity = 0 );
+
+  //! replace the scratch buffer.
+  void                  setScratch( unsigned char *scratch, uint32 capacity );
+
+  //! forget all fragments.
+  void                  clear();
+
+  //! the fragment list, in wire order.
+  const struct iovec *  fragments() const;
+
+  //! number of fragments in fragments().
+  int                   count() const;
+
+  //! total bytes across all fragments.
+  uint32                length() const;
+
+  //! the scratch buffer.
+  unsigned char *       scratch() const;
+
+  //! the size of the scratch buffer.
+  uint32                scratchCapacity() const;
+
+  /** @name Encoder interface
+   *  used by NPS_Serialize while serializing.
+   */
+  //@{
+  //! start a new message; the copied run begins at scratch().
+  unsigned char *       begin();
+
+  //! close the copied run at \p cursor and reference \p len bytes at \p data.
+  /*!
+    Returns the cursor at which the next copied run continues, or NULL if
+    there are no free fragment slots (the caller should copy instead).
+  */
+  unsigned char *       reference( unsigned char *cursor,
+				   const void *data, uint32 len );
+
+  //! close the final copied run at \p cursor.
+  void                  finish( unsigned char *cursor );
+  //@}
+
+private:
+
+  //! appends [start, end) as a fragment if non-empty.
+  void                  closeRun( unsigned char *end );
+
+  struct iovec          iov_[maxFragments_];
+  int                   count_;
+  uint32                length_;
+  unsigned char *       scratch_;
+  uint32                capacity_;
+  unsigned char *       runStart_;
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////
+//
+//    I N L I N E   M E T H O D S
+//
+
+inline
+NPS_GatherList::NPS_GatherList( unsigned char *scratch, uint32 capacity )
+  : count_(0),
+    length_(0),
+    scratch_(scratch),
+    capacity_(capacity),
+    runStart_(scratch)
+{}
+
+
+inline void
+NPS_GatherList::setScratch( unsigned char *scratch, uint32 capacity ) {
+  scratch_ = scratch;
+  capacity_ = capacity;
+  clear();
+}
+
+
+inline void
+NPS_GatherList::clear() {
+  count_ = 0;
+  length_ = 0;
+  runStart_ = scratch_;
+}
+
+
+inline const struct iovec *
+NPS_GatherList::fragments() const {
+  return iov_;
+}
+
+
+inline int
+NPS_GatherList::count() const {
+  return count_;
+}
+
+
+inline uint32
+NPS_GatherList::length() const {
+  return length_;
+}
+
+
+inline unsigned char *
+NPS_GatherList::scratch() const {
+  return scratch_;
+}
+
+
+inline uint32
+NPS_GatherList::scratchCapacity() const {
+  return capacity_;
+}
+
+
+inline unsigned char *
+NPS_GatherList::begin() {
+  clear();
+  return scratch_;
+}
+
+
+inline void
+NPS_GatherList::closeRun( unsigned char *end ) {
+  if( end > runStart_ ) {
+    iov_[count_].iov_base = runStart_;
+    iov_[count_].iov_len  = end - runStart_;
+    length_ += end - runStart_;
+    ++count_;
+  }
+  runStart_ = end;
+}
+
+
+inline unsigned char *
+NPS_GatherList::reference( unsigned char *cursor, const void *data, uint32 len ) {
+  // room for the run being closed, this reference and the run after it.
+  if( count_ + 3 > maxFragments_ )
+    return NULL;
+
+  closeRun( cursor );
+  iov_[count_].iov_base = const_cast<void *>(data);
+  iov_[count_].iov_len  = len;
+  length_ += len;
+  ++count_;
+  return cursor;
+}
+
+
+inline void
+NPS_GatherList::finish( unsigned char *cursor ) {
+  closeRun( cursor );
+}
+
+
+#endif // #if !defined ( NPS_GATHER_LIST_H_ )
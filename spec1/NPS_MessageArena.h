@@ -0,0 +1,247 @@
+//  Name: NPS_MessageArena.h
+//
+//  Purpose: slab allocator for serialized message buffers.
+//
+//  Notes:
+//  ------------------
+//  NPS_Serialize::serialize( uint16 & ) allocates a fresh buffer with
+//  new[] for every message, which at lobby fan-out rates means one
+//  malloc/free per message per recipient.  An NPS_MessageArena hands
+//  out buffers from a small set of power-of-two size classes carved
+//  from large slabs, and recycles released buffers on per-class free
+//  lists, so once the arena is warm no further heap traffic occurs.
+//
+//  An arena is NOT thread safe.  Create one per connection or one per
+//  thread, and release buffers on the same thread that allocated them.
+//
+
+#if !defined ( NPS_MESSAGE_ARENA_H_ )
+#define NPS_MESSAGE_ARENA_H_
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "NPS_Utils.h"
+
+//! Per-connection/per-thread pool of serialization buffers.
+/*!
+  Example usage:
+  \code
+  NPS_MessageArena arena;       // one per connection or thread
+
+  uint16 len = 0;
+  const unsigned char *buffer = instance.serialize( arena, len );
+  write( sock, buffer, len );
+  arena.release( buffer );      // back on the free list, no delete[]
+  \endcode
+
+  Every block carries a small hidden prefix recording its size class, so
+  release() needs only the pointer.  The prefix is marked free while the
+  block is on a free list; releasing a block twice, or a pointer the
+  arena did not hand out, asserts and is otherwise ignored.
+*/
+class NPS_MessageArena {
+public:
+
+  enum {
+    defaultSlabSize_ = 64 * 1024,  //!< bytes requested from the heap per slab
+    minShift_        = 6,          //!< smallest block is 64 bytes
+    maxShift_        = 17,         //!< largest block holds MAX_MSG_LEN + prefix
+    numClasses_      = maxShift_ - minShift_ + 1,
+    prefixSize_      = 8           //!< a Prefix; keeps the payload 8-byte aligned
+  };
+
+  //! constructor.
+  /*!
+    \param slab_size number of bytes to reserve from the heap at a time.
+  */
+  NPS_MessageArena( uint32 slab_size = defaultSlabSize_ );
+
+  //! destructor. Returns all slabs to the heap.
+  /*!
+    Outstanding buffers become invalid; release them first.
+  */
+  ~NPS_MessageArena();
+
+  //! returns a buffer of at least \p len bytes.
+  unsigned char *       allocate( uint16 len );
+
+  //! returns a buffer obtained from allocate() to its free list.
+  void                  release( const unsigned char *buffer );
+
+  //! number of bytes obtained from the heap.
+  uint32                bytesReserved() const;
+
+  //! number of buffers currently handed out.
+  uint32                blocksOutstanding() const;
+
+private:
+
+  // not copyable; buffers hold no back-pointer to the arena.
+  NPS_MessageArena( const NPS_MessageArena & );
+  NPS_MessageArena &    operator = ( const NPS_MessageArena & );
+
+  //! intrusive free list link, stored in the payload of a free block.
+  struct FreeBlock {
+    FreeBlock *         next_;
+  };
+
+  //! slab bookkeeping, stored at the front of each slab.
+  struct Slab {
+    Slab *              next_;
+    uint32              size_;
+    uint32              pad_;
+  };
+
+  //! the hidden prefix in front of every block.
+  struct Prefix {
+    unsigned int        magic_;
+    uint16              class_;
+    uint16              pad_;
+  };
+
+  //! values of Prefix::magic_, so stray and repeated releases can be caught.
+  enum {
+    magic_     = 0x4e50414c,   //!< handed out
+    freeMagic_ = 0x4e504652    //!< on a free list
+  };
+
+  //! maps a request length (including prefix) to a size class.
+  static uint16         sizeClass( uint32 bytes );
+
+  //! carve \p bytes from the current slab, growing if necessary.
+  unsigned char *       carve( uint32 bytes );
+
+  FreeBlock *           freeList_[numClasses_];
+  Slab *                slabs_;
+  unsigned char *       cursor_;
+  unsigned char *       limit_;
+  uint32                slabSize_;
+  uint32                bytesReserved_;
+  uint32                blocksOutstanding_;
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////
+//
+//    I N L I N E   M E T H O D S
+//
+
+inline
+NPS_MessageArena::NPS_MessageArena( uint32 slab_size )
+  : slabs_(NULL),
+    cursor_(NULL),
+    limit_(NULL),
+    slabSize_(slab_size),
+    bytesReserved_(0),
+    blocksOutstanding_(0)
+{
+  memset( freeList_, 0, sizeof(freeList_) );
+}
+
+
+inline
+NPS_MessageArena::~NPS_MessageArena() {
+  while( slabs_ ) {
+    Slab *next = slabs_->next_;
+    free( slabs_ );
+    slabs_ = next;
+  }
+}
+
+
+inline uint16
+NPS_MessageArena::sizeClass( uint32 bytes ) {
+  uint16 cls = 0;
+  uint32 size = 1 << minShift_;
+  while( size < bytes ) {
+    size <<= 1;
+    ++cls;
+  }
+  return cls;
+}
+
+
+inline unsigned char *
+NPS_MessageArena::carve( uint32 bytes ) {
+  if( cursor_ == NULL || (uint32)(limit_ - cursor_) < bytes ) {
+    // whatever is left in the old slab is abandoned; released blocks go
+    // to the free lists, so the waste is bounded by one block per slab.
+    uint32 want = sizeof(Slab) + ((bytes > slabSize_)? bytes : slabSize_);
+    Slab *slab = static_cast<Slab *>( malloc( want ) );
+    if( !slab )
+      return NULL;
+    slab->next_ = slabs_;
+    slab->size_ = want;
+    slabs_ = slab;
+    bytesReserved_ += want;
+    cursor_ = reinterpret_cast<unsigned char *>(slab + 1);
+    limit_  = reinterpret_cast<unsigned char *>(slab) + want;
+  }
+  unsigned char *ptr = cursor_;
+  cursor_ += bytes;
+  return ptr;
+}
+
+
+inline unsigned char *
+NPS_MessageArena::allocate( uint16 len ) {
+  uint16 cls = sizeClass( (uint32)len + prefixSize_ );
+  unsigned char *block = NULL;
+
+  if( freeList_[cls] ) {
+    block = reinterpret_cast<unsigned char *>(freeList_[cls]) - prefixSize_;
+    freeList_[cls] = freeList_[cls]->next_;
+  } else {
+    block = carve( 1 << (cls + minShift_) );
+    if( !block )
+      return NULL;
+  }
+
+  Prefix tag = { magic_, cls, 0 };
+  memcpy( block, &tag, sizeof(tag) );
+  ++blocksOutstanding_;
+  return block + prefixSize_;
+}
+
+
+inline void
+NPS_MessageArena::release( const unsigned char *buffer ) {
+  if( !buffer )
+    return;
+
+  unsigned char *payload = const_cast<unsigned char *>(buffer);
+  Prefix tag;
+  memcpy( &tag, payload - prefixSize_, sizeof(tag) );
+  if( tag.magic_ != magic_ || tag.class_ >= numClasses_ ) {
+    // refuse rather than corrupt a free list.
+    if( tag.magic_ == freeMagic_ )
+      assert( !"NPS_MessageArena: block released twice" );
+    else
+      assert( !"NPS_MessageArena: pointer not from an arena" );
+    return;
+  }
+
+  tag.magic_ = freeMagic_;
+  memcpy( payload - prefixSize_, &tag, sizeof(tag) );
+  FreeBlock *fb = reinterpret_cast<FreeBlock *>(payload);
+  fb->next_ = freeList_[tag.class_];
+  freeList_[tag.class_] = fb;
+  --blocksOutstanding_;
+}
+
+
+inline uint32
+NPS_MessageArena::bytesReserved() const {
+  return bytesReserved_;
+}
+
+
+inline uint32
+NPS_MessageArena::blocksOutstanding() const {
+  return blocksOutstanding_;
+}
+
+
+#endif // #if !defined ( NPS_MESSAGE_ARENA_H_ )
@@ -0,0 +1,695 @@
+//  Name: NPS_MessageView.h
+//
+//  Purpose: read-only views over received, still-serialized messages.
+//
+//  Notes:
+//  ------------------
+//  deserialize() copies every field into the object and allocates for
+//  blobs, which is wasted work when a message is only being routed or
+//  rebroadcast.  A view instead keeps a pointer into the receive buffer
+//  and decodes a field only when it is asked for, byte-swapping on read.
+//  Blobs come back as an NPS_BlobRef pointing into the buffer, so nothing
+//  is copied unless the caller copies it.
+//
+//  NPS_HeaderView reads just the header (id, length, version, checksum);
+//  NPS_MessageView<myClass> adds field access for classes that declare
+//  an NPS_Schema (see NPS_SerializeSchema.h) and derive directly from
+//  NPS_SchemaSerialize<myClass>.
+//
+//  A view never owns its buffer; the buffer must outlive it.  Accessors
+//  check each field against the buffer bounds and return a zero value
+//  (or an empty reference) for a field that does not fit, so a truncated
+//  or hostile message can never be read past its end.  Use valid() to
+//  reject such messages up front.
+//
+//  NPS_HeaderView reads both the v1 and the compact (v2) header.  Field
+//  access follows the v1 layout only; NPS_MessageView::valid() is false
+//  for a compact message, which must be decoded with deserialize().
+//
+
+#if !defined ( NPS_MESSAGE_VIEW_H_ )
+#define NPS_MESSAGE_VIEW_H_
+
+#include <string.h>
+#include "NPS_Serialize.h"
+#include "NPS_SerializeSchema.h"
+
+
+//! A blob field (uint16 length plus bytes) referenced in place.
+class NPS_BlobRef {
+public:
+
+  //! constructor.
+  NPS_BlobRef( const char *data = NULL, uint16 len = 0 );
+
+  //! the bytes, in the receive buffer. Not null terminated.
+  const char *          data() const;
+
+  //! the number of bytes.
+  uint16                length() const;
+
+  //! copies at most \p size - 1 bytes to \p buff and null terminates.
+  /*!
+    Same truncation rule as _deserialize( char *, uint16, true ).
+    \return the number of bytes copied, excluding the terminator.
+  */
+  uint16                copyTo( char *buff, uint16 size ) const;
+
+private:
+
+  const char *          data_;
+  uint16                length_;
+};
+
+
+//! A fixed scalar array referenced in place; elements are swapped on read.
+template <class T, int N>
+class NPS_ArrayRef {
+public:
+
+  //! constructor.
+  NPS_ArrayRef( const unsigned char *data = NULL );
+
+  //! element \p i in host order.
+  T                     operator [] ( int i ) const;
+
+  //! the number of elements, or 0 if the array did not fit the buffer.
+  int                   size() const;
+
+  //! converts the whole array to host order with one ntoh_n() pass.
+  void                  copyTo( T (&dst)[N] ) const;
+
+private:
+
+  const unsigned char * data_;
+};
+
+
+//! An id list (uint16 count plus scalars) referenced in place.
+template <class T>
+class NPS_IdListRef {
+public:
+
+  //! constructor.
+  NPS_IdListRef( const unsigned char *data = NULL, uint16 count = 0 );
+
+  //! id \p i in host order.
+  T                     operator [] ( int i ) const;
+
+  //! the number of ids.
+  uint16                size() const;
+
+  //! converts at most \p max ids to host order; returns the number converted.
+  uint16                copyTo( T *dst, uint16 max ) const;
+
+private:
+
+  const unsigned char * data_;
+  uint16                count_;
+};
+
+
+
+//! Per field-kind view policy: how to read and how to step over a field.
+/*!
+  Specialized for each field template in NPS_SerializeSchema.h.  \c Type
+  is what NPS_SchemaView::field() returns for that field.
+*/
+template <class Field>
+struct NPS_FieldView;
+
+template <class Schema>
+class NPS_SchemaView;
+
+
+template <class Owner, class M, M Owner::*Member, class Wire>
+struct NPS_FieldView< NPS_Field<Owner, M, Member, Wire> > {
+  typedef M Type;
+
+  static Type read( const unsigned char *p ) {
+    unsigned char *q = const_cast<unsigned char *>(p);
+    Wire val;
+    NPS_FieldCodec<Wire>::decode( q, val );
+    return (M)val;
+  }
+  static bool skip( const unsigned char *&p, const unsigned char *end ) {
+    if( end - p < (int)NPS_FieldCodec<Wire>::fixedSize_ )
+      return false;
+    p += NPS_FieldCodec<Wire>::fixedSize_;
+    return true;
+  }
+};
+
+
+template <class Owner, int N, char (Owner::*Data)[N], uint16 Owner::*Length>
+struct NPS_FieldView< NPS_BlobField<Owner, N, Data, Length> > {
+  typedef NPS_BlobRef Type;
+
+  static Type read( const unsigned char *p ) {
+    uint16 len;
+    unsigned char *q = const_cast<unsigned char *>(p);
+    NPS_ScalarCodec<uint16>::decode( q, len );
+    return NPS_BlobRef( reinterpret_cast<const char *>(q), len );
+  }
+  static bool skip( const unsigned char *&p, const unsigned char *end ) {
+    if( end - p < (int)sizeof(uint16) )
+      return false;
+    uint16 len;
+    unsigned char *q = const_cast<unsigned char *>(p);
+    NPS_ScalarCodec<uint16>::decode( q, len );
+    if( end - q < (int)len )
+      return false;
+    p = q + len;
+    return true;
+  }
+};
+
+
+template <class Owner, class T, int N, T (Owner::*Data)[N]>
+struct NPS_FieldView< NPS_ArrayField<Owner, T, N, Data> > {
+  typedef NPS_ArrayRef<T, N> Type;
+
+  static Type read( const unsigned char *p ) {
+    return Type( p );
+  }
+  static bool skip( const unsigned char *&p, const unsigned char *end ) {
+    if( end - p < (int)(N * sizeof(T)) )
+      return false;
+    p += N * sizeof(T);
+    return true;
+  }
+};
+
+
+template <class Owner, class T, int N, T (Owner::*Data)[N], uint16 Owner::*Count>
+struct NPS_FieldView< NPS_IdListField<Owner, T, N, Data, Count> > {
+  typedef NPS_IdListRef<T> Type;
+
+  static Type read( const unsigned char *p ) {
+    uint16 count;
+    unsigned char *q = const_cast<unsigned char *>(p);
+    NPS_ScalarCodec<uint16>::decode( q, count );
+    return Type( q, count );
+  }
+  static bool skip( const unsigned char *&p, const unsigned char *end ) {
+    if( end - p < (int)sizeof(uint16) )
+      return false;
+    uint16 count;
+    unsigned char *q = const_cast<unsigned char *>(p);
+    NPS_ScalarCodec<uint16>::decode( q, count );
+    if( end - q < (int)(count * sizeof(T)) )
+      return false;
+    p = q + count * sizeof(T);
+    return true;
+  }
+};
+
+
+template <class Owner, class M, M Owner::*Member>
+struct NPS_FieldView< NPS_NestedField<Owner, M, Member> > {
+  typedef NPS_SchemaView<typename M::Schema> Type;
+
+  static Type read( const unsigned char *p ) {
+    uint16 len;
+    unsigned char *q = const_cast<unsigned char *>(p);
+    NPS_ScalarCodec<uint16>::decode( q, len );
+    return Type( q, len );
+  }
+  // same shape on the wire as a blob.
+  static bool skip( const unsigned char *&p, const unsigned char *end ) {
+    if( end - p < (int)sizeof(uint16) )
+      return false;
+    uint16 len;
+    unsigned char *q = const_cast<unsigned char *>(p);
+    NPS_ScalarCodec<uint16>::decode( q, len );
+    if( end - q < (int)len )
+      return false;
+    p = q + len;
+    return true;
+  }
+};
+
+
+//! locates field \p I of a field list; a compile-time walk, no loop.
+template <int I, class... Fields>
+struct NPS_SchemaSeek;
+
+template <class First, class... Rest>
+struct NPS_SchemaSeek<0, First, Rest...> {
+  typedef First Field;
+
+  static const unsigned char * seek( const unsigned char *p, const unsigned char *end ) {
+    // the field itself must fit too.
+    const unsigned char *q = p;
+    return NPS_FieldView<First>::skip( q, end )? p : NULL;
+  }
+};
+
+template <int I, class First, class... Rest>
+struct NPS_SchemaSeek<I, First, Rest...> {
+  typedef typename NPS_SchemaSeek<I - 1, Rest...>::Field Field;
+
+  static const unsigned char * seek( const unsigned char *p, const unsigned char *end ) {
+    if( !NPS_FieldView<First>::skip( p, end ) )
+      return NULL;
+    return NPS_SchemaSeek<I - 1, Rest...>::seek( p, end );
+  }
+};
+
+
+
+//! Lazy, read-only access to a serialized schema body.
+/*!
+  field<I>() decodes the I'th field of the schema, counting from 0 in
+  declaration order.  Fields before I that have a fixed size are stepped
+  over by a constant; only blob and nested fields cost a length read.
+*/
+template <class... Fields>
+class NPS_SchemaView< NPS_Schema<Fields...> > {
+public:
+
+  //! the view type of field \p I.
+  template <int I>
+  struct FieldType {
+    typedef typename NPS_FieldView<
+      typename NPS_SchemaSeek<I, Fields...>::Field >::Type Type;
+  };
+
+  //! constructor.
+  /*!
+    \param body the first byte of the body (after any header).
+    \param len the number of body bytes available.
+  */
+  NPS_SchemaView( const unsigned char *body = NULL, uint16 len = 0 );
+
+  //! field \p I, or a zero value if it does not lie within the body.
+  template <int I>
+  typename FieldType<I>::Type field() const;
+
+  //! true if every field lies within the body.
+  bool                  valid() const;
+
+  //! the first body byte.
+  const unsigned char * body() const;
+
+  //! the number of body bytes.
+  uint16                bodyLength() const;
+
+private:
+
+  const unsigned char * body_;
+  uint16                bodyLength_;
+};
+
+
+
+//! Read-only access to the header of a received message.
+/*!
+  Enough to route a message without knowing its class:
+  \code
+  NPS_HeaderView hdr( buff, received );
+  if( hdr.valid() && hdr.messageId() == NPS_USER_STATUS )
+    forward( hdr.buffer(), hdr.length() );   // the bytes, unchanged
+  \endcode
+*/
+class NPS_HeaderView {
+public:
+
+  //! constructor.
+  /*!
+    \param buffer the first byte of the message header.
+    \param available the number of bytes received at \p buffer.
+  */
+  NPS_HeaderView( const unsigned char *buffer = NULL, uint32 available = 0 );
+
+  //! true if the whole header and the whole message are available.
+  bool                  valid() const;
+
+  //! true if the header is a compact (v2) one.
+  bool                  isCompact() const;
+
+  //! the message id (opcode), or 0 if no header.
+  uint16                messageId() const;
+
+  //! the message length, header included.
+  uint16                messageLength() const;
+
+  //! the message version.
+  uint16                messageVersion() const;
+
+  //! the checksum (or sequence number).
+  uint32                checksum() const;
+
+  //! the message bytes, header included, for forwarding as is.
+  const unsigned char * buffer() const;
+
+  //! the number of message bytes at buffer(); 0 if !valid().
+  uint16                length() const;
+
+  //! the first body byte.
+  const unsigned char * body() const;
+
+  //! the number of body bytes; 0 if !valid().
+  uint16                bodyLength() const;
+
+private:
+
+  const unsigned char * buffer_;
+  uint32                available_;
+
+  //! parsed up front when the header is compact.
+  NPS_Serialize::CompactHeader compact_;
+  NPS_DecodeStatus      compactStatus_;
+};
+
+
+
+//! Typed, lazy view of a received \p Message.
+/*!
+  \code
+  NPS_MessageView<NPS_SessionKey> view( buff, received );
+  if( view.valid() ) {
+    uint32 expires = view.field<1>();          // expiryDate_, swapped on read
+    NPS_BlobRef key = view.field<0>();          // points into buff
+  }
+  \endcode
+*/
+template <class Message>
+class NPS_MessageView : public NPS_HeaderView,
+                        public NPS_SchemaView<typename Message::Schema> {
+public:
+
+  typedef NPS_SchemaView<typename Message::Schema> SchemaView;
+
+  //! constructor. See NPS_HeaderView.
+  NPS_MessageView( const unsigned char *buffer = NULL, uint32 available = 0 );
+
+  //! view an already inspected header.
+  NPS_MessageView( const NPS_HeaderView &header );
+
+  //! true if the header, the message and every field are within bounds.
+  /*!
+    Always false for a compact message.
+  */
+  bool                  valid() const;
+
+  using NPS_HeaderView::body;
+  using NPS_HeaderView::bodyLength;
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////
+//
+//    I N L I N E   M E T H O D S
+//
+
+//**************** NPS_BlobRef ******************//
+
+inline
+NPS_BlobRef::NPS_BlobRef( const char *data, uint16 len )
+  : data_(data),
+    length_(len)
+{}
+
+
+inline const char *
+NPS_BlobRef::data() const {
+  return data_;
+}
+
+
+inline uint16
+NPS_BlobRef::length() const {
+  return length_;
+}
+
+
+inline uint16
+NPS_BlobRef::copyTo( char *buff, uint16 size ) const {
+  if( !buff || !size )
+    return 0;
+  uint16 keep = ( length_ < size - 1 )? length_ : size - 1;
+  if( keep )
+    memcpy( buff, data_, keep );
+  buff[keep] = '\0';
+  return keep;
+}
+
+
+//**************** NPS_ArrayRef ******************//
+
+template <class T, int N>
+inline
+NPS_ArrayRef<T, N>::NPS_ArrayRef( const unsigned char *data )
+  : data_(data)
+{}
+
+
+template <class T, int N>
+inline T
+NPS_ArrayRef<T, N>::operator [] ( int i ) const {
+  // the same conversion as copyTo(), one element wide.
+  T val;
+  ntoh_n( &val, reinterpret_cast<const T *>(data_ + i * sizeof(T)), 1 );
+  return val;
+}
+
+
+template <class T, int N>
+inline int
+NPS_ArrayRef<T, N>::size() const {
+  return ( data_ )? N : 0;
+}
+
+
+template <class T, int N>
+inline void
+NPS_ArrayRef<T, N>::copyTo( T (&dst)[N] ) const {
+  if( data_ )
+    ntoh_n( dst, reinterpret_cast<const T *>(data_), N );
+  else
+    memset( dst, 0, sizeof(dst) );
+}
+
+
+//**************** NPS_IdListRef ******************//
+
+template <class T>
+inline
+NPS_IdListRef<T>::NPS_IdListRef( const unsigned char *data, uint16 count )
+  : data_(data),
+    count_( (data)? count : 0 )
+{}
+
+
+template <class T>
+inline T
+NPS_IdListRef<T>::operator [] ( int i ) const {
+  T val = 0;
+  if( i >= 0 && i < count_ )
+    ntoh_n( &val, reinterpret_cast<const T *>(data_ + i * sizeof(T)), 1 );
+  return val;
+}
+
+
+template <class T>
+inline uint16
+NPS_IdListRef<T>::size() const {
+  return count_;
+}
+
+
+template <class T>
+inline uint16
+NPS_IdListRef<T>::copyTo( T *dst, uint16 max ) const {
+  uint16 n = ( count_ < max )? count_ : max;
+  ntoh_n( dst, reinterpret_cast<const T *>(data_), n );
+  return n;
+}
+
+
+//**************** NPS_SchemaView ******************//
+
+template <class... Fields>
+inline
+NPS_SchemaView< NPS_Schema<Fields...> >::NPS_SchemaView( const unsigned char *body,
+							 uint16 len )
+  : body_(body),
+    bodyLength_( (body)? len : 0 )
+{}
+
+
+template <class... Fields>
+template <int I>
+inline typename NPS_SchemaView< NPS_Schema<Fields...> >::template FieldType<I>::Type
+NPS_SchemaView< NPS_Schema<Fields...> >::field() const {
+  typedef typename NPS_SchemaSeek<I, Fields...>::Field Field;
+
+  const unsigned char *p = NULL;
+  if( body_ )
+    p = NPS_SchemaSeek<I, Fields...>::seek( body_, body_ + bodyLength_ );
+  if( !p )
+    return typename FieldType<I>::Type();
+  return NPS_FieldView<Field>::read( p );
+}
+
+
+template <class... Fields>
+inline bool
+NPS_SchemaView< NPS_Schema<Fields...> >::valid() const {
+  if( !body_ )
+    return false;
+  const unsigned char *p = body_;
+  const unsigned char *end = body_ + bodyLength_;
+  bool ok = true;
+  int expand[] = { 0, (ok = ok && NPS_FieldView<Fields>::skip( p, end ), 0)... };
+  (void)expand;
+  return ok;
+}
+
+
+template <class... Fields>
+inline const unsigned char *
+NPS_SchemaView< NPS_Schema<Fields...> >::body() const {
+  return body_;
+}
+
+
+template <class... Fields>
+inline uint16
+NPS_SchemaView< NPS_Schema<Fields...> >::bodyLength() const {
+  return bodyLength_;
+}
+
+
+//**************** NPS_HeaderView ******************//
+
+inline
+NPS_HeaderView::NPS_HeaderView( const unsigned char *buffer, uint32 available )
+  : buffer_(buffer),
+    available_( (buffer)? available : 0 ),
+    compactStatus_(NPS_DECODE_BAD)
+{
+  if( available_ && NPS_Serialize::CompactHeader::isCompact( buffer_ ) )
+    compactStatus_ = compact_.parse( buffer_, available_ );
+}
+
+
+inline bool
+NPS_HeaderView::isCompact() const {
+  return available_ && NPS_Serialize::CompactHeader::isCompact( buffer_ );
+}
+
+
+inline bool
+NPS_HeaderView::valid() const {
+  if( isCompact() )
+    return compactStatus_ == NPS_DECODE_OK && compact_.length() <= available_;
+  if( available_ < (uint32)NPS_Serialize::Header::size_ )
+    return false;
+  uint16 len = messageLength();
+  return len >= NPS_Serialize::Header::size_ && len <= available_;
+}
+
+
+// A Header constructed over a const buffer never owns it, so these are
+// just the Header accessors applied in place.
+
+inline uint16
+NPS_HeaderView::messageId() const {
+  if( isCompact() )
+    return compact_.id_;
+  if( available_ < (uint32)NPS_Serialize::Header::size_ )
+    return 0;
+  return NPS_Serialize::Header( buffer_ ).id();
+}
+
+
+inline uint16
+NPS_HeaderView::messageLength() const {
+  if( isCompact() )
+    return (uint16)compact_.length();
+  if( available_ < (uint32)NPS_Serialize::Header::size_ )
+    return 0;
+  return NPS_Serialize::Header( buffer_ ).length();
+}
+
+
+inline uint16
+NPS_HeaderView::messageVersion() const {
+  if( isCompact() )
+    return compact_.version_;
+  if( available_ < (uint32)NPS_Serialize::Header::size_ )
+    return 0;
+  return NPS_Serialize::Header( buffer_ ).version();
+}
+
+
+inline uint32
+NPS_HeaderView::checksum() const {
+  if( isCompact() )
+    return compact_.checksum_;
+  if( available_ < (uint32)NPS_Serialize::Header::size_ )
+    return 0;
+  return NPS_Serialize::Header( buffer_ ).checksum();
+}
+
+
+inline const unsigned char *
+NPS_HeaderView::buffer() const {
+  return buffer_;
+}
+
+
+inline uint16
+NPS_HeaderView::length() const {
+  return ( valid() )? messageLength() : 0;
+}
+
+
+inline const unsigned char *
+NPS_HeaderView::body() const {
+  if( !valid() )
+    return NULL;
+  return buffer_ + ( ( isCompact() )? (uint16)compact_.size_
+				    : (uint16)NPS_Serialize::Header::size_ );
+}
+
+
+inline uint16
+NPS_HeaderView::bodyLength() const {
+  if( !valid() )
+    return 0;
+  return ( isCompact() )? compact_.bodyLength_
+			: messageLength() - NPS_Serialize::Header::size_;
+}
+
+
+//**************** NPS_MessageView ******************//
+
+template <class Message>
+inline
+NPS_MessageView<Message>::NPS_MessageView( const unsigned char *buffer,
+					   uint32 available )
+  : NPS_HeaderView( buffer, available ),
+    SchemaView( NPS_HeaderView::body(), NPS_HeaderView::bodyLength() )
+{}
+
+
+template <class Message>
+inline
+NPS_MessageView<Message>::NPS_MessageView( const NPS_HeaderView &header )
+  : NPS_HeaderView( header ),
+    SchemaView( header.body(), header.bodyLength() )
+{}
+
+
+template <class Message>
+inline bool
+NPS_MessageView<Message>::valid() const {
+  return NPS_HeaderView::valid() && !isCompact() && SchemaView::valid();
+}
+
+
+#endif // #if !defined ( NPS_MESSAGE_VIEW_H_ )
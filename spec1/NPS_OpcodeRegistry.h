@@ -0,0 +1,459 @@
+//  Name: NPS_OpcodeRegistry.h
+//
+//  Purpose: opcode to message-class dispatch with per-opcode statistics.
+//
+//  Notes:
+//  ------------------
+//  Handlers have traditionally picked messages apart with a chain of
+//  opcode comparisons, so the cost of reaching a handler grows with the
+//  number of opcodes tested ahead of it.  An NPS_OpcodeRegistry maps an
+//  NPS_OPCODE straight to its entry through a two-level table indexed by
+//  the high and low opcode bytes.  The opcode families in NPSTypes.h each
+//  own a high byte (0x00 game messages, 0x01 lobby client commands, 0x02
+//  lobby server commands, ...), so each family fills one dense 256-entry
+//  page and dispatch is two loads regardless of how many opcodes exist.
+//
+//  Each entry binds:
+//  \li a factory, creating the NPS_Serialize subclass for the opcode;
+//  \li a decoder, filling it from the received bytes (bounds-checked, see
+//      NPS_Decoder.h);
+//  \li a handler, taking the typed message.
+//  The factory, decoder and handler trampolines are instantiated from
+//  template arguments, so the table holds direct function pointers and a
+//  dispatch makes no virtual call until the message's own _doDeserialize().
+//
+//  Each entry keeps a message count, a byte count, an error count and a
+//  log2 latency histogram covering its decode and handler.
+//
+//  A registry is NOT thread safe: it reuses one message instance per
+//  opcode.  Use one per dispatching thread, and fill it in before the
+//  first dispatch().
+//
+
+#if !defined ( NPS_OPCODE_REGISTRY_H_ )
+#define NPS_OPCODE_REGISTRY_H_
+
+#include <string.h>
+#include <time.h>
+#include "NPSTypes.h"
+#include "NPS_Serialize.h"
+#include "NPS_MessageView.h"
+
+
+//! Opcode table; see the notes at the top of NPS_OpcodeRegistry.h.
+/*!
+  Example usage:
+  \code
+  NPSSTATUS onUserStatus( GLDP_UserStatus &msg, void *context );
+  NPSSTATUS onAnyGameMessage( const NPS_HeaderView &msg, void *context );
+
+  NPS_OpcodeRegistry registry;
+  registry.registerMessage< GLDP_UserStatus, onUserStatus >( NPS_GET_USER_STATUS );
+  registry.registerRaw< onAnyGameMessage >( NPS_SEND_ALL );   // no decode at all
+
+  // per received message:
+  NPSSTATUS status = registry.dispatch( buff, len, connection );
+  \endcode
+*/
+class NPS_OpcodeRegistry {
+public:
+
+  enum {
+    pageBits_      = 8,
+    pageSize_      = 1 << pageBits_,   //!< entries per page (one low byte)
+    numPages_      = 1 << pageBits_,   //!< pages (one per high byte)
+    latencyBuckets_ = 32               //!< bucket i counts times < 2^i ns
+  };
+
+  //! creates a message instance for an opcode.
+  typedef NPS_Serialize * (*Factory)();
+  //! destroys a message created by the Factory.
+  typedef void            (*Destroy)( NPS_Serialize * );
+  //! bounds-checked decode into a message instance.
+  typedef NPS_DecodeStatus (*Decoder)( NPS_Serialize &msg, NPS_Decoder &dec );
+  //! a typed handler behind a trampoline.
+  typedef NPSSTATUS       (*Handler)( NPS_Serialize &msg, void *context );
+  //! a handler that works on the undecoded bytes.
+  typedef NPSSTATUS       (*RawHandler)( const NPS_HeaderView &msg, void *context );
+
+  //! per-opcode counters.
+  struct Stats {
+    uint32              messages_;   //!< messages dispatched
+    uint32              errors_;     //!< malformed or failed (handler status != NPS_OK)
+    double64            bytes_;      //!< message bytes, header included
+    uint32              latency_[latencyBuckets_];  //!< decode + handler time histogram
+
+    //! an upper bound on the \p q'th latency quantile (0..1), in nanoseconds.
+    double64            latencyQuantile( double64 q ) const;
+  };
+
+  //! constructor.
+  NPS_OpcodeRegistry();
+
+  //! destructor. Releases pages and cached message instances.
+  ~NPS_OpcodeRegistry();
+
+  //! route \p opcode to \p Fn with a decoded \p Message.
+  /*!
+    \p Message must be default constructible; one instance is created on
+    first use and reused for every later message with this opcode.
+  */
+  template <class Message, NPSSTATUS (*Fn)( Message &, void * )>
+  void                  registerMessage( NPS_OPCODE opcode, const char *name = NULL );
+
+  //! route \p opcode to \p Fn without decoding it.
+  template <NPSSTATUS (*Fn)( const NPS_HeaderView &, void * )>
+  void                  registerRaw( NPS_OPCODE opcode, const char *name = NULL );
+
+  //! forget \p opcode.
+  void                  unregister( NPS_OPCODE opcode );
+
+  //! true if \p opcode has an entry.
+  bool                  isRegistered( NPS_OPCODE opcode ) const;
+
+  //! the registered name of \p opcode, or NULL.
+  const char *          name( NPS_OPCODE opcode ) const;
+
+  //! a new, caller-owned instance of the class registered for \p opcode, or NULL.
+  NPS_Serialize *       create( NPS_OPCODE opcode ) const;
+
+  //! decode the message at \p buff and pass it to its handler.
+  /*!
+    \param buff the first byte of the message header.
+    \param available the number of bytes at \p buff.
+    \param context passed through to the handler.
+    \return the handler's status, or
+    \li NPS_NO_DATA_AVAIL if the message is not complete yet,
+    \li NPS_BAD_PARAM if it is malformed,
+    \li NPS_NOT_IMPLEMENTED if its opcode is not registered.
+  */
+  NPSSTATUS             dispatch( const unsigned char *buff, uint32 available,
+				  void *context = NULL );
+
+  /** @name statistics
+   */
+  //@{
+  //! counters for \p opcode, or NULL if it is not registered.
+  const Stats *         stats( NPS_OPCODE opcode ) const;
+  //! messages whose opcode had no entry.
+  uint32                unknown() const;
+  //! zero every counter.
+  void                  resetStats();
+  //! turn handler timing on or off (on by default); counting continues.
+  void                  setTiming( bool on );
+  //@}
+
+private:
+
+  // not copyable; pages and instances are owned.
+  NPS_OpcodeRegistry( const NPS_OpcodeRegistry & );
+  NPS_OpcodeRegistry &  operator = ( const NPS_OpcodeRegistry & );
+
+  struct Entry {
+    Factory             factory_;
+    Destroy             destroy_;
+    Decoder             decoder_;
+    Handler             handler_;
+    RawHandler          raw_;
+    NPS_Serialize *     instance_;
+    const char *        name_;
+    Stats               stats_;
+  };
+
+  struct Page {
+    Entry               entry_[pageSize_];
+  };
+
+  //! the entry for \p opcode, or NULL; two loads, no search.
+  Entry *               _find( NPS_OPCODE opcode ) const;
+  //! the entry for \p opcode, allocating its page if need be.
+  Entry *               _slot( NPS_OPCODE opcode );
+  static void           _clear( Entry &e );
+
+  //! monotonic time in nanoseconds.
+  static double64       _now();
+  static void           _record( Stats &s, double64 ns );
+
+  // generated per message class / handler.
+  template <class Message>
+  static NPS_Serialize * _create();
+  template <class Message>
+  static void           _destroy( NPS_Serialize *msg );
+  static NPS_DecodeStatus _decode( NPS_Serialize &msg, NPS_Decoder &dec );
+  template <class Message, NPSSTATUS (*Fn)( Message &, void * )>
+  static NPSSTATUS      _call( NPS_Serialize &msg, void *context );
+
+  Page *                pages_[numPages_];
+  uint32                unknown_;
+  bool                  timing_;
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////
+//
+//    I N L I N E   M E T H O D S
+//
+
+inline
+NPS_OpcodeRegistry::NPS_OpcodeRegistry()
+  : unknown_(0),
+    timing_(true)
+{
+  memset( pages_, 0, sizeof(pages_) );
+}
+
+
+inline
+NPS_OpcodeRegistry::~NPS_OpcodeRegistry() {
+  for( int p = 0; p < numPages_; ++p ) {
+    if( !pages_[p] )
+      continue;
+    for( int i = 0; i < pageSize_; ++i )
+      _clear( pages_[p]->entry_[i] );
+    delete pages_[p];
+  }
+}
+
+
+inline NPS_OpcodeRegistry::Entry *
+NPS_OpcodeRegistry::_find( NPS_OPCODE opcode ) const {
+  Page *page = pages_[opcode >> pageBits_];
+  if( !page )
+    return NULL;
+  Entry *e = &page->entry_[opcode & (pageSize_ - 1)];
+  return ( e->handler_ || e->raw_ )? e : NULL;
+}
+
+
+inline NPS_OpcodeRegistry::Entry *
+NPS_OpcodeRegistry::_slot( NPS_OPCODE opcode ) {
+  Page *&page = pages_[opcode >> pageBits_];
+  if( !page ) {
+    page = new Page;
+    memset( page, 0, sizeof(Page) );
+  }
+  return &page->entry_[opcode & (pageSize_ - 1)];
+}
+
+
+inline void
+NPS_OpcodeRegistry::_clear( Entry &e ) {
+  if( e.instance_ && e.destroy_ )
+    e.destroy_( e.instance_ );
+  memset( &e, 0, sizeof(e) );
+}
+
+
+template <class Message>
+inline NPS_Serialize *
+NPS_OpcodeRegistry::_create() {
+  return new Message;
+}
+
+
+template <class Message>
+inline void
+NPS_OpcodeRegistry::_destroy( NPS_Serialize *msg ) {
+  delete static_cast<Message *>(msg);
+}
+
+
+inline NPS_DecodeStatus
+NPS_OpcodeRegistry::_decode( NPS_Serialize &msg, NPS_Decoder &dec ) {
+  return msg.deserialize( dec );
+}
+
+
+template <class Message, NPSSTATUS (*Fn)( Message &, void * )>
+inline NPSSTATUS
+NPS_OpcodeRegistry::_call( NPS_Serialize &msg, void *context ) {
+  return Fn( static_cast<Message &>(msg), context );
+}
+
+
+template <class Message, NPSSTATUS (*Fn)( Message &, void * )>
+inline void
+NPS_OpcodeRegistry::registerMessage( NPS_OPCODE opcode, const char *name ) {
+  Entry *e = _slot( opcode );
+  _clear( *e );
+  e->factory_ = &_create<Message>;
+  e->destroy_ = &_destroy<Message>;
+  e->decoder_ = &_decode;
+  e->handler_ = &_call<Message, Fn>;
+  e->name_    = name;
+}
+
+
+template <NPSSTATUS (*Fn)( const NPS_HeaderView &, void * )>
+inline void
+NPS_OpcodeRegistry::registerRaw( NPS_OPCODE opcode, const char *name ) {
+  Entry *e = _slot( opcode );
+  _clear( *e );
+  e->raw_  = Fn;
+  e->name_ = name;
+}
+
+
+inline void
+NPS_OpcodeRegistry::unregister( NPS_OPCODE opcode ) {
+  if( Entry *e = _find( opcode ) )
+    _clear( *e );
+}
+
+
+inline bool
+NPS_OpcodeRegistry::isRegistered( NPS_OPCODE opcode ) const {
+  return _find( opcode ) != NULL;
+}
+
+
+inline const char *
+NPS_OpcodeRegistry::name( NPS_OPCODE opcode ) const {
+  Entry *e = _find( opcode );
+  return ( e )? e->name_ : NULL;
+}
+
+
+inline NPS_Serialize *
+NPS_OpcodeRegistry::create( NPS_OPCODE opcode ) const {
+  Entry *e = _find( opcode );
+  return ( e && e->factory_ )? e->factory_() : NULL;
+}
+
+
+inline NPSSTATUS
+NPS_OpcodeRegistry::dispatch( const unsigned char *buff, uint32 available,
+			      void *context ) {
+  if( NPS_Serialize::bytesNeeded( buff, available ) )
+    return NPS_NO_DATA_AVAIL;
+
+  NPS_HeaderView header( buff, available );
+  Entry *e = _find( header.messageId() );
+  if( !e ) {
+    ++unknown_;
+    return NPS_NOT_IMPLEMENTED;
+  }
+
+  Stats &s = e->stats_;
+  ++s.messages_;
+  s.bytes_ += header.messageLength();
+  if( !header.valid() ) {
+    ++s.errors_;
+    return NPS_BAD_PARAM;
+  }
+
+  double64 start = ( timing_ )? _now() : 0;
+  NPSSTATUS status;
+
+  if( e->raw_ )
+    status = e->raw_( header, context );
+  else {
+    if( !e->instance_ )
+      e->instance_ = e->factory_();
+    NPS_Decoder dec( buff, buff + header.length() );
+    if( !e->instance_ ) {
+      ++s.errors_;
+      return NPS_OUT_OF_MEMORY;
+    }
+    if( e->decoder_( *e->instance_, dec ) != NPS_DECODE_OK ) {
+      ++s.errors_;
+      return NPS_BAD_PARAM;
+    }
+    status = e->handler_( *e->instance_, context );
+  }
+
+  if( status != NPS_OK )
+    ++s.errors_;
+  if( timing_ )
+    _record( s, _now() - start );
+  return status;
+}
+
+
+inline const NPS_OpcodeRegistry::Stats *
+NPS_OpcodeRegistry::stats( NPS_OPCODE opcode ) const {
+  Entry *e = _find( opcode );
+  return ( e )? &e->stats_ : NULL;
+}
+
+
+inline uint32
+NPS_OpcodeRegistry::unknown() const {
+  return unknown_;
+}
+
+
+inline void
+NPS_OpcodeRegistry::resetStats() {
+  unknown_ = 0;
+  for( int p = 0; p < numPages_; ++p ) {
+    if( !pages_[p] )
+      continue;
+    for( int i = 0; i < pageSize_; ++i )
+      memset( &pages_[p]->entry_[i].stats_, 0, sizeof(Stats) );
+  }
+}
+
+
+inline void
+NPS_OpcodeRegistry::setTiming( bool on ) {
+  timing_ = on;
+}
+
+
+inline double64
+NPS_OpcodeRegistry::_now() {
+#if defined ( WIN32 )
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER t;
+  if( !freq.QuadPart )
+    QueryPerformanceFrequency( &freq );
+  QueryPerformanceCounter( &t );
+  return (double64)t.QuadPart * 1e9 / (double64)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (double64)ts.tv_sec * 1e9 + (double64)ts.tv_nsec;
+#endif
+}
+
+
+inline void
+NPS_OpcodeRegistry::_record( Stats &s, double64 ns ) {
+  // bucket = bit width of ns, so bucket i holds [2^(i-1), 2^i).
+  NPS_SWAP64 v = ( ns > 0 )? (NPS_SWAP64)ns : 0;
+  int bucket = 0;
+#if defined ( __GNUC__ )
+  if( v )
+    bucket = 64 - __builtin_clzll( v );
+#else
+  for( ; v; v >>= 1 )
+    ++bucket;
+#endif
+  if( bucket > latencyBuckets_ - 1 )
+    bucket = latencyBuckets_ - 1;
+  ++s.latency_[bucket];
+}
+
+
+inline double64
+NPS_OpcodeRegistry::Stats::latencyQuantile( double64 q ) const {
+  uint32 total = 0;
+  for( int i = 0; i < latencyBuckets_; ++i )
+    total += latency_[i];
+  if( !total )
+    return 0;
+
+  double64 want = q * total;
+  uint32 seen = 0;
+  for( int i = 0; i < latencyBuckets_; ++i ) {
+    seen += latency_[i];
+    if( seen >= want && latency_[i] )
+      return (double64)(1u << i);
+  }
+  return (double64)(1u << (latencyBuckets_ - 1));
+}
+
+
+#endif // #if !defined ( NPS_OPCODE_REGISTRY_H_ )
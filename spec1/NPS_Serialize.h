@@ -15,7 +15,9 @@
 //  Strings are written as pascal strings.
 //
 //  This class handles the memory allocation and deallocation of memory
-//  required for the serialized buffer.
+//  required for the serialized buffer.  Alternatively, buffers may be
+//  drawn from a caller-supplied NPS_MessageArena, in which case the
+//  steady state performs no heap allocation at all.
 //
 //  Simply derive from the NPS_Serialize and implement the following
 //  three methods:
@@ -37,8 +39,15 @@
 #include <iostream>
 #include <string.h>  // for memset() et al.
 #include <time.h> // for time_t
+#include <utility>  // for std::move
 //#include "NPSLoggable.h"
 #include "NPS_Utils.h"
+#include "NPS_MessageArena.h"
+#include "NPS_GatherList.h"
+#include "NPS_Checksum.h"
+#include "NPS_Decoder.h"
+#include "NPS_Varint.h"
+#include "NPS_SharedPayload.h"
 
 //! Base class for serialization support.
 /*!
@@ -61,6 +70,18 @@
   myClass instance
   instance.deserialize( buff );
 
+  // on hot paths, serialize into a per-connection (or per-thread) arena
+  // instead; the buffer goes back on the arena's free list, not the heap.
+  const unsigned char *pooled = instance.serialize( arena, len );
+  write( sock, pooled, len );
+  NPS_Serialize::releaseBuffer( pooled, arena );
+
+  // to route or rebroadcast without deserializing, read the received bytes
+  // in place (see NPS_MessageView.h).
+  NPS_MessageView<myClass> view( buff, received );
+  if( view.valid() )
+    forward( view.buffer(), view.length() );
+
   \endcode
 
   To derive from this class, you will need to reimplement
@@ -71,6 +92,13 @@
   \endcode
 
  */
+//! the wire encoding selected by serialize( NPS_MessageArena &, uint16 & ).
+enum NPS_WireFormat {
+  NPS_WIRE_V1 = 1,    //!< Header::size_ header, fixed-width fields
+  NPS_WIRE_V2 = 2     //!< CompactHeader, varint fields; see serializeCompact()
+};
+
+
 class NPS_Serialize {
 public:
 
@@ -89,6 +117,11 @@ public:
   //! assignment operator
   NPS_Serialize &       operator = ( const NPS_Serialize & );
 
+  //! move constructor; takes over the header allocation instead of copying it.
+  NPS_Serialize( NPS_Serialize && );
+  //! move assignment; takes over the header allocation instead of copying it.
+  NPS_Serialize &       operator = ( NPS_Serialize && );
+
 
   //! destructor. If set as allocation owner, will release memory.
   virtual ~NPS_Serialize();
@@ -112,6 +145,34 @@ public:
   const unsigned char * serialize( unsigned char *buff, uint16 &len );
   const unsigned char * serialize( unsigned char *buff, uint16 &len ) const;
 
+  //@{
+  /*!
+   * Perform the serialization into a buffer drawn from \p arena.
+   *
+   * This is the allocation-free fast path: the buffer comes from the
+   * arena's free lists and is filled by serialize( unsigned char *, uint16 & ).
+   * Release it with releaseBuffer( buffer, arena ), or hand it to a
+   * MessageBuffer constructed with the same arena.
+   * Returns NULL if the arena could not grow.
+   * \param len the number of bytes written is returned here.
+   */
+  //@}
+  const unsigned char * serialize( NPS_MessageArena &arena, uint16 &len );
+  const unsigned char * serialize( NPS_MessageArena &arena, uint16 &len ) const;
+
+  //! Perform the serialization as a list of iovec fragments.
+  /*!
+    The header and fields are packed into \p gather's scratch buffer, which
+    must hold serializeSizeOf() bytes.  Blobs written with _serializeRef(),
+    schema blob fields, and the blobs of members written with
+    _serializeRef( const NPS_Serialize * ) or as schema nested fields are
+    referenced in place rather than copied.
+    Returns the fragment list, or NULL if the scratch buffer is too small.
+    \param len the total number of bytes across all fragments.
+    \sa NPS_GatherList, NPSComm::SendToSocketV()
+  */
+  const struct iovec *  serialize( NPS_GatherList &gather, uint16 &len );
+
   //! Perform the deserialization, populating the class from the supplied buffer.
   /*
     populates the class from the serialized stream in \p buff_in
@@ -121,9 +182,138 @@ public:
   void                  deserialize( const unsigned char *buff_in,
 				     bool deallocate = false );
 
+  //! as deserialize(), but only if the header checksum of \p buff_in verifies.
+  /*!
+    \p available is the number of bytes at \p buff_in.  Returns false,
+    leaving the class untouched, on a mismatch or if the header claims
+    more than \p available bytes.
+    \sa verifyChecksum()
+  */
+  bool                  deserialize( const unsigned char *buff_in,
+				     uint32 available,
+				     NPS_ChecksumType verify,
+				     bool deallocate = false );
+
+  /** @name checksum engine
+   *  selects what goes in the header's checksum slot.
+   *
+   *  By default the slot carries generateChecksum(), which covers only the
+   *  version and length.  With NPS_CHECKSUM_CRC32C or NPS_CHECKSUM_XXHASH32
+   *  it instead carries a hash of the header id, length and version plus
+   *  the whole body (see NPS_Checksum.h).
+   *
+   *  The arena and gather serialize() overloads seal the checksum
+   *  themselves, hashing the body straight after it is written while it is
+   *  still in cache.  After serialize( unsigned char *, uint16 & ) call
+   *  sealChecksum() on the buffer and the length it returned.
+   *
+   *  Verification is opt-in on the receiving side; the receiver must know
+   *  which engine its peer uses, and a sequence number (setSequenceNumber())
+   *  always takes precedence over any checksum.
+   */
+  //@{
+  //! set the checksum engine for this instance (not copied by operator =).
+  void                  setChecksumType( NPS_ChecksumType type );
+  //! the checksum engine for this instance.
+  NPS_ChecksumType      checksumType() const;
+
+  //! hash serialized message \p buff and store the result in its header.
+  /*!
+    Returns false, sealing nothing, if the header claims more than the
+    \p available bytes at \p buff.
+  */
+  static bool           sealChecksum( unsigned char *buff,
+				      uint32 available,
+				      NPS_ChecksumType type );
+  //! true if the checksum in the header of \p buff matches its contents.
+  /*!
+    Always true for NPS_CHECKSUM_LEGACY, which protects nothing.  Always
+    false if the header claims more than the \p available bytes at
+    \p buff; nothing past them is read.
+  */
+  static bool           verifyChecksum( const unsigned char *buff,
+					uint32 available,
+					NPS_ChecksumType type );
+  //@}
+
+  /** @name compact (v2) wire format
+   *  varint fields behind a 4 to 6 byte CompactHeader.
+   *
+   *  Integers travel as LEB128 varints (zigzag for signed types), blob and
+   *  nested lengths as varints, and NPS_ID_LIST_FIELD lists as deltas (see
+   *  NPS_Varint.h and NPS_SerializeSchema.h).  Only classes whose fields
+   *  are declared as an NPS_Schema have a compact form; for any other class
+   *  compactSizeOf() is 0 and serializeCompact() returns NULL.
+   *
+   *  The encoding is negotiated: a peer that has not said it understands
+   *  v2 must be sent v1.  Receivers need not be told; deserialize(
+   *  NPS_Decoder & ), bytesNeeded() and verifyChecksum() recognise either
+   *  header by its first byte.  The unchecked deserialize( const unsigned
+   *  char *, bool ) reads v1 only.
+   */
+  //@{
+  //! select the encoding of serialize( NPS_MessageArena &, uint16 & ) (not copied by operator =).
+  /*!
+    NPS_WIRE_V2 falls back to v1 for a class with no compact form.
+  */
+  void                  setWireFormat( NPS_WireFormat format );
+  //! the encoding of serialize( NPS_MessageArena &, uint16 & ).
+  NPS_WireFormat        wireFormat() const;
+
+  //! the exact size of the compact serialization, or 0 if there is none (or it is over 0xFFFF).
+  uint16                compactSizeOf() const;
+
+  //! serialize in the compact format into \p buff, which must hold compactSizeOf() bytes.
+  /*!
+    The checksum, if any, is sealed.
+    Returns NULL, with \p len 0, if the class has no compact form or the
+    message would be longer than 0xFFFF bytes.
+  */
+  const unsigned char * serializeCompact( unsigned char *buff, uint16 &len );
+
+  //! as above, into a buffer drawn from \p arena.
+  const unsigned char * serializeCompact( NPS_MessageArena &arena, uint16 &len );
+  //@}
+
+  //! bounds-checked deserialization of the message at \p dec's cursor.
+  /*!
+    Nothing is read until the whole message (per its header length) is
+    within \p dec; until then NPS_DECODE_SHORT is returned and \p dec is
+    left alone, so a connection can keep reading and retry:
+    \code
+    NPS_Decoder dec( rbuf, rbuf + have );
+    switch( msg.deserialize( dec ) ) {
+    case NPS_DECODE_OK:     // dec is past the message
+      break;
+    case NPS_DECODE_SHORT:  // read bytesNeeded() more, dec.extend(), retry
+      break;
+    case NPS_DECODE_BAD:    // no field may be trusted; drop the connection
+      break;
+    }
+    \endcode
+    Every field is then read against the message length, with one failure
+    check at the end.  Fields read by the out-of-line blob and nested
+    readers are checked after the fact.  The header refers to the buffer,
+    which must outlive any later header accessor calls.
+
+    A compact (v2) message is decoded with _doDeserializeCompact(); its
+    header is not kept, so checksum() reads 0 afterwards.
+  */
+  NPS_DecodeStatus      deserialize( NPS_Decoder &dec );
+
+  //! bytes still to arrive before the message at \p buff is complete; 0 if it is.
+  /*!
+    Until the header is in, only the rest of the header is counted.
+  */
+  static uint32         bytesNeeded( const unsigned char *buff, uint32 available );
+
   //! deallocate the buffer allocated by serialize()
   static void           releaseBuffer( const unsigned char *buffer );
 
+  //! return a buffer from serialize( NPS_MessageArena &, uint16 & ) to its arena
+  static void           releaseBuffer( const unsigned char *buffer,
+				       NPS_MessageArena &arena );
+
   //! return the message version from the header
   uint16                messageVersion() const;
 
@@ -247,6 +437,58 @@ public:
   };
 
 
+  //! the compact (v2) header.
+  /*!
+    A v1 header opens with the high byte of the message id, and no opcode
+    has 0xE0-0xEF there, so the first byte tells the two apart.
+
+    The header looks like this:
+    \li 1 int8 marker, 0xE0 | flags
+    \li varint msgid
+    \li varint body length (unlike v1, the header is not included)
+    \li varint message version, if flags & hasVersion_
+    \li 4 int8s checksum or sequence number, if flags & hasChecksum_
+  */
+  struct CompactHeader {
+    //! constructor.
+    CompactHeader();
+
+    enum {
+      marker_       = 0xE0,               //!< first byte, before the flags
+      markerMask_   = 0xF0,
+      hasVersion_   = 0x01,
+      hasChecksum_  = 0x02,
+      maxSize_      = 1 + 3*3 + 4         //!< the longest header in bytes
+    };
+
+    //! true if \p buff starts with a compact header.
+    static bool           isCompact( const unsigned char *buff );
+
+    //! read the header at \p buff.
+    /*!
+      NPS_DECODE_SHORT if \p available bytes do not hold all of it yet.
+    */
+    NPS_DecodeStatus      parse( const unsigned char *buff, uint32 available );
+
+    //! the bytes encode() will write.
+    uint16                encodedSize() const;
+
+    //! write the header at \p p, advancing it.
+    void                  encode( unsigned char *&p ) const;
+
+    //! header plus body, in bytes.
+    uint32                length() const;
+
+    uint16                id_;
+    uint16                version_;
+    uint16                bodyLength_;
+    unsigned int          checksum_;
+    uint8                 flags_;
+    //! header bytes; set by parse().
+    uint8                 size_;
+  };
+
+
 
   /** @name Derivation
    * the following three methods MUST be implemented by the subclasses,
@@ -316,6 +558,10 @@ public:
    *  The order that the members get serialized is not important except
    *  that the order must be the same for doSerialize() and _doDeserialize().
    *
+   *  Rather than writing the three methods by hand, a class may declare its
+   *  fields once as an NPS_Schema and derive from NPS_SchemaSerialize, which
+   *  generates them (see NPS_SerializeSchema.h).
+   *
    * \sa NPS_RawMessage class
    */
   //@{
@@ -325,6 +571,16 @@ public:
   virtual void          _doSerialize() = 0;
   //! deserialize this class up the vtree
   virtual void          _doDeserialize() =0;
+
+  //! the compact body size up the vtree; false if the class has no compact form.
+  virtual bool          _compactSizeOf( uint16 &size ) const;
+  //! serialize this class up the vtree in the compact format, advancing \p p.
+  /*!
+    false, writing nothing, if the class has no compact form.
+  */
+  virtual bool          _doSerializeCompact( unsigned char *&p );
+  //! deserialize this class up the vtree from the compact format.
+  virtual void          _doDeserializeCompact( NPS_Decoder &dec );
   //@}
 
 
@@ -356,15 +612,21 @@ public:
 
 
   //! Convenience class for storing and manipulating serialized buffers.
+  /*!
+    If constructed with an arena, the buffer is returned to that arena
+    instead of being released with delete[], and allocate() draws from it.
+  */
   class MessageBuffer {
   public:
     //! constructor.
     /*
       \param buff the serialized buffer.
       \param len the length of the buffer.
+      \param arena if non-NULL, the arena that owns \p buff.
     */
     MessageBuffer( const unsigned char *buff = NULL,
-		   uint16 len = 0 );
+		   uint16 len = 0,
+		   NPS_MessageArena *arena = NULL );
     //! destructor. Deallocates \p buffer if non-NULL
     ~MessageBuffer();
 
@@ -384,10 +646,21 @@ public:
     //! allocates a buiffer of size \p len
     void                     allocate( uint16 len );
 
+    //! returns the arena backing this buffer, or NULL if heap allocated.
+    NPS_MessageArena *       arena() const;
+
   private:
 
+    // not copyable; the buffer has a single owner.
+    MessageBuffer( const MessageBuffer & );
+    MessageBuffer &          operator = ( const MessageBuffer & );
+
+    //! gives \p buffer_ back to the arena, or to the heap.
+    void                     releaseStorage();
+
     const unsigned char *    buffer_;
     uint16                   length_;
+    NPS_MessageArena *       arena_;
 
   };
 
@@ -436,6 +709,29 @@ protected:
   void                  _serialize( const char *str );
   //! serialize a buffer; does not assume null-termination.
   void                  _serialize( const char *buff, uint16 len );
+  //! as _serialize( const char *, uint16 ), but may reference \p buff in place.
+  /*!
+    When serializing to an NPS_GatherList, a large \p buff becomes its own
+    fragment instead of being copied; otherwise identical to
+    _serialize( buff, len ).  \p buff must outlive the send.
+  */
+  void                  _serializeRef( const char *buff, uint16 len );
+  //! as _serialize( const NPS_Serialize * ), but \p s's own blobs may be referenced.
+  /*!
+    When serializing to an NPS_GatherList, \p s is written straight into
+    the list, so its _serializeRef() blobs and schema blobs become
+    fragments too.  A member that serializes its own header is copied as
+    usual.
+  */
+  void                  _serializeRef( const NPS_Serialize *s );
+  //! serialize \p count scalars at once (e.g. the Integer1..16 run of a GenericHighScore).
+  /*!
+    Writes the same stream as calling _serialize() on each element, but
+    converts the whole run with one bulk hton_n() pass.
+  */
+  template <class T>
+  void                  _serializeArray( const T *vals, uint16 count,
+					 bool in_nbo = false );
   //@}
 
   /** @name _deserialize
@@ -471,6 +767,10 @@ protected:
 				      bool terminate = true );
   // allocates memory for buffer.
   char *                _deserialize( uint16 &len, char *&dest, bool terminate = false );
+  //! deserialize \p count scalars at once; the inverse of _serializeArray().
+  template <class T>
+  void                  _deserializeArray( T *vals, uint16 count,
+					   bool in_nbo = false );
   //@}
 
 
@@ -503,9 +803,34 @@ protected:
 					  uint16 len,
 					  bool check_termination = false  );
 
+  //! get the size needed to serialize \p count scalars with _serializeArray().
+  template <class T>
+  static uint16         _serializeSizeOfArray( const T *vals, uint16 count );
+
   //@}
 
 
+  //! the current read/write position in the buffer being (de)serialized.
+  /*!
+    For generated codecs (see NPS_SerializeSchema.h) that write the
+    stream directly rather than through the _serialize() family.
+  */
+  unsigned char *&      _serializeCursor();
+
+  //! the bounds-checked decoder, positioned at the cursor, or NULL.
+  /*!
+    Set only inside deserialize( NPS_Decoder & ).  Generated codecs that
+    read through it must store its cursor back with _serializeCursor().
+  */
+  NPS_Decoder *         _decoder();
+
+  //! the gather list being serialized to, or NULL.
+  /*!
+    Set only inside serialize( NPS_GatherList &, uint16 & ).  Generated
+    codecs pass it on so that their blobs can be referenced in place.
+  */
+  NPS_GatherList *      _gather() const;
+
   //!calculate the checksum.
   /*!
     reimplement this method to use this hook to generate the checksum value
@@ -518,8 +843,41 @@ private:
   void                  _serializeRaw( const unsigned char *buff, uint16 len );
   void                  _deserializeRaw( unsigned char *buff, uint16 len );
 
+  //! writes the header for a \p len byte message at \p start.
+  void                  _writeHeader( unsigned char *start, uint16 len );
+
+  //! true if serialize() must replace the header checksum with a body hash.
+  bool                  _sealsChecksum() const;
+
+  //! the compact header for a \p body_len byte body.
+  CompactHeader         _compactHeader( uint16 body_len ) const;
+
+  //! deserialize( NPS_Decoder & ) for a compact message.
+  NPS_DecodeStatus      _deserializeCompact( NPS_Decoder &dec );
+
+  //! the length of the message at \p buff, or 0 if it is malformed or not all in \p available.
+  static uint32         _checkedLength( const unsigned char *buff,
+					uint32 available );
+
+  //! the body hash of the message starting at \p buff, which _checkedLength() has vetted.
+  static uint32         _bodyChecksum( const unsigned char *buff,
+				       uint32 len,
+				       NPS_ChecksumType type );
+
   unsigned char *       serializedBufferPtr_;
 
+  //! set only while serializing to an NPS_GatherList.
+  NPS_GatherList *      gather_ = NULL;
+
+  //! what the header checksum slot carries.
+  NPS_ChecksumType      checksumType_ = NPS_CHECKSUM_LEGACY;
+
+  //! set only while in deserialize( NPS_Decoder & ).
+  NPS_Decoder *         decoder_ = NULL;
+
+  //! what serialize( NPS_MessageArena &, uint16 & ) writes.
+  NPS_WireFormat        wireFormat_ = NPS_WIRE_V1;
+
   uint16                messageId_;
   uint16                messageVersion_;
 
@@ -562,6 +920,12 @@ private:
  *   delete[] msg;
  * \endcode
  *
+ * Messages built on an NPS_SharedPayload refer to its bytes rather than
+ * copying them, so one blob can be relayed to many recipients; such a
+ * blob is never the caller's to delete (see isShared()).  Moving a
+ * message moves its blob, and the adopting constructor takes a buffer
+ * without copying it.
+ *
 */
 class NPS_RawMessage : public NPS_Serialize {
 public:
@@ -574,12 +938,46 @@ public:
     \param buff the message buffer
   */
   NPS_RawMessage( uint16 id =0, uint16 len = 0, const char *buff = NULL );
+
+  //! uses \p buff as the blob without copying it, if \p adopt is set.
+  /*!
+    The blob is then the message's as if it had copied it: an
+    NPS_RawMessage leaves it to the caller, an NPS_RawMessageGC deletes it
+    with delete[].  If \p adopt is false, \p buff is copied.
+  */
+  NPS_RawMessage( uint16 id, uint16 len, char *buff, bool adopt );
+
+  //! refers to \p payload's bytes instead of copying them.
+  NPS_RawMessage( uint16 id, const NPS_SharedPayload &payload );
+
+  //! copy constructor; shares a shared payload, otherwise copies the blob.
+  NPS_RawMessage( const NPS_RawMessage &msg );
+
+  //! move constructor; takes over \p msg's blob, leaving \p msg empty.
+  NPS_RawMessage( NPS_RawMessage &&msg );
+
   //! destructor.
   ~NPS_RawMessage();
 
   //! assignment operator, acts like default constructor.
   NPS_RawMessage &      operator = ( const NPS_RawMessage & );
 
+  //! move assignment; releases this message's blob, then takes over \p msg's.
+  NPS_RawMessage &      operator = ( NPS_RawMessage &&msg );
+
+  //! hands the blob (from new[]) to the caller, leaving the message empty.
+  /*!
+    NULL for a shared blob, which is not the message's to give away.
+    \param len the blob length is returned here.
+  */
+  char *                detach( uint16 &len );
+
+  //! true if the blob belongs to an NPS_SharedPayload.
+  bool                  isShared() const;
+
+  //! the payload behind a shared blob; empty otherwise.
+  const NPS_SharedPayload & payload() const;
+
   // returns a pointer to the data blob
   const char *          getBlob() const;
   // generates a message using NPS_Message semantics
@@ -605,9 +1003,21 @@ protected:
   void                  allocate( uint16 len );
   virtual void          release();
 
+  //! false for a class whose release() deletes the blob; it copies shared blobs instead.
+  virtual bool          _mayShare() const;
+
+  //! release(), except that a shared blob is merely let go.
+  void                  _releaseBlob();
+
+  //! takes over \p msg's blob, leaving \p msg empty.
+  void                  _take( NPS_RawMessage &msg );
+
   char *                buffer_;
   uint16                length_;
 
+  //! set while the blob may be shared; see isShared().
+  NPS_SharedPayload     payload_;
+
 };
 
 
@@ -617,11 +1027,21 @@ public:
 
   NPS_RawMessageGC( uint16 id =0, uint16 len = 0, const char *buff = NULL );
 
+  //! takes ownership of \p buff (from new[]) without copying it, if \p adopt is set.
+  NPS_RawMessageGC( uint16 id, uint16 len, char *buff, bool adopt );
+
+  NPS_RawMessageGC( const NPS_RawMessageGC &msg );
+  NPS_RawMessageGC( NPS_RawMessageGC &&msg );
+
   NPS_RawMessageGC &    operator = ( const NPS_RawMessageGC &msg );
+  NPS_RawMessageGC &    operator = ( NPS_RawMessageGC &&msg );
 protected:
 
   void                  release();
 
+  //! release() deletes the blob, so it can never be shared.
+  bool                  _mayShare() const;
+
 };
 
 
@@ -637,12 +1057,28 @@ inline
 NPS_Serialize::NPS_Serialize( const NPS_Serialize &s )
   : messageId_(s.messageId_),
     messageVersion_(s.messageVersion_),
-    serializeHeader_(s.serializeHeader_)
+    serializeHeader_(s.serializeHeader_),
+    sequenceNumber_(s.sequenceNumber_)
 {
   header_ = s.header_;
 }
 
 
+inline
+NPS_Serialize::NPS_Serialize( NPS_Serialize &&s )
+  : serializedBufferPtr_(NULL),
+    messageId_(s.messageId_),
+    messageVersion_(s.messageVersion_),
+    serializeHeader_(s.serializeHeader_),
+    sequenceNumber_(s.sequenceNumber_)
+{
+  header_.data_ = s.header_.data_;
+  header_.iOwnTheBuffer_ = s.header_.iOwnTheBuffer_;
+  s.header_.data_ = NULL;
+  s.header_.iOwnTheBuffer_ = false;
+}
+
+
 inline NPS_Serialize &
 NPS_Serialize::operator = ( const NPS_Serialize &s ) {
   if( this != &s ) {
@@ -654,12 +1090,66 @@ NPS_Serialize::operator = ( const NPS_Serialize &s ) {
 }
 
 
+inline NPS_Serialize &
+NPS_Serialize::operator = ( NPS_Serialize &&s ) {
+  if( this != &s ) {
+    messageVersion_ =s.messageVersion_;
+    messageId_ =s.messageId_;
+    header_.deleteAllocation();
+    header_.data_ = s.header_.data_;
+    header_.iOwnTheBuffer_ = s.header_.iOwnTheBuffer_;
+    s.header_.data_ = NULL;
+    s.header_.iOwnTheBuffer_ = false;
+  }
+  return *this;
+}
+
+
 inline void
 NPS_Serialize::releaseBuffer( const unsigned char *buffer ) {
   delete[] const_cast<char *>(reinterpret_cast<const char *>(buffer));
 }
 
 
+inline void
+NPS_Serialize::releaseBuffer( const unsigned char *buffer,
+			      NPS_MessageArena &arena ) {
+  arena.release( buffer );
+}
+
+
+inline const unsigned char *
+NPS_Serialize::serialize( NPS_MessageArena &arena, uint16 &len ) {
+  if( wireFormat_ == NPS_WIRE_V2 && compactSizeOf() )
+    return serializeCompact( arena, len );
+  unsigned char *buff = arena.allocate( serializeSizeOf() );
+  if( !buff ) {
+    len = 0;
+    return NULL;
+  }
+  serialize( buff, len );
+  if( _sealsChecksum() )
+    sealChecksum( buff, len, checksumType_ );
+  return buff;
+}
+
+
+inline const unsigned char *
+NPS_Serialize::serialize( NPS_MessageArena &arena, uint16 &len ) const {
+  if( wireFormat_ == NPS_WIRE_V2 && compactSizeOf() )
+    return const_cast<NPS_Serialize *>(this)->serializeCompact( arena, len );
+  unsigned char *buff = arena.allocate( serializeSizeOf() );
+  if( !buff ) {
+    len = 0;
+    return NULL;
+  }
+  serialize( buff, len );
+  if( _sealsChecksum() )
+    sealChecksum( buff, len, checksumType_ );
+  return buff;
+}
+
+
 // protected methods.
 
 inline uint16
@@ -762,6 +1252,51 @@ NPS_Serialize::_serializeRaw( const unsigned char *buff, uint16 len ) {
   serializedBufferPtr_ += len;
 }
 
+inline void
+NPS_Serialize::_serializeRef( const char *buff, uint16 len ) {
+  if( gather_ && len >= NPS_GatherList::referenceThreshold_ ) {
+    unsigned char *mark = serializedBufferPtr_;
+    _serialize( len );
+    unsigned char *next = gather_->reference( serializedBufferPtr_, buff, len );
+    if( next ) {
+      serializedBufferPtr_ = next;
+      return;
+    }
+    serializedBufferPtr_ = mark;  // out of fragments; copy as usual.
+  }
+  _serialize( buff, len );
+}
+
+inline void
+NPS_Serialize::_serializeRef( const NPS_Serialize *s ) {
+  if( !gather_ || s->serializeHeader_ ) {
+    _serialize( s );
+    return;
+  }
+  // as _serialize( const NPS_Serialize * ): the body size, then the body,
+  // but with the gather list handed down.
+  NPS_Serialize *member = const_cast<NPS_Serialize *>(s);
+  _serialize( member->serializeSizeOf() );
+  member->serializedBufferPtr_ = serializedBufferPtr_;
+  member->gather_ = gather_;
+  member->_doSerialize();
+  member->gather_ = NULL;
+  serializedBufferPtr_ = member->serializedBufferPtr_;
+}
+
+// swap straight from the caller's array into the output buffer, no
+// intermediate copy.
+template <class T>
+inline void
+NPS_Serialize::_serializeArray( const T *vals, uint16 count, bool b ) {
+  if( b )
+    _serializeRaw( reinterpret_cast<const unsigned char *>(vals), count * sizeof(T) );
+  else {
+    hton_n( reinterpret_cast<T *>(serializedBufferPtr_), vals, count );
+    serializedBufferPtr_ += count * sizeof(T);
+  }
+}
+
 
 // each of following takes a pointer to the buffer to read from
 // and a reference to the argument to be written to. They
@@ -771,13 +1306,15 @@ NPS_Serialize::_serializeRaw( const unsigned char *buff, uint16 len ) {
 // cast as a int8 (char).
 inline void
 NPS_Serialize::_deserialize( bool &b ) {
-  b = (bool)(*serializedBufferPtr_++);
+  uint8 c;
+  _deserializeRaw( &c, 1 );
+  b = (bool)c;
 }
 
 
 inline void
 NPS_Serialize::_deserialize( int8 &val ) {
-  val = *serializedBufferPtr_++;
+  _deserializeRaw( reinterpret_cast<unsigned char *>(&val), 1 );
 }
 
 
@@ -789,7 +1326,7 @@ NPS_Serialize::_deserialize( unsigned int &val, bool b ) {
 
 inline void
 NPS_Serialize::_deserialize( uint8 &val ) {
-  val = *serializedBufferPtr_++;
+  _deserializeRaw( &val, 1 );
 }
 
 inline void
@@ -850,10 +1387,33 @@ NPS_Serialize::_deserialize( double64 &val, bool b ) {
 
 inline void
 NPS_Serialize::_deserializeRaw( unsigned char *dest, uint16 len ) {
+  if( NPS_Decoder *dec = _decoder() ) {
+    dec->getBytes( dest, len );
+    serializedBufferPtr_ = const_cast<unsigned char *>(dec->cursor());
+    return;
+  }
   memcpy( dest, serializedBufferPtr_, len );
   serializedBufferPtr_ += len;
 }
 
+template <class T>
+inline void
+NPS_Serialize::_deserializeArray( T *vals, uint16 count, bool b ) {
+  if( NPS_Decoder *dec = _decoder() ) {
+    if( b )
+      dec->getBytes( vals, count * sizeof(T) );
+    else
+      dec->getArray( vals, count );
+    serializedBufferPtr_ = const_cast<unsigned char *>(dec->cursor());
+  }
+  else if( b )
+    _deserializeRaw( reinterpret_cast<unsigned char *>(vals), count * sizeof(T) );
+  else {
+    ntoh_n( vals, reinterpret_cast<const T *>(serializedBufferPtr_), count );
+    serializedBufferPtr_ += count * sizeof(T);
+  }
+}
+
 
 // methods to be called when implementing serializeSizeOf()
 
@@ -934,6 +1494,12 @@ NPS_Serialize::_serializeSizeOf( double64 val ) {
   return sizeof(val);
 }
 
+template <class T>
+inline uint16
+NPS_Serialize::_serializeSizeOfArray( const T *, uint16 count ) {
+  return count * sizeof(T);
+}
+
 // assumes null-temination.
 inline uint16
 NPS_Serialize::_serializeSizeOf( const char *str ) {
@@ -1149,6 +1715,88 @@ NPS_Serialize::Header::getDataPtr() const {
 }
 
 
+//**************** NPS_Serialize::CompactHeader ******************//
+
+inline
+NPS_Serialize::CompactHeader::CompactHeader()
+  : id_(0),
+    version_(0),
+    bodyLength_(0),
+    checksum_(0),
+    flags_(0),
+    size_(0)
+{}
+
+
+inline bool
+NPS_Serialize::CompactHeader::isCompact( const unsigned char *buff ) {
+  return ( buff[0] & markerMask_ ) == marker_;
+}
+
+
+inline NPS_DecodeStatus
+NPS_Serialize::CompactHeader::parse( const unsigned char *buff, uint32 available ) {
+  NPS_Decoder dec( buff, buff + available );
+  NPS_VARINT id = 0, len = 0, ver = 0;
+  uint8 first = 0;
+
+  dec.get( first );
+  dec.getVarint( id );
+  dec.getVarint( len );
+  if( first & hasVersion_ )
+    dec.getVarint( ver );
+  if( first & hasChecksum_ )
+    dec.get( checksum_ );
+  else
+    checksum_ = 0;
+
+  if( dec.failed() )
+    return ( available < (uint32)maxSize_ )? NPS_DECODE_SHORT : NPS_DECODE_BAD;
+  if( ( first & ~(hasVersion_ | hasChecksum_) ) != marker_ ||
+      id > 0xFFFF || len > 0xFFFF || ver > 0xFFFF )
+    return NPS_DECODE_BAD;
+  // the whole frame must be addressable by a uint16 length, as a v1 one is.
+  if( (uint32)(dec.cursor() - buff) + len > 0xFFFF )
+    return NPS_DECODE_BAD;
+
+  flags_ = first & (hasVersion_ | hasChecksum_);
+  id_ = (uint16)id;
+  bodyLength_ = (uint16)len;
+  version_ = (uint16)ver;
+  size_ = (uint8)(dec.cursor() - buff);
+  return NPS_DECODE_OK;
+}
+
+
+inline uint16
+NPS_Serialize::CompactHeader::encodedSize() const {
+  return 1 + varint_size( id_ ) + varint_size( bodyLength_ ) +
+    ( ( flags_ & hasVersion_ )? varint_size( version_ ) : 0 ) +
+    ( ( flags_ & hasChecksum_ )? sizeof(checksum_) : 0 );
+}
+
+
+inline void
+NPS_Serialize::CompactHeader::encode( unsigned char *&p ) const {
+  *p++ = (unsigned char)(marker_ | flags_);
+  varint_encode( p, id_ );
+  varint_encode( p, bodyLength_ );
+  if( flags_ & hasVersion_ )
+    varint_encode( p, version_ );
+  if( flags_ & hasChecksum_ ) {
+    unsigned int sum = hton( checksum_ );
+    memcpy( p, &sum, sizeof(sum) );
+    p += sizeof(sum);
+  }
+}
+
+
+inline uint32
+NPS_Serialize::CompactHeader::length() const {
+  return size_ + bodyLength_;
+}
+
+
 
 
 
@@ -1160,22 +1808,191 @@ NPS_RawMessage::serializeSizeOf() const {
 
 inline void
 NPS_RawMessage::_doSerialize() {
-  _serialize( buffer_, length_ );
+  _serializeRef( buffer_, length_ );
 }
 
 inline void
 NPS_RawMessage::_doDeserialize() {
-  release();
+  _releaseBlob();
+  if( NPS_Decoder *dec = _decoder() ) {
+    // the out-of-line reader trusts the length prefix; this one checks it
+    // against what the frame holds before copying.
+    uint16 len = 0;
+    const char *blob = dec->getBlobRef( len );
+    _serializeCursor() = const_cast<unsigned char *>(dec->cursor());
+    if( blob && len ) {
+      buffer_ = new char[len];
+      memcpy( buffer_, blob, len );
+      length_ = len;
+    }
+    return;
+  }
   buffer_ = _deserialize( length_, buffer_, false );
 }
 
 
+inline
+NPS_RawMessage::NPS_RawMessage( uint16 id, uint16 len, char *buff, bool adopt )
+  : NPS_RawMessage( id, (adopt)? 0 : len, (adopt)? NULL : buff )
+{
+  if( adopt ) {
+    buffer_ = buff;
+    length_ = ( buff )? len : 0;
+  }
+}
+
+
+inline
+NPS_RawMessage::NPS_RawMessage( uint16 id, const NPS_SharedPayload &payload )
+  : NPS_RawMessage( id )
+{
+  payload_ = payload;
+  buffer_ = const_cast<char *>(payload_.data());
+  length_ = payload_.length();
+}
+
+
+inline
+NPS_RawMessage::NPS_RawMessage( const NPS_RawMessage &msg )
+  : NPS_Serialize( msg ),
+    buffer_(NULL),
+    length_(0)
+{
+  if( msg.isShared() ) {
+    payload_ = msg.payload_;
+    buffer_ = msg.buffer_;
+    length_ = msg.length_;
+  }
+  else if( msg.buffer_ ) {
+    buffer_ = new char[msg.length_];
+    memcpy( buffer_, msg.buffer_, msg.length_ );
+    length_ = msg.length_;
+  }
+}
+
+
+inline
+NPS_RawMessage::NPS_RawMessage( NPS_RawMessage &&msg )
+  : NPS_Serialize( std::move( msg ) ),
+    buffer_(NULL),
+    length_(0)
+{
+  _take( msg );
+}
+
+
+inline NPS_RawMessage &
+NPS_RawMessage::operator = ( NPS_RawMessage &&msg ) {
+  if( this != &msg ) {
+    _releaseBlob();
+    NPS_Serialize::operator = ( std::move( msg ) );
+    _take( msg );
+  }
+  return *this;
+}
+
+
+inline char *
+NPS_RawMessage::detach( uint16 &len ) {
+  if( isShared() ) {
+    len = 0;
+    return NULL;
+  }
+  char *blob = buffer_;
+  len = length_;
+  buffer_ = NULL;
+  length_ = 0;
+  payload_.reset();
+  return blob;
+}
+
+
+inline bool
+NPS_RawMessage::isShared() const {
+  // the out-of-line copy and createMessage() may have replaced the blob.
+  return buffer_ && buffer_ == payload_.data();
+}
+
+
+inline const NPS_SharedPayload &
+NPS_RawMessage::payload() const {
+  return payload_;
+}
+
+
+inline bool
+NPS_RawMessage::_mayShare() const {
+  return true;
+}
+
+
+inline void
+NPS_RawMessage::_releaseBlob() {
+  if( !isShared() )
+    release();
+  buffer_ = NULL;
+  length_ = 0;
+  payload_.reset();
+}
+
+
+inline void
+NPS_RawMessage::_take( NPS_RawMessage &msg ) {
+  if( msg.isShared() && !_mayShare() ) {
+    // release() would delete the shared bytes; keep a private copy.
+    buffer_ = new char[msg.length_];
+    memcpy( buffer_, msg.buffer_, msg.length_ );
+  }
+  else {
+    buffer_ = msg.buffer_;
+    if( msg.isShared() )
+      payload_ = std::move( msg.payload_ );
+  }
+  length_ = msg.length_;
+
+  msg.buffer_ = NULL;
+  msg.length_ = 0;
+  msg.payload_.reset();
+}
+
+
 
 inline
 NPS_RawMessageGC::NPS_RawMessageGC( uint16 id, uint16 len, const char *buff )
   : NPS_RawMessage(id,len,buff )
 {}
 
+
+inline
+NPS_RawMessageGC::NPS_RawMessageGC( uint16 id, uint16 len, char *buff, bool adopt )
+  : NPS_RawMessage( id, len, buff, adopt )
+{}
+
+
+inline
+NPS_RawMessageGC::NPS_RawMessageGC( const NPS_RawMessageGC &msg )
+  : NPS_RawMessage( msg )
+{}
+
+
+inline
+NPS_RawMessageGC::NPS_RawMessageGC( NPS_RawMessageGC &&msg )
+  : NPS_RawMessage( std::move( msg ) )
+{}
+
+
+inline NPS_RawMessageGC &
+NPS_RawMessageGC::operator = ( NPS_RawMessageGC &&msg ) {
+  NPS_RawMessage::operator = ( std::move( msg ) );
+  return *this;
+}
+
+
+inline bool
+NPS_RawMessageGC::_mayShare() const {
+  return false;
+}
+
 inline NPS_RawMessageGC &
 NPS_RawMessageGC::operator = ( const NPS_RawMessageGC &msg ) {
   if( this != &msg ) {
@@ -1206,6 +2023,359 @@ NPS_Serialize::generateChecksum() const {
 }
 
 
+inline void
+NPS_Serialize::_writeHeader( unsigned char *start, uint16 len ) {
+  header_.setAllocation( start );
+  header_.clear();
+  header_.setId( messageId_ );
+  header_.setLength( len );
+  header_.setVersion( messageVersion_ );
+  header_.setChecksum( ( sequenceNumber_ )? sequenceNumber_ : generateChecksum() );
+}
+
+
+inline const struct iovec *
+NPS_Serialize::serialize( NPS_GatherList &gather, uint16 &len ) {
+  len = serializeSizeOf();
+  if( !gather.scratch() || gather.scratchCapacity() < len ) {
+    len = 0;
+    return NULL;
+  }
+
+  serializedBufferPtr_ = gather.begin();
+  if( serializeHeader_ ) {
+    _writeHeader( serializedBufferPtr_, len );
+    // the scratch belongs to the caller; never let the header free it.
+    header_.data_ = NULL;
+    serializedBufferPtr_ += Header::size_;
+  }
+
+  gather_ = &gather;
+  _doSerialize();
+  gather_ = NULL;
+
+  gather.finish( serializedBufferPtr_ );
+
+  if( _sealsChecksum() ) {
+    // the header leads the first fragment, which is always in the scratch.
+    const struct iovec *frag = gather.fragments();
+    const unsigned char *first = static_cast<const unsigned char *>(frag[0].iov_base);
+    NPS_Checksum sum( checksumType_ );
+    sum.update( first, 4*sizeof(uint16) );
+    sum.update( first + Header::size_, frag[0].iov_len - Header::size_ );
+    for( int i = 1; i < gather.count(); ++i )
+      sum.update( frag[i].iov_base, frag[i].iov_len );
+    Header( gather.scratch() ).setChecksum( sum.value() );
+  }
+  return gather.fragments();
+}
+
+
+inline bool
+NPS_Serialize::_sealsChecksum() const {
+  return checksumType_ != NPS_CHECKSUM_LEGACY && serializeHeader_ && !sequenceNumber_;
+}
+
+
+inline uint32
+NPS_Serialize::_checkedLength( const unsigned char *buff, uint32 available ) {
+  if( !buff || !available )
+    return 0;
+  if( CompactHeader::isCompact( buff ) ) {
+    CompactHeader header;
+    if( header.parse( buff, available ) != NPS_DECODE_OK ||
+	header.length() > available )
+      return 0;
+    return header.length();
+  }
+  if( available < (uint32)Header::size_ )
+    return 0;
+  uint16 len = Header( buff ).length();
+  return ( len >= Header::size_ && len <= available )? len : 0;
+}
+
+
+inline uint32
+NPS_Serialize::_bodyChecksum( const unsigned char *buff, uint32 len,
+			      NPS_ChecksumType type ) {
+  NPS_Checksum sum( type );
+  if( CompactHeader::isCompact( buff ) ) {
+    // the header up to its checksum slot, then the body.
+    CompactHeader header;
+    header.parse( buff, len );
+    sum.update( buff, header.size_ - sizeof(header.checksum_) );
+    sum.update( buff + header.size_, header.bodyLength_ );
+    return sum.value();
+  }
+
+  // id, length and version, then the body; never the checksum slot itself.
+  sum.update( buff, 4*sizeof(uint16) );
+  if( len > (uint32)Header::size_ )
+    sum.update( buff + Header::size_, len - Header::size_ );
+  return sum.value();
+}
+
+
+inline bool
+NPS_Serialize::sealChecksum( unsigned char *buff, uint32 available,
+			     NPS_ChecksumType type ) {
+  uint32 len = _checkedLength( buff, available );
+  if( !len )
+    return false;
+  if( type == NPS_CHECKSUM_LEGACY )
+    return true;
+  if( CompactHeader::isCompact( buff ) ) {
+    CompactHeader header;
+    header.parse( buff, len );
+    if( header.flags_ & CompactHeader::hasChecksum_ ) {
+      unsigned int sum = hton( (unsigned int)_bodyChecksum( buff, len, type ) );
+      memcpy( buff + header.size_ - sizeof(sum), &sum, sizeof(sum) );
+    }
+    return true;
+  }
+  Header( buff ).setChecksum( _bodyChecksum( buff, len, type ) );
+  return true;
+}
+
+
+inline bool
+NPS_Serialize::verifyChecksum( const unsigned char *buff, uint32 available,
+			       NPS_ChecksumType type ) {
+  uint32 len = _checkedLength( buff, available );
+  if( !len )
+    return false;
+  if( type == NPS_CHECKSUM_LEGACY )
+    return true;
+  if( CompactHeader::isCompact( buff ) ) {
+    CompactHeader header;
+    header.parse( buff, len );
+    return ( header.flags_ & CompactHeader::hasChecksum_ ) &&
+      header.checksum_ == _bodyChecksum( buff, len, type );
+  }
+  return Header( buff ).checksum() == _bodyChecksum( buff, len, type );
+}
+
+
+inline bool
+NPS_Serialize::deserialize( const unsigned char *buff_in, uint32 available,
+			    NPS_ChecksumType verify, bool deallocate ) {
+  if( !verifyChecksum( buff_in, available, verify ) )
+    return false;
+  deserialize( buff_in, deallocate );
+  return true;
+}
+
+
+inline void
+NPS_Serialize::setChecksumType( NPS_ChecksumType type ) {
+  checksumType_ = type;
+}
+
+
+inline NPS_ChecksumType
+NPS_Serialize::checksumType() const {
+  return checksumType_;
+}
+
+
+inline unsigned char *&
+NPS_Serialize::_serializeCursor() {
+  return serializedBufferPtr_;
+}
+
+
+inline NPS_GatherList *
+NPS_Serialize::_gather() const {
+  return gather_;
+}
+
+
+inline NPS_Decoder *
+NPS_Serialize::_decoder() {
+  // out-of-line readers move only the cursor; catch the decoder up.
+  if( decoder_ )
+    decoder_->seek( serializedBufferPtr_ );
+  return decoder_;
+}
+
+
+inline uint32
+NPS_Serialize::bytesNeeded( const unsigned char *buff, uint32 available ) {
+  if( buff && available && CompactHeader::isCompact( buff ) ) {
+    CompactHeader header;
+    switch( header.parse( buff, available ) ) {
+    case NPS_DECODE_SHORT:
+      return 1;   // the header length is not known until it is all here
+    case NPS_DECODE_BAD:
+      return 0;   // let deserialize() say so
+    default:
+      return ( header.length() > available )? header.length() - available : 0;
+    }
+  }
+  if( !buff || available < (uint32)Header::size_ )
+    return Header::size_ - ( (buff)? available : 0 );
+  uint16 len = Header( buff ).length();
+  return ( len > available )? len - available : 0;
+}
+
+
+inline NPS_DecodeStatus
+NPS_Serialize::deserialize( NPS_Decoder &dec ) {
+  const unsigned char *start = dec.cursor();
+  if( bytesNeeded( start, dec.remaining() ) )
+    return NPS_DECODE_SHORT;
+
+  if( CompactHeader::isCompact( start ) )
+    return _deserializeCompact( dec );
+
+  uint16 len = Header( start ).length();
+  if( len < Header::size_ ) {
+    dec.fail();
+    return NPS_DECODE_BAD;
+  }
+
+  header_.setAllocation( const_cast<unsigned char *>(start) );
+  header_.iOwnTheBuffer_ = false;
+  messageId_ = header_.id();
+  messageVersion_ = header_.version();
+
+  NPS_Decoder body( start + Header::size_, start + len );
+  serializedBufferPtr_ = const_cast<unsigned char *>(body.cursor());
+  decoder_ = &body;
+  _doDeserialize();
+  _decoder();  // one last catch-up, for a reader that ran off the end
+  decoder_ = NULL;
+
+  dec.skip( len );
+  return ( body.failed() )? NPS_DECODE_BAD : NPS_DECODE_OK;
+}
+
+
+inline NPS_DecodeStatus
+NPS_Serialize::_deserializeCompact( NPS_Decoder &dec ) {
+  CompactHeader header;
+  if( header.parse( dec.cursor(), dec.remaining() ) != NPS_DECODE_OK ) {
+    dec.fail();
+    return NPS_DECODE_BAD;
+  }
+
+  header_.setAllocation( NULL );
+  messageId_ = header.id_;
+  messageVersion_ = header.version_;
+
+  dec.skip( header.size_ );
+  NPS_Decoder body = dec.slice( header.bodyLength_ );
+  _doDeserializeCompact( body );
+
+  // trailing bytes mean the peer and this class disagree on the fields.
+  return ( body.failed() || body.remaining() )? NPS_DECODE_BAD : NPS_DECODE_OK;
+}
+
+
+inline bool
+NPS_Serialize::_compactSizeOf( uint16 & ) const {
+  return false;
+}
+
+
+inline bool
+NPS_Serialize::_doSerializeCompact( unsigned char *& ) {
+  return false;
+}
+
+
+inline void
+NPS_Serialize::_doDeserializeCompact( NPS_Decoder &dec ) {
+  dec.fail();
+}
+
+
+inline NPS_Serialize::CompactHeader
+NPS_Serialize::_compactHeader( uint16 body_len ) const {
+  CompactHeader header;
+  header.id_ = messageId_;
+  header.version_ = messageVersion_;
+  header.bodyLength_ = body_len;
+  if( messageVersion_ )
+    header.flags_ |= CompactHeader::hasVersion_;
+  if( sequenceNumber_ || checksumType_ != NPS_CHECKSUM_LEGACY ) {
+    header.flags_ |= CompactHeader::hasChecksum_;
+    header.checksum_ = (unsigned int)sequenceNumber_;
+  }
+  return header;
+}
+
+
+inline uint16
+NPS_Serialize::compactSizeOf() const {
+  uint16 body = 0;
+  if( !_compactSizeOf( body ) )
+    return 0;
+  uint32 size = (uint32)_compactHeader( body ).encodedSize() + body;
+  return ( size <= 0xFFFF )? (uint16)size : 0;
+}
+
+
+inline const unsigned char *
+NPS_Serialize::serializeCompact( unsigned char *buff, uint16 &len ) {
+  len = 0;
+  if( !buff )
+    return NULL;
+
+  // write the body behind a header with a one byte length, rather than
+  // take a sizing pass over the fields first; a body of 128 bytes or
+  // more is shifted up afterwards.
+  CompactHeader header = _compactHeader( 0 );
+  uint16 guess = header.encodedSize();
+  unsigned char *body = buff + guess;
+  unsigned char *p = body;
+  if( !_doSerializeCompact( p ) )
+    return NULL;
+
+  // refuse what \p len could not describe rather than truncate it.
+  uint32 body_len = (uint32)(p - body);
+  if( body_len > 0xFFFF )
+    return NULL;
+  header.bodyLength_ = (uint16)body_len;
+  uint16 size = header.encodedSize();
+  if( (uint32)size + body_len > 0xFFFF )
+    return NULL;
+  if( size != guess )
+    memmove( buff + size, body, header.bodyLength_ );
+  p = buff;
+  header.encode( p );
+  len = size + header.bodyLength_;
+
+  if( !sequenceNumber_ )
+    sealChecksum( buff, len, checksumType_ );
+  return buff;
+}
+
+
+inline const unsigned char *
+NPS_Serialize::serializeCompact( NPS_MessageArena &arena, uint16 &len ) {
+  uint16 size = compactSizeOf();
+  unsigned char *buff = ( size )? arena.allocate( size ) : NULL;
+  if( !buff ) {
+    len = 0;
+    return NULL;
+  }
+  return serializeCompact( buff, len );
+}
+
+
+inline void
+NPS_Serialize::setWireFormat( NPS_WireFormat format ) {
+  wireFormat_ = format;
+}
+
+
+inline NPS_WireFormat
+NPS_Serialize::wireFormat() const {
+  return wireFormat_;
+}
+
+
 inline bool
 NPS_Serialize::serializeHeader() const {
   return serializeHeader_;
@@ -1231,27 +2401,50 @@ NPS_Serialize::setSerializeHeader( bool b ) {
 
 inline
 NPS_Serialize::MessageBuffer::MessageBuffer( const unsigned char *buff,
-					      uint16 len )
+					      uint16 len,
+					      NPS_MessageArena *arena )
   : buffer_(buff),
-    length_(len)
+    length_(len),
+    arena_(arena)
 {}
 
 
 inline
 NPS_Serialize::MessageBuffer::~MessageBuffer() {
-  // for some reason, the Visual C++ compiler couldn't figure out how
-  // to delete an unsigned char allocation
-  delete[] (char *)buffer_;
+  releaseStorage();
   buffer_ = NULL;
   length_ = 0;
 }
 
 
+inline void
+NPS_Serialize::MessageBuffer::releaseStorage() {
+  if( arena_ ) {
+    arena_->release( buffer_ );
+  } else {
+    // for some reason, the Visual C++ compiler couldn't figure out how
+    // to delete an unsigned char allocation
+    delete[] (char *)buffer_;
+  }
+}
+
+
+inline NPS_MessageArena *
+NPS_Serialize::MessageBuffer::arena() const {
+  return arena_;
+}
+
+
 
 inline uint16
 NPS_Serialize::MessageBuffer::messageId() const {
   if( !buffer_ )
     return 0;
+  if( CompactHeader::isCompact( buffer_ ) ) {
+    CompactHeader compact;
+    compact.parse( buffer_, length_ );
+    return compact.id_;
+  }
   NPS_Serialize::Header header( buffer_ );
   return header.id();
 }
@@ -1261,6 +2454,11 @@ inline uint16
 NPS_Serialize::MessageBuffer::messageLength() const {
   if( !buffer_ )
     return 0;
+  if( CompactHeader::isCompact( buffer_ ) ) {
+    CompactHeader compact;
+    compact.parse( buffer_, length_ );
+    return (uint16)compact.length();
+  }
   NPS_Serialize::Header header( buffer_ );
   return header.length();
 }
@@ -1279,7 +2477,7 @@ NPS_Serialize::MessageBuffer::length() const {
 
 inline void
 NPS_Serialize::MessageBuffer::set( const unsigned char *buff, uint16 len ) {
-  delete[] (char *)buffer_;
+  releaseStorage();
   buffer_ = buff;
   length_ = len;
 }
@@ -1288,7 +2486,7 @@ NPS_Serialize::MessageBuffer::set( const unsigned char *buff, uint16 len ) {
 
 inline void
 NPS_Serialize::MessageBuffer::clear() {
-  delete[] (char *)buffer_;
+  releaseStorage();
   buffer_ = NULL;
   length_ = 0;
 }
@@ -1298,9 +2496,9 @@ NPS_Serialize::MessageBuffer::clear() {
 
 inline void
 NPS_Serialize::MessageBuffer::allocate( uint16 len ) {
-  delete[] (char *)buffer_;
+  releaseStorage();
   length_ = len;
-  buffer_ = new unsigned char [length_];
+  buffer_ = ( arena_ )? arena_->allocate( length_ ) : new unsigned char [length_];
 }
 
 
@@ -0,0 +1,758 @@
+//  Name: NPS_SerializeSchema.h
+//
+//  Purpose: compile-time field lists for NPS_Serialize subclasses.
+//
+//  Notes:
+//  ------------------
+//  Hand-written subclasses implement serializeSizeOf(), _doSerialize()
+//  and _doDeserialize() separately, and the three have to be kept in
+//  lockstep by hand.  With an NPS_Schema the fields are declared once;
+//  the three methods are generated from that declaration, each field is
+//  encoded inline (no virtual hop per field), and a message made only
+//  of fixed-size fields gets its size as a compile-time constant.
+//
+//  The wire format is identical to the hand-written methods:
+//  \li scalars are written with _serialize( T ) semantics (network order,
+//      sizeof(T) bytes; bool, int8 and uint8 as a single byte).
+//  \li blobs are written as _serialize( const char *, uint16 ) does: a
+//      uint16 length followed by the bytes.  Serializing to an
+//      NPS_GatherList references large ones in place, as _serializeRef()
+//      does, nested schema members included.
+//  \li nested schema classes are written as _serialize( const NPS_Serialize * )
+//      does: a uint16 length followed by the body, without header.
+//
+//  Nested classes that do not themselves use a schema must still be
+//  serialized by hand (see GLDP_UserStatus).
+//
+//  Every schema class also has a compact (v2) form, written by
+//  NPS_Serialize::serializeCompact():
+//  \li integers wider than a byte are LEB128 varints, zigzag-mapped first
+//      if signed; floats, doubles and single bytes are as above.
+//  \li blob and nested lengths are varints; fixed arrays are element by
+//      element.
+//  \li NPS_ID_LIST_FIELD lists are a varint count plus zigzag deltas, so
+//      a sorted list of nearby ids costs about a byte per id.
+//
+
+#if !defined ( NPS_SERIALIZE_SCHEMA_H_ )
+#define NPS_SERIALIZE_SCHEMA_H_
+
+#include <string.h>
+#include <type_traits>
+#include "NPS_Serialize.h"
+#include "NPS_Varint.h"
+
+
+//! Scalar codec; one byte-swap and one fixed-size copy per field.
+template <class T>
+struct NPS_ScalarCodec {
+  enum {
+    isFixed_   = 1,
+    fixedSize_ = sizeof(T)
+  };
+
+  static uint16 size( const T & ) {
+    return sizeof(T);
+  }
+  static void encode( unsigned char *&p, T val ) {
+    val = hton(val);
+    memcpy( p, &val, sizeof(val) );
+    p += sizeof(val);
+  }
+  static void decode( unsigned char *&p, T &val ) {
+    memcpy( &val, p, sizeof(val) );
+    p += sizeof(val);
+    val = ntoh(val);
+  }
+};
+
+//! single byte values are never swapped.
+template <class T>
+struct NPS_ByteCodec {
+  enum {
+    isFixed_   = 1,
+    fixedSize_ = 1
+  };
+
+  static uint16 size( const T & ) {
+    return 1;
+  }
+  static void encode( unsigned char *&p, T val ) {
+    *p++ = (uint8)val;
+  }
+  static void decode( unsigned char *&p, T &val ) {
+    val = (T)(*p++);
+  }
+};
+
+template <class T> struct NPS_FieldCodec : NPS_ScalarCodec<T> {};
+template <> struct NPS_FieldCodec<bool>  : NPS_ByteCodec<bool> {};
+template <> struct NPS_FieldCodec<int8>  : NPS_ByteCodec<int8> {};
+template <> struct NPS_FieldCodec<uint8> : NPS_ByteCodec<uint8> {};
+
+//! int has no hton() overload of its own; it travels as an unsigned int
+//! of the same width, as in _serialize( int ).
+template <>
+struct NPS_FieldCodec<int> {
+  enum {
+    isFixed_   = 1,
+    fixedSize_ = sizeof(int)
+  };
+
+  static uint16 size( const int & ) {
+    return sizeof(int);
+  }
+  static void encode( unsigned char *&p, int val ) {
+    NPS_ScalarCodec<unsigned int>::encode( p, (unsigned int)val );
+  }
+  static void decode( unsigned char *&p, int &val ) {
+    unsigned int tmp;
+    NPS_ScalarCodec<unsigned int>::decode( p, tmp );
+    val = (int)tmp;
+  }
+};
+
+
+
+//! Compact (v2) codec for everything that is not an integer wider than a byte.
+template <class T,
+	  int Kind = ( std::is_integral<T>::value && sizeof(T) > 1 )?
+		     ( std::is_signed<T>::value ? 2 : 1 ) : 0>
+struct NPS_CompactCodec {
+  static uint16 size( T ) {
+    return NPS_FieldCodec<T>::fixedSize_;
+  }
+  static void encode( unsigned char *&p, T val ) {
+    NPS_FieldCodec<T>::encode( p, val );
+  }
+  static void decode( NPS_Decoder &dec, T &val ) {
+    dec.get( val );
+  }
+};
+
+//! unsigned integers are plain varints.
+template <class T>
+struct NPS_CompactCodec<T, 1> {
+  static uint16 size( T val ) {
+    return varint_size( val );
+  }
+  static void encode( unsigned char *&p, T val ) {
+    varint_encode( p, val );
+  }
+  static void decode( NPS_Decoder &dec, T &val ) {
+    NPS_VARINT v;
+    dec.getVarint( v );
+    val = (T)v;
+  }
+};
+
+//! signed integers are zigzag varints.
+template <class T>
+struct NPS_CompactCodec<T, 2> {
+  static uint16 size( T val ) {
+    return varint_size( zigzag( val ) );
+  }
+  static void encode( unsigned char *&p, T val ) {
+    varint_encode( p, zigzag( val ) );
+  }
+  static void decode( NPS_Decoder &dec, T &val ) {
+    NPS_VARINT v;
+    dec.getVarint( v );
+    val = (T)unzigzag( v );
+  }
+};
+
+
+
+//! A scalar data member, optionally carried on the wire as type \p Wire.
+/*!
+  Use the NPS_FIELD() and NPS_FIELD_AS() macros rather than naming this
+  directly.  NPS_FIELD_AS() is for enums and for members whose C++ type
+  differs from the type that has always been written to the wire.
+*/
+template <class Owner, class M, M Owner::*Member, class Wire = M>
+struct NPS_Field {
+  typedef NPS_FieldCodec<Wire> Codec;
+  enum {
+    isFixed_   = Codec::isFixed_,
+    fixedSize_ = Codec::fixedSize_
+  };
+
+  static uint16 size( const Owner &o ) {
+    return Codec::size( (Wire)(o.*Member) );
+  }
+  static void encode( unsigned char *&p, const Owner &o ) {
+    Codec::encode( p, (Wire)(o.*Member) );
+  }
+  static void encode( NPS_GatherList &, unsigned char *&p, const Owner &o ) {
+    encode( p, o );
+  }
+  static void decode( unsigned char *&p, Owner &o ) {
+    Wire val;
+    Codec::decode( p, val );
+    o.*Member = (M)val;
+  }
+  static void decode( NPS_Decoder &dec, Owner &o ) {
+    Wire val;
+    dec.get( val );
+    o.*Member = (M)val;
+  }
+
+  static uint16 compactSize( const Owner &o ) {
+    return NPS_CompactCodec<Wire>::size( (Wire)(o.*Member) );
+  }
+  static void encodeCompact( unsigned char *&p, const Owner &o ) {
+    NPS_CompactCodec<Wire>::encode( p, (Wire)(o.*Member) );
+  }
+  static void decodeCompact( NPS_Decoder &dec, Owner &o ) {
+    Wire val;
+    NPS_CompactCodec<Wire>::decode( dec, val );
+    o.*Member = (M)val;
+  }
+};
+
+
+//! A fixed char array written as a uint16 length plus \p Length bytes.
+/*!
+  Decoding truncates to the array size and always null-terminates, as
+  _deserialize( char *, uint16, true ) does.
+*/
+template <class Owner, int N, char (Owner::*Data)[N], uint16 Owner::*Length>
+struct NPS_BlobField {
+  enum {
+    isFixed_   = 0,
+    fixedSize_ = 0
+  };
+
+  static uint16 size( const Owner &o ) {
+    return sizeof(uint16) + o.*Length;
+  }
+  static void encode( unsigned char *&p, const Owner &o ) {
+    uint16 len = o.*Length;
+    NPS_ScalarCodec<uint16>::encode( p, len );
+    memcpy( p, o.*Data, len );
+    p += len;
+  }
+  //! as _serializeRef( const char *, uint16 ): a large blob becomes a fragment.
+  static void encode( NPS_GatherList &gather, unsigned char *&p, const Owner &o ) {
+    uint16 len = o.*Length;
+    if( len >= NPS_GatherList::referenceThreshold_ ) {
+      unsigned char *len_at = p;
+      NPS_ScalarCodec<uint16>::encode( p, len );
+      if( unsigned char *next = gather.reference( p, o.*Data, len ) ) {
+	p = next;
+	return;
+      }
+      p = len_at;  // out of fragments; copy as usual.
+    }
+    encode( p, o );
+  }
+  static void decode( unsigned char *&p, Owner &o ) {
+    uint16 len;
+    NPS_ScalarCodec<uint16>::decode( p, len );
+    uint16 keep = ( len < N - 1 )? len : N - 1;
+    memcpy( o.*Data, p, keep );
+    (o.*Data)[keep] = '\0';
+    o.*Length = keep;
+    p += len;
+  }
+  static void decode( NPS_Decoder &dec, Owner &o ) {
+    o.*Length = dec.getBlob( o.*Data, N );
+  }
+
+  static uint16 compactSize( const Owner &o ) {
+    return varint_size( o.*Length ) + o.*Length;
+  }
+  static void encodeCompact( unsigned char *&p, const Owner &o ) {
+    uint16 len = o.*Length;
+    varint_encode( p, len );
+    memcpy( p, o.*Data, len );
+    p += len;
+  }
+  static void decodeCompact( NPS_Decoder &dec, Owner &o ) {
+    NPS_VARINT len;
+    dec.getVarint( len );
+    const unsigned char *src = dec.getRef( (uint32)len );
+    uint16 keep = ( src )? (uint16)(( len < N - 1 )? len : N - 1) : 0;
+    memcpy( o.*Data, src, keep );
+    (o.*Data)[keep] = '\0';
+    o.*Length = keep;
+  }
+};
+
+
+//! A fixed array of scalars, converted with one bulk hton_n()/ntoh_n() pass.
+/*!
+  Same stream as N consecutive NPS_FIELD()s of the element type.
+*/
+template <class Owner, class T, int N, T (Owner::*Data)[N]>
+struct NPS_ArrayField {
+  enum {
+    isFixed_   = 1,
+    fixedSize_ = N * sizeof(T)
+  };
+
+  static uint16 size( const Owner & ) {
+    return N * sizeof(T);
+  }
+  static void encode( unsigned char *&p, const Owner &o ) {
+    hton_n( reinterpret_cast<T *>(p), o.*Data, N );
+    p += N * sizeof(T);
+  }
+  static void encode( NPS_GatherList &, unsigned char *&p, const Owner &o ) {
+    encode( p, o );
+  }
+  static void decode( unsigned char *&p, Owner &o ) {
+    ntoh_n( o.*Data, reinterpret_cast<const T *>(p), N );
+    p += N * sizeof(T);
+  }
+  static void decode( NPS_Decoder &dec, Owner &o ) {
+    dec.getArray( o.*Data, N );
+  }
+
+  static uint16 compactSize( const Owner &o ) {
+    uint16 total = 0;
+    for( int i = 0; i < N; ++i )
+      total += NPS_CompactCodec<T>::size( (o.*Data)[i] );
+    return total;
+  }
+  static void encodeCompact( unsigned char *&p, const Owner &o ) {
+    for( int i = 0; i < N; ++i )
+      NPS_CompactCodec<T>::encode( p, (o.*Data)[i] );
+  }
+  static void decodeCompact( NPS_Decoder &dec, Owner &o ) {
+    for( int i = 0; i < N; ++i )
+      NPS_CompactCodec<T>::decode( dec, (o.*Data)[i] );
+  }
+};
+
+
+//! A list of ids: a fixed array of scalars of which the first \p Count are sent.
+/*!
+  v1 writes a uint16 count, then the ids with one bulk hton_n() pass.
+  v2 writes a varint count, then each id as the zigzag varint of its
+  difference from the one before (the first from 0), so a sorted list of
+  nearby ids costs about a byte each.  The ids need not be sorted.
+
+  A count greater than the array fails a bounds-checked decode; the
+  unchecked decode keeps the first N ids.
+*/
+template <class Owner, class T, int N, T (Owner::*Data)[N], uint16 Owner::*Count>
+struct NPS_IdListField {
+  enum {
+    isFixed_   = 0,
+    fixedSize_ = 0
+  };
+
+  static uint16 count( const Owner &o ) {
+    return ( o.*Count < N )? o.*Count : N;
+  }
+
+  static uint16 size( const Owner &o ) {
+    return sizeof(uint16) + count( o ) * sizeof(T);
+  }
+  static void encode( unsigned char *&p, const Owner &o ) {
+    uint16 n = count( o );
+    NPS_ScalarCodec<uint16>::encode( p, n );
+    hton_n( reinterpret_cast<T *>(p), o.*Data, n );
+    p += n * sizeof(T);
+  }
+  static void encode( NPS_GatherList &, unsigned char *&p, const Owner &o ) {
+    encode( p, o );
+  }
+  static void decode( unsigned char *&p, Owner &o ) {
+    uint16 n;
+    NPS_ScalarCodec<uint16>::decode( p, n );
+    o.*Count = ( n < N )? n : N;
+    ntoh_n( o.*Data, reinterpret_cast<const T *>(p), o.*Count );
+    p += n * sizeof(T);
+  }
+  static void decode( NPS_Decoder &dec, Owner &o ) {
+    uint16 n = 0;
+    dec.get( n );
+    if( n > N ) {
+      dec.fail();
+      n = 0;
+    }
+    dec.getArray( o.*Data, n );
+    o.*Count = n;
+  }
+
+  static uint16 compactSize( const Owner &o ) {
+    uint16 n = count( o );
+    uint16 total = varint_size( n );
+    NPS_VARINT prev = 0;
+    for( uint16 i = 0; i < n; ++i ) {
+      NPS_VARINT cur = (NPS_VARINT)(o.*Data)[i];
+      total += varint_size( zigzag( (long long)(cur - prev) ) );
+      prev = cur;
+    }
+    return total;
+  }
+  static void encodeCompact( unsigned char *&p, const Owner &o ) {
+    uint16 n = count( o );
+    varint_encode( p, n );
+    NPS_VARINT prev = 0;
+    for( uint16 i = 0; i < n; ++i ) {
+      NPS_VARINT cur = (NPS_VARINT)(o.*Data)[i];
+      varint_encode( p, zigzag( (long long)(cur - prev) ) );
+      prev = cur;
+    }
+  }
+  static void decodeCompact( NPS_Decoder &dec, Owner &o ) {
+    NPS_VARINT n;
+    dec.getVarint( n );
+    if( n > N ) {
+      dec.fail();
+      n = 0;
+    }
+    // modular arithmetic, so any T round-trips whatever the deltas.
+    NPS_VARINT prev = 0;
+    for( uint16 i = 0; i < (uint16)n; ++i ) {
+      NPS_VARINT delta;
+      dec.getVarint( delta );
+      prev += (NPS_VARINT)unzigzag( delta );
+      (o.*Data)[i] = (T)prev;
+    }
+    o.*Count = (uint16)n;
+  }
+};
+
+
+//! A member that is itself an NPS_SchemaSerialize class; encoded inline.
+template <class Owner, class M, M Owner::*Member>
+struct NPS_NestedField {
+  typedef typename M::Schema Nested;
+  enum {
+    isFixed_   = Nested::isFixed_,
+    fixedSize_ = sizeof(uint16) + Nested::fixedSize_
+  };
+
+  static uint16 size( const Owner &o ) {
+    return sizeof(uint16) + Nested::sizeOf( o.*Member );
+  }
+  static void encode( unsigned char *&p, const Owner &o ) {
+    NPS_ScalarCodec<uint16>::encode( p, Nested::sizeOf( o.*Member ) );
+    Nested::encode( p, o.*Member );
+  }
+  static void encode( NPS_GatherList &gather, unsigned char *&p, const Owner &o ) {
+    NPS_ScalarCodec<uint16>::encode( p, Nested::sizeOf( o.*Member ) );
+    Nested::encode( &gather, p, o.*Member );
+  }
+  static void decode( unsigned char *&p, Owner &o ) {
+    uint16 len;
+    NPS_ScalarCodec<uint16>::decode( p, len );
+    unsigned char *end = p + len;
+    Nested::decode( p, o.*Member );
+    p = end;
+  }
+  static void decode( NPS_Decoder &dec, Owner &o ) {
+    NPS_Decoder body = dec.nested();
+    Nested::decode( body, o.*Member );
+    dec.merge( body );
+  }
+
+  static uint16 compactSize( const Owner &o ) {
+    uint16 len = Nested::compactSizeOf( o.*Member );
+    return varint_size( len ) + len;
+  }
+  static void encodeCompact( unsigned char *&p, const Owner &o ) {
+    // as NPS_Serialize::serializeCompact(): guess a one byte length.
+    unsigned char *body = p + 1;
+    unsigned char *end = body;
+    Nested::encodeCompact( end, o.*Member );
+    uint16 len = (uint16)(end - body);
+    uint16 extra = varint_size( len ) - 1;
+    if( extra )
+      memmove( body + extra, body, len );
+    varint_encode( p, len );
+    p += len;
+  }
+  static void decodeCompact( NPS_Decoder &dec, Owner &o ) {
+    NPS_VARINT len;
+    dec.getVarint( len );
+    NPS_Decoder body = dec.slice( (uint32)len );
+    Nested::decodeCompact( body, o.*Member );
+    dec.merge( body );
+  }
+};
+
+
+#define NPS_FIELD( owner, member ) \
+  NPS_Field< owner, decltype(owner::member), &owner::member >
+#define NPS_FIELD_AS( owner, member, wire ) \
+  NPS_Field< owner, decltype(owner::member), &owner::member, wire >
+#define NPS_BLOB_FIELD( owner, data, length ) \
+  NPS_BlobField< owner, sizeof(owner::data), &owner::data, &owner::length >
+#define NPS_ARRAY_FIELD( owner, member ) \
+  NPS_ArrayField< owner, \
+                  typename std::remove_extent<decltype(owner::member)>::type, \
+                  std::extent<decltype(owner::member)>::value, \
+                  &owner::member >
+#define NPS_NESTED_FIELD( owner, member ) \
+  NPS_NestedField< owner, decltype(owner::member), &owner::member >
+#define NPS_ID_LIST_FIELD( owner, data, count ) \
+  NPS_IdListField< owner, \
+                   typename std::remove_extent<decltype(owner::data)>::type, \
+                   std::extent<decltype(owner::data)>::value, \
+                   &owner::data, &owner::count >
+
+
+
+//! compile-time sums over a field list.
+template <class... Fields>
+struct NPS_SchemaSum {
+  enum {
+    isFixed_   = 1,
+    fixedSize_ = 0
+  };
+};
+
+template <class First, class... Rest>
+struct NPS_SchemaSum<First, Rest...> {
+  enum {
+    isFixed_   = First::isFixed_ && NPS_SchemaSum<Rest...>::isFixed_,
+    fixedSize_ = First::fixedSize_ + NPS_SchemaSum<Rest...>::fixedSize_
+  };
+};
+
+
+//! An ordered list of fields.
+/*!
+  The encode/decode order is the declaration order.  Each field is a
+  static, non-virtual call, so the whole list inlines into a straight
+  sequence of copies and byte-swaps.
+
+  \code
+  typedef NPS_Schema< NPS_FIELD( myClass, myInt ),
+                      NPS_BLOB_FIELD( myClass, myData, myDataLen ) > Schema;
+  \endcode
+*/
+template <class... Fields>
+struct NPS_Schema {
+  enum {
+    //! true if every field has a fixed wire size.
+    isFixed_   = NPS_SchemaSum<Fields...>::isFixed_,
+    //! the wire size of the fixed-size fields (the full body size if isFixed_).
+    fixedSize_ = NPS_SchemaSum<Fields...>::fixedSize_
+  };
+
+  //! body size in bytes, excluding any header.
+  template <class Owner>
+  static uint16 sizeOf( const Owner &o ) {
+    if( isFixed_ )
+      return fixedSize_;
+    uint16 total = 0;
+    int expand[] = { 0, (total += Fields::size( o ), 0)... };
+    (void)expand;
+    return total;
+  }
+
+  //! write every field at \p p, advancing it.
+  template <class Owner>
+  static void encode( unsigned char *&p, const Owner &o ) {
+    int expand[] = { 0, (Fields::encode( p, o ), 0)... };
+    (void)expand;
+  }
+
+  //! as encode( p, o ), but large blobs are referenced through \p gather if set.
+  template <class Owner>
+  static void encode( NPS_GatherList *gather, unsigned char *&p, const Owner &o ) {
+    if( !gather ) {
+      encode( p, o );
+      return;
+    }
+    int expand[] = { 0, (Fields::encode( *gather, p, o ), 0)... };
+    (void)expand;
+  }
+
+  //! read every field from \p p, advancing it.
+  template <class Owner>
+  static void decode( unsigned char *&p, Owner &o ) {
+    int expand[] = { 0, (Fields::decode( p, o ), 0)... };
+    (void)expand;
+  }
+
+  //! read every field from \p dec; check dec.failed() afterwards.
+  template <class Owner>
+  static void decode( NPS_Decoder &dec, Owner &o ) {
+    int expand[] = { 0, (Fields::decode( dec, o ), 0)... };
+    (void)expand;
+  }
+
+  /** @name compact (v2) form
+   *  never fixed-size; the size depends on the values.
+   */
+  //@{
+  template <class Owner>
+  static uint16 compactSizeOf( const Owner &o ) {
+    uint16 total = 0;
+    int expand[] = { 0, (total += Fields::compactSize( o ), 0)... };
+    (void)expand;
+    return total;
+  }
+
+  template <class Owner>
+  static void encodeCompact( unsigned char *&p, const Owner &o ) {
+    int expand[] = { 0, (Fields::encodeCompact( p, o ), 0)... };
+    (void)expand;
+  }
+
+  template <class Owner>
+  static void decodeCompact( NPS_Decoder &dec, Owner &o ) {
+    int expand[] = { 0, (Fields::decodeCompact( dec, o ), 0)... };
+    (void)expand;
+  }
+  //@}
+};
+
+
+
+//! Generates the NPS_Serialize derivation methods from \p Derived::Schema.
+/*!
+  Derive from NPS_SchemaSerialize<myClass> (or NPS_SchemaSerialize<myClass,
+  MyParent> to extend a hand-written parent) and declare a Schema typedef;
+  the three derivation methods are then provided, along with the compact
+  (v2) ones.  The parent's methods are called first, as the hand-written
+  convention requires.  A hand-written parent has no compact form, so
+  neither does a class that extends one.
+
+  The Schema typedef must be public and must follow the member
+  declarations it names.
+
+  \code
+  class myClass : public NPS_SchemaSerialize<myClass> {
+  private:
+    int   myInt;
+    char  myData[256];
+    uint16 myDataLen;
+
+  public:
+    typedef NPS_Schema< NPS_FIELD( myClass, myInt ),
+                        NPS_BLOB_FIELD( myClass, myData, myDataLen ) > Schema;
+  };
+
+  // fixed-size messages can size buffers at compile time:
+  unsigned char buff[ NPS_Serialize::Header::size_ + myFixedClass::Schema::fixedSize_ ];
+  \endcode
+*/
+template <class Derived, class Base = NPS_Serialize>
+class NPS_SchemaSerialize : public Base {
+public:
+
+  using Base::Base;
+
+  //! reimplemented from NPS_Serialize.
+  virtual uint16        serializeSizeOf() const;
+  //! reimplemented from NPS_Serialize.
+  virtual void          _doSerialize();
+  //! reimplemented from NPS_Serialize.
+  virtual void          _doDeserialize();
+
+  //! reimplemented from NPS_Serialize.
+  virtual bool          _compactSizeOf( uint16 &size ) const;
+  //! reimplemented from NPS_Serialize.
+  virtual bool          _doSerializeCompact( unsigned char *&p );
+  //! reimplemented from NPS_Serialize.
+  virtual void          _doDeserializeCompact( NPS_Decoder &dec );
+
+private:
+
+  //! NPS_Serialize's own methods are pure; only real parents are chained.
+  static void           _baseSerialize( NPS_Serialize & ) {}
+  static void           _baseDeserialize( NPS_Serialize & ) {}
+  template <class B>
+  static void           _baseSerialize( B &b )   { b.B::_doSerialize(); }
+  template <class B>
+  static void           _baseDeserialize( B &b ) { b.B::_doDeserialize(); }
+
+  static bool           _baseCompactSizeOf( const NPS_Serialize &, uint16 &size ) {
+    size = 0;
+    return true;
+  }
+  static bool           _baseSerializeCompact( NPS_Serialize &, unsigned char *& ) {
+    return true;
+  }
+  static void           _baseDeserializeCompact( NPS_Serialize &, NPS_Decoder & ) {}
+  template <class B>
+  static bool           _baseCompactSizeOf( const B &b, uint16 &size ) {
+    return b.B::_compactSizeOf( size );
+  }
+  template <class B>
+  static bool           _baseSerializeCompact( B &b, unsigned char *&p ) {
+    return b.B::_doSerializeCompact( p );
+  }
+  template <class B>
+  static void           _baseDeserializeCompact( B &b, NPS_Decoder &dec ) {
+    b.B::_doDeserializeCompact( dec );
+  }
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////
+//
+//    I N L I N E   M E T H O D S
+//
+
+template <class Derived, class Base>
+inline uint16
+NPS_SchemaSerialize<Derived, Base>::serializeSizeOf() const {
+  return Base::serializeSizeOf() +
+    Derived::Schema::sizeOf( static_cast<const Derived &>(*this) );
+}
+
+
+template <class Derived, class Base>
+inline void
+NPS_SchemaSerialize<Derived, Base>::_doSerialize() {
+  _baseSerialize( static_cast<Base &>(*this) );
+  Derived::Schema::encode( this->_gather(), this->_serializeCursor(),
+			   static_cast<const Derived &>(*this) );
+}
+
+
+template <class Derived, class Base>
+inline void
+NPS_SchemaSerialize<Derived, Base>::_doDeserialize() {
+  _baseDeserialize( static_cast<Base &>(*this) );
+  if( NPS_Decoder *dec = this->_decoder() ) {
+    Derived::Schema::decode( *dec, static_cast<Derived &>(*this) );
+    this->_serializeCursor() = const_cast<unsigned char *>(dec->cursor());
+  }
+  else
+    Derived::Schema::decode( this->_serializeCursor(),
+			     static_cast<Derived &>(*this) );
+}
+
+
+
+template <class Derived, class Base>
+inline bool
+NPS_SchemaSerialize<Derived, Base>::_compactSizeOf( uint16 &size ) const {
+  if( !_baseCompactSizeOf( static_cast<const Base &>(*this), size ) )
+    return false;
+  size += Derived::Schema::compactSizeOf( static_cast<const Derived &>(*this) );
+  return true;
+}
+
+
+template <class Derived, class Base>
+inline bool
+NPS_SchemaSerialize<Derived, Base>::_doSerializeCompact( unsigned char *&p ) {
+  if( !_baseSerializeCompact( static_cast<Base &>(*this), p ) )
+    return false;
+  Derived::Schema::encodeCompact( p, static_cast<const Derived &>(*this) );
+  return true;
+}
+
+
+template <class Derived, class Base>
+inline void
+NPS_SchemaSerialize<Derived, Base>::_doDeserializeCompact( NPS_Decoder &dec ) {
+  _baseDeserializeCompact( static_cast<Base &>(*this), dec );
+  Derived::Schema::decodeCompact( dec, static_cast<Derived &>(*this) );
+}
+
+
+#endif // #if !defined ( NPS_SERIALIZE_SCHEMA_H_ )
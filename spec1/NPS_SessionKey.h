@@ -17,6 +17,7 @@
 
 
 #include <NPS_Serialize.h>
+#include <NPS_SerializeSchema.h>
 #include <NPSTypes.h>
 
 //! class that encapsulates a session key
@@ -26,7 +27,7 @@
 */
 
 
-class NPS_SessionKey : public NPS_Serialize {
+class NPS_SessionKey : public NPS_SchemaSerialize<NPS_SessionKey> {
 public:
 
   //! default constructor.
@@ -68,21 +69,18 @@ public:
   //! returns the key length. will be <= maxLength()
   uint16                length() const;
 
-
-  // NPS_Serialize virtual methods implementation.
-  //! returns the length of the buffer required to serialize this class.
-  virtual uint16        serializeSizeOf() const;
-  //! perform the serialization.
-  virtual void          _doSerialize();
-  //! deserialize into this class.
-  virtual void          _doDeserialize();
-
 private:
 
   char                  key_[maxLength_+1];
   uint16                keyLength_;
   time_t                expiryDate_;
 
+public:
+
+  //! wire layout; NPS_SchemaSerialize generates the NPS_Serialize methods from it.
+  typedef NPS_Schema< NPS_BLOB_FIELD( NPS_SessionKey, key_, keyLength_ ),
+                      NPS_FIELD( NPS_SessionKey, expiryDate_ ) > Schema;
+
 };
 
 
@@ -155,28 +153,6 @@ NPS_SessionKey::setExpiryDate( time_t t ) {
 }
 
 
-// returns the length of the buffer required to serialize this class.
-inline uint16
-NPS_SessionKey::serializeSizeOf() const {
-  return NPS_Serialize::serializeSizeOf() +
-    _serializeSizeOf( key_, keyLength_ ) +
-    _serializeSizeOf( expiryDate_ );
-}
-
-// perform the serialization.
-inline void
-NPS_SessionKey::_doSerialize() {
-  _serialize( key_, keyLength_ );
-  _serialize( expiryDate_ );
-}
-
-// deserialize into this class.
-inline void
-NPS_SessionKey::_doDeserialize() {
-  keyLength_ = _deserialize( key_, maxLength_ );
-  _deserialize( expiryDate_ );
-}
-
 //XXX fixme!
 inline bool
 NPS_SessionKey::isValid() const {
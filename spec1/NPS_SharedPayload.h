@@ -0,0 +1,243 @@
+//  Name: NPS_SharedPayload.h
+//
+//  Purpose: reference counted, immutable message blob.
+//
+//  Notes:
+//  ------------------
+//  Relaying one inbound message to N recipients used to mean N copies of
+//  its blob, one per NPS_RawMessage.  An NPS_SharedPayload holds the blob
+//  once; every NPS_RawMessage built on it refers to the same bytes, and
+//  the last one to go frees them.
+//
+//  The count is a std::atomic, so payloads may be shared between
+//  connection threads.  The bytes themselves are never written after
+//  construction.
+//
+
+#if !defined ( NPS_SHARED_PAYLOAD_H_ )
+#define NPS_SHARED_PAYLOAD_H_
+
+#include <string.h>
+#include <atomic>
+#include <new>
+#include "NPS_Utils.h"
+
+
+//! A handle on a reference counted blob; copying the handle shares the blob.
+/*!
+  \code
+  NPS_RawMessageGC in;
+  in.deserialize( buff );
+  uint16 len;
+  char *blob = in.detach( len );                          // no copy
+  NPS_SharedPayload payload = NPS_SharedPayload::adopt( blob, len );
+
+  for( int i = 0; i < recipients; ++i ) {
+    NPS_RawMessage out( NPS_GAME_MESSAGE_LONG, payload );  // no copy
+    ...
+  }
+  \endcode
+*/
+class NPS_SharedPayload {
+public:
+
+  //! an empty payload.
+  NPS_SharedPayload();
+
+  //! a payload holding a copy of \p len bytes at \p data; one allocation.
+  NPS_SharedPayload( const char *data, uint16 len );
+
+  //! a payload that takes over \p data, which must come from new[].
+  static NPS_SharedPayload adopt( char *data, uint16 len );
+
+  //! shares \p p's blob.
+  NPS_SharedPayload( const NPS_SharedPayload &p );
+  //! takes \p p's reference, leaving \p p empty.
+  NPS_SharedPayload( NPS_SharedPayload &&p );
+
+  NPS_SharedPayload &   operator = ( const NPS_SharedPayload &p );
+  NPS_SharedPayload &   operator = ( NPS_SharedPayload &&p );
+
+  //! drops this reference; the blob goes with the last one.
+  ~NPS_SharedPayload();
+
+  //! the bytes, or NULL if empty.
+  const char *          data() const;
+
+  //! the number of bytes.
+  uint16                length() const;
+
+  //! the number of handles sharing the blob; 0 if empty.
+  long                  useCount() const;
+
+  //! drop this reference, leaving the handle empty.
+  void                  reset();
+
+private:
+
+  //! the count and the bytes; a copied blob follows its Block in memory.
+  struct Block {
+    std::atomic<long>   count_;
+    char *              data_;
+    uint16              length_;
+    bool                adopted_;
+  };
+
+  explicit NPS_SharedPayload( Block *block );
+
+  static Block *        _allocate( uint16 len );
+  void                  _incRef();
+  void                  _decRef();
+
+  Block *               block_;
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////
+//
+//    I N L I N E   M E T H O D S
+//
+
+inline
+NPS_SharedPayload::NPS_SharedPayload()
+  : block_(NULL)
+{}
+
+
+inline
+NPS_SharedPayload::NPS_SharedPayload( Block *block )
+  : block_(block)
+{}
+
+
+inline
+NPS_SharedPayload::NPS_SharedPayload( const char *data, uint16 len )
+  : block_(NULL)
+{
+  if( !data )
+    return;
+  block_ = _allocate( len );
+  block_->data_ = reinterpret_cast<char *>(block_ + 1);
+  memcpy( block_->data_, data, len );
+}
+
+
+inline NPS_SharedPayload
+NPS_SharedPayload::adopt( char *data, uint16 len ) {
+  if( !data )
+    return NPS_SharedPayload();
+  Block *block = _allocate( 0 );
+  block->data_ = data;
+  block->length_ = len;
+  block->adopted_ = true;
+  return NPS_SharedPayload( block );
+}
+
+
+inline
+NPS_SharedPayload::NPS_SharedPayload( const NPS_SharedPayload &p )
+  : block_(p.block_)
+{
+  _incRef();
+}
+
+
+inline
+NPS_SharedPayload::NPS_SharedPayload( NPS_SharedPayload &&p )
+  : block_(p.block_)
+{
+  p.block_ = NULL;
+}
+
+
+inline NPS_SharedPayload &
+NPS_SharedPayload::operator = ( const NPS_SharedPayload &p ) {
+  if( block_ != p.block_ ) {
+    _decRef();
+    block_ = p.block_;
+    _incRef();
+  }
+  return *this;
+}
+
+
+inline NPS_SharedPayload &
+NPS_SharedPayload::operator = ( NPS_SharedPayload &&p ) {
+  if( this != &p ) {
+    _decRef();
+    block_ = p.block_;
+    p.block_ = NULL;
+  }
+  return *this;
+}
+
+
+inline
+NPS_SharedPayload::~NPS_SharedPayload() {
+  _decRef();
+}
+
+
+inline const char *
+NPS_SharedPayload::data() const {
+  return ( block_ )? block_->data_ : NULL;
+}
+
+
+inline uint16
+NPS_SharedPayload::length() const {
+  return ( block_ )? block_->length_ : 0;
+}
+
+
+inline long
+NPS_SharedPayload::useCount() const {
+  return ( block_ )? block_->count_.load( std::memory_order_relaxed ) : 0;
+}
+
+
+inline void
+NPS_SharedPayload::reset() {
+  _decRef();
+  block_ = NULL;
+}
+
+
+inline NPS_SharedPayload::Block *
+NPS_SharedPayload::_allocate( uint16 len ) {
+  // new[] of char is aligned for any type, so the Block can lead it.
+  Block *block = new( new char[sizeof(Block) + len] ) Block;
+  block->count_.store( 1, std::memory_order_relaxed );
+  block->data_ = NULL;
+  block->length_ = len;
+  block->adopted_ = false;
+  return block;
+}
+
+
+inline void
+NPS_SharedPayload::_incRef() {
+  if( !block_ )
+    return;
+  // a new handle comes from an existing one, so nothing needs ordering.
+  block_->count_.fetch_add( 1, std::memory_order_relaxed );
+}
+
+
+inline void
+NPS_SharedPayload::_decRef() {
+  if( !block_ )
+    return;
+  // release our use of the bytes; the last handle acquires everyone's.
+  if( block_->count_.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ) {
+    if( block_->adopted_ )
+      delete[] block_->data_;
+    block_->~Block();
+    delete[] reinterpret_cast<char *>(block_);
+  }
+  block_ = NULL;
+}
+
+
+#endif // #if !defined ( NPS_SHARED_PAYLOAD_H_ )
@@ -18,8 +18,12 @@
 #include <time.h>
 
 
+#include <stddef.h>  // size_t
+
+
 #if defined ( WIN32 )
 #include <winsock.h>
+#include <stdlib.h>  // _byteswap_xxx()
 #else
 #include <arpa/inet.h>  // for ntohx() and htonx()
 #include <sys/isa_defs.h>  // _BIG_ENDIAN
@@ -31,6 +35,33 @@
 #define NPS_BIG_ENDIAN
 #endif
 
+// Vector byte-swap kernels for hton_n()/ntoh_n(). Selected at compile
+// time from the target flags (-mssse3, -mavx2, /arch:AVX2); define
+// NPS_NO_SIMD to force the scalar path.
+#if !defined ( NPS_NO_SIMD ) && defined ( NPS_LITTLE_ENDIAN )
+# if defined ( __AVX2__ )
+#  include <immintrin.h>
+#  define NPS_BSWAP_AVX2
+#  define NPS_BSWAP_SSSE3
+# elif defined ( __SSSE3__ )
+#  include <tmmintrin.h>
+#  define NPS_BSWAP_SSSE3
+# endif
+#endif
+
+// single-instruction byte swaps.
+#if defined ( _MSC_VER )
+# define NPS_BSWAP16(x)  _byteswap_ushort(x)
+# define NPS_BSWAP32(x)  _byteswap_ulong(x)
+# define NPS_BSWAP64(x)  _byteswap_uint64(x)
+typedef unsigned __int64    NPS_SWAP64;
+#else
+# define NPS_BSWAP16(x)  __builtin_bswap16(x)
+# define NPS_BSWAP32(x)  __builtin_bswap32(x)
+# define NPS_BSWAP64(x)  __builtin_bswap64(x)
+typedef unsigned long long  NPS_SWAP64;
+#endif
+
 
 class NPS_TimeString {
 public:
@@ -127,6 +158,38 @@ inline double64         ntoh( double64 val );
 char *
 reverse_byte_order( char *in, uint16 len );
 
+// reverse the bytes of a floating point value via its bit pattern.
+inline float32          reverse_bytes( float32 val );
+inline double64         reverse_bytes( double64 val );
+
+
+//! byte-swap an array of \p count elements of \p size bytes each.
+/*!
+  \p size must be 2, 4 or 8; any other size is copied unchanged.
+  \p dst may equal \p src (in-place swap) but must not partially overlap it.
+  Uses SSSE3/AVX2 shuffles when compiled for them, else a scalar loop.
+*/
+inline void             byte_swap_n( void *dst, const void *src,
+                                     size_t count, size_t size );
+
+//@{
+//! bulk hton()/ntoh() over arrays.
+/*!
+  Each element is converted as a sizeof(T)-byte integer (or IEEE value),
+  which is the same wire image as calling hton() on each element in turn
+  for every type whose hton() keeps its width.
+  On big-endian hosts these only copy.
+*/
+template <class T>
+inline void             hton_n( T *dst, const T *src, size_t count );
+template <class T>
+inline void             ntoh_n( T *dst, const T *src, size_t count );
+template <class T>
+inline void             hton_n( T *vals, size_t count );
+template <class T>
+inline void             ntoh_n( T *vals, size_t count );
+//@}
+
 
 inline bool
 hton( bool val ) {
@@ -207,7 +270,7 @@ hton( uint32 val ) {
 inline uint64
 hton( uint64 val ) {
 #if defined ( NPS_LITTLE_ENDIAN )
-  reverse_byte_order( reinterpret_cast<char *>(&val), sizeof(val) );
+  val = NPS_BSWAP64( val );
 #endif
   return val;
 }
@@ -217,7 +280,7 @@ hton( uint64 val ) {
 inline float32
 hton( float32 val ) {
 #if defined ( NPS_LITTLE_ENDIAN )
-  reverse_byte_order( reinterpret_cast<char *>(&val), sizeof(val) );
+  val = reverse_bytes( val );
 #endif
   return val;
 }
@@ -226,7 +289,7 @@ hton( float32 val ) {
 inline double64
 hton( double64 val ) {
 #if defined ( NPS_LITTLE_ENDIAN )
-  reverse_byte_order( reinterpret_cast<char *>(&val), sizeof(val) );
+  val = reverse_bytes( val );
 #endif
   return val;
 }
@@ -247,7 +310,7 @@ ntoh( uint32 val ) {
 inline uint64
 ntoh( uint64 val ) {
 #if defined ( NPS_LITTLE_ENDIAN )
-  reverse_byte_order( reinterpret_cast<char *>(&val), sizeof(val) );
+  val = NPS_BSWAP64( val );
 #endif
   return val;
 }
@@ -257,7 +320,7 @@ ntoh( uint64 val ) {
 inline float32
 ntoh( float32 val ) {
 #if defined ( NPS_LITTLE_ENDIAN )
-  reverse_byte_order( reinterpret_cast<char *>(&val), sizeof(val) );
+  val = reverse_bytes( val );
 #endif
   return val;
 }
@@ -265,12 +328,141 @@ ntoh( float32 val ) {
 inline double64
 ntoh( double64 val ) {
 #if defined ( NPS_LITTLE_ENDIAN )
-  reverse_byte_order( reinterpret_cast<char *>(&val), sizeof(val) );
+  val = reverse_bytes( val );
 #endif
   return val;
 }
 
 
+// memcpy() keeps this free of aliasing trouble; it compiles to a register move.
+inline float32
+reverse_bytes( float32 val ) {
+  unsigned int bits;
+  memcpy( &bits, &val, sizeof(bits) );
+  bits = NPS_BSWAP32( bits );
+  memcpy( &val, &bits, sizeof(val) );
+  return val;
+}
+
+inline double64
+reverse_bytes( double64 val ) {
+  NPS_SWAP64 bits;
+  memcpy( &bits, &val, sizeof(bits) );
+  bits = NPS_BSWAP64( bits );
+  memcpy( &val, &bits, sizeof(val) );
+  return val;
+}
+
+
+
+// bulk conversion.
+
+#if defined ( NPS_BSWAP_SSSE3 )
+// shuffle control reversing each \p size byte lane of a 16 byte vector.
+inline __m128i
+byte_swap_mask( size_t size ) {
+  switch( size ) {
+  case 2:
+    return _mm_setr_epi8( 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 );
+  case 4:
+    return _mm_setr_epi8( 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 );
+  default:
+    return _mm_setr_epi8( 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 );
+  }
+}
+#endif
+
+
+inline void
+byte_swap_n( void *dst, const void *src, size_t count, size_t size ) {
+  unsigned char *       d = static_cast<unsigned char *>(dst);
+  const unsigned char * s = static_cast<const unsigned char *>(src);
+  size_t                bytes = count * size;
+  size_t                i = 0;
+
+  if( size != 2 && size != 4 && size != 8 ) {
+    if( d != s )
+      memmove( d, s, bytes );
+    return;
+  }
+
+#if defined ( NPS_BSWAP_SSSE3 )
+  const __m128i mask = byte_swap_mask( size );
+#if defined ( NPS_BSWAP_AVX2 )
+  const __m256i mask256 = _mm256_broadcastsi128_si256( mask );
+  for( ; i + 32 <= bytes; i += 32 ) {
+    __m256i v = _mm256_loadu_si256( reinterpret_cast<const __m256i *>(s + i) );
+    _mm256_storeu_si256( reinterpret_cast<__m256i *>(d + i),
+                         _mm256_shuffle_epi8( v, mask256 ) );
+  }
+#endif
+  for( ; i + 16 <= bytes; i += 16 ) {
+    __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i *>(s + i) );
+    _mm_storeu_si128( reinterpret_cast<__m128i *>(d + i),
+                      _mm_shuffle_epi8( v, mask ) );
+  }
+#endif
+
+  // scalar loop; also the tail of the vector loops.
+  switch( size ) {
+  case 2:
+    for( ; i < bytes; i += 2 ) {
+      unsigned short v;
+      memcpy( &v, s + i, sizeof(v) );
+      v = NPS_BSWAP16( v );
+      memcpy( d + i, &v, sizeof(v) );
+    }
+    break;
+  case 4:
+    for( ; i < bytes; i += 4 ) {
+      unsigned int v;
+      memcpy( &v, s + i, sizeof(v) );
+      v = NPS_BSWAP32( v );
+      memcpy( d + i, &v, sizeof(v) );
+    }
+    break;
+  default:
+    for( ; i < bytes; i += 8 ) {
+      NPS_SWAP64 v;
+      memcpy( &v, s + i, sizeof(v) );
+      v = NPS_BSWAP64( v );
+      memcpy( d + i, &v, sizeof(v) );
+    }
+    break;
+  }
+}
+
+
+template <class T>
+inline void
+hton_n( T *dst, const T *src, size_t count ) {
+#if defined ( NPS_LITTLE_ENDIAN )
+  byte_swap_n( dst, src, count, sizeof(T) );
+#else
+  if( dst != src )
+    memmove( dst, src, count * sizeof(T) );
+#endif
+}
+
+template <class T>
+inline void
+ntoh_n( T *dst, const T *src, size_t count ) {
+  hton_n( dst, src, count );  // the swap is its own inverse.
+}
+
+template <class T>
+inline void
+hton_n( T *vals, size_t count ) {
+  hton_n( vals, vals, count );
+}
+
+template <class T>
+inline void
+ntoh_n( T *vals, size_t count ) {
+  hton_n( vals, vals, count );
+}
+
+
 
 
 
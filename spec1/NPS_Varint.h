@@ -0,0 +1,85 @@
+//  Name: NPS_Varint.h
+//
+//  Purpose: LEB128 / zigzag integer encoding for the compact (v2) wire format.
+//
+//  Notes:
+//  ------------------
+//  A varint stores 7 bits per byte, low bits first, with the top bit of
+//  each byte set if another byte follows (unsigned LEB128).  Values below
+//  128 take one byte, below 16384 two, and so on; a 64-bit value takes at
+//  most 10.  Signed values are zigzag-mapped first (0, -1, 1, -2, ... ->
+//  0, 1, 2, 3, ...) so that small negative numbers stay short too.
+//
+//  Decoding is bounds-checked and lives in NPS_Decoder::getVarint().
+//
+
+#if !defined ( NPS_VARINT_H_ )
+#define NPS_VARINT_H_
+
+#include "NPS_Utils.h"
+
+//! the widest integer a varint carries.
+typedef NPS_SWAP64          NPS_VARINT;
+
+enum {
+  NPS_VARINT_MAX_SIZE = 10    //!< bytes in the longest varint
+};
+
+//! bytes varint_encode() will write for \p val.
+inline uint16               varint_size( NPS_VARINT val );
+
+//! write \p val at \p p, advancing it.
+inline void                 varint_encode( unsigned char *&p, NPS_VARINT val );
+
+//! map a signed value onto the unsigned varint range.
+inline NPS_VARINT           zigzag( long long val );
+
+//! the inverse of zigzag().
+inline long long            unzigzag( NPS_VARINT val );
+
+
+
+////////////////////////////////////////////////////////////////////////////
+//
+//    I N L I N E   M E T H O D S
+//
+
+inline uint16
+varint_size( NPS_VARINT val ) {
+#if defined ( __GNUC__ )
+  // 7 bits per byte, by the position of the highest set bit.
+  return (uint16)( ( 64 - __builtin_clzll( val | 1 ) + 6 ) / 7 );
+#else
+  uint16 size = 1;
+  while( val >= 0x80 ) {
+    val >>= 7;
+    ++size;
+  }
+  return size;
+#endif
+}
+
+
+inline void
+varint_encode( unsigned char *&p, NPS_VARINT val ) {
+  while( val >= 0x80 ) {
+    *p++ = (unsigned char)(val | 0x80);
+    val >>= 7;
+  }
+  *p++ = (unsigned char)val;
+}
+
+
+inline NPS_VARINT
+zigzag( long long val ) {
+  return ( (NPS_VARINT)val << 1 ) ^ (NPS_VARINT)( val >> 63 );
+}
+
+
+inline long long
+unzigzag( NPS_VARINT val ) {
+  return (long long)( val >> 1 ) ^ -(long long)( val & 1 );
+}
+
+
+#endif // #if !defined ( NPS_VARINT_H_ )
@@ -0,0 +1,140 @@
+/*************************************************************************
+ File Name:     NPSListenerGroup_bench.cpp
+
+ Purpose:       Accept-rate benchmark for NPSListenerGroup at 1, 2, 4
+                and 8 workers: loopback clients connect and close as
+                fast as they can, and each run reports accepts a second
+                and how the kernel spread them over the workers.
+
+ Build:         g++ -O2 -std=c++17 -Dlinux -I.. NPSListenerGroup_bench.cpp
+                -lpthread -o listener_bench   (one line, with the NPS
+                library)
+ Run:           ./listener_bench [connections [client threads]]
+ *************************************************************************/
+
+#include <NPSListenerGroup.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define MAX_BENCH_WORKERS  8
+
+struct Counts
+{
+  std::atomic < long > Total;
+  std::atomic < long > PerWorker[MAX_BENCH_WORKERS];
+};
+
+static void OnAccept (int Worker, SOCKET Client, struct sockaddr_in *,
+                      void *Context)
+{
+  Counts *C = (Counts *) Context;
+
+  close (Client);
+  C->PerWorker[Worker]++;
+  C->Total++;
+}
+
+// Connects Count times to Port on the loopback, closing each at once.
+static long Connect (int Port, long Count)
+{
+  struct sockaddr_in Addr;
+  long Failed = 0;
+
+  memset (&Addr, 0, sizeof (Addr));
+  Addr.sin_family = AF_INET;
+  Addr.sin_port = htons (Port);
+  Addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  for (long i = 0; i < Count; i++)
+  {
+    int Fd = socket (AF_INET, SOCK_STREAM, 0);
+
+    if (Fd < 0 || connect (Fd, (struct sockaddr *) &Addr, sizeof (Addr)))
+      Failed++;
+    if (Fd >= 0)
+    {
+      // RST rather than FIN, so a long run does not use up the
+      // loopback's ports in TIME_WAIT.
+      struct linger Linger = { 1, 0 };
+
+      setsockopt (Fd, SOL_SOCKET, SO_LINGER, &Linger, sizeof (Linger));
+      close (Fd);
+    }
+  }
+  return Failed;
+}
+
+static int Run (int nWorkers, long Connections, int nClients)
+{
+  NPSListenerGroup Group;
+  Counts C;
+
+  C.Total = 0;
+  for (int i = 0; i < MAX_BENCH_WORKERS; i++)
+    C.PerWorker[i] = 0;
+  if (Group.Open (0, nWorkers, OnAccept, &C) != NPS_OK)
+  {
+    fprintf (stderr, "Open (%d workers) failed\n", nWorkers);
+    return 1;
+  }
+
+  std::vector < std::thread > Clients;
+  std::atomic < long > Failed (0);
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now ();
+
+  for (int i = 0; i < nClients; i++)
+    Clients.push_back (std::thread ([&, i]
+    {
+      long Share = Connections / nClients
+        + (i < Connections % nClients ? 1 : 0);
+
+      Failed += Connect (Group.GetPort (), Share);
+    }));
+  for (size_t i = 0; i < Clients.size (); i++)
+    Clients[i].join ();
+
+  // Every connect has completed; wait for the workers to accept them.
+  long Expect = Connections - Failed;
+
+  while (C.Total < Expect
+         && std::chrono::steady_clock::now () - t0 < std::chrono::seconds (30))
+    std::this_thread::sleep_for (std::chrono::microseconds (100));
+
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now ();
+  double Secs = std::chrono::duration < double > (t1 - t0).count ();
+
+  Group.Close ();
+  printf ("%d worker(s)  %8.1fk accepts/s  ", nWorkers,
+          C.Total / Secs / 1000.0);
+  for (int i = 0; i < nWorkers; i++)
+    printf (" %ld", C.PerWorker[i].load ());
+  if (Failed)
+    printf ("  (%ld connects failed)", Failed.load ());
+  printf ("\n");
+  return C.Total == Expect ? 0 : 1;
+}
+
+int main (int argc, char **argv)
+{
+  long Connections = (argc > 1) ? atol (argv[1]) : 20000;
+  int nClients = (argc > 2) ? atoi (argv[2]) : 1;
+  int Workers[] = { 1, 2, 4, 8 };
+  int Failures = 0;
+
+  if (Connections <= 0)
+    Connections = 1;
+  if (nClients <= 0)
+    nClients = 1;
+  printf ("%ld connections from %d client thread(s), %u CPU(s)\n",
+          Connections, nClients, std::thread::hardware_concurrency ());
+  for (size_t i = 0; i < sizeof (Workers) / sizeof (Workers[0]); i++)
+    Failures += Run (Workers[i], Connections, nClients);
+  return Failures ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+///////////////////////////////////////////////////////////////////////////
+//  File Name:     NPS_Checksum_bench.cpp
+//
+//  Purpose:       Micro-benchmark of the header checksum engines: legacy,
+//                 CRC32C and xxHash32, sealing and verifying messages
+//                 from 64 bytes to 60 KB.
+//
+//                 Sealing is serialize() followed by sealChecksum(), so
+//                 the legacy column is the cost of serialization alone
+//                 and the others show what the body hash adds to it.
+//                 Every sealed message is verified before anything is
+//                 timed.  Build with -msse4.2 for the hardware CRC32C.
+//
+//  Build:         g++ -O2 -msse4.2 -std=c++17 -I.. NPS_Checksum_bench.cpp
+//                     -L<nps lib dir> -lnps -o checksum_bench  (one line)
+//  Run:           ./checksum_bench [iterations]
+///////////////////////////////////////////////////////////////////////////
+
+#include <NPS_Serialize.h>
+#include <NPS_SerializeSchema.h>
+#include <NPS_Checksum.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+
+//! a header, one scalar and a blob of the size under test.
+class BenchBody : public NPS_SchemaSerialize<BenchBody> {
+public:
+  BenchBody()
+    : NPS_SchemaSerialize<BenchBody>( 1 ), seq_(0), dataLen_(0) {}
+
+  uint32                seq_;
+  char                  data_[60001];
+  uint16                dataLen_;
+
+  typedef NPS_Schema< NPS_FIELD( BenchBody, seq_ ),
+                      NPS_BLOB_FIELD( BenchBody, data_, dataLen_ ) > Schema;
+};
+
+
+static const char *
+engineName( NPS_ChecksumType type ) {
+  switch( type ) {
+  case NPS_CHECKSUM_CRC32C:   return "crc32c";
+  case NPS_CHECKSUM_XXHASH32: return "xxhash32";
+  default:                    return "legacy";
+  }
+}
+
+//! nanoseconds per seal and per verify of \p m with \p type.
+static bool
+run( BenchBody &m, NPS_ChecksumType type, long iterations ) {
+  static unsigned char buff[0xFFFF];  // the most a v1 header length allows
+  uint16 len = 0;
+  unsigned long sink = 0;
+
+  m.serialize( buff, len );
+  if( !NPS_Serialize::sealChecksum( buff, len, type ) ||
+      !NPS_Serialize::verifyChecksum( buff, len, type ) ) {
+    fprintf( stderr, "%s: a sealed %u byte message does not verify\n",
+             engineName( type ), (unsigned)len );
+    return false;
+  }
+
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  for( long i = 0; i < iterations; ++i ) {
+    m.seq_ = (uint32)i;
+    m.serialize( buff, len );
+    NPS_Serialize::sealChecksum( buff, len, type );
+    sink += buff[6];
+  }
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  for( long i = 0; i < iterations; ++i )
+    sink += NPS_Serialize::verifyChecksum( buff, len, type );
+  std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+
+  double seal = std::chrono::duration<double, std::nano>( t1 - t0 ).count() / iterations;
+  double verify = std::chrono::duration<double, std::nano>( t2 - t1 ).count() / iterations;
+  printf( "%-8s %5u bytes  seal %9.1f ns  verify %9.1f ns",
+          engineName( type ), (unsigned)len, seal, verify );
+  // legacy verification reads only the header; a rate would mean nothing.
+  if( type != NPS_CHECKSUM_LEGACY && verify > 0 )
+    printf( "  %5.2f GB/s", len / verify );
+  printf( "  (%lu)\n", sink );
+  return true;
+}
+
+
+int
+main( int argc, char **argv ) {
+  long iterations = ( argc > 1 )? atol( argv[1] ) : 100000;
+  if( iterations <= 0 )
+    iterations = 1;
+
+  static BenchBody m;
+  for( size_t i = 0; i < sizeof(m.data_); ++i )
+    m.data_[i] = (char)( i * 131 );
+
+  uint16 sizes[] = { 64, 512, 4096, 16000, 60000 };
+  NPS_ChecksumType types[] = { NPS_CHECKSUM_LEGACY, NPS_CHECKSUM_CRC32C,
+                               NPS_CHECKSUM_XXHASH32 };
+  for( size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s ) {
+    m.dataLen_ = sizes[s];
+    // fewer passes over the big bodies, so each size takes about as long.
+    long n = iterations / ( 1 + sizes[s] / 4096 );
+    for( size_t t = 0; t < sizeof(types) / sizeof(types[0]); ++t )
+      if( !run( m, types[t], ( n > 0 )? n : 1 ) )
+	return 1;
+  }
+  return 0;
+}
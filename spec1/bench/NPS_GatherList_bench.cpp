@@ -0,0 +1,186 @@
+///////////////////////////////////////////////////////////////////////////
+//  File Name:     NPS_GatherList_bench.cpp
+//
+//  Purpose:       Micro-benchmark of gathering serialization against the
+//                 contiguous copy it replaces, with and without the send.
+//
+//                 The message is a few scalar fields and a blob, like a
+//                 chat or channel data message.  The contiguous path
+//                 serializes into one buffer, copying the blob, and sends
+//                 it as a single fragment; the gather path references the
+//                 blob and sends the fragment list.  Both go through
+//                 NPSComm::SendToSocketV() to a reader thread draining a
+//                 socketpair, and the two streams are compared byte for
+//                 byte before anything is timed.
+//
+//  Build:         g++ -O2 -std=c++17 -Dlinux -I.. NPS_GatherList_bench.cpp
+//                     -L<nps lib dir> -lnps -lpthread -o gather_bench
+//                     (one line)
+//  Run:           ./gather_bench [iterations]
+///////////////////////////////////////////////////////////////////////////
+
+#include <NPSComm.h>
+#include <NPS_Serialize.h>
+#include <NPS_SerializeSchema.h>
+#include <NPS_GatherList.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+//! a chat-style message: addressing fields, then the text.
+class BenchChat : public NPS_SchemaSerialize<BenchChat> {
+public:
+  BenchChat()
+    : NPS_SchemaSerialize<BenchChat>( 1 ),
+      from_(0), to_(0), channel_(0), textLen_(0) {}
+
+  uint32                from_;
+  uint32                to_;
+  uint16                channel_;
+  char                  text_[16001];
+  uint16                textLen_;
+
+  typedef NPS_Schema< NPS_FIELD( BenchChat, from_ ),
+                      NPS_FIELD( BenchChat, to_ ),
+                      NPS_FIELD( BenchChat, channel_ ),
+                      NPS_BLOB_FIELD( BenchChat, text_, textLen_ ) > Schema;
+};
+
+
+//! reads and discards until the writer closes.
+static void
+drain( int fd ) {
+  static char buff[65536];
+  while( read( fd, buff, sizeof(buff) ) > 0 )
+    ;
+}
+
+//! reads \p len bytes, or until the writer closes.
+static std::string
+readAll( int fd, size_t len ) {
+  std::string out;
+  char buff[4096];
+  while( out.size() < len ) {
+    ssize_t n = read( fd, buff, sizeof(buff) );
+    if( n <= 0 )
+      break;
+    out.append( buff, n );
+  }
+  return out;
+}
+
+//! the stream each path puts on the wire.
+static bool
+sameStream( NPSComm &comm, BenchChat &m ) {
+  int pair[2];
+  if( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) )
+    return false;
+  SOCKET sock = pair[0];
+
+  unsigned char buff[MAX_MSG_LEN], scratch[MAX_MSG_LEN];
+  uint16 len = 0, glen = 0;
+  m.serialize( buff, len );
+  struct iovec one = { buff, len };
+  NPS_GatherList gather( scratch, sizeof(scratch) );
+  m.serialize( gather, glen );
+
+  std::string both;
+  std::thread reader( [&] { both = readAll( pair[1], len + glen ); } );
+  comm.SendToSocketV( &sock, &one, 1 );
+  comm.SendToSocketV( &sock, gather.fragments(), gather.count() );
+  reader.join();
+  close( pair[0] );
+  close( pair[1] );
+  return len == glen && both.size() == 2u * len &&
+    both.compare( 0, len, both, len, len ) == 0;
+}
+
+//! nanoseconds per message for one blob size, four ways.
+static void
+run( NPSComm &comm, BenchChat &m, long iterations ) {
+  unsigned char buff[MAX_MSG_LEN], scratch[MAX_MSG_LEN];
+  NPS_GatherList gather( scratch, sizeof(scratch) );
+  uint16 len = 0;
+  unsigned long sink = 0;
+
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  for( long i = 0; i < iterations; ++i ) {
+    m.channel_ = (uint16)i;
+    m.serialize( buff, len );
+    sink += buff[len - 1];
+  }
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  for( long i = 0; i < iterations; ++i ) {
+    m.channel_ = (uint16)i;
+    sink += m.serialize( gather, len )->iov_len;
+  }
+  std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+
+  int pair[2];
+  if( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) )
+    return;
+  SOCKET sock = pair[0];
+  std::thread reader( drain, pair[1] );
+
+  std::chrono::steady_clock::time_point t3 = std::chrono::steady_clock::now();
+  for( long i = 0; i < iterations; ++i ) {
+    m.channel_ = (uint16)i;
+    m.serialize( buff, len );
+    struct iovec one = { buff, len };
+    comm.SendToSocketV( &sock, &one, 1 );
+  }
+  std::chrono::steady_clock::time_point t4 = std::chrono::steady_clock::now();
+  for( long i = 0; i < iterations; ++i ) {
+    m.channel_ = (uint16)i;
+    m.serialize( gather, len );
+    comm.SendToSocketV( &sock, gather.fragments(), gather.count() );
+  }
+  std::chrono::steady_clock::time_point t5 = std::chrono::steady_clock::now();
+
+  close( pair[0] );
+  reader.join();
+  close( pair[1] );
+
+  double n = (double)iterations;
+  printf( "%5u byte blob  serialize: copy %8.1f ns  gather %8.1f ns"
+          "   +send: copy %8.1f ns  gather %8.1f ns  (%lu)\n",
+          (unsigned)m.textLen_,
+          std::chrono::duration<double, std::nano>( t1 - t0 ).count() / n,
+          std::chrono::duration<double, std::nano>( t2 - t1 ).count() / n,
+          std::chrono::duration<double, std::nano>( t4 - t3 ).count() / n,
+          std::chrono::duration<double, std::nano>( t5 - t4 ).count() / n,
+          sink );
+}
+
+
+int
+main( int argc, char **argv ) {
+  long iterations = ( argc > 1 )? atol( argv[1] ) : 200000;
+  if( iterations <= 0 )
+    iterations = 1;
+
+  NPSComm comm;
+  static BenchChat m;
+  m.from_ = 1001;
+  m.to_ = 2002;
+  memset( m.text_, 'x', sizeof(m.text_) );
+
+  uint16 sizes[] = { 32, 256, 1024, 4096, 16000 };
+  for( size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i ) {
+    m.textLen_ = sizes[i];
+    // the benchmark is only meaningful if both put the same bytes on the wire.
+    if( !sameStream( comm, m ) ) {
+      fprintf( stderr, "wire mismatch at a %u byte blob\n", (unsigned)sizes[i] );
+      return 1;
+    }
+    run( comm, m, iterations );
+  }
+  return 0;
+}
@@ -0,0 +1,1011 @@
+//====================================================================
+// cQ.cpp
+//=======
+//
+// Description:
+//    A Generic list data structure.
+//
+//    Nodes are slots in parallel arrays instead of linked tsQnodes:
+//    m_Data holds each item, m_Flags whether the slot is live and
+//    selected, and m_Gen how often the slot has been reused, which
+//    makes handles stable.  m_Fifo holds the live slots in the order
+//    they were added; a removed node leaves a hole (-1) at m_Pos[slot],
+//    and the holes are squeezed out once they outnumber the nodes, so
+//    removing from either end or the middle is O(1).  Sorted orders are cached in m_Orders until the
+//    list changes.  m_Indexes holds the secondary indexes given to
+//    Init(); every change to a node's item goes through
+//    Help_UnIndexNode() and Help_IndexNode().
+//
+// Project:
+//    NFS III
+//
+//====================================================================
+//           Copyright 1998 Electronic Arts Seattle.
+//====================================================================
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "cQ.h"
+
+// Ascending order for std::stable_sort: left before right when right is
+// greater.
+struct cQ::tsQless
+{
+   cQ                   * list;
+   cForeignComparison   * pfCompare;
+   const void           * criteria;
+
+   bool operator()(int left, int right) const
+   {
+      const void * l = list->m_Data[left];
+      const void * r = list->m_Data[right];
+
+      if (pfCompare)
+         return (pfCompare->Comparor(l, r, criteria) == kQnode_RightIsGreater);
+      return (list->NodeData_Comparor(l, r, criteria) == kQnode_RightIsGreater);
+   }
+};
+
+// -------------------------------------------------------------------
+cQ::cQ(tsQinfo * listInfo)
+{
+   memset(&m_Qinfo, 0, sizeof(m_Qinfo));
+   for (int i = 0; i < kQ_CachedOrders; i++)
+   {
+      m_Orders[i].pfCompare = NULL;
+      m_Orders[i].version = 0;
+      m_Orders[i].valid = FALSE;
+   }
+   m_NextOrder = 0;
+   m_FifoHead = 0;
+   m_FinderIndex = -1;
+   m_NextSeq = 0;
+   m_Version = 0;
+   m_Num = 0;
+   m_NumSelected = 0;
+   m_MutexInited = FALSE;
+   m_Dirty = FALSE;
+
+   if (listInfo)
+      Init(listInfo);
+}
+
+// -------------------------------------------------------------------
+cQ::cQ(const tsQinfo * listInfo, const tsQindex * indexes, int numIndexes)
+   : cQ((tsQinfo *) NULL)
+{
+   Init(listInfo, indexes, numIndexes);
+}
+
+// -------------------------------------------------------------------
+cQ::~cQ(void)
+{
+   DeleteAll();
+   Help_DeleteCriticalSection();
+}
+
+// -------------------------------------------------------------------
+void cQ::Init(tsQinfo * listInfo)
+{
+   Init(listInfo, NULL, 0);
+}
+
+// -------------------------------------------------------------------
+void cQ::Init(const tsQinfo * listInfo, const tsQindex * indexes, int numIndexes)
+{
+   if (!listInfo)
+      return;
+
+   DeleteAll();
+   m_Qinfo = *listInfo;
+   Help_InitCriticalSection();
+
+   Lock();
+   m_Indexes.clear();
+   m_FinderIndex = -1;
+   for (int i = 0; indexes && i < numIndexes && i < kQ_MaxIndexes; i++)
+   {
+      const tsQindex & info = indexes[i];
+
+      m_Indexes.push_back(tsQindexData());
+      m_Indexes.back().info = info;
+      m_Indexes.back().hashUsed = 0;
+      if (!info.pfKey || !info.pfCompare || (info.type == kQindex_Hash && !info.pfHash))
+      {
+         assert(0);
+         m_Indexes.back().info.type = (teQindexType) -1;  // never matches
+         continue;
+      }
+      if (info.isFinder && m_FinderIndex < 0)
+         m_FinderIndex = i;
+   }
+   UnLock();
+}
+
+// ===================================================================
+// List level methods
+// ===================================================================
+void cQ::Iterate(teQorder order, void * callerInfo, cForeignIterator * pForeign_Iterator, const void * criteria, cForeignComparison * pfCompare)
+{
+   std::vector<int> scratch;
+   const std::vector<int> * slots = &m_Fifo;
+   BOOL reverse = (order == kQ_LIFO || order == kQ_Descend);
+   int  count = 0;
+
+   Lock();
+   if (order == kQ_Ascend || order == kQ_Descend)
+      slots = &Help_Sorted(scratch, criteria, pfCompare);
+
+   for (size_t i = 0; i < slots->size(); i++)
+   {
+      int slot = (*slots)[reverse ? slots->size() - 1 - i : i];
+      BOOL isSelected;
+      BOOL more;
+
+      if (slot < 0)
+         continue;
+      isSelected = (m_Flags[slot] & kQslot_Selected) != 0;
+      if (pForeign_Iterator)
+         more = pForeign_Iterator->Iterator(m_Data[slot], count++, isSelected, callerInfo);
+      else
+         more = NodeData_Iterator(m_Data[slot], count++, isSelected, callerInfo);
+      if (!more)
+         break;
+   }
+   UnLock();
+}
+
+// -------------------------------------------------------------------
+void cQ::DeleteAll(void)
+{
+   Lock();
+   while (m_Num)
+      Help_RemoveNode(Help_Newest());
+   UnLock();
+}
+
+// -------------------------------------------------------------------
+int cQ::Count(void)
+{
+   int num;
+
+   Lock();
+   num = m_Num;
+   UnLock();
+   return (num);
+}
+
+// -------------------------------------------------------------------
+int cQ::Count_Selected(void)
+{
+   int num;
+
+   Lock();
+   num = m_NumSelected;
+   UnLock();
+   return (num);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::IsDirty(void)
+{
+   BOOL dirty;
+
+   Lock();
+   dirty = m_Dirty;
+   m_Dirty = FALSE;
+   UnLock();
+   return (dirty);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::SetDirty(void)
+{
+   Lock();
+   Help_Changed();
+   UnLock();
+   return (TRUE);
+}
+
+// ===================================================================
+// Node level methods
+// ===================================================================
+BOOL cQ::Node_Add(void * item, char * memName)
+{
+   return (Node_Add_Handle(item, memName) != kQ_NoHandle);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::Node_Select(const void * criteria, teQ_SelType selType, cForeignFinder * pfFind)
+{
+   BOOL result = FALSE;
+   int  slot;
+
+   Lock();
+   slot = Help_FindNode(criteria, pfFind);
+   if (slot >= 0)
+      result = Help_SelectNode(slot, selType);
+   UnLock();
+   return (result);
+}
+
+// -------------------------------------------------------------------
+// pfModify, if given, picks the node in place of NodeData_Finder;
+// NodeData_Modify changes it either way.
+BOOL cQ::Node_Modify(const void * criteria, void * item, cForeignModifier * pfModify)
+{
+   int slot = -1;
+
+   Lock();
+   if (pfModify)
+   {
+      for (size_t i = m_FifoHead; i < m_Fifo.size() && slot < 0; i++)
+      {
+         if (m_Fifo[i] >= 0 && pfModify->Modifier(criteria, m_Data[m_Fifo[i]]))
+            slot = m_Fifo[i];
+      }
+   }
+   else
+      slot = Help_FindNode(criteria);
+   if (slot >= 0)
+   {
+      Help_UnIndexNode(slot);
+      NodeData_Modify(item, m_Data[slot]);
+      Help_IndexNode(slot);
+      Help_Changed();
+   }
+   UnLock();
+   return (slot >= 0);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::Node_Delete(const void * criteria, cForeignFinder * pfFind)
+{
+   int slot;
+
+   Lock();
+   slot = Help_FindNode(criteria, pfFind);
+   if (slot >= 0)
+      Help_RemoveNode(slot);
+   UnLock();
+   return (slot >= 0);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::Node_Find(const void * criteria, void * item, cForeignFinder * pfFind)
+{
+   int slot;
+
+   Lock();
+   slot = Help_FindNode(criteria, pfFind);
+   if (slot >= 0 && item)
+      Help_CopyItem(item, m_Data[slot]);
+   UnLock();
+   return (slot >= 0);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::Node_Find_Selected(void * item)
+{
+   BOOL result = FALSE;
+
+   Lock();
+   if (m_NumSelected)
+   {
+      for (size_t i = m_FifoHead; i < m_Fifo.size(); i++)
+      {
+         if (m_Fifo[i] >= 0 && (m_Flags[m_Fifo[i]] & kQslot_Selected))
+         {
+            if (item)
+               Help_CopyItem(item, m_Data[m_Fifo[i]]);
+            result = TRUE;
+            break;
+         }
+      }
+   }
+   UnLock();
+   return (result);
+}
+
+// -------------------------------------------------------------------
+// N counts from 0, over the items the filter accepts.
+BOOL cQ::Node_Find_N (const void * criteria, int N, teQorder order, void * item, cForeignComparison * pfCompare,  void * filtercriteria, cForeignFilter * pfFilter)
+{
+   std::vector<int> scratch;
+   const std::vector<int> * slots = &m_Fifo;
+   BOOL reverse = (order == kQ_LIFO || order == kQ_Descend);
+   BOOL result = FALSE;
+
+   if (N < 0)
+      return (FALSE);
+
+   Lock();
+   if (N < m_Num)
+   {
+      if (order == kQ_Ascend || order == kQ_Descend)
+         slots = &Help_Sorted(scratch, criteria, pfCompare);
+
+      for (size_t i = 0; i < slots->size(); i++)
+      {
+         int slot = (*slots)[reverse ? slots->size() - 1 - i : i];
+
+         if (slot < 0)
+            continue;
+         if (pfFilter && filtercriteria && !pfFilter->Filter(m_Data[slot], filtercriteria))
+            continue;
+         if (N-- == 0)
+         {
+            if (item)
+               Help_CopyItem(item, m_Data[slot]);
+            result = TRUE;
+            break;
+         }
+      }
+   }
+   UnLock();
+   return (result);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::Node_Get(const void * criteria, void * item)
+{
+   int slot;
+
+   Lock();
+   if (criteria)
+      slot = Help_FindNode(criteria);
+   else
+      slot = Help_Oldest();
+   if (slot >= 0)
+   {
+      if (item)
+         Help_CopyItem(item, m_Data[slot]);
+      Help_RemoveNode(slot);
+   }
+   UnLock();
+   return (slot >= 0);
+}
+
+// ===================================================================
+// Handle level methods
+// ===================================================================
+tQhandle cQ::Node_Add_Handle(void * item, char * memName)
+{
+   tQhandle handle = kQ_NoHandle;
+   int      slot;
+
+   if (!item)
+      return (kQ_NoHandle);
+
+   Lock();
+   slot = Help_AddNode(item, memName);
+   if (slot >= 0)
+      handle = Help_Handle(slot);
+   UnLock();
+   return (handle);
+}
+
+// -------------------------------------------------------------------
+tQhandle cQ::Node_Find_Handle(const void * criteria, cForeignFinder * pfFind)
+{
+   tQhandle handle = kQ_NoHandle;
+   int      slot;
+
+   Lock();
+   slot = Help_FindNode(criteria, pfFind);
+   if (slot >= 0)
+      handle = Help_Handle(slot);
+   UnLock();
+   return (handle);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::Node_Get_Handle(tQhandle handle, void * item)
+{
+   int slot;
+
+   Lock();
+   slot = Help_HandleSlot(handle);
+   if (slot >= 0 && item)
+      Help_CopyItem(item, m_Data[slot]);
+   UnLock();
+   return (slot >= 0);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::Node_Select_Handle(tQhandle handle, teQ_SelType selType)
+{
+   BOOL result = FALSE;
+   int  slot;
+
+   Lock();
+   slot = Help_HandleSlot(handle);
+   if (slot >= 0)
+      result = Help_SelectNode(slot, selType);
+   UnLock();
+   return (result);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::Node_Delete_Handle(tQhandle handle)
+{
+   int slot;
+
+   Lock();
+   slot = Help_HandleSlot(handle);
+   if (slot >= 0)
+      Help_RemoveNode(slot);
+   UnLock();
+   return (slot >= 0);
+}
+
+// ===================================================================
+// Index level methods
+// ===================================================================
+BOOL cQ::Node_Find_Index(int index, const void * key, void * item)
+{
+   int slot;
+
+   Lock();
+   slot = Help_IndexFind(index, key);
+   if (slot >= 0 && item)
+      Help_CopyItem(item, m_Data[slot]);
+   UnLock();
+   return (slot >= 0);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::Node_Get_Index(int index, const void * key, void * item)
+{
+   int slot;
+
+   Lock();
+   slot = Help_IndexFind(index, key);
+   if (slot >= 0)
+   {
+      if (item)
+         Help_CopyItem(item, m_Data[slot]);
+      Help_RemoveNode(slot);
+   }
+   UnLock();
+   return (slot >= 0);
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::Node_Delete_Index(int index, const void * key)
+{
+   int slot;
+
+   Lock();
+   slot = Help_IndexFind(index, key);
+   if (slot >= 0)
+      Help_RemoveNode(slot);
+   UnLock();
+   return (slot >= 0);
+}
+
+// ===================================================================
+// Cross list locking
+// ===================================================================
+void cQ::Lock(void)
+{
+   Help_EnterCriticalSection();
+}
+
+// -------------------------------------------------------------------
+void cQ::UnLock(void)
+{
+   Help_LeaveCriticalSection();
+}
+
+// ===================================================================
+// Node data defaults
+// ===================================================================
+int cQ::NodeData_SizeOf(const void * /*item*/)
+{
+   return (m_Qinfo.itemSize);
+}
+
+// -------------------------------------------------------------------
+// A pointer list keeps the caller's pointer; otherwise the item is
+// copied.
+void * cQ::NodeData_Alloc(void * item, char * /*memName*/)
+{
+   int    size = NodeData_SizeOf(item);
+   void * copy;
+
+   if (size <= 0)
+      return (item);
+   copy = malloc(size);
+   if (copy)
+      NodeData_Copy(copy, item, size);
+   return (copy);
+}
+
+// -------------------------------------------------------------------
+void cQ::NodeData_Free(void * item)
+{
+   if (NodeData_SizeOf(item) > 0)
+      free(item);
+}
+
+// -------------------------------------------------------------------
+void cQ::NodeData_Copy(void * dest, const void * src, int length)
+{
+   memcpy(dest, src, length);
+}
+
+// ===================================================================
+// Helpers; the caller holds the lock.
+// ===================================================================
+int cQ::Help_AddNode(void * item, char * memName)
+{
+   void * data;
+   int    slot;
+
+   if (m_Qinfo.maxItems > 0 && m_Num >= m_Qinfo.maxItems)
+      Help_RemoveNode(Help_Oldest());
+
+   data = NodeData_Alloc(item, memName);
+   if (!data)
+      return (-1);
+
+   if (!m_FreeSlots.empty())
+   {
+      slot = m_FreeSlots.back();
+      m_FreeSlots.pop_back();
+   }
+   else
+   {
+      if (m_Data.size() >= ((size_t) 1 << kQslot_Bits) - 1)
+      {
+         NodeData_Free(data);
+         return (-1);
+      }
+      slot = (int) m_Data.size();
+      m_Data.push_back(NULL);
+      m_Flags.push_back(0);
+      m_Gen.push_back(0);
+      m_Seq.push_back(0);
+      m_Pos.push_back(0);
+   }
+   m_Data[slot] = data;
+   m_Flags[slot] = kQslot_Live;
+   m_Seq[slot] = m_NextSeq++;
+   m_Pos[slot] = (int) m_Fifo.size();
+   m_Fifo.push_back(slot);
+   Help_IndexNode(slot);
+   m_Num++;
+   Help_Changed();
+   return (slot);
+}
+
+// -------------------------------------------------------------------
+void cQ::Help_RemoveNode(int slot)
+{
+   assert(m_Fifo[m_Pos[slot]] == slot);
+   m_Fifo[m_Pos[slot]] = -1;
+
+   // Keep the oldest and the newest node at the ends.
+   while (!m_Fifo.empty() && m_Fifo.back() < 0)
+      m_Fifo.pop_back();
+   if (m_FifoHead > m_Fifo.size())
+      m_FifoHead = m_Fifo.size();
+   while (m_FifoHead < m_Fifo.size() && m_Fifo[m_FifoHead] < 0)
+      m_FifoHead++;
+
+   if (m_Flags[slot] & kQslot_Selected)
+      m_NumSelected--;
+   Help_UnIndexNode(slot);
+   NodeData_Free(m_Data[slot]);
+   m_Data[slot] = NULL;
+   m_Flags[slot] = 0;
+   m_Gen[slot]++;
+   m_FreeSlots.push_back(slot);
+   m_Num--;
+   if (m_Fifo.size() > 2 * (size_t) m_Num + kQ_FifoSlack)
+      Help_CompactFifo();
+   Help_Changed();
+}
+
+// -------------------------------------------------------------------
+// The oldest and newest live slot, or -1 if the list is empty.
+int cQ::Help_Oldest(void)
+{
+   return (m_FifoHead < m_Fifo.size() ? m_Fifo[m_FifoHead] : -1);
+}
+
+// -------------------------------------------------------------------
+int cQ::Help_Newest(void)
+{
+   return (m_Fifo.empty() ? -1 : m_Fifo.back());
+}
+
+// -------------------------------------------------------------------
+// Squeezes the holes out of m_Fifo, keeping the order.
+void cQ::Help_CompactFifo(void)
+{
+   size_t n = 0;
+
+   for (size_t i = m_FifoHead; i < m_Fifo.size(); i++)
+   {
+      if (m_Fifo[i] < 0)
+         continue;
+      m_Fifo[n] = m_Fifo[i];
+      m_Pos[m_Fifo[n]] = (int) n;
+      n++;
+   }
+   m_Fifo.resize(n);
+   m_FifoHead = 0;
+}
+
+// -------------------------------------------------------------------
+int cQ::Help_FindNode(const void * criteria, cForeignFinder * pfFind)
+{
+   if (!pfFind && m_FinderIndex >= 0)
+      return (Help_IndexFind(m_FinderIndex, criteria));
+
+   for (size_t i = m_FifoHead; i < m_Fifo.size(); i++)
+   {
+      int slot = m_Fifo[i];
+
+      if (slot < 0)
+         continue;
+      if (pfFind ? pfFind->Finder(criteria, m_Data[slot])
+                 : NodeData_Finder(criteria, m_Data[slot]))
+         return (slot);
+   }
+   return (-1);
+}
+
+// -------------------------------------------------------------------
+int cQ::Help_HandleSlot(tQhandle handle)
+{
+   tQhandle index = handle & (((tQhandle) 1 << kQslot_Bits) - 1);
+   int slot = (int) index - 1;
+
+   if (!index || (size_t) slot >= m_Data.size()
+       || !(m_Flags[slot] & kQslot_Live)
+       || (m_Gen[slot] & ((tQhandle) -1 >> kQslot_Bits)) != handle >> kQslot_Bits)
+      return (-1);
+   return (slot);
+}
+
+// -------------------------------------------------------------------
+tQhandle cQ::Help_Handle(int slot)
+{
+   return ((m_Gen[slot] << kQslot_Bits) | (tQhandle) (slot + 1));
+}
+
+// -------------------------------------------------------------------
+void cQ::Help_CopyItem(void * dest, const void * data)
+{
+   int size = NodeData_SizeOf(data);
+
+   if (size > 0)
+      NodeData_Copy(dest, data, size);
+   else
+      *(const void **) dest = data;
+}
+
+// -------------------------------------------------------------------
+BOOL cQ::Help_SelectNode (int slot, teQ_SelType selType)
+{
+   BOOL selected = (m_Flags[slot] & kQslot_Selected) != 0;
+   BOOL select;
+
+   switch (selType)
+   {
+   case kQ_ToggleSelect: select = !selected; break;
+   case kQ_Select:       select = TRUE;      break;
+   default:              select = FALSE;     break;
+   }
+   if (select == selected)
+      return (TRUE);
+
+   if (select)
+   {
+      if (m_Qinfo.maxSelections == kQ_NoNodes
+          || (m_Qinfo.maxSelections > 0 && m_NumSelected >= m_Qinfo.maxSelections))
+         return (FALSE);
+      m_Flags[slot] |= kQslot_Selected;
+      m_NumSelected++;
+   }
+   else
+   {
+      m_Flags[slot] &= ~kQslot_Selected;
+      m_NumSelected--;
+   }
+   return (TRUE);
+}
+
+// -------------------------------------------------------------------
+void cQ::Help_Changed(void)
+{
+   m_Dirty = TRUE;
+   m_Version++;
+}
+
+// -------------------------------------------------------------------
+void cQ::Help_IndexNode(int slot)
+{
+   for (size_t i = 0; i < m_Indexes.size(); i++)
+   {
+      tsQindexData & index = m_Indexes[i];
+      const void   * key;
+
+      switch (index.info.type)
+      {
+      case kQindex_Hash:
+         key = index.info.pfKey(m_Data[slot]);
+         Help_HashInsert(index, index.info.pfHash(key), slot);
+         break;
+      case kQindex_Ordered:
+         // After any equal keys, so that equal keys stay oldest first
+         // except after a Node_Modify.
+         key = index.info.pfKey(m_Data[slot]);
+         index.ordered.insert(index.ordered.begin() + Help_OrderedBound(index, key, TRUE), slot);
+         break;
+      default:
+         break;
+      }
+   }
+}
+
+// -------------------------------------------------------------------
+// Must be called while the item still has the key it was indexed by.
+void cQ::Help_UnIndexNode(int slot)
+{
+   for (size_t i = 0; i < m_Indexes.size(); i++)
+   {
+      tsQindexData & index = m_Indexes[i];
+      const void   * key;
+
+      switch (index.info.type)
+      {
+      case kQindex_Hash:
+         key = index.info.pfKey(m_Data[slot]);
+         Help_HashErase(index, index.info.pfHash(key), slot);
+         break;
+      case kQindex_Ordered:
+         {
+            size_t pos;
+
+            key = index.info.pfKey(m_Data[slot]);
+            for (pos = Help_OrderedBound(index, key, FALSE); pos < index.ordered.size(); pos++)
+            {
+               if (index.ordered[pos] == slot)
+               {
+                  index.ordered.erase(index.ordered.begin() + pos);
+                  break;
+               }
+            }
+         }
+         break;
+      default:
+         break;
+      }
+   }
+}
+
+// -------------------------------------------------------------------
+// The oldest node whose key matches, or -1.
+int cQ::Help_IndexFind(int i, const void * key)
+{
+   int found = -1;
+
+   if (i < 0 || (size_t) i >= m_Indexes.size() || !key)
+      return (-1);
+
+   tsQindexData & index = m_Indexes[i];
+
+   switch (index.info.type)
+   {
+   case kQindex_Hash:
+      if (!index.hash.empty())
+      {
+         unsigned long  hash = index.info.pfHash(key);
+         size_t         mask = index.hash.size() - 1;
+
+         for (size_t pos = Help_HashStart(hash, index.hash.size());
+              index.hash[pos].slot != kQhash_Empty; pos = (pos + 1) & mask)
+         {
+            int slot = index.hash[pos].slot;
+
+            if (slot >= 0 && index.hash[pos].hash == hash
+                && index.info.pfCompare(key, m_Data[slot]) == 0
+                && (found < 0 || m_Seq[slot] < m_Seq[found]))
+               found = slot;
+         }
+      }
+      break;
+   case kQindex_Ordered:
+      for (size_t pos = Help_OrderedBound(index, key, FALSE); pos < index.ordered.size(); pos++)
+      {
+         int slot = index.ordered[pos];
+
+         if (index.info.pfCompare(key, m_Data[slot]) != 0)
+            break;
+         if (found < 0 || m_Seq[slot] < m_Seq[found])
+            found = slot;
+      }
+      break;
+   default:
+      break;
+   }
+   return (found);
+}
+
+// -------------------------------------------------------------------
+// Where a probe for hash starts.  pfHash need not spread its bits (an
+// id is its own hash), so they are mixed before the low ones are taken.
+size_t cQ::Help_HashStart(unsigned long hash, size_t size)
+{
+   hash ^= hash >> 16;
+   hash *= 0x45d9f3bUL;
+   hash ^= hash >> 16;
+   return ((size_t) hash & (size - 1));
+}
+
+// -------------------------------------------------------------------
+void cQ::Help_HashInsert(tsQindexData & index, unsigned long hash, int slot)
+{
+   size_t pos;
+   size_t mask;
+
+   if ((size_t) (index.hashUsed + 1) * 2 > index.hash.size())
+      Help_HashResize(index);
+   mask = index.hash.size() - 1;
+   for (pos = Help_HashStart(hash, index.hash.size()); index.hash[pos].slot >= 0; pos = (pos + 1) & mask)
+      ;
+   if (index.hash[pos].slot == kQhash_Empty)
+      index.hashUsed++;
+   index.hash[pos].hash = hash;
+   index.hash[pos].slot = slot;
+}
+
+// -------------------------------------------------------------------
+// Leaves a kQhash_Deleted behind, so that probes carry on past it.
+void cQ::Help_HashErase(tsQindexData & index, unsigned long hash, int slot)
+{
+   size_t mask = index.hash.size() - 1;
+
+   if (index.hash.empty())
+      return;
+   for (size_t pos = Help_HashStart(hash, index.hash.size());
+        index.hash[pos].slot != kQhash_Empty; pos = (pos + 1) & mask)
+   {
+      if (index.hash[pos].slot == slot)
+      {
+         index.hash[pos].slot = kQhash_Deleted;
+         return;
+      }
+   }
+}
+
+// -------------------------------------------------------------------
+// Rebuilds the table at four times the live entries, dropping the
+// kQhash_Deleted ones; it grows or shrinks as the list has.
+void cQ::Help_HashResize(tsQindexData & index)
+{
+   std::vector<tsQhashEntry> old;
+   size_t   live = 0;
+   size_t   size = kQhash_MinSize;
+
+   for (size_t i = 0; i < index.hash.size(); i++)
+      if (index.hash[i].slot >= 0)
+         live++;
+   while (size < (live + 1) * 4)
+      size *= 2;
+
+   tsQhashEntry empty = { 0, kQhash_Empty };
+
+   old.swap(index.hash);
+   index.hash.assign(size, empty);
+   index.hashUsed = 0;
+   for (size_t i = 0; i < old.size(); i++)
+      if (old[i].slot >= 0)
+         Help_HashInsert(index, old[i].hash, old[i].slot);
+}
+
+// -------------------------------------------------------------------
+// Binary search of an ordered index: the first position whose key is
+// not before key, or with upper, the first whose key is after it.
+size_t cQ::Help_OrderedBound(tsQindexData & index, const void * key, BOOL upper)
+{
+   size_t lo = 0;
+   size_t hi = index.ordered.size();
+
+   while (lo < hi)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+      int    cmp = index.info.pfCompare(key, m_Data[index.ordered[mid]]);
+
+      if (upper ? cmp >= 0 : cmp > 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   return (lo);
+}
+
+// -------------------------------------------------------------------
+// The live slots in ascending order.  Without criteria the order is
+// cached per comparison object; criteria is only known by address, and
+// callers commonly reuse one address for different values, so orders
+// sorted with criteria are built in scratch every time.
+const std::vector<int> &
+cQ::Help_Sorted(std::vector<int> & scratch, const void * criteria, cForeignComparison * pfCompare)
+{
+   tsQless   less = { this, pfCompare, criteria };
+   tsQorder  * cached = NULL;
+
+   // Sorting is O(n log n) anyway, so take the holes out first.
+   if (criteria)
+   {
+      Help_CompactFifo();
+      scratch = m_Fifo;
+      std::stable_sort(scratch.begin(), scratch.end(), less);
+      return (scratch);
+   }
+
+   for (int i = 0; i < kQ_CachedOrders; i++)
+   {
+      if (m_Orders[i].valid && m_Orders[i].pfCompare == pfCompare)
+      {
+         if (m_Orders[i].version == m_Version)
+            return (m_Orders[i].slots);
+         cached = &m_Orders[i];
+         break;
+      }
+   }
+   if (!cached)
+   {
+      cached = &m_Orders[m_NextOrder];
+      m_NextOrder = (m_NextOrder + 1) % kQ_CachedOrders;
+   }
+
+   cached->pfCompare = pfCompare;
+   cached->version = m_Version;
+   cached->valid = TRUE;
+   Help_CompactFifo();
+   cached->slots = m_Fifo;
+   std::stable_sort(cached->slots.begin(), cached->slots.end(), less);
+   return (cached->slots);
+}
+
+// -------------------------------------------------------------------
+inline void cQ::Help_InitCriticalSection(void)
+{
+   if (m_Qinfo.threadSafe && !m_MutexInited)
+   {
+      InitializeCriticalSection(&m_Mutex);
+      m_MutexInited = TRUE;
+   }
+}
+
+// -------------------------------------------------------------------
+inline void cQ::Help_DeleteCriticalSection(void)
+{
+   if (m_MutexInited)
+   {
+      DeleteCriticalSection(&m_Mutex);
+      m_MutexInited = FALSE;
+   }
+}
+
+// -------------------------------------------------------------------
+inline void cQ::Help_EnterCriticalSection(void)
+{
+   if (m_MutexInited)
+      EnterCriticalSection(&m_Mutex);
+}
+
+// -------------------------------------------------------------------
+inline void cQ::Help_LeaveCriticalSection(void)
+{
+   if (m_MutexInited)
+      LeaveCriticalSection(&m_Mutex);
+}
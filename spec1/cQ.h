@@ -31,6 +31,7 @@
 #define cQ_H
 
 #include <stdio.h>
+#include <vector>
 
 #include "NPSDll_Types.h"
 
@@ -48,6 +49,9 @@
 // -------------------------------------------------------------------
 #define kQ_NoNodes        -1  // For use with tsQinfo.maxSelections
 #define kQ_UnlimitedNodes  0  // For use with tsQinfo.maxItems & maxSelections
+#define kQ_NoHandle        0  // Never a valid tQhandle
+#define kQ_CachedOrders    4  // Sort orders remembered between Iterate() calls
+#define kQ_MaxIndexes      8  // Most indexes Init() will take
 
 typedef enum
 {
@@ -56,6 +60,7 @@ typedef enum
    kQnode_RightIsGreater=1
 }teQ_CompareResults;
 
+// No longer used by cQ itself; kept for code that still names it.
 typedef struct tsQnode
 {
    struct tsQnode  * prev;
@@ -73,6 +78,24 @@ typedef enum
    kQ_Descend
 }teQorder;
 
+typedef enum
+{
+   kQindex_Hash,        // O(1) lookup; needs pfKey, pfHash and pfCompare
+   kQindex_Ordered      // O(log n) lookup; needs pfKey and pfCompare
+}teQindexType;
+
+// A secondary index, kept up to date as nodes are added, modified and
+// deleted.  A key is whatever pfKey points into an item: e.g. &room->id,
+// or room->name.  Lookups are by a key in that same form.
+typedef struct
+{
+   teQindexType      type;
+   const void *   (* pfKey)(const void * item);
+   unsigned long  (* pfHash)(const void * key);
+   int            (* pfCompare)(const void * key, const void * item);  // <0, 0, >0: key sorts before, with, after item's
+   BOOL              isFinder;   // criteria are keys: answers Node_Find etc. instead of NodeData_Finder
+}tsQindex;
+
 typedef struct
 {
    int   itemSize;      // # chars in an item, 0=pointer copy, dynamic sizing requires user defined "sizeOf" callback.
@@ -81,6 +104,15 @@ typedef struct
    BOOL  threadSafe;    // set False only if list cannot be reentered
 }tsQinfo;
 
+// Names one node for as long as it is in the list; a handle to a deleted
+// node is never reused for another.  64 bits wide everywhere, so a slot
+// can be reused 2^42 times before its handles come round again.
+#ifdef WIN32
+typedef unsigned __int64 tQhandle;
+#else
+typedef unsigned long long tQhandle;
+#endif
+
 typedef enum
 {
    kQ_ToggleSelect,
@@ -99,6 +131,11 @@ typedef enum
 // Init(tsQinfo * listInfo=NULL)
 //    Fully inits list
 // -------------------------------------------------------------------
+// cQ(const tsQinfo * listInfo, const tsQindex * indexes, int numIndexes)
+// Init(const tsQinfo * listInfo, const tsQindex * indexes, int numIndexes)
+//    As above, with up to kQ_MaxIndexes secondary indexes.  indexes is
+//    copied; it need not outlive the call.
+// -------------------------------------------------------------------
 // void  Iterate(teQorder, void * callerInfo = NULL, tfList_CB_Iterate * pfIterate = NULL, const void * criteria = NULL, tfList_CB_Compare * pfCompare = NULL);
 //    use criteria to pass additional info to the compare callback.
 //    usefull for information such as "col num".
@@ -159,6 +196,46 @@ typedef enum
 //    "item" parameter it "item" is non-Null, and Item is deleted from
 //    the list.
 // -------------------------------------------------------------------
+// tQhandle Node_Add_Handle(void * item, char * memName = "listnode");
+//    As Node_Add, returning the new node's handle, or kQ_NoHandle.
+// -------------------------------------------------------------------
+// tQhandle Node_Find_Handle(const void * criteria, cForeignFinder * pfFind = NULL);
+//    The handle of the node found, or kQ_NoHandle.
+// -------------------------------------------------------------------
+// BOOL  Node_Get_Handle(tQhandle handle, void * item);
+// BOOL  Node_Select_Handle(tQhandle handle, teQ_SelType selType);
+// BOOL  Node_Delete_Handle(tQhandle handle);
+//    As Node_Find, Node_Select and Node_Delete, without a search.
+//    FALSE if the node has been deleted.
+// -------------------------------------------------------------------
+// BOOL  Node_Find_Index(int index, const void * key, void * item = NULL);
+// BOOL  Node_Get_Index(int index, const void * key, void * item = NULL);
+// BOOL  Node_Delete_Index(int index, const void * key);
+//    As Node_Find, Node_Get and Node_Delete, looking key up in
+//    indexes[index] as passed to Init() instead of calling a finder on
+//    every node.
+//    Of several nodes with the key, the oldest is the one found.
+//
+//    Node_Find, Node_Select, Node_Modify, Node_Delete, Node_Get and
+//    Node_Find_Handle do the same with the first index marked isFinder,
+//    when they are given no foreign finder.  That index must then agree
+//    with NodeData_Finder, which it replaces.
+// -------------------------------------------------------------------
+// Storage:
+//    Nodes live in parallel arrays (item pointer, flags, generation,
+//    FIFO position), reused through a free list, and hash indexes are
+//    open addressed arrays, so adding a node allocates nothing but the
+//    item copy (none for pointer lists) once the arrays have grown.
+//    Removing any node, the oldest included, is O(1) amortized.  For
+//    pointer lists (itemSize 0, NodeData_SizeOf() not overridden) the
+//    found item's pointer is what gets copied out.
+//
+//    Ascending and descending orders are cached per comparison object
+//    when criteria is NULL, and sorted again only after the list has
+//    been dirtied (see IsDirty).  Selection does not dirty the list.
+//    Callbacks must not add to or delete from the list they are called
+//    from.
+// -------------------------------------------------------------------
 // ===================================================================
 class cForeignIterator
 {
@@ -195,8 +272,10 @@ class cQ
 {
 public:
    cQ(tsQinfo * listInfo=NULL);
+   cQ(const tsQinfo * listInfo, const tsQindex * indexes, int numIndexes);
    virtual ~cQ(void);
    void  Init(tsQinfo * listInfo);
+   void  Init(const tsQinfo * listInfo, const tsQindex * indexes, int numIndexes);
 
    // List level methods
    // ------------------
@@ -224,6 +303,20 @@ public:
    BOOL  Node_Find_N (const void * criteria, int N, teQorder order, void * item, cForeignComparison * pfCompare=NULL,  void * filtercriteria=NULL, cForeignFilter * pfFilter=NULL);
    BOOL  Node_Get(const void * criteria, void * item = NULL);
 
+   // Handle level methods
+   // --------------------
+   tQhandle Node_Add_Handle(void * item, char * memName = (char *) "listnode");
+   tQhandle Node_Find_Handle(const void * criteria, cForeignFinder * pfFind = NULL);
+   BOOL  Node_Get_Handle(tQhandle handle, void * item);
+   BOOL  Node_Select_Handle(tQhandle handle, teQ_SelType selType);
+   BOOL  Node_Delete_Handle(tQhandle handle);
+
+   // Index level methods
+   // -------------------
+   BOOL  Node_Find_Index(int index, const void * key, void * item = NULL);
+   BOOL  Node_Get_Index(int index, const void * key, void * item = NULL);
+   BOOL  Node_Delete_Index(int index, const void * key);
+
 protected:
    // These are visible for cross list locking.
    // Extreme care should be taken not to dead lock because you forgot to unlock.
@@ -264,9 +357,60 @@ protected:
          NodeData_Copy(void * dest, const void * src, int length);
 
 private:
+   enum
+   {
+      kQslot_Live     = 0x01,
+      kQslot_Selected = 0x02,
+      kQslot_Bits     = 22,     // tQhandle = generation << 22 | slot + 1
+      kQ_FifoSlack    = 16,     // holes m_Fifo may hold beyond m_Num
+      kQhash_Empty    = -1,     // tsQhashEntry::slot of a never used entry
+      kQhash_Deleted  = -2,     // ... of a removed one
+      kQhash_MinSize  = 16
+   };
+
+   // A sorted order, good while m_Version is unchanged.
+   struct tsQorder
+   {
+      cForeignComparison   * pfCompare;
+      unsigned long        version;
+      BOOL                 valid;
+      std::vector<int>     slots;
+   };
+   struct tsQless;
+
+   // One node in a kQindex_Hash index.
+   struct tsQhashEntry
+   {
+      unsigned long        hash;      // pfHash of the node's key
+      int                  slot;      // or kQhash_Empty / kQhash_Deleted
+   };
+
+   struct tsQindexData
+   {
+      tsQindex             info;
+      std::vector<tsQhashEntry>
+                           hash;      // kQindex_Hash: linear probing, a power of 2, at most half used
+      int                  hashUsed;  // entries of hash not kQhash_Empty
+      std::vector<int>     ordered;   // kQindex_Ordered: slots by key
+   };
+
    tsQinfo     m_Qinfo;
-   tsQnode     * m_Head;
-   tsQnode     * m_Tail;
+   std::vector<void *>           m_Data;       // per slot: the item
+   std::vector<unsigned char>    m_Flags;      // per slot: kQslot_*
+   std::vector<tQhandle>         m_Gen;        // per slot: bumped when freed
+   std::vector<unsigned long>    m_Seq;        // per slot: when it was added
+   std::vector<int>              m_Pos;        // per slot: index in m_Fifo
+   std::vector<int>              m_FreeSlots;
+   std::vector<int>              m_Fifo;       // live slots, oldest first; -1 for a hole
+   size_t      m_FifoHead;   // m_Fifo before this is all holes
+   tsQorder    m_Orders[kQ_CachedOrders];
+   int         m_NextOrder;
+   std::vector<tsQindexData>     m_Indexes;
+   int         m_FinderIndex;  // index answering Help_FindNode, or -1
+   unsigned long
+               m_NextSeq;
+   unsigned long
+               m_Version;    // bumped by everything that dirties the list
    int         m_Num;
    int         m_NumSelected;
    CRITICAL_SECTION
@@ -274,9 +418,31 @@ private:
    BOOL        m_MutexInited;
    BOOL        m_Dirty;
 
-   void        Help_RemoveNode (tsQnode * node);
-   tsQnode *   Help_FindNode(const void * criteria, cForeignFinder * pfFind=NULL);
-   void        Help_SelectNode (tsQnode * node, teQ_SelType selType);
+   cQ(const cQ &);
+   cQ & operator=(const cQ &);
+
+   int         Help_AddNode (void * item, char * memName);
+   void        Help_RemoveNode (int slot);
+   int         Help_Oldest(void);
+   int         Help_Newest(void);
+   void        Help_CompactFifo(void);
+   int         Help_FindNode(const void * criteria, cForeignFinder * pfFind=NULL);
+   int         Help_HandleSlot(tQhandle handle);
+   tQhandle    Help_Handle(int slot);
+   void        Help_CopyItem(void * dest, const void * data);
+   BOOL        Help_SelectNode (int slot, teQ_SelType selType);
+   void        Help_Changed(void);
+   void        Help_IndexNode(int slot);
+   void        Help_UnIndexNode(int slot);
+   int         Help_IndexFind(int index, const void * key);
+   void        Help_HashInsert(tsQindexData & index, unsigned long hash, int slot);
+   void        Help_HashErase(tsQindexData & index, unsigned long hash, int slot);
+   void        Help_HashResize(tsQindexData & index);
+   static size_t
+               Help_HashStart(unsigned long hash, size_t size);
+   size_t      Help_OrderedBound(tsQindexData & index, const void * key, BOOL upper);
+   const std::vector<int> &
+               Help_Sorted(std::vector<int> & scratch, const void * criteria, cForeignComparison * pfCompare);
    inline void Help_InitCriticalSection(void);
    inline void Help_DeleteCriticalSection(void);
    inline void Help_EnterCriticalSection(void);
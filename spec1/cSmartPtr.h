@@ -16,12 +16,86 @@
 #if defined(WIN32)
 # include <windows.h>
 #else
-# include <assert.h>
-# include <synch.h>
 # include <pthread.h>
-# include <thread.h>
 #endif
-#include <map>
+#include <assert.h>
+#include <stddef.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <utility>
+
+/*!
+ * Counting policies for cRefCountT.
+ *
+ * cThreadSafeCount counts with std::atomic: no lock is taken to copy or
+ * drop a cSmartPtr, only to lock a cWeakPtr or to free an object that has
+ * weak references.  cSingleThreadCount counts with plain longs, for
+ * objects that never leave the thread that made them.
+ */
+struct cThreadSafeCount
+{
+  template<class T>
+  struct tAtomic { typedef std::atomic<T> type; };
+  typedef std::mutex tLock;
+};
+
+/*!
+ * The subset of std::atomic that cRefCountT uses, without the atomics.
+ */
+template<class T>
+class cPlainAtomic
+{
+public:
+  cPlainAtomic(T value = T())
+  :m_Value(value)
+  {}
+
+  T
+    load(std::memory_order = std::memory_order_seq_cst)const
+  { return(m_Value);}
+  void
+    store(T value, std::memory_order = std::memory_order_seq_cst)
+  { m_Value = value;}
+  T
+    fetch_add(T delta, std::memory_order = std::memory_order_seq_cst)
+  { T old = m_Value; m_Value += delta; return(old);}
+  T
+    fetch_sub(T delta, std::memory_order = std::memory_order_seq_cst)
+  { T old = m_Value; m_Value -= delta; return(old);}
+  bool
+    compare_exchange_strong(T& expected, T desired,
+                            std::memory_order = std::memory_order_seq_cst,
+                            std::memory_order = std::memory_order_seq_cst)
+  {
+    if (m_Value != expected)
+    {
+      expected = m_Value;
+      return(false);
+    }
+    m_Value = desired;
+    return(true);
+  }
+
+private:
+  T
+    m_Value;
+};
+
+struct cSingleThreadCount
+{
+  struct cNoLock
+  {
+    void lock(void) {}
+    void unlock(void) {}
+  };
+
+  template<class T>
+  struct tAtomic { typedef cPlainAtomic<T> type; };
+  typedef cNoLock tLock;
+};
+
 
 template<class T>
 class cSmartPtr
@@ -32,6 +106,13 @@ public:
   {
     init();
   }
+  //! Takes over a reference the caller already holds if !addRef.
+  cSmartPtr(T* ptr, bool addRef)
+  :m_Ptr(ptr)
+  {
+    if (addRef)
+      init();
+  }
   cSmartPtr(const cSmartPtr& rhs)
   :m_Ptr(rhs.m_Ptr)
   {
@@ -48,10 +129,12 @@ public:
   {
     if (m_Ptr != rhs.m_Ptr)
     {
-      if (m_Ptr)
-        m_Ptr->decRef();
+      // rhs first, in case dropping ours frees the object holding rhs.
+      T* old = m_Ptr;
       m_Ptr = rhs.m_Ptr;
       init();
+      if (old)
+        old->decRef();
     }
     return(*this);
   }
@@ -66,6 +149,11 @@ public:
   {
     return(*m_Ptr);
   }
+  T*
+    get()const
+  {
+    return(m_Ptr);
+  }
 
 private:
   T*
@@ -82,13 +170,75 @@ private:
 
 
 /*!
- * For UNIX machines, this class needs the following defined in the
- * programs main:
- *    pthread_mutex_t cRefCount::m_Mutex = PTHREAD_MUTEX_INITIALIZER;
+ * An intrusive reference count, freeing the object with the last
+ * cSmartPtr to it.
+ *
+ * Copying a reference only has to make the count larger, so incRef() is
+ * a relaxed increment.  decRef() is acq_rel so that every thread's writes
+ * to the object happen before the thread dropping the last reference
+ * deletes it.
+ *
+ * cWeakPtr references the object without keeping it alive.  The first
+ * one allocates a small cWeakBlock that outlives the object, so objects
+ * never given a weak reference cost one pointer.
  */
-class cRefCount
+template<class T_Policy = cThreadSafeCount>
+class cRefCountT
 {
 public:
+  typedef typename T_Policy::template tAtomic<long>::type tCount;
+  typedef typename T_Policy::tLock tLock;
+
+  /**
+   * Shared by an object and its weak references.  m_Refs counts the
+   * weak references, plus one while the object lives; m_Object is NULL
+   * once the object is being destroyed.
+   */
+  class cWeakBlock
+  {
+  public:
+    cWeakBlock(cRefCountT* object)
+    :m_Refs(1), m_Object(object)
+    {}
+
+    void
+      addRef(void)
+    { m_Refs.fetch_add(1, std::memory_order_relaxed);}
+    void
+      release(void)
+    {
+      if (m_Refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+    }
+
+    /**
+     * Adds a reference to the object if it is still alive.
+     */
+    bool
+      lockObject(void)
+    {
+      std::lock_guard<tLock> guard(m_Lock);
+      return(m_Object && m_Object->tryIncRef());
+    }
+
+    bool
+      expired(void)
+    {
+      std::lock_guard<tLock> guard(m_Lock);
+      return(!m_Object || !m_Object->refCount());
+    }
+
+  private:
+    friend class cRefCountT;
+
+    tCount
+      m_Refs;
+    cRefCountT*
+      m_Object;
+    tLock
+      m_Lock;
+  };
+
   /**
    */
   void incRef(void);
@@ -97,81 +247,215 @@ public:
    */
   void decRef(void);
 
+  /**
+   * The number of cSmartPtrs; already stale if other threads hold some.
+   */
+  long refCount(void)const;
+
+  /**
+   * This object's weak block, with a reference added for the caller.
+   */
+  cWeakBlock* weakBlock(void);
+
 protected:
-  cRefCount(void);
-  cRefCount(const cRefCount& rhs);
-  cRefCount& operator=(const cRefCount& rhs);
-  virtual ~cRefCount(void);
+  cRefCountT(void);
+  cRefCountT(const cRefCountT& rhs);
+  cRefCountT& operator=(const cRefCountT& rhs);
+  virtual ~cRefCountT(void);
 
 private:
-  volatile long
+  typedef typename T_Policy::template tAtomic<cWeakBlock*>::type tBlockPtr;
+
+  tCount
     m_Count;
-#if ! defined (WIN32)
-  static pthread_mutex_t m_Mutex;
-#endif
+  tBlockPtr
+    m_Weak;
 
+  bool tryIncRef(void);
 };
 
-inline void cRefCount::incRef(void)
+template<class T_Policy>
+inline void cRefCountT<T_Policy>::incRef(void)
 {
-#if defined(WIN32)
-  InterlockedIncrement((long*)&m_Count);
+#if defined(NDEBUG)
+  m_Count.fetch_add(1, std::memory_order_relaxed);
 #else
-  pthread_mutex_lock (&cRefCount::m_Mutex);
-  assert (m_Count >= 0);
-  ++m_Count;
-  pthread_mutex_unlock (&cRefCount::m_Mutex);
+  long old = m_Count.fetch_add(1, std::memory_order_relaxed);
+  assert (old >= 0);
 #endif
-  //std::cerr<<"cRefCount inc, post inc cnt = "<<m_Count<<std::endl;
 }
 
-inline void cRefCount::decRef(void)
+template<class T_Policy>
+inline void cRefCountT<T_Policy>::decRef(void)
 {
-#if defined(WIN32)
-  if (InterlockedDecrement ((long*) &m_Count) == 0)
-  {
-    //std::cerr<<"cRefCount delete this"<<std::endl;
+  long old = m_Count.fetch_sub(1, std::memory_order_acq_rel);
+
+  assert (old > 0);
+  if (old == 1)
     delete this;
-  }
+}
 
-#else
-  pthread_mutex_lock (&cRefCount::m_Mutex);
-  assert (m_Count > 0);
-  --m_Count;
-  if (m_Count == 0)
+template<class T_Policy>
+inline long cRefCountT<T_Policy>::refCount(void)const
+{
+  return(m_Count.load(std::memory_order_relaxed));
+}
+
+// Only ever called under the weak block's lock, which the destructor
+// takes before the memory can go away.  A count that has reached zero
+// stays there.
+template<class T_Policy>
+inline bool cRefCountT<T_Policy>::tryIncRef(void)
+{
+  long count = m_Count.load(std::memory_order_relaxed);
+
+  while (count != 0)
   {
-    //std::cerr<<"cRefCount delete this"<<std::endl;
-    pthread_mutex_unlock (&cRefCount::m_Mutex);
-    delete this;
+    if (m_Count.compare_exchange_strong(count, count + 1,
+                                        std::memory_order_relaxed,
+                                        std::memory_order_relaxed))
+      return(true);
   }
-  else
+  return(false);
+}
+
+template<class T_Policy>
+inline typename cRefCountT<T_Policy>::cWeakBlock*
+cRefCountT<T_Policy>::weakBlock(void)
+{
+  cWeakBlock* block = m_Weak.load(std::memory_order_acquire);
+
+  if (!block)
   {
-    pthread_mutex_unlock (&cRefCount::m_Mutex);
+    cWeakBlock* created = new cWeakBlock(this);
+
+    if (m_Weak.compare_exchange_strong(block, created,
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_acquire))
+      block = created;
+    else
+      delete created;
   }
-#endif
+  block->addRef();
+  return(block);
 }
 
-inline cRefCount::cRefCount(void)
-  : m_Count(0)
+template<class T_Policy>
+inline cRefCountT<T_Policy>::cRefCountT(void)
+  : m_Count(0), m_Weak(NULL)
 {
-  //std::cerr<<"cRefCount constructor"<<std::endl;
 }
 
-inline cRefCount::cRefCount(const cRefCount& rhs)
-  : m_Count(0)
+template<class T_Policy>
+inline cRefCountT<T_Policy>::cRefCountT(const cRefCountT& rhs)
+  : m_Count(0), m_Weak(NULL)
 {
-  //std::cerr<<"cRefCount copy constructor"<<std::endl;
 }
 
-inline cRefCount& cRefCount::operator=(const cRefCount& rhs)
+template<class T_Policy>
+inline cRefCountT<T_Policy>&
+cRefCountT<T_Policy>::operator=(const cRefCountT& rhs)
 {
-  //std::cerr<<"cRefCount = op"<<std::endl;
   return(*this);
 }
 
-inline cRefCount::~cRefCount(void)
+template<class T_Policy>
+inline cRefCountT<T_Policy>::~cRefCountT(void)
 {
-  //std::cerr<<"~cRefCount"<<std::endl;
+  cWeakBlock* block = m_Weak.load(std::memory_order_acquire);
+
+  if (block)
+  {
+    {
+      std::lock_guard<tLock> guard(block->m_Lock);
+      block->m_Object = NULL;
+    }
+    block->release();
+  }
+}
+
+
+/*!
+ * The thread safe count, as a class so that it can still be forward
+ * declared.  Derive from cRefCountT<cSingleThreadCount> instead for
+ * objects that stay on one thread.
+ *
+ * The static pthread_mutex_t m_Mutex that programs used to define is no
+ * longer needed.
+ */
+class cRefCount : public cRefCountT<cThreadSafeCount>
+{
+protected:
+  cRefCount(void) {}
+  cRefCount(const cRefCount& rhs)
+  :cRefCountT<cThreadSafeCount>(rhs)
+  {}
+  virtual ~cRefCount(void) {}
+};
+
+
+/*!
+ * A reference to a cRefCountT object that does not keep it alive.
+ * lock() gives a cSmartPtr to it, or a null one if it has been freed.
+ */
+template<class T>
+class cWeakPtr
+{
+public:
+  typedef typename T::cWeakBlock tWeakBlock;
+
+  cWeakPtr(T* ptr = 0)
+  :m_Ptr(ptr), m_Block(ptr ? ptr->weakBlock() : 0)
+  {}
+  cWeakPtr(const cSmartPtr<T>& rhs)
+  :m_Ptr(rhs.get()), m_Block(m_Ptr ? m_Ptr->weakBlock() : 0)
+  {}
+  cWeakPtr(const cWeakPtr& rhs)
+  :m_Ptr(rhs.m_Ptr), m_Block(rhs.m_Block)
+  {
+    if (m_Block)
+      m_Block->addRef();
+  }
+  ~cWeakPtr()
+  {
+    if (m_Block)
+      m_Block->release();
+  }
+
+  cWeakPtr&
+    operator=(const cWeakPtr& rhs)
+  {
+    if (m_Block != rhs.m_Block)
+    {
+      if (rhs.m_Block)
+        rhs.m_Block->addRef();
+      if (m_Block)
+        m_Block->release();
+      m_Block = rhs.m_Block;
+    }
+    m_Ptr = rhs.m_Ptr;
+    return(*this);
+  }
+
+  cSmartPtr<T>
+    lock()const
+  {
+    if (m_Block && m_Block->lockObject())
+      return(cSmartPtr<T>(m_Ptr, false));
+    return(cSmartPtr<T>());
+  }
+
+  bool
+    expired()const
+  {
+    return(!m_Block || m_Block->expired());
+  }
+
+private:
+  T*
+    m_Ptr;
+  tWeakBlock*
+    m_Block;
 };
 
 
@@ -207,149 +491,516 @@ public:
   { return(m_SmartPtr->mData);}
 };
 
-template <class T_Key, class T_NodeData>
+/*!
+ * A reader/writer lock: SRWLOCK on Windows, pthread_rwlock_t elsewhere.
+ * Neither is recursive.
+ */
+class cRWLock
+{
+public:
+  cRWLock(void)
+  {
+#if defined(WIN32)
+    InitializeSRWLock(&mLock);
+#else
+    pthread_rwlockattr_t attr;
+
+    pthread_rwlockattr_init(&attr);
+# if defined(__GLIBC__)
+    // glibc prefers readers by default, which starves writers of a busy
+    // table.
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+# endif
+    pthread_rwlock_init(&mLock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+#endif
+  }
+  ~cRWLock(void)
+  {
+#if !defined(WIN32)
+    pthread_rwlock_destroy(&mLock);
+#endif
+  }
+
+  void
+    ReadLock(void)
+  {
+#if defined(WIN32)
+    AcquireSRWLockShared(&mLock);
+#else
+    pthread_rwlock_rdlock(&mLock);
+#endif
+  }
+  void
+    ReadUnLock(void)
+  {
+#if defined(WIN32)
+    ReleaseSRWLockShared(&mLock);
+#else
+    pthread_rwlock_unlock(&mLock);
+#endif
+  }
+  void
+    WriteLock(void)
+  {
+#if defined(WIN32)
+    AcquireSRWLockExclusive(&mLock);
+#else
+    pthread_rwlock_wrlock(&mLock);
+#endif
+  }
+  void
+    WriteUnLock(void)
+  {
+#if defined(WIN32)
+    ReleaseSRWLockExclusive(&mLock);
+#else
+    pthread_rwlock_unlock(&mLock);
+#endif
+  }
+
+  //! Holds a cRWLock for reading until the end of the scope.
+  class cReadGuard
+  {
+  public:
+    cReadGuard(cRWLock& lock) :mLock(lock) { mLock.ReadLock();}
+    ~cReadGuard(void) { mLock.ReadUnLock();}
+  private:
+    cReadGuard(const cReadGuard&);
+    cReadGuard& operator=(const cReadGuard&);
+    cRWLock& mLock;
+  };
+
+  //! Holds a cRWLock for writing until the end of the scope.
+  class cWriteGuard
+  {
+  public:
+    cWriteGuard(cRWLock& lock) :mLock(lock) { mLock.WriteLock();}
+    ~cWriteGuard(void) { mLock.WriteUnLock();}
+  private:
+    cWriteGuard(const cWriteGuard&);
+    cWriteGuard& operator=(const cWriteGuard&);
+    cRWLock& mLock;
+  };
+
+private:
+  cRWLock(const cRWLock&);
+  cRWLock& operator=(const cRWLock&);
+
+#if defined(WIN32)
+  SRWLOCK
+    mLock;
+#else
+  pthread_rwlock_t
+    mLock;
+#endif
+};
+
+
+/*!
+ * A thread safe hash map, e.g. customer id -> GLDP_UserStatus or user id
+ * -> session.
+ *
+ * Keys are spread over a power of two number of shards, each an open
+ * addressing table (linear probing, no tombstones) under its own
+ * cRWLock, so lookups of different keys rarely wait for one another and
+ * readers of one shard never wait for each other.  A table keeps every
+ * key's full hash in a separate array, so a probe compares hashes in one
+ * cache line and only touches a key whose hash matches.  Entries are
+ * constructed in place; T_NodeData needs a copy (or move) constructor
+ * but no default constructor.  Set() and the Find() and Remove() that
+ * copy a value out also need copy assignment.
+ *
+ * Add(), Set(), Remove(), Find() and Count() are virtual, as they were
+ * on the std::map based cMap, so a subclass may still override them.
+ * Visit(), Update() and ForEach() are templates and cannot be.
+ *
+ * Visit() and Update() run a function on the value where it lies, under
+ * the shard's read or write lock, instead of copying it out as Find()
+ * does:
+ *
+ *   cMap<NPS_CUSTOMERID, GLDP_UserStatus> statuses;
+ *
+ *   statuses.Update(id, [&](GLDP_UserStatus& s) { s.setBan(ban);});
+ *   statuses.Visit(id, [&](const GLDP_UserStatus& s) { ok = s.isAuthorized();});
+ *
+ * The function must not call back into the map: the locks are not
+ * recursive.  Pointers to values are only good until the lock is let go.
+ */
+template <class T_Key, class T_NodeData, class T_Hash = std::hash<T_Key> >
 class cMap
 {
 public:
-  cMap(void)
+  //! nShards is rounded up to a power of two.
+  cMap(unsigned nShards = 16)
   {
-		InitLock();
+    mShardMask = 1;
+    while (mShardMask < nShards)
+      mShardMask <<= 1;
+    mShards = new cShard[mShardMask];
+    mShardMask--;
   }
   virtual
     ~cMap(void)
   {
-    Lock();
-    tMap::iterator it;
-    if (!mMap.empty())
-    {
-      for (it = mMap.begin(); it != mMap.end();)
-      {
-        Remove(it->first);
-        it = mMap.begin();
-      }
-    }
-    UnLock();
-		DeleteLock();
+    Clear();
+    delete[] mShards;
   }
+
+  //! Adds a copy of *data, unless key is already present.
   virtual bool
-    Add(T_Key &key, T_NodeData * data)
+    Add(const T_Key &key, const T_NodeData * data)
   {
     if (!data)
-      return(FALSE);
-    Lock();
-    mMap.insert(tMap::value_type(key,*data));
-    UnLock();
-    return(TRUE);
+      return(false);
+    return(Add(key, *data));
   }
 
+  //! Adds a copy of data, unless key is already present.
   virtual bool
-    Remove(const T_Key &key, T_NodeData &data)
+    Add(const T_Key &key, const T_NodeData &data)
+  {
+    size_t hash = Hash(key);
+    cShard& shard = ShardOf(hash);
+    cRWLock::cWriteGuard guard(shard.mLock);
+
+    if (shard.FindSlot(key, hash) >= 0)
+      return(false);
+    shard.Insert(key, hash, data);
+    return(true);
+  }
+
+  //! Adds key, or replaces its value.  True if it was added.
+  virtual bool
+    Set(const T_Key &key, const T_NodeData &data)
   {
-    Lock();
-    if (Find(key,data))
+    size_t hash = Hash(key);
+    cShard& shard = ShardOf(hash);
+    cRWLock::cWriteGuard guard(shard.mLock);
+    long slot = shard.FindSlot(key, hash);
+
+    if (slot >= 0)
     {
-      mMap.erase(key);
-      UnLock();
-      return (TRUE);
+      shard.mEntries[slot].mData = data;
+      return(false);
     }
-    UnLock();
-    return(FALSE);
+    shard.Insert(key, hash, data);
+    return(true);
+  }
+
+  //! Removes key, copying its value to data first.
+  virtual bool
+    Remove(const T_Key &key, T_NodeData &data)
+  {
+    size_t hash = Hash(key);
+    cShard& shard = ShardOf(hash);
+    cRWLock::cWriteGuard guard(shard.mLock);
+    long slot = shard.FindSlot(key, hash);
+
+    if (slot < 0)
+      return(false);
+    data = shard.mEntries[slot].mData;
+    shard.Erase(slot);
+    return(true);
   }
 
-	virtual bool
+  virtual bool
     Remove(const T_Key &key)
   {
-    Lock();
-    if (Find(key))
-    {
-      mMap.erase(key);
-      UnLock();
-      return (TRUE);
-    }
-    UnLock();
-    return(FALSE);
+    size_t hash = Hash(key);
+    cShard& shard = ShardOf(hash);
+    cRWLock::cWriteGuard guard(shard.mLock);
+    long slot = shard.FindSlot(key, hash);
+
+    if (slot < 0)
+      return(false);
+    shard.Erase(slot);
+    return(true);
   }
+
+  //! Copies key's value to data.  Visit() avoids the copy.
   virtual bool
     Find(const T_Key &key, T_NodeData &data)
   {
-    Lock();
-    if (!mMap.empty())
-    {
-      tMap::iterator it = mMap.find(key);
-      if (it != mMap.end())
-      {
-        data = (*it).second;
-        UnLock();
-        return (TRUE);
-      }
-    }
-    UnLock();
-    return(FALSE);
+    return(Visit(key, [&data](const T_NodeData& value) { data = value;}));
   }
+
   virtual bool
     Find(const T_Key &key)
   {
-    Lock();
-    if (!mMap.empty())
+    size_t hash = Hash(key);
+    cShard& shard = ShardOf(hash);
+    cRWLock::cReadGuard guard(shard.mLock);
+
+    return(shard.FindSlot(key, hash) >= 0);
+  }
+
+  //! Calls fn(const T_NodeData&) on key's value under a read lock.
+  template <class T_Fn>
+  bool
+    Visit(const T_Key &key, T_Fn fn)
+  {
+    size_t hash = Hash(key);
+    cShard& shard = ShardOf(hash);
+    cRWLock::cReadGuard guard(shard.mLock);
+    long slot = shard.FindSlot(key, hash);
+
+    if (slot < 0)
+      return(false);
+    fn((const T_NodeData&) shard.mEntries[slot].mData);
+    return(true);
+  }
+
+  //! Calls fn(T_NodeData&) on key's value under a write lock.
+  template <class T_Fn>
+  bool
+    Update(const T_Key &key, T_Fn fn)
+  {
+    size_t hash = Hash(key);
+    cShard& shard = ShardOf(hash);
+    cRWLock::cWriteGuard guard(shard.mLock);
+    long slot = shard.FindSlot(key, hash);
+
+    if (slot < 0)
+      return(false);
+    fn(shard.mEntries[slot].mData);
+    return(true);
+  }
+
+  //! Calls fn(const T_Key&, const T_NodeData&) on every entry, a shard
+  //! at a time, so it is not a snapshot of the whole map.
+  template <class T_Fn>
+  void
+    ForEach(T_Fn fn)
+  {
+    for (unsigned i = 0; i <= mShardMask; i++)
     {
-      tMap::iterator it = mMap.find(key);
-      if (it != mMap.end())
+      cShard& shard = mShards[i];
+      cRWLock::cReadGuard guard(shard.mLock);
+
+      for (size_t slot = 0; slot < shard.mCapacity; slot++)
       {
-        UnLock();
-        return (TRUE);
+        if (shard.mHashes[slot])
+          fn((const T_Key&) shard.mEntries[slot].mKey,
+             (const T_NodeData&) shard.mEntries[slot].mData);
       }
     }
-    UnLock();
-    return(FALSE);
   }
+
+  void
+    Clear(void)
+  {
+    for (unsigned i = 0; i <= mShardMask; i++)
+    {
+      cRWLock::cWriteGuard guard(mShards[i].mLock);
+
+      mShards[i].Free();
+    }
+  }
+
   virtual int
-    Count(void)const{return(mMap.size());}
+    Count(void)const
+  {
+    size_t count = 0;
 
-protected:
-  virtual void
-    InitLock(void)
-	{
-#if defined(WIN32)
-		InitializeCriticalSection(&mMutex);
-#else
-#endif
-	}
-	virtual void
-		DeleteLock(void)
-	{
-#if defined(WIN32)
-    DeleteCriticalSection(&mMutex);
-#else
-#endif
-	}
-  virtual void
-    Lock(void)
-	{
-#if defined(WIN32)
-		EnterCriticalSection(&mMutex);
-#else
-#endif
-	}
-  virtual void
-    UnLock(void)
-	{
-#if defined(WIN32)
-		LeaveCriticalSection(&mMutex);
-#else
-#endif
-	}
+    for (unsigned i = 0; i <= mShardMask; i++)
+    {
+      cRWLock::cReadGuard guard(mShards[i].mLock);
 
-  typedef std::map<T_Key, T_NodeData> tMap;
-	tMap
-		mMap;
+      count += mShards[i].mSize;
+    }
+    return((int) count);
+  }
 
 private:
-#if defined(WIN32)
-  CRITICAL_SECTION
-    mMutex;
-#else
-#endif
+  struct sEntry
+  {
+    sEntry(const T_Key& key, const T_NodeData& data)
+    :mKey(key), mData(data)
+    {}
+    sEntry(T_Key&& key, T_NodeData&& data)
+    :mKey(std::move(key)), mData(std::move(data))
+    {}
+
+    T_Key
+      mKey;
+    T_NodeData
+      mData;
+  };
+
+  // mHashes[slot] is 0 for an empty slot, else the key's hash.  A table
+  // is grown at 3/4 full, so a probe always ends at an empty slot.
+  struct cShard
+  {
+    cShard(void)
+    :mHashes(NULL), mEntries(NULL), mCapacity(0), mSize(0)
+    {}
+    ~cShard(void)
+    { Free();}
+
+    long
+      FindSlot(const T_Key& key, size_t hash)const
+    {
+      if (!mSize)
+        return(-1);
+
+      size_t mask = mCapacity - 1;
+
+      for (size_t slot = hash & mask; mHashes[slot]; slot = (slot + 1) & mask)
+      {
+        if (mHashes[slot] == hash && mEntries[slot].mKey == key)
+          return((long) slot);
+      }
+      return(-1);
+    }
+
+    void
+      Insert(const T_Key& key, size_t hash, const T_NodeData& data)
+    {
+      if ((mSize + 1) * 4 > mCapacity * 3)
+        Grow();
 
+      size_t slot = FreeSlot(hash);
+
+      new (&mEntries[slot]) sEntry(key, data);
+      mHashes[slot] = hash;
+      mSize++;
+    }
+
+    // Backward shift deletion: moves later entries of the probe run
+    // into the hole, unless that would put one before its home slot.
+    void
+      Erase(long at)
+    {
+      size_t mask = mCapacity - 1;
+      size_t hole = (size_t) at;
+      size_t slot = hole;
+
+      mEntries[hole].~sEntry();
+      mHashes[hole] = 0;
+      mSize--;
+      for (;;)
+      {
+        slot = (slot + 1) & mask;
+        if (!mHashes[slot])
+          break;
+
+        size_t home = mHashes[slot] & mask;
+
+        // Stays put if its home is cyclically within (hole, slot].
+        if ((hole < slot) ? (home > hole && home <= slot)
+                          : (home > hole || home <= slot))
+          continue;
+        new (&mEntries[hole]) sEntry(std::move(mEntries[slot].mKey),
+                                     std::move(mEntries[slot].mData));
+        mHashes[hole] = mHashes[slot];
+        mEntries[slot].~sEntry();
+        mHashes[slot] = 0;
+        hole = slot;
+      }
+    }
+
+    void
+      Free(void)
+    {
+      for (size_t slot = 0; slot < mCapacity; slot++)
+      {
+        if (mHashes[slot])
+          mEntries[slot].~sEntry();
+      }
+      delete[] mHashes;
+      ::operator delete(mEntries);
+      mHashes = NULL;
+      mEntries = NULL;
+      mCapacity = mSize = 0;
+    }
+
+    cRWLock
+      mLock;
+    size_t*
+      mHashes;
+    sEntry*
+      mEntries;
+    size_t
+      mCapacity;
+    size_t
+      mSize;
+    // Keeps neighbouring shards' locks off each other's cache lines.
+    char
+      mPad[64];
+
+  private:
+    size_t
+      FreeSlot(size_t hash)const
+    {
+      size_t mask = mCapacity - 1;
+      size_t slot = hash & mask;
+
+      while (mHashes[slot])
+        slot = (slot + 1) & mask;
+      return(slot);
+    }
+
+    void
+      Grow(void)
+    {
+      size_t* oldHashes = mHashes;
+      sEntry* oldEntries = mEntries;
+      size_t oldCapacity = mCapacity;
+
+      mCapacity = oldCapacity ? oldCapacity * 2 : 8;
+      mHashes = new size_t[mCapacity]();
+      mEntries = (sEntry*) ::operator new(mCapacity * sizeof(sEntry));
+      for (size_t i = 0; i < oldCapacity; i++)
+      {
+        if (!oldHashes[i])
+          continue;
+
+        size_t slot = FreeSlot(oldHashes[i]);
+
+        new (&mEntries[slot]) sEntry(std::move(oldEntries[i].mKey),
+                                     std::move(oldEntries[i].mData));
+        mHashes[slot] = oldHashes[i];
+        oldEntries[i].~sEntry();
+      }
+      delete[] oldHashes;
+      ::operator delete(oldEntries);
+    }
+
+    cShard(const cShard&);
+    cShard& operator=(const cShard&);
+  };
+
+  cShard*
+    mShards;
+  unsigned
+    mShardMask;
+
+  cMap(const cMap&);
+  cMap& operator=(const cMap&);
+
+  // std::hash of an integer is usually the integer, so the bits are
+  // mixed (the murmur3 finalizer) before the shard takes the high ones
+  // and the table the low ones.  Never 0, which marks an empty slot.
+  static size_t
+    Hash(const T_Key& key)
+  {
+    unsigned long long h = (unsigned long long) T_Hash()(key);
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return((size_t) h ? (size_t) h : 1);
+  }
+
+  cShard&
+    ShardOf(size_t hash)const
+  {
+    return(mShards[(hash >> (sizeof(size_t) * 8 - 16)) & mShardMask]);
+  }
 };
 
 
@@ -0,0 +1,347 @@
+/*************************************************************************
+ File Name:     NPSShaper_test.cpp
+
+ Purpose:       Tests for NPSShaper: the non-blocking default send,
+                send failures on waiting messages, turn taking on a
+                shared bucket, rate changes and removal while waiting.
+
+ Build:         g++ -std=c++17 -I.. NPSShaper_test.cpp -lpthread
+                -o shaper_test   (one line, with the NPS library)
+ Run:           ./shaper_test; exits non-zero on any failure.
+ *************************************************************************/
+
+#include <NPSShaper.h>
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int Failures;
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond))                                                        \
+    {                                                                   \
+      fprintf (stderr, "%s:%d: CHECK (%s) failed\n", __FILE__, __LINE__, \
+               #cond);                                                  \
+      Failures++;                                                       \
+    }                                                                   \
+  } while (0)
+
+// A send function that records what went where, and fails on request.
+struct Recorder
+{
+  std::vector < SOCKET > Order;
+  std::vector < long > Sizes;
+  SOCKET FailOn;
+  int Calls;
+};
+
+static NPSSTATUS RecordSend (SOCKET Socket, const char *, long Size,
+                             void *Context)
+{
+  Recorder *R = (Recorder *) Context;
+
+  R->Calls++;
+  if (Socket == R->FailOn)
+    return NPS_ERR;
+  R->Order.push_back (Socket);
+  R->Sizes.push_back (Size);
+  return NPS_OK;
+}
+
+static struct sockaddr_in Peer (const char *Addr)
+{
+  struct sockaddr_in A;
+
+  memset (&A, 0, sizeof (A));
+  A.sin_family = AF_INET;
+  inet_pton (AF_INET, Addr, &A.sin_addr);
+  return A;
+}
+
+// Runs Reactor's timers for Ms milliseconds, or until Done() holds.
+template < class Pred >
+static void RunFor (NPSReactor & Reactor, long Ms, Pred Done)
+{
+  NPSReactorTime End = NPSReactor::Clock () + Ms;
+
+  while (NPSReactor::Clock () < End && !Done ())
+  {
+    struct timeval TimeOut = { 0, 5000 };
+
+    Reactor.RunOnce (&TimeOut);
+  }
+}
+
+// The default send never blocks: a message far larger than the socket
+// buffer goes out a bufferful at a time from the reactor's timer, with
+// the connection's bucket charged only for what was written.
+static void TestDefaultSend (void)
+{
+  NPSReactor Reactor;
+  NPSShaper Shaper (&Reactor);
+  int Pair[2];
+
+  CHECK (socketpair (AF_UNIX, SOCK_STREAM, 0, Pair) == 0);
+
+  int Small = 4096;
+
+  setsockopt (Pair[0], SOL_SOCKET, SO_SNDBUF, &Small, sizeof (Small));
+
+  std::string Message (1 << 20, '\0');
+
+  for (size_t i = 0; i < Message.size (); i++)
+    Message[i] = (char) (i * 131);
+
+  struct sockaddr_in Addr = Peer ("10.0.0.1");
+
+  CHECK (Shaper.AddConnection (Pair[0], &Addr) == NPS_OK);
+
+  // Nobody is reading yet; on a blocking socket this used to hang.
+  NPSReactorTime Start = NPSReactor::Clock ();
+
+  CHECK (Shaper.Send (Pair[0], Message.data (), (long) Message.size ())
+         == NPS_OK);
+  CHECK (Shaper.Send (Pair[0], "tail", 4) == NPS_OK);
+  CHECK (NPSReactor::Clock () - Start < 100);
+  CHECK (Shaper.Depth (Pair[0]) == 2);
+  CHECK (Shaper.BytesSent () < (long) Message.size ());
+
+  std::string Received;
+  std::thread Reader ([&]
+  {
+    char Buff[4096];
+
+    while (Received.size () < Message.size () + 4)
+    {
+      ssize_t n = read (Pair[1], Buff, sizeof (Buff));
+
+      if (n <= 0)
+        break;
+      Received.append (Buff, n);
+    }
+  });
+
+  RunFor (Reactor, 10000, [&] { return Shaper.Depth (Pair[0]) == 0; });
+  Reader.join ();
+  CHECK (Shaper.Depth (Pair[0]) == 0);
+  CHECK (Received == Message + "tail");
+  CHECK (Shaper.BytesSent () == (long) Message.size () + 4);
+  CHECK (Shaper.SendErrors () == 0);
+
+  // And a closed peer is an error, not a SIGPIPE.
+  close (Pair[1]);
+  CHECK (Shaper.Send (Pair[0], "x", 1) == NPS_ERR);
+  Shaper.RemoveConnection (Pair[0]);
+  close (Pair[0]);
+}
+
+// What the socket would not take is charged only once written: a rate
+// limited connection behind a full socket still gets its whole rate.
+static void TestPartialRefund (void)
+{
+  NPSReactor Reactor;
+  NPSShaper Shaper (&Reactor);
+  int Pair[2];
+
+  CHECK (socketpair (AF_UNIX, SOCK_STREAM, 0, Pair) == 0);
+
+  int Small = 4096;
+
+  setsockopt (Pair[0], SOL_SOCKET, SO_SNDBUF, &Small, sizeof (Small));
+
+  struct sockaddr_in Addr = Peer ("10.0.0.3");
+  std::string Message (64 * 1024, 'x');
+
+  Shaper.AddConnection (Pair[0], &Addr);
+  Shaper.SetConnectionRate (Pair[0], 64 * 1024, 64 * 1024);
+  CHECK (Shaper.Send (Pair[0], Message.data (), (long) Message.size ())
+         == NPS_OK);
+  CHECK (Shaper.Depth (Pair[0]) == 1);
+
+  // Drain it all; had the unsent part been charged, the bucket would be
+  // a second in debt and the rest would wait that long.
+  size_t Got = 0;
+  char Buff[65536];
+  NPSReactorTime Start = NPSReactor::Clock ();
+
+  while (Got < Message.size () && NPSReactor::Clock () - Start < 5000)
+  {
+    ssize_t n = recv (Pair[1], Buff, sizeof (Buff), MSG_DONTWAIT);
+
+    if (n > 0)
+      Got += n;
+    struct timeval TimeOut = { 0, 1000 };
+
+    Reactor.RunOnce (&TimeOut);
+  }
+  CHECK (Got == Message.size ());
+  CHECK (NPSReactor::Clock () - Start < 500);
+  close (Pair[0]);
+  close (Pair[1]);
+}
+
+// A failed send of a waiting message drops the rest of that
+// connection's backlog and leaves others alone.
+static void TestSendFailure (void)
+{
+  NPSReactor Reactor;
+  Recorder R;
+
+  R.FailOn = INVALID_SOCKET;
+  R.Calls = 0;
+
+  NPSShaper Shaper (&Reactor, RecordSend, &R);
+  struct sockaddr_in Addr = Peer ("10.0.0.2");
+  char Buff[100];
+
+  memset (Buff, 0, sizeof (Buff));
+  Shaper.AddConnection (10, &Addr);
+  Shaper.AddConnection (11, &Addr);
+  Shaper.SetConnectionRate (10, 10000, 100);
+  Shaper.SetConnectionRate (11, 10000, 100);
+  for (int i = 0; i < 4; i++)
+  {
+    Shaper.Send (10, Buff, sizeof (Buff));
+    Shaper.Send (11, Buff, sizeof (Buff));
+  }
+  // The first of each went straight through; three wait on each.
+  CHECK (Shaper.Depth (10) == 3);
+  CHECK (Shaper.Depth (11) == 3);
+
+  R.FailOn = 10;
+  R.Calls = 0;
+  RunFor (Reactor, 1000, [&] { return Shaper.Depth (11) == 0; });
+  CHECK (Shaper.Depth (10) == 0);
+  CHECK (Shaper.BytesQueued (10) == 0);
+  CHECK (Shaper.Depth (11) == 0);
+  CHECK (Shaper.SendErrors () == 1);
+  // One failed try on 10, three sends on 11.
+  CHECK (R.Calls == 4);
+  CHECK (R.Order.size () == 5);
+  for (size_t i = 2; i < R.Order.size (); i++)
+    CHECK (R.Order[i] == 11);
+}
+
+// Connections sharing a group bucket take turns, however much each has
+// waiting.
+static void TestTurns (void)
+{
+  NPSReactor Reactor;
+  Recorder R;
+
+  R.FailOn = INVALID_SOCKET;
+  R.Calls = 0;
+
+  NPSShaper Shaper (&Reactor, RecordSend, &R);
+  int Group = Shaper.CreateGroup (20000, 100);
+  struct in_addr In = Peer ("10.0.1.1").sin_addr;
+  struct sockaddr_in Addr = Peer ("10.0.1.1");
+  char Buff[100];
+
+  memset (Buff, 0, sizeof (Buff));
+  Shaper.AddAddrToGroup (Group, &In);
+  Shaper.AddConnection (20, &Addr);
+  Shaper.AddConnection (21, &Addr);
+  Shaper.AddConnection (22, &Addr);
+  for (int i = 0; i < 9; i++)
+    Shaper.Send (20, Buff, sizeof (Buff));
+  Shaper.Send (21, Buff, sizeof (Buff));
+  Shaper.Send (21, Buff, sizeof (Buff));
+  Shaper.Send (22, Buff, sizeof (Buff));
+  CHECK (Shaper.MessagesDeferred () == 11);
+
+  RunFor (Reactor, 2000, [&] { return R.Order.size () == 12; });
+  CHECK (R.Order.size () == 12);
+
+  // 20's first goes at once; then 20, 21 and 22 alternate until 21 and
+  // 22 run dry.
+  SOCKET Expect[] = { 20, 20, 21, 22, 20, 21, 20, 20, 20, 20, 20, 20 };
+
+  for (size_t i = 0; i < R.Order.size () && i < 12; i++)
+    CHECK (R.Order[i] == Expect[i]);
+}
+
+// Raising a waiting connection's rate lets its messages go at once,
+// rather than when the old rate would have let them.
+static void TestRekey (void)
+{
+  NPSReactor Reactor;
+  Recorder R;
+
+  R.FailOn = INVALID_SOCKET;
+  R.Calls = 0;
+
+  NPSShaper Shaper (&Reactor, RecordSend, &R);
+  struct sockaddr_in Addr = Peer ("10.0.2.1");
+  char Buff[100];
+
+  memset (Buff, 0, sizeof (Buff));
+  Shaper.AddConnection (30, &Addr);
+  Shaper.SetConnectionRate (30, 10, 100);   // 10 s a message
+  Shaper.Send (30, Buff, sizeof (Buff));
+  Shaper.Send (30, Buff, sizeof (Buff));
+  CHECK (Shaper.Depth (30) == 1);
+
+  NPSReactorTime Start = NPSReactor::Clock ();
+
+  Shaper.SetConnectionRate (30, NPS_SHAPER_UNLIMITED, 0);
+  RunFor (Reactor, 2000, [&] { return Shaper.Depth (30) == 0; });
+  CHECK (Shaper.Depth (30) == 0);
+  CHECK (NPSReactor::Clock () - Start < 500);
+  CHECK (R.Order.size () == 2);
+}
+
+// A connection removed while waiting sends nothing more, and those
+// behind it still go.
+static void TestRemoveWhileWaiting (void)
+{
+  NPSReactor Reactor;
+  Recorder R;
+
+  R.FailOn = INVALID_SOCKET;
+  R.Calls = 0;
+
+  NPSShaper Shaper (&Reactor, RecordSend, &R);
+  struct sockaddr_in Addr = Peer ("10.0.3.1");
+  char Buff[100];
+
+  memset (Buff, 0, sizeof (Buff));
+  Shaper.AddConnection (40, &Addr);
+  Shaper.AddConnection (41, &Addr);
+  Shaper.SetDefaultConnectionRate (20000, 100);
+  for (int i = 0; i < 3; i++)
+  {
+    Shaper.Send (40, Buff, sizeof (Buff));
+    Shaper.Send (41, Buff, sizeof (Buff));
+  }
+  Shaper.RemoveConnection (40);
+  // A new connection on the same socket is not mistaken for the old one.
+  Shaper.AddConnection (40, &Addr);
+  CHECK (Shaper.Depth (40) == 0);
+
+  RunFor (Reactor, 1000, [&] { return Shaper.Depth (41) == 0; });
+  CHECK (Shaper.Depth (41) == 0);
+  CHECK (R.Order.size () == 4);
+  for (size_t i = 1; i < R.Order.size (); i++)
+    CHECK (R.Order[i] == 41);
+}
+
+int main (void)
+{
+  TestDefaultSend ();
+  TestPartialRefund ();
+  TestSendFailure ();
+  TestTurns ();
+  TestRekey ();
+  TestRemoveWhileWaiting ();
+  if (Failures)
+    fprintf (stderr, "%d failure(s)\n", Failures);
+  else
+    printf ("NPSShaper: all tests passed\n");
+  return Failures ? 1 : 0;
+}